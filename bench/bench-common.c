@@ -0,0 +1,119 @@
+/* bench-common.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "bench"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib-2.0/glib.h>
+
+#include "stated-config.h"
+#include "bench-common.h"
+
+/**
+ * Shared helpers for the benchmarks.
+ *
+ * Every result is printed in a human readable form, and appended as a
+ * JSON line to the file passed with --output (or STATED_BENCH_OUTPUT),
+ * so that results can be compared between releases.
+ */
+
+static uint bench_iterations = 0;
+static char *bench_output = NULL;
+
+void
+bench_init (int    *argc,
+            char ***argv,
+            uint   default_iterations)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  int iterations = 0;
+  GOptionEntry entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Iterations per benchmark", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &bench_output, "Append JSON results to FILE", "FILE" },
+    { NULL }
+  };
+
+  context = g_option_context_new ("- stated benchmark");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, argc, argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    exit (EXIT_FAILURE);
+  }
+
+  bench_iterations = (iterations > 0) ? (uint)iterations : default_iterations;
+
+  if (bench_output == NULL)
+    bench_output = g_strdup (g_getenv ("STATED_BENCH_OUTPUT"));
+}
+
+uint
+bench_get_iterations (void)
+{
+  return bench_iterations;
+}
+
+/**
+ * Reports a result. extra_json, if not NULL, is a list of additional
+ * "key": value pairs to include in the JSON line.
+ */
+void
+bench_report (const char *name,
+              uint64_t   iterations,
+              uint64_t   elapsed_us,
+              const char *extra_json)
+{
+  g_autofree char *line = NULL;
+  double ns_per_op = (double)elapsed_us * 1000 / MAX (iterations, 1);
+  FILE *output;
+
+  g_print ("%-32s %10lu iterations %12.1f ns/op\n", name, iterations, ns_per_op);
+
+  if (bench_output == NULL)
+    return;
+
+  line = g_strdup_printf ("{\"benchmark\": \"%s\", \"version\": \"%s\", "
+                          "\"iterations\": %lu, \"elapsed_us\": %lu, "
+                          "\"ns_per_op\": %.1f%s%s}\n",
+                          name, PACKAGE_VERSION, iterations, elapsed_us,
+                          ns_per_op,
+                          (extra_json != NULL) ? ", " : "",
+                          (extra_json != NULL) ? extra_json : "");
+
+  output = fopen (bench_output, "a");
+  if (output == NULL) {
+    g_warning ("Unable to open %s: %s", bench_output, g_strerror (errno));
+    return;
+  }
+
+  fputs (line, output);
+  fclose (output);
+}
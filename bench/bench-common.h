@@ -0,0 +1,47 @@
+/* bench-common.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDBENCHCOMMON_H
+#define STATEDBENCHCOMMON_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+#include "fake-root.h"
+
+void bench_init (int    *argc,
+                 char ***argv,
+                 uint   default_iterations);
+uint bench_get_iterations (void);
+void bench_report (const char *name,
+                   uint64_t   iterations,
+                   uint64_t   elapsed_us,
+                   const char *extra_json);
+
+#endif /* STATEDBENCHCOMMON_H */
@@ -0,0 +1,188 @@
+/* bench-hotpaths.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * Times stated's hot paths against a fake tree of kernel interfaces:
+ *
+ * - wakelock lock/unlock throughput, synchronous and through the
+ *   sysfs worker
+ * - timed wakelock rearm
+ * - display change dispatch through StatedDevicestate
+ * - resume handling through StatedDevicestate
+ */
+
+#define G_LOG_DOMAIN "bench-hotpaths"
+
+#define BENCH_ITERATIONS 20000
+#define BENCH_WAKELOCK "stated_bench"
+
+/* Flush the sysfs worker every so often, so that its queue never fills */
+#define BENCH_WORKER_FLUSH_INTERVAL 16
+
+#include <stdlib.h>
+#include <glib-2.0/glib.h>
+
+#include "bench-common.h"
+#include "devicestate.h"
+#include "display-manual.h"
+#include "logind.h"
+#include "sleeptracker.h"
+#include "sysfs-worker.h"
+#include "wakelocks.h"
+
+static void
+bench_lock_unlock_sync (uint iterations)
+{
+  uint64_t start;
+  uint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    wakelock_lock (BENCH_WAKELOCK);
+    wakelock_unlock (BENCH_WAKELOCK);
+  }
+
+  bench_report ("wakelock-lock-unlock-sync", iterations,
+                g_get_monotonic_time () - start, NULL);
+}
+
+static void
+bench_lock_unlock_worker (uint iterations)
+{
+  g_autofree char *extra = NULL;
+  uint64_t start, enqueue_us = 0, enqueue_start;
+  uint i;
+
+  sysfs_worker_start ();
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    enqueue_start = g_get_monotonic_time ();
+    wakelock_lock (BENCH_WAKELOCK);
+    wakelock_unlock (BENCH_WAKELOCK);
+    enqueue_us += g_get_monotonic_time () - enqueue_start;
+
+    if (i % BENCH_WORKER_FLUSH_INTERVAL == 0)
+      sysfs_worker_flush ();
+  }
+  sysfs_worker_flush ();
+
+  extra = g_strdup_printf ("\"main_thread_us\": %lu, \"max_enqueue_us\": %lu",
+                           enqueue_us, sysfs_worker_get_metrics ()->enqueue_max_us);
+  bench_report ("wakelock-lock-unlock-worker", iterations,
+                g_get_monotonic_time () - start, extra);
+
+  sysfs_worker_stop ();
+}
+
+static void
+bench_timed_rearm (uint iterations)
+{
+  uint64_t start;
+  uint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    wakelock_timed (BENCH_WAKELOCK, 10);
+
+  bench_report ("wakelock-timed-rearm", iterations,
+                g_get_monotonic_time () - start, NULL);
+
+  wakelock_cancel (BENCH_WAKELOCK, FALSE);
+}
+
+static void
+bench_display_change (StatedDisplayManual *display,
+                      uint                iterations)
+{
+  uint64_t start;
+  uint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    stated_display_manual_set_on (display, (i % 2) == 0);
+
+  bench_report ("display-change-dispatch", iterations,
+                g_get_monotonic_time () - start, NULL);
+}
+
+static void
+bench_resume (StatedSleeptracker *sleep_tracker,
+              uint               iterations)
+{
+  uint64_t start, boottime = 0;
+  uint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    /* Far enough apart not to be considered a resume loop */
+    g_signal_emit_by_name (sleep_tracker, "resume", boottime, boottime + 60000);
+    boottime += 60000;
+  }
+
+  bench_report ("resume-handling", iterations,
+                g_get_monotonic_time () - start, NULL);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(StatedDisplayManual) display = NULL;
+  g_autoptr(StatedSleeptracker) sleep_tracker = NULL;
+  g_autoptr(StatedLogind) logind = NULL;
+  g_autoptr(StatedDevicestate) devicestate = NULL;
+  char *root;
+  uint iterations;
+
+  bench_init (&argc, &argv, BENCH_ITERATIONS);
+  iterations = bench_get_iterations ();
+
+  root = stated_fake_root_new ();
+
+  bench_lock_unlock_sync (iterations);
+  bench_lock_unlock_worker (iterations);
+  bench_timed_rearm (iterations);
+
+  display = stated_display_manual_new (TRUE);
+  sleep_tracker = stated_sleeptracker_new ();
+  logind = stated_logind_new_offline ();
+  devicestate = stated_devicestate_new_full (STATED_DISPLAY (display), NULL,
+                                             sleep_tracker, logind);
+
+  bench_display_change (display, iterations);
+  bench_resume (sleep_tracker, iterations);
+
+  g_clear_object (&devicestate);
+  wakelock_cancel_all ();
+
+  stated_fake_root_free (root);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+/* bench-sysfs-batch.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * Compares the cost of applying a power transition (a batch of writes
+ * to different attributes) through:
+ *
+ * - sysfs_write(), i.e. open/write/close for every attribute
+ * - sysfs-batch with plain pwrite() on persistent fds
+ * - sysfs-batch with io_uring, if available
+ *
+ * Attributes are emulated with regular files in a temporary directory.
+ */
+
+#define G_LOG_DOMAIN "bench-sysfs-batch"
+
+#define BENCH_ATTRIBUTES 8
+#define BENCH_TRANSITIONS 10000
+
+#include <stdlib.h>
+#include <glib-2.0/glib.h>
+#include <glib-2.0/gstdio.h>
+
+#include "bench-common.h"
+#include "sysfs-batch.h"
+#include "utils.h"
+
+static char *attributes[BENCH_ATTRIBUTES];
+
+static void
+report (const char *backend,
+        uint       transitions,
+        uint64_t   syscalls,
+        uint64_t   elapsed_us)
+{
+  g_autofree char *name = NULL, *extra = NULL;
+
+  name = g_strdup_printf ("sysfs-transition-%s", backend);
+  extra = g_strdup_printf ("\"syscalls_per_transition\": %.2f",
+                           (double)syscalls / transitions);
+
+  g_print ("%-32s %10.2f syscalls/transition\n", name,
+           (double)syscalls / transitions);
+  bench_report (name, transitions, elapsed_us, extra);
+}
+
+static void
+bench_sysfs_write (uint transitions)
+{
+  uint64_t start;
+  uint i, j;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < transitions; i++) {
+    for (j = 0; j < BENCH_ATTRIBUTES; j++)
+      sysfs_write ((i % 2) ? "1" : "0", attributes[j]);
+  }
+
+  /* open, write and close for every attribute */
+  report ("sysfs_write", transitions, (uint64_t)transitions * BENCH_ATTRIBUTES * 3,
+          g_get_monotonic_time () - start);
+}
+
+static void
+bench_sysfs_batch (const char *backend,
+                   uint       transitions)
+{
+  StatedSysfsBatchEntry entries[BENCH_ATTRIBUTES];
+  uint64_t start, syscalls;
+  uint i, j;
+
+  syscalls = sysfs_batch_get_syscalls ();
+  start = g_get_monotonic_time ();
+  for (i = 0; i < transitions; i++) {
+    for (j = 0; j < BENCH_ATTRIBUTES; j++) {
+      entries[j].sysfs_file = attributes[j];
+      entries[j].content = (i % 2) ? "1" : "0";
+    }
+
+    if (sysfs_batch_submit (entries, BENCH_ATTRIBUTES) != 0)
+      g_error ("Batch failed");
+  }
+
+  report (backend, transitions, sysfs_batch_get_syscalls () - syscalls,
+          g_get_monotonic_time () - start);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *root = NULL;
+  uint transitions;
+  uint i;
+
+  bench_init (&argc, &argv, BENCH_TRANSITIONS);
+  transitions = bench_get_iterations ();
+
+  root = g_dir_make_tmp ("stated-bench-XXXXXX", &error);
+  if (root == NULL)
+    g_error ("Unable to create temporary directory: %s", error->message);
+
+  for (i = 0; i < BENCH_ATTRIBUTES; i++) {
+    attributes[i] = g_strdup_printf ("%s/attribute%u", root, i);
+    if (!g_file_set_contents (attributes[i], "", 0, &error))
+      g_error ("Unable to create %s: %s", attributes[i], error->message);
+  }
+
+  g_print ("%u transitions of %u attributes\n", transitions, BENCH_ATTRIBUTES);
+
+  bench_sysfs_write (transitions);
+
+  sysfs_batch_init (FALSE);
+  bench_sysfs_batch ("batch-write", transitions);
+  sysfs_batch_cleanup ();
+
+  if (sysfs_batch_init (TRUE)) {
+    bench_sysfs_batch ("batch-io_uring", transitions);
+    sysfs_batch_cleanup ();
+  } else {
+    g_print ("%-32s not available\n", "sysfs-transition-batch-io_uring");
+  }
+
+  for (i = 0; i < BENCH_ATTRIBUTES; i++) {
+    g_unlink (attributes[i]);
+    g_free (attributes[i]);
+  }
+  g_rmdir (root);
+
+  return EXIT_SUCCESS;
+}
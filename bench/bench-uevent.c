@@ -0,0 +1,139 @@
+/* bench-uevent.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * Feeds uevents to the uevent monitor through a socketpair, in the
+ * kernel's format, and times how long it takes to get them to the
+ * subscribers:
+ *
+ * - with a subsystem subscription, so that the socket filter drops
+ *   the uevents of the other subsystems before they're queued
+ * - with a catch-all subscription, i.e. without a filter, everything
+ *   being matched in userspace
+ *
+ * One uevent in BENCH_RELEVANT_RATIO is from the subscribed subsystem.
+ */
+
+#define G_LOG_DOMAIN "bench-uevent"
+
+#define BENCH_ITERATIONS 100000
+#define BENCH_RELEVANT_RATIO 10
+
+/* Uevents written before letting the monitor catch up */
+#define BENCH_BATCH 64
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib-2.0/glib.h>
+
+#include "bench-common.h"
+#include "uevent.h"
+
+static const char *battery_env[] = { "POWER_SUPPLY_NAME=battery", "POWER_SUPPLY_CAPACITY=42", NULL };
+static const char *usb_env[] = { "DEVTYPE=usb_interface", "PRODUCT=1d6b/2/510", NULL };
+
+static uint64_t delivered = 0;
+static uint64_t relevant = 0;
+
+static void
+on_uevent (const StatedUevent *event,
+           void               *data)
+{
+  if (event == NULL)
+    g_error ("uevents lost");
+
+  delivered++;
+  if (g_strcmp0 (uevent_get (event, "POWER_SUPPLY_NAME"), "battery") == 0)
+    relevant++;
+}
+
+static void
+bench_uevents (const char *name,
+               const char *subsystem,
+               uint       iterations)
+{
+  g_autofree char *extra = NULL;
+  uint64_t start, expected;
+  uint i, subscription_id;
+  int fds[2];
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+    g_error ("Unable to create socketpair");
+
+  subscription_id = uevent_subscribe (subsystem, NULL, on_uevent, NULL);
+  uevent_monitor_start_for_fd (fds[1]);
+
+  delivered = relevant = 0;
+  expected = 0;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    if (i % BENCH_RELEVANT_RATIO == 0) {
+      uevent_inject (fds[0], "change", "/devices/platform/battery/power_supply/battery",
+                     "power_supply", battery_env);
+      expected++;
+    } else {
+      uevent_inject (fds[0], "add", "/devices/platform/ehci/usb1/1-1/1-1:1.0",
+                     "usb", usb_env);
+      if (subsystem == NULL)
+        expected++;
+    }
+
+    if (i % BENCH_BATCH == BENCH_BATCH - 1 || i == iterations - 1) {
+      while (delivered < expected)
+        g_main_context_iteration (NULL, TRUE);
+    }
+  }
+
+  if (relevant != iterations / BENCH_RELEVANT_RATIO + (iterations % BENCH_RELEVANT_RATIO != 0))
+    g_error ("Lost uevents: %lu relevant", relevant);
+
+  extra = g_strdup_printf ("\"delivered\": %lu", delivered);
+  bench_report (name, iterations, g_get_monotonic_time () - start, extra);
+
+  uevent_monitor_stop ();
+  uevent_unsubscribe (subscription_id);
+  close (fds[0]);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  uint iterations;
+
+  bench_init (&argc, &argv, BENCH_ITERATIONS);
+  iterations = bench_get_iterations ();
+
+  bench_uevents ("uevent-filtered", "power_supply", iterations);
+  bench_uevents ("uevent-unfiltered", NULL, iterations);
+
+  return EXIT_SUCCESS;
+}
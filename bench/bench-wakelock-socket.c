@@ -0,0 +1,249 @@
+/* bench-wakelock-socket.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * Compares the client-side cost of taking and releasing a short
+ * wakelock:
+ *
+ * - writing wake_lock/wake_unlock directly, opening the files every
+ *   time or keeping them open
+ * - through the wakelock socket: an acquire request, the lock fd back
+ *   and a close(), one lock at a time or several overlapping
+ *
+ * The server runs its main loop on a separate thread, the kernel
+ * interfaces are emulated with the usual fake root.
+ */
+
+#define G_LOG_DOMAIN "bench-wakelock-socket"
+
+#define BENCH_ITERATIONS 20000
+#define BENCH_WAKELOCK "bench_client"
+
+/* Locks held at the same time in the overlapping run */
+#define BENCH_OVERLAPPING 8
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib-2.0/glib.h>
+
+#include "bench-common.h"
+#include "wakelock-server.h"
+#include "wakelocks.h"
+#include "utils.h"
+
+static void
+bench_direct_sysfs_write (uint iterations)
+{
+  char *lock_file = (char *) stated_path ("/sys/power/wake_lock");
+  char *unlock_file = (char *) stated_path ("/sys/power/wake_unlock");
+  uint64_t start;
+  uint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    sysfs_write (BENCH_WAKELOCK, lock_file);
+    sysfs_write (BENCH_WAKELOCK, unlock_file);
+  }
+
+  bench_report ("client-lock-direct-open-write", iterations,
+                g_get_monotonic_time () - start, NULL);
+}
+
+static void
+bench_direct_persistent (uint iterations)
+{
+  int lock_fd, unlock_fd;
+  uint64_t start;
+  uint i;
+
+  lock_fd = open (stated_path ("/sys/power/wake_lock"), O_WRONLY | O_CLOEXEC);
+  unlock_fd = open (stated_path ("/sys/power/wake_unlock"), O_WRONLY | O_CLOEXEC);
+  if (lock_fd < 0 || unlock_fd < 0)
+    g_error ("Unable to open the wakelock files: %s", g_strerror (errno));
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    if (write (lock_fd, BENCH_WAKELOCK, strlen (BENCH_WAKELOCK)) < 0 ||
+        write (unlock_fd, BENCH_WAKELOCK, strlen (BENCH_WAKELOCK)) < 0)
+      g_error ("Unable to write the wakelock files: %s", g_strerror (errno));
+  }
+
+  bench_report ("client-lock-direct-persistent", iterations,
+                g_get_monotonic_time () - start, NULL);
+
+  close (lock_fd);
+  close (unlock_fd);
+}
+
+static int
+client_connect (const char *socket_path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  g_strlcpy (addr.sun_path, socket_path, sizeof addr.sun_path);
+
+  fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof addr) < 0)
+    g_error ("Unable to connect to %s: %s", socket_path, g_strerror (errno));
+
+  return fd;
+}
+
+static int
+client_acquire (int fd)
+{
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  char request = STATED_WAKELOCK_SERVER_ACQUIRE, status;
+  struct iovec iov = { .iov_base = &status, .iov_len = 1 };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof control.buf,
+  };
+  struct cmsghdr *cmsg;
+  int lock_fd;
+
+  if (send (fd, &request, 1, MSG_NOSIGNAL) != 1 || recvmsg (fd, &msg, 0) != 1)
+    g_error ("Wakelock request failed: %s", g_strerror (errno));
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (status != STATED_WAKELOCK_SERVER_GRANTED || cmsg == NULL ||
+      cmsg->cmsg_type != SCM_RIGHTS)
+    g_error ("Wakelock request denied");
+
+  memcpy (&lock_fd, CMSG_DATA (cmsg), sizeof (int));
+
+  return lock_fd;
+}
+
+static void
+bench_socket (const char *socket_path,
+              uint       iterations)
+{
+  uint64_t start;
+  uint i;
+  int fd;
+
+  fd = client_connect (socket_path);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    close (client_acquire (fd));
+
+  bench_report ("client-lock-socket", iterations,
+                g_get_monotonic_time () - start, NULL);
+
+  close (fd);
+}
+
+static void
+bench_socket_overlapping (const char *socket_path,
+                          uint       iterations)
+{
+  int lock_fds[BENCH_OVERLAPPING];
+  uint64_t start;
+  uint i;
+  int fd;
+
+  fd = client_connect (socket_path);
+
+  for (i = 0; i < BENCH_OVERLAPPING; i++)
+    lock_fds[i] = client_acquire (fd);
+
+  /* Always keep BENCH_OVERLAPPING locks, replacing the oldest one */
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    close (lock_fds[i % BENCH_OVERLAPPING]);
+    lock_fds[i % BENCH_OVERLAPPING] = client_acquire (fd);
+  }
+
+  bench_report ("client-lock-socket-overlapping", iterations,
+                g_get_monotonic_time () - start, NULL);
+
+  for (i = 0; i < BENCH_OVERLAPPING; i++)
+    close (lock_fds[i]);
+  close (fd);
+}
+
+static void *
+server_thread (void *data)
+{
+  g_main_loop_run (data);
+
+  return NULL;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GMainLoop) loop = NULL;
+  GThread *thread;
+  const char *socket_path;
+  char *root;
+  uint iterations;
+
+  bench_init (&argc, &argv, BENCH_ITERATIONS);
+  iterations = bench_get_iterations ();
+
+  root = stated_fake_root_new ();
+
+  bench_direct_sysfs_write (iterations);
+  bench_direct_persistent (iterations);
+
+  socket_path = stated_path ("/run/stated/wakelock.sock");
+  if (!wakelock_server_start (socket_path, NULL))
+    g_error ("Unable to start the wakelock server");
+
+  loop = g_main_loop_new (NULL, FALSE);
+  thread = g_thread_new ("wakelock-server", server_thread, loop);
+
+  bench_socket (socket_path, iterations);
+  bench_socket_overlapping (socket_path, iterations);
+
+  g_main_loop_quit (loop);
+  g_thread_join (thread);
+
+  wakelock_server_stop ();
+  wakelock_cancel_all ();
+
+  stated_fake_root_free (root);
+
+  return EXIT_SUCCESS;
+}
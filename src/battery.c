@@ -0,0 +1,400 @@
+/* battery.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-battery"
+
+/* Weight of the latest period in the rolling drain average */
+#define BATTERY_EWMA_WEIGHT 0.2
+
+/* Fuel gauges update slowly, shorter periods only count towards totals */
+#define BATTERY_EWMA_MIN_PERIOD (uint64_t)60000 /* 1 min */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "battery.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * StatedBattery samples the battery at every power mode change
+ * (display on/off, suspend entry, resume) and attributes the energy
+ * drawn in between to the mode that just ended, so that policy or
+ * firmware changes show up as mW saved per mode.
+ *
+ * Attributes are kept open for the whole lifetime of the object and
+ * re-read with pread(), so that sampling doesn't allocate.
+ */
+
+static const char power_supply_dir[] = "/sys/class/power_supply";
+
+typedef enum {
+  BATTERY_ENERGY_NOW = 0,
+  BATTERY_CHARGE_NOW,
+  BATTERY_VOLTAGE_NOW,
+  BATTERY_CURRENT_NOW,
+  BATTERY_STATUS,
+  BATTERY_N_ATTRIBUTES
+} StatedBatteryAttribute;
+
+static const char *battery_attributes[BATTERY_N_ATTRIBUTES] = {
+  "energy_now",
+  "charge_now",
+  "voltage_now",
+  "current_now",
+  "status",
+};
+
+static const char *mode_names[STATED_BATTERY_N_MODES] = {
+  "screen_on",
+  "screen_off_awake",
+  "suspended",
+};
+
+struct _StatedBattery
+{
+  GObject parent_instance;
+
+  int fds[BATTERY_N_ATTRIBUTES];
+
+  StatedBatteryMode mode;
+  gboolean sampled;
+  uint64_t sample_boottime;
+  uint64_t sample_energy_uwh;
+  int64_t current_ua;
+
+  StatedBatteryModeStats stats[STATED_BATTERY_N_MODES];
+};
+
+G_DEFINE_TYPE (StatedBattery, stated_battery, G_TYPE_OBJECT)
+
+/**
+ * Returns the path of the first power supply of type "Battery",
+ * or NULL.
+ */
+static char *
+find_battery (void)
+{
+  g_autofree char *type = NULL;
+  g_autofree char *type_path = NULL;
+  g_autofree char *path = NULL;
+  const char *name;
+  GDir *dir;
+
+  dir = g_dir_open (stated_path (power_supply_dir), 0, NULL);
+  if (dir == NULL)
+    return NULL;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_clear_pointer (&type, g_free);
+    g_free (type_path);
+    g_free (path);
+    path = g_build_filename (stated_path (power_supply_dir), name, NULL);
+    type_path = g_build_filename (path, "type", NULL);
+
+    if (g_file_get_contents (type_path, &type, NULL, NULL) &&
+        g_str_has_prefix (type, "Battery"))
+      break;
+  }
+
+  g_dir_close (dir);
+
+  return (name != NULL) ? g_steal_pointer (&path) : NULL;
+}
+
+static ssize_t
+read_attribute (StatedBattery          *self,
+                StatedBatteryAttribute attribute,
+                char                   *buf,
+                size_t                 buf_size)
+{
+  ssize_t len;
+
+  if (self->fds[attribute] < 0)
+    return -1;
+
+  len = pread (self->fds[attribute], buf, buf_size - 1, 0);
+  if (len < 0) {
+    g_debug ("Unable to read %s: %s", battery_attributes[attribute],
+             g_strerror (errno));
+    return -1;
+  }
+
+  while (len > 0 && buf[len - 1] == '\n')
+    len--;
+  buf[len] = '\0';
+
+  return len;
+}
+
+static gboolean
+read_int64 (StatedBattery          *self,
+            StatedBatteryAttribute attribute,
+            int64_t                *value)
+{
+  char buf[32];
+  char *end;
+
+  if (read_attribute (self, attribute, buf, sizeof buf) <= 0)
+    return FALSE;
+
+  *value = strtoll (buf, &end, 10);
+
+  return (end != buf);
+}
+
+/**
+ * Reads the remaining energy, in µWh. Gauges exposing charge only are
+ * converted using the current voltage.
+ */
+static gboolean
+read_energy (StatedBattery *self,
+             uint64_t      *energy_uwh)
+{
+  int64_t energy, charge, voltage;
+
+  if (read_int64 (self, BATTERY_ENERGY_NOW, &energy)) {
+    *energy_uwh = MAX (energy, 0);
+    return TRUE;
+  }
+
+  if (read_int64 (self, BATTERY_CHARGE_NOW, &charge) &&
+      read_int64 (self, BATTERY_VOLTAGE_NOW, &voltage)) {
+    *energy_uwh = MAX (charge, 0) * MAX (voltage, 0) / 1000000;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static gboolean
+is_discharging (StatedBattery *self)
+{
+  char buf[32];
+
+  /* Assume discharging if the status is unknown */
+  if (read_attribute (self, BATTERY_STATUS, buf, sizeof buf) <= 0)
+    return TRUE;
+
+  return (strcmp (buf, "Discharging") == 0 || strcmp (buf, "Not charging") == 0);
+}
+
+/**
+ * Samples the battery, attributing the energy drawn since the previous
+ * sample to the current mode, then switches to the given mode.
+ */
+void
+stated_battery_set_mode (StatedBattery     *self,
+                         StatedBatteryMode mode)
+{
+  StatedBatteryModeStats *stats;
+  uint64_t now, energy_uwh, elapsed, drawn;
+  double drain_mw;
+
+  g_return_if_fail (STATED_IS_BATTERY (self));
+  g_return_if_fail (mode < STATED_BATTERY_N_MODES);
+
+  now = time_get_boottime ();
+  read_int64 (self, BATTERY_CURRENT_NOW, &self->current_ua);
+
+  if (!read_energy (self, &energy_uwh)) {
+    self->sampled = FALSE;
+    self->mode = mode;
+    return;
+  }
+
+  /* Periods spent charging don't tell anything about the drain */
+  if (self->sampled && is_discharging (self) &&
+      now > self->sample_boottime && energy_uwh <= self->sample_energy_uwh) {
+    elapsed = now - self->sample_boottime;
+    drawn = self->sample_energy_uwh - energy_uwh;
+
+    stats = &self->stats[self->mode];
+    stats->time_ms += elapsed;
+    stats->energy_uwh += drawn;
+    stats->periods++;
+
+    /* µWh * 3600 = µJ, and µJ / ms = mW */
+    if (elapsed >= BATTERY_EWMA_MIN_PERIOD) {
+      drain_mw = (double)drawn * 3600 / elapsed;
+      stats->drain_ewma_mw = (stats->drain_ewma_mw == 0) ? drain_mw
+                             : stats->drain_ewma_mw * (1 - BATTERY_EWMA_WEIGHT) +
+                               drain_mw * BATTERY_EWMA_WEIGHT;
+    }
+
+    g_debug ("%s: %lu uWh in %lu ms", mode_names[self->mode], drawn, elapsed);
+  }
+
+  self->sampled = TRUE;
+  self->sample_boottime = now;
+  self->sample_energy_uwh = energy_uwh;
+  self->mode = mode;
+}
+
+const StatedBatteryModeStats *
+stated_battery_get_mode_stats (StatedBattery     *self,
+                               StatedBatteryMode mode)
+{
+  g_return_val_if_fail (STATED_IS_BATTERY (self), NULL);
+  g_return_val_if_fail (mode < STATED_BATTERY_N_MODES, NULL);
+
+  return &self->stats[mode];
+}
+
+static void
+append_stats (GString       *out,
+              StatedBattery *self)
+{
+  const StatedBatteryModeStats *stats;
+  char labels[32];
+  int i;
+
+  stats_append_type (out, "stated_battery_energy_uwh", "gauge", "Remaining energy at the last sample");
+  stats_append_value (out, "stated_battery_energy_uwh", NULL, self->sample_energy_uwh);
+  stats_append_type (out, "stated_battery_current_ua", "gauge", "Current at the last sample");
+  stats_append_value (out, "stated_battery_current_ua", NULL, self->current_ua);
+
+  stats_append_type (out, "stated_battery_mode_seconds_total", "counter",
+                     "Time spent discharging per power mode");
+  for (i = 0; i < STATED_BATTERY_N_MODES; i++) {
+    g_snprintf (labels, sizeof labels, "mode=\"%s\"", mode_names[i]);
+    stats_append_value (out, "stated_battery_mode_seconds_total", labels,
+                        self->stats[i].time_ms / 1000.0);
+  }
+
+  stats_append_type (out, "stated_battery_mode_energy_uwh_total", "counter",
+                     "Energy drawn per power mode");
+  for (i = 0; i < STATED_BATTERY_N_MODES; i++) {
+    g_snprintf (labels, sizeof labels, "mode=\"%s\"", mode_names[i]);
+    stats_append_value (out, "stated_battery_mode_energy_uwh_total", labels,
+                        self->stats[i].energy_uwh);
+  }
+
+  stats_append_type (out, "stated_battery_drain_mw", "gauge",
+                     "Average drain per power mode");
+  for (i = 0; i < STATED_BATTERY_N_MODES; i++) {
+    stats = &self->stats[i];
+    g_snprintf (labels, sizeof labels, "mode=\"%s\"", mode_names[i]);
+    stats_append_value (out, "stated_battery_drain_mw", labels,
+                        stats->time_ms ? (double)stats->energy_uwh * 3600 / stats->time_ms : 0);
+  }
+
+  stats_append_type (out, "stated_battery_drain_ewma_mw", "gauge",
+                     "Rolling average drain per power mode");
+  for (i = 0; i < STATED_BATTERY_N_MODES; i++) {
+    g_snprintf (labels, sizeof labels, "mode=\"%s\"", mode_names[i]);
+    stats_append_value (out, "stated_battery_drain_ewma_mw", labels,
+                        self->stats[i].drain_ewma_mw);
+  }
+}
+
+static void
+stated_battery_constructed (GObject *obj)
+{
+  StatedBattery *self = STATED_BATTERY (obj);
+  g_autofree char *battery = NULL;
+  char path[PATH_MAX];
+  int i;
+
+  G_OBJECT_CLASS (stated_battery_parent_class)->constructed (obj);
+
+  battery = find_battery ();
+  if (battery == NULL) {
+    g_warning ("No battery found");
+    return;
+  }
+
+  g_debug ("Sampling battery %s", battery);
+
+  for (i = 0; i < BATTERY_N_ATTRIBUTES; i++) {
+    g_snprintf (path, sizeof path, "%s/%s", battery, battery_attributes[i]);
+
+    /* Gauges expose either energy or charge, so don't complain */
+    self->fds[i] = open (path, O_RDONLY | O_CLOEXEC);
+  }
+
+  stats_register ("battery", (StatedStatsProviderFunc) append_stats, self);
+
+  /* Take the initial sample */
+  stated_battery_set_mode (self, STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+}
+
+static void
+stated_battery_dispose (GObject *obj)
+{
+  StatedBattery *self = STATED_BATTERY (obj);
+  int i;
+
+  stats_unregister ("battery");
+
+  for (i = 0; i < BATTERY_N_ATTRIBUTES; i++) {
+    if (self->fds[i] >= 0) {
+      close (self->fds[i]);
+      self->fds[i] = -1;
+    }
+  }
+
+  G_OBJECT_CLASS (stated_battery_parent_class)->dispose (obj);
+}
+
+static void
+stated_battery_class_init (StatedBatteryClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = stated_battery_constructed;
+  object_class->dispose      = stated_battery_dispose;
+}
+
+static void
+stated_battery_init (StatedBattery *self)
+{
+  int i;
+
+  for (i = 0; i < BATTERY_N_ATTRIBUTES; i++)
+    self->fds[i] = -1;
+}
+
+StatedBattery *
+stated_battery_new (void)
+{
+  return g_object_new (STATED_TYPE_BATTERY, NULL);
+}
+
+gboolean
+stated_battery_check (void)
+{
+  g_autofree char *battery = find_battery ();
+
+  return (battery != NULL);
+}
@@ -0,0 +1,64 @@
+/* battery.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDBATTERY_H
+#define STATEDBATTERY_H
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  STATED_BATTERY_MODE_SCREEN_ON = 0,
+  STATED_BATTERY_MODE_SCREEN_OFF_AWAKE,
+  STATED_BATTERY_MODE_SUSPENDED,
+  STATED_BATTERY_N_MODES
+} StatedBatteryMode;
+
+typedef struct {
+  uint64_t time_ms;
+  uint64_t energy_uwh;
+  uint periods;
+  double drain_ewma_mw;
+} StatedBatteryModeStats;
+
+#define STATED_TYPE_BATTERY stated_battery_get_type ()
+G_DECLARE_FINAL_TYPE (StatedBattery, stated_battery, STATED, BATTERY, GObject)
+
+StatedBattery *stated_battery_new (void);
+gboolean stated_battery_check (void);
+void stated_battery_set_mode (StatedBattery     *self,
+                              StatedBatteryMode mode);
+const StatedBatteryModeStats *stated_battery_get_mode_stats (StatedBattery     *self,
+                                                             StatedBatteryMode mode);
+
+G_END_DECLS
+
+#endif /* STATEDBATTERY_H */
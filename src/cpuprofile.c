@@ -0,0 +1,196 @@
+/* cpuprofile.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-cpuprofile"
+
+#define CPUPROFILE_MAX_POLICIES 16
+
+#include <string.h>
+
+#include "cpuprofile.h"
+#include "sysfs-worker.h"
+#include "utils.h"
+
+/**
+ * CPU profiles map onto cpufreq governors, picking for every cpufreq
+ * policy the first governor of the profile the kernel has. The
+ * governors found at the first switch are remembered, and put back
+ * when going back to the default profile.
+ */
+
+static const char cpufreq_dir[] = "/sys/devices/system/cpu/cpufreq";
+
+static const char *profile_names[STATED_CPU_PROFILE_N] = {
+  [STATED_CPU_PROFILE_DEFAULT] = "default",
+  [STATED_CPU_PROFILE_POWERSAVE] = "powersave",
+  [STATED_CPU_PROFILE_BALANCED] = "balanced",
+  [STATED_CPU_PROFILE_PERFORMANCE] = "performance",
+};
+
+static const char *profile_governors[STATED_CPU_PROFILE_N][4] = {
+  [STATED_CPU_PROFILE_DEFAULT] = { NULL },
+  [STATED_CPU_PROFILE_POWERSAVE] = { "powersave", "conservative", NULL },
+  [STATED_CPU_PROFILE_BALANCED] = { "schedutil", "interactive", "ondemand", NULL },
+  [STATED_CPU_PROFILE_PERFORMANCE] = { "performance", NULL },
+};
+
+typedef struct {
+  const char *governor_file; /* interned */
+  char *original;
+  char **available;
+} StatedCpufreqPolicy;
+
+static StatedCpufreqPolicy policies[CPUPROFILE_MAX_POLICIES];
+static uint n_policies = 0;
+static gboolean policies_loaded = FALSE;
+
+static StatedCpuProfile current_profile = STATED_CPU_PROFILE_DEFAULT;
+
+static void
+load_policies (void)
+{
+  g_autofree char *available = NULL;
+  g_autofree char *governor_path = NULL;
+  g_autofree char *path = NULL;
+  const char *name;
+  char *original;
+  GDir *dir;
+
+  policies_loaded = TRUE;
+
+  dir = g_dir_open (stated_path (cpufreq_dir), 0, NULL);
+  if (dir == NULL) {
+    g_debug ("No cpufreq policies, CPU profiles are not supported");
+    return;
+  }
+
+  while ((name = g_dir_read_name (dir)) != NULL && n_policies < CPUPROFILE_MAX_POLICIES) {
+    if (!g_str_has_prefix (name, "policy"))
+      continue;
+
+    g_clear_pointer (&governor_path, g_free);
+    governor_path = g_build_filename (stated_path (cpufreq_dir), name, "scaling_governor", NULL);
+    if (!g_file_get_contents (governor_path, &original, NULL, NULL))
+      continue;
+
+    g_clear_pointer (&path, g_free);
+    path = g_build_filename (stated_path (cpufreq_dir), name, "scaling_available_governors", NULL);
+    g_clear_pointer (&available, g_free);
+    if (!g_file_get_contents (path, &available, NULL, NULL)) {
+      g_free (original);
+      continue;
+    }
+
+    policies[n_policies].original = g_strstrip (original);
+    policies[n_policies].available = g_strsplit (g_strstrip (available), " ", -1);
+    policies[n_policies].governor_file = g_intern_string (governor_path);
+    n_policies++;
+  }
+
+  g_dir_close (dir);
+}
+
+static const char *
+pick_governor (StatedCpufreqPolicy *policy,
+               StatedCpuProfile    profile)
+{
+  uint i;
+
+  if (profile == STATED_CPU_PROFILE_DEFAULT)
+    return policy->original;
+
+  for (i = 0; profile_governors[profile][i] != NULL; i++) {
+    if (g_strv_contains ((const char * const *) policy->available, profile_governors[profile][i]))
+      return profile_governors[profile][i];
+  }
+
+  return NULL;
+}
+
+/**
+ * Switches every cpufreq policy to the governor of profile. Policies
+ * that have none of its governors are left alone.
+ */
+void
+cpuprofile_apply (StatedCpuProfile profile)
+{
+  const char *governor;
+  uint i;
+
+  g_return_if_fail (profile < STATED_CPU_PROFILE_N);
+
+  if (profile == current_profile)
+    return;
+
+  if (!policies_loaded)
+    load_policies ();
+
+  g_message ("CPU profile: %s -> %s", profile_names[current_profile], profile_names[profile]);
+  current_profile = profile;
+
+  for (i = 0; i < n_policies; i++) {
+    governor = pick_governor (&policies[i], profile);
+    if (governor == NULL) {
+      g_debug ("No %s governor for %s", profile_names[profile], policies[i].governor_file);
+      continue;
+    }
+
+    sysfs_write_queued (governor, policies[i].governor_file, NULL);
+  }
+}
+
+StatedCpuProfile
+cpuprofile_get (void)
+{
+  return current_profile;
+}
+
+const char *
+cpuprofile_to_string (StatedCpuProfile profile)
+{
+  g_return_val_if_fail (profile < STATED_CPU_PROFILE_N, NULL);
+
+  return profile_names[profile];
+}
+
+gboolean
+cpuprofile_from_string (const char       *str,
+                        StatedCpuProfile *profile)
+{
+  uint i;
+
+  for (i = 0; i < STATED_CPU_PROFILE_N; i++) {
+    if (strcmp (str, profile_names[i]) == 0) {
+      *profile = i;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,49 @@
+/* cpuprofile.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDCPUPROFILE_H
+#define STATEDCPUPROFILE_H
+
+#include <glib-2.0/glib.h>
+
+typedef enum {
+  STATED_CPU_PROFILE_DEFAULT = 0, /* Whatever the system had set up */
+  STATED_CPU_PROFILE_POWERSAVE,
+  STATED_CPU_PROFILE_BALANCED,
+  STATED_CPU_PROFILE_PERFORMANCE,
+  STATED_CPU_PROFILE_N
+} StatedCpuProfile;
+
+void cpuprofile_apply (StatedCpuProfile profile);
+StatedCpuProfile cpuprofile_get (void);
+const char *cpuprofile_to_string (StatedCpuProfile profile);
+gboolean cpuprofile_from_string (const char       *str,
+                                 StatedCpuProfile *profile);
+
+#endif /* STATEDCPUPROFILE_H */
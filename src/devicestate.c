@@ -32,11 +32,13 @@
 #define DISPLAY_WAKELOCK "stated_display"
 #define POWERKEY_WAKELOCK "stated_powerkey_timer"
 #define RESUME_WAKELOCK "stated_resume_timer"
-#define DEFAULT_WAIT_TIME 10
+#define LOGIND_INHIBIT_WAKELOCK "stated_logind_inhibit"
 
-/* Resume behaviour */
-#define RESUME_LOCK_WAIT_TIME 2
-#define RESUME_MAX_CEILING 7
+/* Suspend abort storm backoff */
+#define SUSPEND_BACKOFF_WAKELOCK "stated_suspend_backoff"
+#define SUSPEND_BACKOFF_WAIT_TIME 30
+#define SUSPEND_BACKOFF_MAX_LEVEL 4
+#define SUSPEND_BACKOFF_AUTOSLEEP_PAUSE_TIME 600
 
 #include "wakelocks.h"
 #include "devicestate.h"
@@ -44,8 +46,67 @@
 #include "display-file.h"
 #include "input.h"
 #include "sleeptracker.h"
+#include "sleep.h"
+#include "sleephooks.h"
+#include "suspendstats.h"
+#include "trace.h"
+#include "flightrec.h"
+#include "idle.h"
+#include "tracepoints.h"
+#include "ledger.h"
+#include "logind.h"
+#include "battery.h"
+#include "cpuprofile.h"
+#include "lock-model.h"
+#include "metrics.h"
+#include "powersource.h"
+#include "powerstate.h"
+#include "selfprof.h"
+#include "stats.h"
+#include "utils.h"
+
+/* Built-in policy sets, one per power source */
+static const StatedDevicestatePolicy default_policies[STATED_POWERSOURCE_N] = {
+  [STATED_POWERSOURCE_BATTERY] = {
+    .display_wait_time = 10,
+    .lid_display_wait_time = 0,
+    .powerkey_wait_time = 10,
+    .resume_lock_wait_time = 2,
+    .resume_max_ceiling = 7,
+    .resume_loop_threshold = 15000, /* 15 secs */
+    .autosleep = 1,
+    .cpu_profile = STATED_CPU_PROFILE_DEFAULT,
+    .low_battery_threshold = 15,
+    .idle_timeout = 0,
+  },
+  /* Energy is cheap, keep the device responsive */
+  [STATED_POWERSOURCE_AC] = {
+    .display_wait_time = 30,
+    .lid_display_wait_time = 0,
+    .powerkey_wait_time = 15,
+    .resume_lock_wait_time = 2,
+    .resume_max_ceiling = 7,
+    .resume_loop_threshold = 15000,
+    .autosleep = 1,
+    .cpu_profile = STATED_CPU_PROFILE_DEFAULT,
+    .low_battery_threshold = 15,
+    .idle_timeout = 0,
+  },
+  /* Get back to sleep as soon as possible */
+  [STATED_POWERSOURCE_LOW_BATTERY] = {
+    .display_wait_time = 2,
+    .lid_display_wait_time = 0,
+    .powerkey_wait_time = 5,
+    .resume_lock_wait_time = 1,
+    .resume_max_ceiling = 7,
+    .resume_loop_threshold = 15000,
+    .autosleep = 1,
+    .cpu_profile = STATED_CPU_PROFILE_POWERSAVE,
+    .low_battery_threshold = 15,
+    .idle_timeout = 0,
+  },
+};
 
-static uint64_t RESUME_LOOP_THRESHOLD = (uint64_t)15000; /* 15 secs */
 
 struct _StatedDevicestate
 {
@@ -54,14 +115,220 @@ struct _StatedDevicestate
   /* instance members */
   StatedDisplay *primary_display;
   StatedInput *powerkey_input;
+  StatedInput *lid_input;
   StatedSleeptracker *sleep_tracker;
+  StatedSuspendstats *suspend_stats;
+  StatedBattery *battery;
+  StatedLogind *logind;
+  StatedPowersource *power_source;
+  StatedIdle *idle;
   gboolean primary_display_on;
+  gboolean lid_closed;
+
+  /* Whether the pre-suspend hooks ran in this awake period */
+  gboolean sleep_hooks_ran;
+
+  /* The policy in use, picked from policies by the power source */
+  StatedDevicestatePolicy policy;
+  StatedDevicestatePolicy policies[STATED_POWERSOURCE_N];
+  StatedPowersourceState source;
+  StatedLockModel *lock_model;
+
+  /* Set on shadow instances: the active instance they're compared to */
+  StatedDevicestate *shadow_of;
 
   uint8_t subsequent_resumes;
+  uint8_t suspend_backoff_level;
+
+  uint resume_loops;
 };
 
+typedef enum {
+  STATED_DEVICESTATE_PROP_DISPLAY = 1,
+  STATED_DEVICESTATE_PROP_POWERKEY_INPUT,
+  STATED_DEVICESTATE_PROP_LID_INPUT,
+  STATED_DEVICESTATE_PROP_SLEEP_TRACKER,
+  STATED_DEVICESTATE_PROP_LOGIND,
+  STATED_DEVICESTATE_PROP_SHADOW_OF,
+  STATED_DEVICESTATE_PROP_LAST
+} StatedDevicestateProperty;
+
+static GParamSpec *props[STATED_DEVICESTATE_PROP_LAST] = { NULL, };
+
 G_DEFINE_TYPE (StatedDevicestate, stated_devicestate, G_TYPE_OBJECT)
 
+/**
+ * Wakelocks are taken through these, so that they're accounted in the
+ * lock model. Shadow instances only account them.
+ */
+static void
+devicestate_lock (StatedDevicestate *self,
+                  char              *lock_name)
+{
+  lock_model_lock (self->lock_model, lock_name);
+
+  if (self->shadow_of == NULL)
+    wakelock_lock (lock_name);
+}
+
+static void
+devicestate_unlock (StatedDevicestate *self,
+                    char              *lock_name)
+{
+  lock_model_unlock (self->lock_model, lock_name);
+
+  if (self->shadow_of == NULL)
+    wakelock_unlock (lock_name);
+}
+
+static void
+devicestate_lock_timed (StatedDevicestate *self,
+                        char              *lock_name,
+                        uint              timeout)
+{
+  lock_model_timed (self->lock_model, lock_name, timeout);
+
+  if (self->shadow_of == NULL)
+    wakelock_timed (lock_name, timeout);
+}
+
+static void
+devicestate_lock_cancel (StatedDevicestate *self,
+                         char              *lock_name,
+                         gboolean          keep_lock)
+{
+  lock_model_cancel (self->lock_model, lock_name, keep_lock);
+
+  if (self->shadow_of == NULL)
+    wakelock_cancel (lock_name, keep_lock);
+}
+
+/**
+ * Schedules the removal of the display wakelock after screen-off,
+ * right away if there's no grace period (e.g. the lid is closed).
+ */
+static void
+devicestate_display_lock_release (StatedDevicestate *self)
+{
+  uint wait_time = self->lid_closed ? self->policy.lid_display_wait_time
+                                    : self->policy.display_wait_time;
+
+  if (wait_time > 0) {
+    devicestate_lock_timed (self, DISPLAY_WAKELOCK, wait_time);
+  } else if (lock_model_is_held (self->lock_model, DISPLAY_WAKELOCK)) {
+    devicestate_lock_cancel (self, DISPLAY_WAKELOCK, TRUE);
+    devicestate_unlock (self, DISPLAY_WAKELOCK);
+  }
+}
+
+/**
+ * Mirrors logind's sleep and idle block inhibitors onto a single
+ * wakelock, held for as long as at least one of them is.
+ */
+static void
+on_logind_inhibited_changed (StatedDevicestate *self,
+                             GParamSpec        *pspec,
+                             StatedLogind      *logind)
+{
+  if (stated_logind_get_inhibited (logind)) {
+    g_debug ("logind inhibitors active, taking wakelock");
+    devicestate_lock (self, LOGIND_INHIBIT_WAKELOCK);
+  } else {
+    g_debug ("logind inhibitors released, dropping wakelock");
+    devicestate_unlock (self, LOGIND_INHIBIT_WAKELOCK);
+  }
+}
+
+/**
+ * Runs the post-sleep hooks if the pre-sleep ones ran: either after a
+ * resume, or when the device ended up staying awake instead (the
+ * display came back on, or autosleep got disabled), so that whatever
+ * the hooks quiesced is brought back up in any case.
+ */
+static void
+devicestate_sleep_hooks_post (StatedDevicestate *self)
+{
+  if (self->shadow_of != NULL || !self->sleep_hooks_ran)
+    return;
+
+  self->sleep_hooks_ran = FALSE;
+  sleephooks_run (STATED_SLEEP_HOOKS_POST);
+}
+
+/**
+ * Lets the idle engine run only while the display is on, the
+ * compositor isn't reporting idleness itself, and no logind inhibitor
+ * asks to stay awake.
+ */
+static void
+devicestate_update_idle (StatedDevicestate *self)
+{
+  if (self->idle == NULL)
+    return;
+
+  stated_idle_set_active (self->idle,
+                          !stated_logind_get_idle_hint (self->logind) &&
+                          !stated_logind_get_inhibited (self->logind) &&
+                          (self->primary_display == NULL || self->primary_display_on));
+}
+
+static void
+devicestate_set_display_on (StatedDevicestate *self,
+                            gboolean          on)
+{
+  self->primary_display_on = on;
+
+  if (self->shadow_of == NULL) {
+    trace_record (self->primary_display_on ? STATED_TRACE_DISPLAY_ON : STATED_TRACE_DISPLAY_OFF,
+                  time_get_boottime ());
+    flightrec_record (STATED_FLIGHTREC_DISPLAY, NULL, NULL, self->primary_display_on, 0, 0);
+    TRACE_DISPLAY_CHANGED (self->primary_display_on);
+    metrics_display_changed (self->primary_display_on);
+    if (self->primary_display_on)
+      devicestate_sleep_hooks_post (self);
+    powerstate_handle (self->primary_display_on ? STATED_POWER_EVENT_DISPLAY_ON
+                                                : STATED_POWER_EVENT_DISPLAY_OFF);
+  }
+
+  /* Suspend statistics are polled only while the display is off */
+  if (self->suspend_stats)
+    stated_suspendstats_set_polling (self->suspend_stats,
+                                     !self->primary_display_on);
+
+  /* Awake time while the display is off is accounted per session */
+  if (self->shadow_of != NULL) {
+    /* Not by shadows */
+  } else if (self->primary_display_on) {
+    ledger_session_end ();
+    selfprof_screen_off_end ();
+  } else {
+    ledger_session_begin ();
+    selfprof_screen_off_begin ();
+  }
+
+  if (self->battery)
+    stated_battery_set_mode (self->battery,
+                             self->primary_display_on ? STATED_BATTERY_MODE_SCREEN_ON
+                                                      : STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+
+  if (self->primary_display_on) {
+    g_debug ("Display on, setting wakelock");
+    devicestate_lock (self, DISPLAY_WAKELOCK);
+
+    /* Cancel an eventual timeout triggered by a previous display shutdown */
+    devicestate_lock_cancel (self, DISPLAY_WAKELOCK, TRUE);
+  } else {
+    g_debug ("Display off, scheduling wakelock removal");
+
+    devicestate_display_lock_release (self);
+  }
+
+  if (self->idle != NULL && self->primary_display_on)
+    stated_idle_notify_activity (self->idle);
+
+  devicestate_update_idle (self);
+}
+
 static void
 on_display_status_changed (StatedDevicestate *self,
                            GParamSpec    *pspec,
@@ -75,19 +342,86 @@ on_display_status_changed (StatedDevicestate *self,
   g_value_init (&value, pspec->value_type);
   g_object_get_property (G_OBJECT (display), pspec->name, &value);
 
-  if (g_value_get_boolean (&value) == TRUE) {
-    g_debug ("Display on, setting wakelock");
-    wakelock_lock (DISPLAY_WAKELOCK);
+  /* Already handled as off when the idle engine blanked it */
+  if (!g_value_get_boolean (&value) && !self->primary_display_on &&
+      self->idle != NULL && stated_idle_get_blanked (self->idle)) {
+    g_value_unset (&value);
+    return;
+  }
 
-    /* Cancel an eventual timeout triggered by a previous display shutdown */
-    wakelock_cancel (DISPLAY_WAKELOCK, TRUE);
-  } else {
-    g_debug ("Display off, scheduling wakelock removal");
+  devicestate_set_display_on (self, g_value_get_boolean (&value));
 
-    wakelock_timed (DISPLAY_WAKELOCK, DEFAULT_WAIT_TIME);
+  g_value_unset (&value);
+}
+
+/**
+ * A display blanked by the idle engine is off as far as the policy
+ * is concerned, until the engine sees activity again.
+ */
+static void
+on_idle_blanked_changed (StatedDevicestate *self,
+                         GParamSpec        *pspec,
+                         StatedIdle        *idle)
+{
+  gboolean display_on = FALSE;
+
+  if (stated_idle_get_blanked (idle)) {
+    if (self->primary_display_on)
+      devicestate_set_display_on (self, FALSE);
+    return;
   }
 
-  g_value_unset (&value);
+  if (self->primary_display != NULL)
+    g_object_get (self->primary_display, "on", &display_on, NULL);
+
+  if (display_on && !self->primary_display_on)
+    devicestate_set_display_on (self, TRUE);
+}
+
+
+/**
+ * Switches to the policy set of the current power source. The
+ * system-wide settings (autosleep, CPU profile) are only applied by
+ * the active instance.
+ */
+static void
+devicestate_apply_policy (StatedDevicestate *self)
+{
+  self->source = self->power_source ? stated_powersource_get_state (self->power_source)
+                                    : STATED_POWERSOURCE_BATTERY;
+  self->policy = self->policies[self->source];
+
+  if (self->shadow_of != NULL)
+    return;
+
+  autosleep_set_allowed (self->policy.autosleep > 0);
+  if (!autosleep_is_enabled ())
+    devicestate_sleep_hooks_post (self);
+  cpuprofile_apply (MIN (self->policy.cpu_profile, STATED_CPU_PROFILE_N - 1));
+
+  /* The idle engine is only brought up once asked for */
+  if (self->policy.idle_timeout > 0 && self->idle == NULL) {
+    self->idle = stated_idle_new ();
+    g_signal_connect_object (self->idle, "notify::blanked",
+                             G_CALLBACK (on_idle_blanked_changed),
+                             self, G_CONNECT_SWAPPED);
+  }
+
+  if (self->idle != NULL) {
+    stated_idle_set_timeout (self->idle, self->policy.idle_timeout);
+    devicestate_update_idle (self);
+  }
+}
+
+static void
+on_power_source_changed (StatedDevicestate *self,
+                         GParamSpec        *pspec,
+                         StatedPowersource *power_source)
+{
+  g_debug ("Switching to the %s policy",
+           stated_powersource_state_to_string (stated_powersource_get_state (power_source)));
+
+  devicestate_apply_policy (self);
 }
 
 static void
@@ -97,8 +431,47 @@ on_powerkey_pressed (StatedDevicestate *self,
   g_return_if_fail (STATED_IS_DEVICESTATE (self));
   g_return_if_fail (STATED_IS_INPUT (input));
 
+  if (self->shadow_of == NULL) {
+    trace_record (STATED_TRACE_POWERKEY, time_get_boottime ());
+    TRACE_POWERKEY_PRESSED ();
+    powerstate_handle (STATED_POWER_EVENT_POWERKEY);
+  }
+
   /* Add a timeout to remove the wakelock */
-  wakelock_timed (POWERKEY_WAKELOCK, DEFAULT_WAIT_TIME);
+  devicestate_lock_timed (self, POWERKEY_WAKELOCK, self->policy.powerkey_wait_time);
+}
+
+/**
+ * Closing the lid means the user is done: the screen-off grace is
+ * shortened (to nothing by default) and the powerkey one is dropped.
+ * Opening it is handled like a powerkey press, so that the device
+ * stays up while the display comes back.
+ */
+static void
+on_lid_changed (StatedDevicestate *self,
+                GParamSpec        *pspec,
+                StatedInput       *input)
+{
+  g_return_if_fail (STATED_IS_DEVICESTATE (self));
+  g_return_if_fail (STATED_IS_INPUT (input));
+
+  self->lid_closed = stated_input_get_switch_state (input);
+
+  if (self->lid_closed) {
+    g_debug ("Lid closed, hastening screen-off");
+
+    devicestate_lock_cancel (self, POWERKEY_WAKELOCK, FALSE);
+
+    if (!self->primary_display_on && lock_model_is_held (self->lock_model, DISPLAY_WAKELOCK))
+      devicestate_display_lock_release (self);
+  } else {
+    g_debug ("Lid opened, waking up");
+
+    if (self->shadow_of == NULL)
+      powerstate_handle (STATED_POWER_EVENT_POWERKEY);
+
+    devicestate_lock_timed (self, POWERKEY_WAKELOCK, self->policy.powerkey_wait_time);
+  }
 }
 
 static void
@@ -108,20 +481,34 @@ on_resume (StatedDevicestate  *self,
            StatedSleeptracker *sleep_tracker)
 {
   uint64_t time_offset;
+  int64_t start = g_get_monotonic_time ();
 
   g_return_if_fail (STATED_IS_DEVICESTATE (self));
   g_return_if_fail (STATED_IS_SLEEPTRACKER (sleep_tracker));
 
+  if (self->shadow_of == NULL) {
+    trace_record (STATED_TRACE_RESUME, new_boottime);
+    powerstate_handle (STATED_POWER_EVENT_RESUME);
+
+    devicestate_sleep_hooks_post (self);
+  }
+
+  /* Close the suspended period */
+  if (self->battery)
+    stated_battery_set_mode (self->battery,
+                             self->primary_display_on ? STATED_BATTERY_MODE_SCREEN_ON
+                                                      : STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+
   /* Always obtain a wakelock for RESUME_WAKELOCK */
-  wakelock_lock (RESUME_WAKELOCK);
+  devicestate_lock (self, RESUME_WAKELOCK);
 
   /* Try to detect subsequent sleep/resume loops and damper them,
    * the logic is as follows:
    *
-   * - Always obtain a timed wakelock, using subsequent_resumes * RESUME_LOCK_WAIT_TIME
+   * - Always obtain a timed wakelock, using subsequent_resumes * resume_lock_wait_time
    * - If a "sleep/resume loop" is detected, increment subsequent_resumes so that
-   *   the device spends more time awake. The ceiling is RESUME_MAX_CEILING (7),
-   *   so that means that the timed wakelock will last at most for 14 seconds.
+   *   the device spends more time awake. The ceiling is resume_max_ceiling (7 by
+   *   default), so the timed wakelock lasts at most for 14 seconds by default.
    */
 
   /* StatedSleeptracker only tracks resumes for now, so we're unable to precisely
@@ -133,42 +520,239 @@ on_resume (StatedDevicestate  *self,
    * this.
    */
   time_offset = (self->subsequent_resumes == 0) ? 0
-                : RESUME_LOCK_WAIT_TIME * (self->subsequent_resumes + 1) * 1000;
+                : self->policy.resume_lock_wait_time * (self->subsequent_resumes + 1) * 1000;
 
   g_debug ("now - previous_bootime: %lu", (new_boottime - previous_boottime + time_offset));
 
-  if ((new_boottime - previous_boottime + time_offset) < RESUME_LOOP_THRESHOLD) {
+  if ((new_boottime - previous_boottime + time_offset) < self->policy.resume_loop_threshold) {
     /* Assume this is a sleep/resume loop. */
     self->subsequent_resumes = MIN (self->subsequent_resumes + 1,
-                                    RESUME_MAX_CEILING);
-    g_warning ("Resume loop detected, subsequent_resumes raised to %d",
-             self->subsequent_resumes);
+                                    self->policy.resume_max_ceiling);
+    self->resume_loops++;
+    if (self->shadow_of == NULL) {
+      g_warning ("Resume loop detected, subsequent_resumes raised to %d",
+               self->subsequent_resumes);
+      powerstate_handle (STATED_POWER_EVENT_RESUME_LOOP);
+    }
   } else {
     /* Clear counter */
     self->subsequent_resumes = 1;
   }
 
+  /* Attribute the resume awake time to the damping level */
+  if (self->shadow_of == NULL)
+    ledger_set_level (RESUME_WAKELOCK, self->subsequent_resumes);
+
   /* Add a timer for the lock we previously obtained */
-  wakelock_timed (RESUME_WAKELOCK,
-                  RESUME_LOCK_WAIT_TIME * self->subsequent_resumes);
+  devicestate_lock_timed (self, RESUME_WAKELOCK,
+                          self->policy.resume_lock_wait_time * self->subsequent_resumes);
+
+  /* A suspend went through, so the backoff can start over */
+  self->suspend_backoff_level = 0;
+
+  if (self->shadow_of != NULL)
+    return;
+
+  if (self->suspend_stats)
+    stated_suspendstats_sample (self->suspend_stats);
+
+  TRACE_RESUME (previous_boottime, new_boottime, (uint)self->subsequent_resumes);
+  metrics_resume (self->subsequent_resumes);
+
+  flightrec_record (STATED_FLIGHTREC_RESUME, NULL, NULL,
+                    (int32_t)MIN (new_boottime - previous_boottime, G_MAXINT32),
+                    self->subsequent_resumes, g_get_monotonic_time () - start);
+}
+
+static void
+on_suspend_abort_storm (StatedDevicestate  *self,
+                        uint               fails,
+                        const char         *device,
+                        int                error,
+                        StatedSuspendstats *suspend_stats)
+{
+  g_return_if_fail (STATED_IS_DEVICESTATE (self));
+  g_return_if_fail (STATED_IS_SUSPENDSTATS (suspend_stats));
+
+  /* Back off gradually: keep the device awake for increasingly longer
+   * periods so that autosleep stops hammering the failing driver, and
+   * as a last resort pause autosleep altogether.
+   *
+   * The level is reset as soon as a suspend succeeds.
+   */
+  self->suspend_backoff_level = MIN (self->suspend_backoff_level + 1,
+                                     SUSPEND_BACKOFF_MAX_LEVEL);
+
+  g_warning ("Suspend aborted %u times (device '%s', errno %d), backoff level %d",
+             fails, device, error, self->suspend_backoff_level);
+
+  if (self->suspend_backoff_level < SUSPEND_BACKOFF_MAX_LEVEL)
+    devicestate_lock_timed (self, SUSPEND_BACKOFF_WAKELOCK,
+                            SUSPEND_BACKOFF_WAIT_TIME * self->suspend_backoff_level);
+  else if (self->shadow_of == NULL && autosleep_pause (SUSPEND_BACKOFF_AUTOSLEEP_PAUSE_TIME) == 0)
+    devicestate_sleep_hooks_post (self);
+}
+
+static void
+on_wakelocks_idle (StatedDevicestate *self)
+{
+  g_return_if_fail (STATED_IS_DEVICESTATE (self));
+
+  powerstate_handle (STATED_POWER_EVENT_WAKELOCKS_IDLE);
+
+  /* With the display off and nothing else held, autosleep is about to
+   * kick in: close the awake period. */
+  if (self->battery && !self->primary_display_on)
+    stated_battery_set_mode (self->battery, STATED_BATTERY_MODE_SUSPENDED);
+
+  /* The hooks hold a wakelock of their own: once they're done we're
+   * back here, and that time they're not run again. They're only run
+   * when a suspend can actually follow. */
+  if (!self->primary_display_on && !self->sleep_hooks_ran && autosleep_is_enabled ()) {
+    self->sleep_hooks_ran = TRUE;
+    sleephooks_run (STATED_SLEEP_HOOKS_PRE);
+  }
+}
+
+static void
+append_shadow_stats (GString           *out,
+                     StatedDevicestate *self)
+{
+  StatedLockModel *models[] = { self->shadow_of->lock_model, self->lock_model };
+  const char *policies[] = { "active", "shadow" };
+
+  lock_model_append_stats (models, policies, G_N_ELEMENTS (models), out);
+
+  stats_append_type (out, "stated_policy_subsequent_resumes", "gauge", NULL);
+  stats_append_value (out, "stated_policy_subsequent_resumes", "policy=\"active\"",
+                      self->shadow_of->subsequent_resumes);
+  stats_append_value (out, "stated_policy_subsequent_resumes", "policy=\"shadow\"",
+                      self->subsequent_resumes);
+
+  stats_append_type (out, "stated_policy_resume_loops_total", "counter", NULL);
+  stats_append_value (out, "stated_policy_resume_loops_total", "policy=\"active\"",
+                      self->shadow_of->resume_loops);
+  stats_append_value (out, "stated_policy_resume_loops_total", "policy=\"shadow\"",
+                      self->resume_loops);
+}
+
+/**
+ * Shadow instances share the sources of the active one and follow the
+ * same signals, but only account the wakelocks they would take.
+ *
+ * Keep in mind that resumes only happen when the active policy lets
+ * the device suspend, so the comparison is only meaningful for
+ * policies that don't drift too far from the active one.
+ */
+static void
+stated_devicestate_constructed_shadow (StatedDevicestate *self)
+{
+  StatedDevicestate *active = self->shadow_of;
+
+  self->primary_display = active->primary_display ? g_object_ref (active->primary_display) : NULL;
+  self->powerkey_input = g_object_ref (active->powerkey_input);
+  self->lid_input = g_object_ref (active->lid_input);
+  self->sleep_tracker = g_object_ref (active->sleep_tracker);
+  self->suspend_stats = NULL;
+  self->battery = NULL;
+  self->logind = g_object_ref (active->logind);
+  self->power_source = g_object_ref (active->power_source);
+
+  self->subsequent_resumes = 1;
+  self->primary_display_on = active->primary_display_on;
+  self->lid_closed = active->lid_closed;
+
+  /* Start from where the active instance is */
+  if (self->primary_display_on)
+    lock_model_lock (self->lock_model, DISPLAY_WAKELOCK);
+  if (stated_logind_get_inhibited (self->logind))
+    lock_model_lock (self->lock_model, LOGIND_INHIBIT_WAKELOCK);
+
+  if (self->primary_display)
+    g_signal_connect_object (self->primary_display, "notify::on",
+                             G_CALLBACK (on_display_status_changed),
+                             self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->powerkey_input, "powerkey-pressed",
+                           G_CALLBACK (on_powerkey_pressed),
+                           self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->lid_input, "notify::switch-state",
+                           G_CALLBACK (on_lid_changed),
+                           self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->sleep_tracker, "resume",
+                           G_CALLBACK (on_resume),
+                           self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->logind, "notify::inhibited",
+                           G_CALLBACK (on_logind_inhibited_changed),
+                           self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->power_source, "notify::state",
+                           G_CALLBACK (on_power_source_changed),
+                           self, G_CONNECT_SWAPPED);
+
+  if (active->suspend_stats)
+    g_signal_connect_object (active->suspend_stats, "abort-storm",
+                             G_CALLBACK (on_suspend_abort_storm),
+                             self, G_CONNECT_SWAPPED);
+
+  stats_register ("shadow", (StatedStatsProviderFunc) append_shadow_stats, self);
 }
 
 static void
 stated_devicestate_constructed (GObject *obj)
 {
   StatedDevicestate *self = STATED_DEVICESTATE (obj);
+  gboolean display_on = FALSE;
 
   G_OBJECT_CLASS (stated_devicestate_parent_class)->constructed (obj);
 
-  if (stated_display_file_check ())
-    self->primary_display = stated_display_file_new ();
-  else
-    self->primary_display = NULL;
+  self->lock_model = lock_model_new ();
+
+  if (self->shadow_of != NULL) {
+    stated_devicestate_constructed_shadow (self);
+    return;
+  }
+
+  /* Sources not supplied at construction time are looked up on the device */
+  if (self->primary_display == NULL && stated_display_file_check ())
+    self->primary_display = STATED_DISPLAY (stated_display_file_new ());
+
+  if (self->powerkey_input == NULL)
+    self->powerkey_input = stated_input_new_for_key (KEY_POWER);
 
-  self->powerkey_input = stated_input_new_for_key (KEY_POWER);
+  /* Its initial position is notified as soon as the device is found */
+  if (self->lid_input == NULL)
+    self->lid_input = stated_input_new_for_switch (SW_LID);
+
+  if (self->sleep_tracker == NULL)
+    self->sleep_tracker = stated_sleeptracker_new ();
 
-  self->sleep_tracker = stated_sleeptracker_new ();
   self->subsequent_resumes = 1;
+  self->lid_closed = stated_input_get_switch_state (self->lid_input);
+
+  if (stated_suspendstats_check ())
+    self->suspend_stats = stated_suspendstats_new ();
+  else
+    self->suspend_stats = NULL;
+
+  if (stated_battery_check ())
+    self->battery = stated_battery_new ();
+  else
+    self->battery = NULL;
+
+  if (self->logind == NULL)
+    self->logind = stated_logind_new ();
+
+  self->power_source = stated_powersource_new ();
+  stated_powersource_set_low_threshold (self->power_source,
+                                        self->policies[STATED_POWERSOURCE_BATTERY].low_battery_threshold);
+  devicestate_apply_policy (self);
+
+  powerstate_init ();
+  wakelock_set_idle_hook ((StatedWakelockIdleHook) on_wakelocks_idle, self);
 
   if (self->primary_display)
     g_signal_connect_object (self->primary_display, "notify::on",
@@ -179,9 +763,43 @@ stated_devicestate_constructed (GObject *obj)
                            G_CALLBACK (on_powerkey_pressed),
                            self, G_CONNECT_SWAPPED);
 
+  g_signal_connect_object (self->lid_input, "notify::switch-state",
+                           G_CALLBACK (on_lid_changed),
+                           self, G_CONNECT_SWAPPED);
+
   g_signal_connect_object (self->sleep_tracker, "resume",
                            G_CALLBACK (on_resume),
                            self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->logind, "notify::inhibited",
+                           G_CALLBACK (on_logind_inhibited_changed),
+                           self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->power_source, "notify::state",
+                           G_CALLBACK (on_power_source_changed),
+                           self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->logind, "notify::idle-hint",
+                           G_CALLBACK (devicestate_update_idle),
+                           self, G_CONNECT_SWAPPED);
+
+  g_signal_connect_object (self->logind, "notify::inhibited",
+                           G_CALLBACK (devicestate_update_idle),
+                           self, G_CONNECT_SWAPPED);
+
+  if (self->suspend_stats)
+    g_signal_connect_object (self->suspend_stats, "abort-storm",
+                             G_CALLBACK (on_suspend_abort_storm),
+                             self, G_CONNECT_SWAPPED);
+
+  /* The display notifies its initial state before we're connected:
+   * a display that's already on (e.g. after a restart) must hold its
+   * wakelock straight away. */
+  if (self->primary_display) {
+    g_object_get (self->primary_display, "on", &display_on, NULL);
+    if (display_on)
+      devicestate_set_display_on (self, TRUE);
+  }
 }
 
 static void
@@ -189,26 +807,186 @@ stated_devicestate_dispose (GObject *obj)
 {
   StatedDevicestate *self = STATED_DEVICESTATE (obj);
 
+  if (self->shadow_of) {
+    stats_unregister ("shadow");
+    g_clear_object (&self->shadow_of);
+  } else {
+    wakelock_set_idle_hook (NULL, NULL);
+
+    /* Unblanking on the way out isn't a policy event */
+    if (self->idle != NULL) {
+      g_signal_handlers_disconnect_by_data (self->idle, self);
+      g_clear_object (&self->idle);
+    }
+
+    /* Give the governors back */
+    if (self->power_source)
+      cpuprofile_apply (STATED_CPU_PROFILE_DEFAULT);
+  }
+
+  g_clear_pointer (&self->lock_model, lock_model_free);
+
   if (self->primary_display)
     g_clear_object (&self->primary_display);
   g_clear_object (&self->powerkey_input);
+  g_clear_object (&self->lid_input);
   g_clear_object (&self->sleep_tracker);
+  g_clear_object (&self->logind);
+  g_clear_object (&self->power_source);
+  if (self->suspend_stats)
+    g_clear_object (&self->suspend_stats);
+  if (self->battery)
+    g_clear_object (&self->battery);
 
   G_OBJECT_CLASS (stated_devicestate_parent_class)->dispose (obj);
 }
 
+static void
+stated_devicestate_set_property (GObject      *obj,
+                                 uint         property_id,
+                                 const GValue *value,
+                                 GParamSpec   *pspec)
+{
+  StatedDevicestate *self = STATED_DEVICESTATE (obj);
+
+  switch ((StatedDevicestateProperty) property_id)
+    {
+    case STATED_DEVICESTATE_PROP_DISPLAY:
+      self->primary_display = g_value_dup_object (value);
+      break;
+
+    case STATED_DEVICESTATE_PROP_POWERKEY_INPUT:
+      self->powerkey_input = g_value_dup_object (value);
+      break;
+
+    case STATED_DEVICESTATE_PROP_LID_INPUT:
+      self->lid_input = g_value_dup_object (value);
+      break;
+
+    case STATED_DEVICESTATE_PROP_SLEEP_TRACKER:
+      self->sleep_tracker = g_value_dup_object (value);
+      break;
+
+    case STATED_DEVICESTATE_PROP_LOGIND:
+      self->logind = g_value_dup_object (value);
+      break;
+
+    case STATED_DEVICESTATE_PROP_SHADOW_OF:
+      self->shadow_of = g_value_dup_object (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
+static void
+stated_devicestate_get_property (GObject    *obj,
+                                 uint       property_id,
+                                 GValue     *value,
+                                 GParamSpec *pspec)
+{
+  StatedDevicestate *self = STATED_DEVICESTATE (obj);
+
+  switch ((StatedDevicestateProperty) property_id)
+    {
+    case STATED_DEVICESTATE_PROP_DISPLAY:
+      g_value_set_object (value, self->primary_display);
+      break;
+
+    case STATED_DEVICESTATE_PROP_POWERKEY_INPUT:
+      g_value_set_object (value, self->powerkey_input);
+      break;
+
+    case STATED_DEVICESTATE_PROP_LID_INPUT:
+      g_value_set_object (value, self->lid_input);
+      break;
+
+    case STATED_DEVICESTATE_PROP_SLEEP_TRACKER:
+      g_value_set_object (value, self->sleep_tracker);
+      break;
+
+    case STATED_DEVICESTATE_PROP_LOGIND:
+      g_value_set_object (value, self->logind);
+      break;
+
+    case STATED_DEVICESTATE_PROP_SHADOW_OF:
+      g_value_set_object (value, self->shadow_of);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
 static void
 stated_devicestate_class_init (StatedDevicestateClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
-  object_class->constructed = stated_devicestate_constructed;
-  object_class->dispose = stated_devicestate_dispose;
+  object_class->constructed  = stated_devicestate_constructed;
+  object_class->dispose      = stated_devicestate_dispose;
+  object_class->set_property = stated_devicestate_set_property;
+  object_class->get_property = stated_devicestate_get_property;
+
+  props[STATED_DEVICESTATE_PROP_DISPLAY] =
+    g_param_spec_object ("display",
+                         "display",
+                         "The primary display, looked up if not supplied",
+                         STATED_TYPE_DISPLAY,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  props[STATED_DEVICESTATE_PROP_POWERKEY_INPUT] =
+    g_param_spec_object ("powerkey-input",
+                         "powerkey-input",
+                         "The powerkey input, looked up if not supplied",
+                         STATED_TYPE_INPUT,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  props[STATED_DEVICESTATE_PROP_LID_INPUT] =
+    g_param_spec_object ("lid-input",
+                         "lid-input",
+                         "The lid switch input, looked up if not supplied",
+                         STATED_TYPE_INPUT,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  props[STATED_DEVICESTATE_PROP_SLEEP_TRACKER] =
+    g_param_spec_object ("sleep-tracker",
+                         "sleep-tracker",
+                         "The sleep tracker, created if not supplied",
+                         STATED_TYPE_SLEEPTRACKER,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  props[STATED_DEVICESTATE_PROP_LOGIND] =
+    g_param_spec_object ("logind",
+                         "logind",
+                         "The logind watcher, on the system bus if not supplied",
+                         STATED_TYPE_LOGIND,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  props[STATED_DEVICESTATE_PROP_SHADOW_OF] =
+    g_param_spec_object ("shadow-of",
+                         "shadow-of",
+                         "The active instance this one shadows, if any",
+                         STATED_TYPE_DEVICESTATE,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  g_object_class_install_properties (object_class, STATED_DEVICESTATE_PROP_LAST, props);
 }
 
 static void
 stated_devicestate_init (StatedDevicestate *self)
 {
+  uint i;
+
+  for (i = 0; i < STATED_POWERSOURCE_N; i++)
+    self->policies[i] = default_policies[i];
+
+  self->policy = self->policies[STATED_POWERSOURCE_BATTERY];
 }
 
 StatedDevicestate *
@@ -216,3 +994,158 @@ stated_devicestate_new (void)
 {
   return g_object_new (STATED_TYPE_DEVICESTATE, NULL);
 }
+
+/**
+ * Creates a new StatedDevicestate driven by the given sources rather
+ * than by the ones found on the device. Any of them can be NULL.
+ */
+StatedDevicestate *
+stated_devicestate_new_full (StatedDisplay      *display,
+                             StatedInput        *powerkey_input,
+                             StatedSleeptracker *sleep_tracker,
+                             StatedLogind       *logind)
+{
+  return g_object_new (STATED_TYPE_DEVICESTATE,
+                       "display", display,
+                       "powerkey-input", powerkey_input,
+                       "sleep-tracker", sleep_tracker,
+                       "logind", logind,
+                       NULL);
+}
+
+/**
+ * Creates a shadow of active: it follows the same display, powerkey
+ * and resume signals, but rather than taking wakelocks it only
+ * accounts the ones it would take. It starts from active's policies,
+ * see stated_devicestate_set_policies() to change them. Its outcome
+ * is compared to active's in the "shadow" stats.
+ */
+StatedDevicestate *
+stated_devicestate_new_shadow (StatedDevicestate *active)
+{
+  StatedDevicestate *self;
+
+  g_return_val_if_fail (STATED_IS_DEVICESTATE (active), NULL);
+  g_return_val_if_fail (active->shadow_of == NULL, NULL);
+
+  self = g_object_new (STATED_TYPE_DEVICESTATE, "shadow-of", active, NULL);
+  stated_devicestate_set_policies (self, active->policies);
+
+  return self;
+}
+
+/**
+ * Replaces the policy used while running on source, without applying
+ * it. The battery one also sets the capacity below which the battery
+ * is low.
+ */
+static void
+devicestate_store_source_policy (StatedDevicestate             *self,
+                                 StatedPowersourceState        source,
+                                 const StatedDevicestatePolicy *policy)
+{
+  self->policies[source] = *policy;
+
+  if (source == STATED_POWERSOURCE_BATTERY && self->shadow_of == NULL && self->power_source)
+    stated_powersource_set_low_threshold (self->power_source, policy->low_battery_threshold);
+}
+
+/**
+ * Replaces the policy of every power source. Held wakelocks are left
+ * alone, the new values apply from the next event on.
+ */
+void
+stated_devicestate_set_policy (StatedDevicestate             *self,
+                               const StatedDevicestatePolicy *policy)
+{
+  uint i;
+
+  g_return_if_fail (STATED_IS_DEVICESTATE (self));
+
+  for (i = 0; i < STATED_POWERSOURCE_N; i++)
+    devicestate_store_source_policy (self, i, policy);
+
+  devicestate_apply_policy (self);
+}
+
+/**
+ * Replaces the policy of every power source with its own one from
+ * policies, indexed by source, applying the result a single time.
+ */
+void
+stated_devicestate_set_policies (StatedDevicestate             *self,
+                                 const StatedDevicestatePolicy policies[STATED_POWERSOURCE_N])
+{
+  uint i;
+
+  g_return_if_fail (STATED_IS_DEVICESTATE (self));
+
+  for (i = 0; i < STATED_POWERSOURCE_N; i++)
+    devicestate_store_source_policy (self, i, &policies[i]);
+
+  devicestate_apply_policy (self);
+}
+
+/**
+ * Returns the policy in use, the one of the current power source.
+ */
+const StatedDevicestatePolicy *
+stated_devicestate_get_policy (StatedDevicestate *self)
+{
+  g_return_val_if_fail (STATED_IS_DEVICESTATE (self), NULL);
+
+  return &self->policy;
+}
+
+/**
+ * Returns the policy used while running on source.
+ */
+const StatedDevicestatePolicy *
+stated_devicestate_get_source_policy (StatedDevicestate      *self,
+                                      StatedPowersourceState source)
+{
+  g_return_val_if_fail (STATED_IS_DEVICESTATE (self), NULL);
+  g_return_val_if_fail (source < STATED_POWERSOURCE_N, NULL);
+
+  return &self->policies[source];
+}
+
+StatedPowersourceState
+stated_devicestate_get_power_source (StatedDevicestate *self)
+{
+  g_return_val_if_fail (STATED_IS_DEVICESTATE (self), STATED_POWERSOURCE_BATTERY);
+
+  return self->source;
+}
+
+/**
+ * Fills policy with the built-in defaults for running on battery.
+ */
+void
+stated_devicestate_policy_init (StatedDevicestatePolicy *policy)
+{
+  *policy = default_policies[STATED_POWERSOURCE_BATTERY];
+}
+
+/**
+ * Fills policy with the built-in defaults for running on source.
+ */
+void
+stated_devicestate_policy_init_for_source (StatedDevicestatePolicy *policy,
+                                           StatedPowersourceState  source)
+{
+  g_return_if_fail (source < STATED_POWERSOURCE_N);
+
+  *policy = default_policies[source];
+}
+
+/**
+ * Returns how many times a sleep/resume loop has been detected.
+ */
+uint
+stated_devicestate_get_resume_loops (StatedDevicestate *self)
+{
+  g_return_val_if_fail (STATED_IS_DEVICESTATE (self), 0);
+
+  return self->resume_loops;
+}
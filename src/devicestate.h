@@ -35,13 +35,51 @@
 #include <sys/param.h>
 
 #include "display.h"
+#include "input.h"
+#include "logind.h"
+#include "powersource.h"
+#include "sleeptracker.h"
 
 G_BEGIN_DECLS
 
+/**
+ * Tunables of the power policy. Wait times are in seconds, the resume
+ * loop threshold in milliseconds.
+ */
+typedef struct {
+  uint display_wait_time;     /* Display wakelock grace after screen-off */
+  uint lid_display_wait_time; /* The same, with the lid closed */
+  uint powerkey_wait_time;    /* Wakelock held after a powerkey press */
+  uint resume_lock_wait_time; /* Resume wakelock, per damping level */
+  uint resume_max_ceiling;    /* Highest damping level */
+  uint resume_loop_threshold; /* Resumes closer than this are a loop */
+  uint autosleep;             /* Whether autosleep is allowed at all */
+  uint cpu_profile;           /* StatedCpuProfile */
+  uint low_battery_threshold; /* Battery capacity, in percent, that is low */
+  uint idle_timeout;          /* Blank the display after this long without input, 0 to disable */
+} StatedDevicestatePolicy;
+
 #define STATED_TYPE_DEVICESTATE stated_devicestate_get_type ()
 G_DECLARE_FINAL_TYPE (StatedDevicestate, stated_devicestate, STATED, DEVICESTATE, GObject)
 
 StatedDevicestate *stated_devicestate_new (void);
+StatedDevicestate *stated_devicestate_new_full (StatedDisplay      *display,
+                                                StatedInput        *powerkey_input,
+                                                StatedSleeptracker *sleep_tracker,
+                                                StatedLogind       *logind);
+StatedDevicestate *stated_devicestate_new_shadow (StatedDevicestate *active);
+void stated_devicestate_set_policy (StatedDevicestate             *self,
+                                    const StatedDevicestatePolicy *policy);
+void stated_devicestate_set_policies (StatedDevicestate             *self,
+                                      const StatedDevicestatePolicy policies[STATED_POWERSOURCE_N]);
+const StatedDevicestatePolicy *stated_devicestate_get_policy (StatedDevicestate *self);
+const StatedDevicestatePolicy *stated_devicestate_get_source_policy (StatedDevicestate      *self,
+                                                                     StatedPowersourceState source);
+StatedPowersourceState stated_devicestate_get_power_source (StatedDevicestate *self);
+void stated_devicestate_policy_init (StatedDevicestatePolicy *policy);
+void stated_devicestate_policy_init_for_source (StatedDevicestatePolicy *policy,
+                                                StatedPowersourceState  source);
+uint stated_devicestate_get_resume_loops (StatedDevicestate *self);
 
 G_END_DECLS
 
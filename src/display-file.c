@@ -31,6 +31,8 @@
 
 #include "display.h"
 #include "display-file.h"
+#include "utils.h"
+#include "selfprof.h"
 
 static const char qcom_display_state_file[] = "/sys/class/graphics/fb0/show_blank_event"; /* FIXME: support other displays */
 /* TODO: allow detecting screen status on other devices / allow feeding state from compositor */
@@ -70,9 +72,10 @@ on_qcom_display_state_changed (GFileMonitor      *monitor,
   g_return_if_fail (STATED_IS_DISPLAY_FILE (self));
 
   char *file_contents = NULL;
+  uint64_t prof_start = selfprof_begin ();
 
   if (event_type == G_FILE_MONITOR_EVENT_CHANGED) {
-    if (!g_file_get_contents (qcom_display_state_file, /* FIXME: read from GFile instead */
+    if (!g_file_get_contents (stated_path (qcom_display_state_file), /* FIXME: read from GFile instead */
                              &file_contents, NULL, NULL))
       goto end;
 
@@ -92,6 +95,8 @@ end:
   if (file_contents != NULL) {
     g_free (file_contents);
   }
+
+  selfprof_end ("display", NULL, prof_start);
   return;
 }
 
@@ -102,10 +107,10 @@ stated_display_file_constructed (GObject *obj)
 
   G_OBJECT_CLASS (stated_display_file_parent_class)->constructed (obj);
 
-  if (access (qcom_display_state_file, F_OK) == 0) {
+  if (access (stated_path (qcom_display_state_file), F_OK) == 0) {
     g_debug ("Found qcom display state file");
 
-    self->watched_file = g_file_new_for_path (qcom_display_state_file);
+    self->watched_file = g_file_new_for_path (stated_path (qcom_display_state_file));
     self->watched_file_monitor = g_file_monitor_file (self->watched_file,
                                                       G_FILE_MONITOR_NONE,
                                                       NULL,
@@ -219,7 +224,7 @@ stated_display_file_new (void)
 gboolean
 stated_display_file_check (void)
 {
-  if (access (qcom_display_state_file, F_OK) == 0) {
+  if (access (stated_path (qcom_display_state_file), F_OK) == 0) {
     return TRUE;
   }
 
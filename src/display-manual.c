@@ -0,0 +1,144 @@
+/* display-manual.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-display-manual"
+
+#include "display.h"
+#include "display-manual.h"
+
+/**
+ * StatedDisplayManual is a display whose state is fed from the outside
+ * rather than detected, e.g. by simulations and benchmarks.
+ */
+
+struct _StatedDisplayManual
+{
+  GObject parent_instance;
+
+  /* instance members */
+  gboolean on;
+};
+
+typedef enum {
+  STATED_DISPLAY_MANUAL_PROP_ON = 1,
+  STATED_DISPLAY_MANUAL_PROP_LAST
+} StatedDisplayManualProperty;
+
+static void stated_display_manual_interface_init (StatedDisplayInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (StatedDisplayManual, stated_display_manual, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (STATED_TYPE_DISPLAY,
+                                                stated_display_manual_interface_init))
+
+static void
+stated_display_manual_set_property (GObject      *obj,
+                                    uint         property_id,
+                                    const GValue *value,
+                                    GParamSpec   *pspec)
+{
+  switch ((StatedDisplayManualProperty) property_id)
+    {
+    case STATED_DISPLAY_MANUAL_PROP_ON:
+      /* Read-only */
+      g_warning ("The 'on' property is read only!");
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
+static void
+stated_display_manual_get_property (GObject    *obj,
+                                    uint       property_id,
+                                    GValue     *value,
+                                    GParamSpec *pspec)
+{
+  StatedDisplayManual *self = STATED_DISPLAY_MANUAL (obj);
+
+  switch ((StatedDisplayManualProperty) property_id)
+    {
+    case STATED_DISPLAY_MANUAL_PROP_ON:
+      g_value_set_boolean (value, self->on);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
+static void
+stated_display_manual_class_init (StatedDisplayManualClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->set_property = stated_display_manual_set_property;
+  object_class->get_property = stated_display_manual_get_property;
+
+  g_object_class_override_property (object_class, STATED_DISPLAY_MANUAL_PROP_ON, "on");
+}
+
+static void
+stated_display_manual_interface_init (StatedDisplayInterface *iface)
+{
+}
+
+static void
+stated_display_manual_init (StatedDisplayManual *self)
+{
+}
+
+StatedDisplayManual *
+stated_display_manual_new (gboolean on)
+{
+  StatedDisplayManual *self = g_object_new (STATED_TYPE_DISPLAY_MANUAL, NULL);
+
+  self->on = on;
+
+  return self;
+}
+
+/**
+ * Sets the display state, notifying "on" as a real display would.
+ */
+void
+stated_display_manual_set_on (StatedDisplayManual *self,
+                              gboolean            on)
+{
+  g_return_if_fail (STATED_IS_DISPLAY_MANUAL (self));
+
+  self->on = on;
+
+  /* We should manually notify since the property is read-only */
+  g_object_notify (G_OBJECT (self), "on");
+}
@@ -0,0 +1,135 @@
+/* fake-root.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-fake-root"
+
+#include <errno.h>
+#include <glib-2.0/glib.h>
+#include <glib-2.0/gstdio.h>
+
+#include "fake-root.h"
+#include "utils.h"
+
+/**
+ * A fake tree of the kernel interfaces used by stated, so that it
+ * can be exercised off-device (benchmarks, simulations).
+ */
+
+/* Fake kernel interfaces, relative to the root */
+static const char *fake_dirs[] = {
+  "/dev/input",
+  "/run",
+  "/sys/class/graphics/fb0",
+  "/sys/power/suspend_stats",
+  "/sys/class/power_supply/battery",
+};
+
+static const struct {
+  const char *path;
+  const char *contents;
+} fake_files[] = {
+  { "/sys/power/wake_lock", "" },
+  { "/sys/power/wake_unlock", "" },
+  { "/sys/power/autosleep", "off\n" },
+  { "/sys/power/suspend_stats/success", "0\n" },
+  { "/sys/power/suspend_stats/fail", "0\n" },
+  { "/sys/power/suspend_stats/failed_freeze", "0\n" },
+  { "/sys/power/suspend_stats/last_failed_dev", "\n" },
+  { "/sys/power/suspend_stats/last_failed_errno", "0\n" },
+  { "/sys/class/graphics/fb0/show_blank_event", "panel_power_on = 1\n" },
+  { "/sys/class/power_supply/battery/type", "Battery\n" },
+  { "/sys/class/power_supply/battery/status", "Discharging\n" },
+  { "/sys/class/power_supply/battery/energy_now", "15000000\n" },
+  { "/sys/class/power_supply/battery/voltage_now", "3800000\n" },
+  { "/sys/class/power_supply/battery/current_now", "-300000\n" },
+};
+
+/**
+ * Creates a fake tree of the kernel interfaces used by stated in a
+ * temporary directory (honouring TMPDIR, ideally a tmpfs), and makes
+ * it the root for every path.
+ */
+char *
+stated_fake_root_new (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  char *root;
+  uint i;
+
+  root = g_dir_make_tmp ("stated-root-XXXXXX", &error);
+  if (root == NULL)
+    g_error ("Unable to create temporary directory: %s", error->message);
+
+  for (i = 0; i < G_N_ELEMENTS (fake_dirs); i++) {
+    g_free (path);
+    path = g_strconcat (root, fake_dirs[i], NULL);
+    if (g_mkdir_with_parents (path, 0755) < 0)
+      g_error ("Unable to create %s: %s", path, g_strerror (errno));
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (fake_files); i++) {
+    g_free (path);
+    path = g_strconcat (root, fake_files[i].path, NULL);
+    if (!g_file_set_contents (path, fake_files[i].contents, -1, &error))
+      g_error ("Unable to create %s: %s", path, error->message);
+  }
+
+  stated_set_root (root);
+
+  return root;
+}
+
+static void
+remove_tree (const char *path)
+{
+  g_autofree char *child = NULL;
+  const char *name;
+  GDir *dir;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL) {
+    while ((name = g_dir_read_name (dir)) != NULL) {
+      g_free (child);
+      child = g_build_filename (path, name, NULL);
+      remove_tree (child);
+    }
+    g_dir_close (dir);
+  }
+
+  g_remove (path);
+}
+
+void
+stated_fake_root_free (char *root)
+{
+  remove_tree (root);
+  g_free (root);
+}
+
@@ -0,0 +1,145 @@
+/* flightrec.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-flightrec"
+
+#include <errno.h>
+#include <string.h>
+#include <glib-2.0/glib.h>
+
+#include "flightrec.h"
+
+/**
+ * An always-on flight recorder: a fixed ring of binary records of
+ * what stated did recently, which can be dumped on demand (SIGUSR2)
+ * and decoded offline with tools/stated-flightrec.
+ *
+ * Recording is lock-free and allocation-free, so that it can be done
+ * from the main loop and from the sysfs worker alike: a slot is
+ * claimed with an atomic increment, filled, and published by storing
+ * its sequence number last.
+ */
+
+static StatedFlightrecRecord ring[STATED_FLIGHTREC_SIZE];
+static uint ring_head = 0;
+
+static const char *event_names[] = {
+  [STATED_FLIGHTREC_WAKELOCK_LOCK]   = "wakelock-lock",
+  [STATED_FLIGHTREC_WAKELOCK_UNLOCK] = "wakelock-unlock",
+  [STATED_FLIGHTREC_WAKELOCK_TIMED]  = "wakelock-timed",
+  [STATED_FLIGHTREC_SYSFS_WRITE]     = "sysfs-write",
+  [STATED_FLIGHTREC_DISPLAY]         = "display",
+  [STATED_FLIGHTREC_RESUME]          = "resume",
+  [STATED_FLIGHTREC_INPUT]           = "input",
+};
+
+const char *
+flightrec_event_type_to_string (StatedFlightrecEventType type)
+{
+  if (type >= G_N_ELEMENTS (event_names) || event_names[type] == NULL)
+    return "unknown";
+
+  return event_names[type];
+}
+
+static inline void
+copy_string (char       *dest,
+             const char *src)
+{
+  if (src == NULL) {
+    dest[0] = '\0';
+    return;
+  }
+
+  /* Truncate from the left, the end of a path is what's interesting */
+  strncpy (dest, src + MAX ((int)strlen (src) - (STATED_FLIGHTREC_STRING_MAX - 1), 0),
+           STATED_FLIGHTREC_STRING_MAX - 1);
+  dest[STATED_FLIGHTREC_STRING_MAX - 1] = '\0';
+}
+
+/**
+ * Records an event. Strings longer than STATED_FLIGHTREC_STRING_MAX - 1
+ * are truncated, keeping their end.
+ */
+void
+flightrec_record (StatedFlightrecEventType type,
+                  const char               *subject,
+                  const char               *detail,
+                  int32_t                  value,
+                  int                      result,
+                  uint32_t                 duration_us)
+{
+  uint seq = (uint)g_atomic_int_add (&ring_head, 1) + 1;
+  StatedFlightrecRecord *record = &ring[(seq - 1) & (STATED_FLIGHTREC_SIZE - 1)];
+
+  /* Unpublish the slot while it's being filled */
+  g_atomic_int_set (&record->seq, 0);
+
+  record->time_us = g_get_monotonic_time ();
+  record->type = type;
+  record->result = CLAMP (result, G_MININT16, G_MAXINT16);
+  record->duration_us = duration_us;
+  record->value = value;
+  copy_string (record->subject, subject);
+  copy_string (record->detail, detail);
+
+  g_atomic_int_set (&record->seq, seq);
+}
+
+/**
+ * Dumps the ring to the given file.
+ */
+gboolean
+flightrec_dump (const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *contents = NULL;
+  StatedFlightrecHeader header = {
+    .magic = STATED_FLIGHTREC_MAGIC,
+    .version = STATED_FLIGHTREC_VERSION,
+    .record_size = sizeof (StatedFlightrecRecord),
+    .n_records = STATED_FLIGHTREC_SIZE,
+    .dump_time_us = g_get_monotonic_time (),
+  };
+
+  /* Records being written while copying are either old or unpublished,
+   * the decoder sorts out the rest by sequence number. */
+  contents = g_malloc (sizeof header + sizeof ring);
+  memcpy (contents, &header, sizeof header);
+  memcpy (contents + sizeof header, ring, sizeof ring);
+
+  if (!g_file_set_contents (path, contents, sizeof header + sizeof ring, &error)) {
+    g_warning ("Unable to dump flight recorder: %s", error->message);
+    return FALSE;
+  }
+
+  g_message ("Flight recorder dumped to %s", path);
+
+  return TRUE;
+}
@@ -0,0 +1,85 @@
+/* flightrec.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDFLIGHTREC_H
+#define STATEDFLIGHTREC_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+#define STATED_FLIGHTREC_MAGIC 0x52464653 /* "SFFR" */
+#define STATED_FLIGHTREC_VERSION 1
+#define STATED_FLIGHTREC_SIZE 1024 /* records, must be a power of two */
+#define STATED_FLIGHTREC_STRING_MAX 20
+
+typedef enum {
+  STATED_FLIGHTREC_WAKELOCK_LOCK = 1,   /* subject: lock */
+  STATED_FLIGHTREC_WAKELOCK_UNLOCK,     /* subject: lock */
+  STATED_FLIGHTREC_WAKELOCK_TIMED,      /* subject: lock, value: timeout (s) */
+  STATED_FLIGHTREC_SYSFS_WRITE,         /* subject: file, detail: content, result, duration */
+  STATED_FLIGHTREC_DISPLAY,             /* value: on */
+  STATED_FLIGHTREC_RESUME,              /* value: since previous resume (ms), result: subsequent
+                                         * resumes, duration: handling time */
+  STATED_FLIGHTREC_INPUT,               /* value: key code, result: key value */
+} StatedFlightrecEventType;
+
+/**
+ * A dump is a StatedFlightrecHeader followed by the whole ring of
+ * StatedFlightrecRecords, in host byte order. Records are ordered by
+ * their sequence number; unused slots have seq 0.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t n_records;
+  int64_t dump_time_us; /* monotonic */
+} StatedFlightrecHeader;
+
+typedef struct {
+  int64_t time_us; /* monotonic */
+  uint32_t seq;
+  uint16_t type;
+  int16_t result;
+  uint32_t duration_us;
+  int32_t value;
+  char subject[STATED_FLIGHTREC_STRING_MAX];
+  char detail[STATED_FLIGHTREC_STRING_MAX];
+} StatedFlightrecRecord;
+
+void flightrec_record (StatedFlightrecEventType type,
+                       const char               *subject,
+                       const char               *detail,
+                       int32_t                  value,
+                       int                      result,
+                       uint32_t                 duration_us);
+gboolean flightrec_dump (const char *path);
+const char *flightrec_event_type_to_string (StatedFlightrecEventType type);
+
+#endif /* STATEDFLIGHTREC_H */
@@ -0,0 +1,541 @@
+/* idle.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-idle"
+
+#define IDLE_MAX_DEVICES 32
+
+/* FB_BLANK_UNBLANK and FB_BLANK_POWERDOWN */
+#define IDLE_BL_POWER_ON "0"
+#define IDLE_BL_POWER_OFF "4"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "idle.h"
+#include "selfprof.h"
+#include "stats.h"
+#include "sysfs-worker.h"
+#include "uevent.h"
+#include "utils.h"
+
+/**
+ * StatedIdle is a fallback for when the compositor's idle timer
+ * doesn't fire (e.g. after a crash of the shell): once no input has
+ * been seen for the timeout, it powers the backlight down through
+ * bl_power, which lets devicestate drop the display wakelock. The
+ * next input powers it back up.
+ *
+ * Input is read straight from every event device, and an event only
+ * updates the last activity timestamp (taken from the event itself,
+ * in CLOCK_MONOTONIC). The timeout is enforced by a single deadline:
+ * when it expires it checks the timestamp, and either blanks or
+ * rearms itself for the remainder. Nothing is done per event.
+ *
+ * Whoever owns it stops it with stated_idle_set_active() when the
+ * compositor handles idleness itself, or when the display is off.
+ */
+
+static const char input_dir[] = "/dev/input";
+static const char backlight_dir[] = "/sys/class/backlight";
+
+typedef struct {
+  StatedIdle *idle;
+  const char *path;   /* interned, NULL for unused slots */
+  int fd;
+  uint source_id;
+  gboolean monotonic; /* Whether event timestamps are in CLOCK_MONOTONIC */
+} StatedIdleDevice;
+
+struct _StatedIdle
+{
+  GObject parent_instance;
+
+  /* instance members */
+  StatedIdleDevice devices[IDLE_MAX_DEVICES];
+  uint uevent_subscription_id;
+
+  uint timeout;            /* seconds, 0 if disabled */
+  gboolean active;
+  gboolean blanked;
+  uint64_t last_activity;  /* monotonic, milliseconds */
+  uint deadline_id;
+
+  uint64_t blanks;
+  uint64_t rearms;
+};
+
+typedef enum {
+  STATED_IDLE_PROP_BLANKED = 1,
+  STATED_IDLE_PROP_LAST
+} StatedIdleProperty;
+
+static GParamSpec *props[STATED_IDLE_PROP_LAST] = { NULL, };
+
+G_DEFINE_TYPE (StatedIdle, stated_idle, G_TYPE_OBJECT)
+
+static void
+stated_idle_device_close (StatedIdleDevice *device)
+{
+  close (device->fd);
+  device->path = NULL;
+  device->fd = -1;
+  device->source_id = 0;
+}
+
+static void
+stated_idle_set_backlight (StatedIdle *self,
+                           gboolean   on)
+{
+  g_autofree char *path = NULL;
+  const char *name;
+  GDir *dir;
+
+  dir = g_dir_open (stated_path (backlight_dir), 0, NULL);
+  if (dir == NULL) {
+    g_warning ("No backlight to power %s", on ? "up" : "down");
+    return;
+  }
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_clear_pointer (&path, g_free);
+    path = g_build_filename (stated_path (backlight_dir), name, "bl_power", NULL);
+
+    sysfs_write_queued (on ? IDLE_BL_POWER_ON : IDLE_BL_POWER_OFF, g_intern_string (path), NULL);
+  }
+
+  g_dir_close (dir);
+}
+
+static void
+stated_idle_set_blanked (StatedIdle *self,
+                         gboolean   blanked)
+{
+  if (blanked == self->blanked)
+    return;
+
+  g_message ("%s the display", blanked ? "Idle, blanking" : "Activity, unblanking");
+
+  self->blanked = blanked;
+  if (blanked)
+    self->blanks++;
+
+  stated_idle_set_backlight (self, !blanked);
+  g_object_notify_by_pspec (G_OBJECT (self), props[STATED_IDLE_PROP_BLANKED]);
+}
+
+static gboolean on_deadline (StatedIdle *self);
+
+static void
+stated_idle_arm (StatedIdle *self,
+                 uint64_t   delay)
+{
+  self->deadline_id = time_timeout_add ((uint) delay, G_SOURCE_FUNC (on_deadline), self);
+}
+
+static void
+stated_idle_disarm (StatedIdle *self)
+{
+  if (self->deadline_id > 0) {
+    time_source_remove (self->deadline_id);
+    self->deadline_id = 0;
+  }
+}
+
+static gboolean
+on_deadline (StatedIdle *self)
+{
+  uint64_t prof_start = selfprof_begin ();
+  uint64_t now = time_get_monotonic ();
+  uint64_t timeout = (uint64_t) self->timeout * 1000;
+
+  self->deadline_id = 0;
+
+  if (now >= self->last_activity + timeout) {
+    stated_idle_set_blanked (self, TRUE);
+  } else {
+    /* There was activity meanwhile: wait for the remainder */
+    self->rearms++;
+    stated_idle_arm (self, self->last_activity + timeout - now);
+  }
+
+  selfprof_end ("idle-deadline", NULL, prof_start);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * Arms the deadline if the engine should run and it isn't already,
+ * disarms it otherwise.
+ */
+static void
+stated_idle_update (StatedIdle *self)
+{
+  if (self->timeout == 0 || !self->active || self->blanked)
+    stated_idle_disarm (self);
+  else if (self->deadline_id == 0)
+    stated_idle_arm (self, (uint64_t) self->timeout * 1000);
+}
+
+static gboolean
+on_device_ready (int              fd,
+                 GIOCondition     condition,
+                 StatedIdleDevice *device)
+{
+  StatedIdle *self = device->idle;
+  struct input_event events[32];
+  gboolean activity = FALSE;
+  ssize_t n;
+  uint i;
+
+  if (condition & (G_IO_HUP | G_IO_ERR)) {
+    g_debug ("%s went away", device->path);
+    stated_idle_device_close (device);
+    return G_SOURCE_REMOVE;
+  }
+
+  while ((n = read (fd, events, sizeof events)) > 0) {
+    for (i = 0; i < n / sizeof (struct input_event); i++) {
+      if (events[i].type == EV_SYN || events[i].type == EV_MSC)
+        continue;
+
+      activity = TRUE;
+      if (device->monotonic)
+        self->last_activity = events[i].input_event_sec * 1000 + events[i].input_event_usec / 1000;
+    }
+  }
+
+  if (!activity)
+    return G_SOURCE_CONTINUE;
+
+  if (!device->monotonic)
+    self->last_activity = time_get_monotonic ();
+
+  if (self->blanked)
+    stated_idle_notify_activity (self);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+stated_idle_open_device (StatedIdle *self,
+                         const char *path)
+{
+  const char *interned = g_intern_string (path);
+  StatedIdleDevice *device = NULL;
+  uint8_t input_props[INPUT_PROP_CNT / 8] = { 0, };
+  int clock = CLOCK_MONOTONIC;
+  int fd;
+  uint i;
+
+  for (i = 0; i < IDLE_MAX_DEVICES; i++) {
+    if (self->devices[i].path == interned)
+      return;
+    else if (self->devices[i].path == NULL && device == NULL)
+      device = &self->devices[i];
+  }
+
+  if (device == NULL) {
+    g_warning ("Too many input devices, not watching %s", path);
+    return;
+  }
+
+  fd = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    g_warning ("Unable to open %s, %s", path, g_strerror (errno));
+    return;
+  }
+
+  /* Sensors report all the time, and not because of the user */
+  if (ioctl (fd, EVIOCGPROP (sizeof input_props), input_props) >= 0 &&
+      (input_props[INPUT_PROP_ACCELEROMETER / 8] & (1 << (INPUT_PROP_ACCELEROMETER % 8)))) {
+    g_debug ("Skipping accelerometer %s", path);
+    close (fd);
+    return;
+  }
+
+  /* Event timestamps are then directly comparable with time_get_monotonic() */
+  device->monotonic = (ioctl (fd, EVIOCSCLOCKID, &clock) == 0);
+  if (!device->monotonic)
+    g_debug ("Unable to set the clock of %s, %s", path, g_strerror (errno));
+
+  g_debug ("Watching %s", path);
+
+  device->idle = self;
+  device->path = interned;
+  device->fd = fd;
+  device->source_id = g_unix_fd_add (fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                     (GUnixFDSourceFunc) on_device_ready, device);
+}
+
+static void
+stated_idle_open_devices (StatedIdle *self)
+{
+  g_autofree char *path = NULL;
+  const char *name;
+  GDir *dir;
+
+  dir = g_dir_open (stated_path (input_dir), 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    if (!g_str_has_prefix (name, "event"))
+      continue;
+
+    g_clear_pointer (&path, g_free);
+    path = g_build_filename (stated_path (input_dir), name, NULL);
+    stated_idle_open_device (self, path);
+  }
+
+  g_dir_close (dir);
+}
+
+static void
+stated_idle_close_devices (StatedIdle *self)
+{
+  uint i;
+
+  for (i = 0; i < IDLE_MAX_DEVICES; i++) {
+    if (self->devices[i].path == NULL)
+      continue;
+
+    g_source_remove (self->devices[i].source_id);
+    stated_idle_device_close (&self->devices[i]);
+  }
+}
+
+static void
+on_input_added (const StatedUevent *event,
+                StatedIdle         *self)
+{
+  g_autofree char *path = NULL;
+
+  /* Events were lost: opening is idempotent, go through them all */
+  if (event == NULL) {
+    stated_idle_open_devices (self);
+    return;
+  }
+
+  if (event->devname == NULL || !g_str_has_prefix (event->devname, "input/event"))
+    return;
+
+  path = g_build_filename (stated_path ("/dev"), event->devname, NULL);
+  stated_idle_open_device (self, path);
+}
+
+static void
+append_stats (GString    *out,
+              StatedIdle *self)
+{
+  uint n_devices = 0;
+  uint i;
+
+  for (i = 0; i < IDLE_MAX_DEVICES; i++) {
+    if (self->devices[i].path != NULL)
+      n_devices++;
+  }
+
+  stats_append_type (out, "stated_idle_timeout_seconds", "gauge", "Idle engine timeout, 0 if disabled");
+  stats_append_value (out, "stated_idle_timeout_seconds", NULL, self->timeout);
+  stats_append_type (out, "stated_idle_active", "gauge", NULL);
+  stats_append_value (out, "stated_idle_active", NULL, self->active);
+  stats_append_type (out, "stated_idle_blanked", "gauge", NULL);
+  stats_append_value (out, "stated_idle_blanked", NULL, self->blanked);
+  stats_append_type (out, "stated_idle_devices", "gauge", NULL);
+  stats_append_value (out, "stated_idle_devices", NULL, n_devices);
+  stats_append_type (out, "stated_idle_blanks_total", "counter", NULL);
+  stats_append_value (out, "stated_idle_blanks_total", NULL, self->blanks);
+  stats_append_type (out, "stated_idle_deadline_rearms_total", "counter", NULL);
+  stats_append_value (out, "stated_idle_deadline_rearms_total", NULL, self->rearms);
+}
+
+static void
+stated_idle_constructed (GObject *obj)
+{
+  StatedIdle *self = STATED_IDLE (obj);
+
+  G_OBJECT_CLASS (stated_idle_parent_class)->constructed (obj);
+
+  self->last_activity = time_get_monotonic ();
+}
+
+static void
+stated_idle_dispose (GObject *obj)
+{
+  StatedIdle *self = STATED_IDLE (obj);
+
+  if (self->timeout > 0)
+    stated_idle_set_timeout (self, 0);
+
+  G_OBJECT_CLASS (stated_idle_parent_class)->dispose (obj);
+}
+
+static void
+stated_idle_get_property (GObject    *obj,
+                          uint       property_id,
+                          GValue     *value,
+                          GParamSpec *pspec)
+{
+  StatedIdle *self = STATED_IDLE (obj);
+
+  switch ((StatedIdleProperty) property_id)
+    {
+    case STATED_IDLE_PROP_BLANKED:
+      g_value_set_boolean (value, self->blanked);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
+static void
+stated_idle_class_init (StatedIdleClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = stated_idle_constructed;
+  object_class->dispose      = stated_idle_dispose;
+  object_class->get_property = stated_idle_get_property;
+
+  props[STATED_IDLE_PROP_BLANKED] =
+    g_param_spec_boolean ("blanked",
+                          "blanked",
+                          "Whether the backlight has been powered down for idleness",
+                          FALSE,
+                          G_PARAM_READABLE);
+
+  g_object_class_install_properties (object_class, STATED_IDLE_PROP_LAST, props);
+}
+
+static void
+stated_idle_init (StatedIdle *self)
+{
+  uint i;
+
+  for (i = 0; i < IDLE_MAX_DEVICES; i++)
+    self->devices[i].fd = -1;
+}
+
+StatedIdle *
+stated_idle_new (void)
+{
+  return g_object_new (STATED_TYPE_IDLE, NULL);
+}
+
+/**
+ * Sets the time without input after which the display is blanked.
+ * 0 disables the engine, closing the input devices and unblanking.
+ */
+void
+stated_idle_set_timeout (StatedIdle *self,
+                         uint       seconds)
+{
+  g_return_if_fail (STATED_IS_IDLE (self));
+
+  if (seconds == self->timeout)
+    return;
+
+  if (seconds > 0 && self->timeout == 0) {
+    g_debug ("Enabling, timeout %u secs", seconds);
+    stated_idle_open_devices (self);
+    self->uevent_subscription_id = uevent_subscribe ("input", "add",
+                                                     (StatedUeventFunc) on_input_added,
+                                                     self);
+    stats_register ("idle", (StatedStatsProviderFunc) append_stats, self);
+  } else if (seconds == 0) {
+    g_debug ("Disabling");
+    stats_unregister ("idle");
+    if (self->uevent_subscription_id > 0) {
+      uevent_unsubscribe (self->uevent_subscription_id);
+      self->uevent_subscription_id = 0;
+    }
+    stated_idle_close_devices (self);
+    stated_idle_set_blanked (self, FALSE);
+  }
+
+  self->timeout = seconds;
+
+  /* The new timeout applies from the next expiration on */
+  stated_idle_update (self);
+}
+
+/**
+ * Lets the engine run, or stops it. A blanked display stays so until
+ * the next activity.
+ */
+void
+stated_idle_set_active (StatedIdle *self,
+                        gboolean   active)
+{
+  g_return_if_fail (STATED_IS_IDLE (self));
+
+  if (active == self->active)
+    return;
+
+  self->active = active;
+
+  /* Count from now, rather than from whenever the input was last seen */
+  if (active)
+    self->last_activity = MAX (self->last_activity, time_get_monotonic ());
+
+  stated_idle_update (self);
+}
+
+/**
+ * Records user activity that doesn't come from the input devices
+ * (e.g. the display being turned on), unblanking if needed.
+ */
+void
+stated_idle_notify_activity (StatedIdle *self)
+{
+  g_return_if_fail (STATED_IS_IDLE (self));
+
+  self->last_activity = MAX (self->last_activity, time_get_monotonic ());
+
+  stated_idle_set_blanked (self, FALSE);
+  stated_idle_update (self);
+}
+
+gboolean
+stated_idle_get_blanked (StatedIdle *self)
+{
+  g_return_val_if_fail (STATED_IS_IDLE (self), FALSE);
+
+  return self->blanked;
+}
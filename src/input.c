@@ -30,22 +30,52 @@
 #define G_LOG_DOMAIN "stated-input"
 
 #include "input.h"
+#include "utils.h"
+#include "flightrec.h"
+#include "selfprof.h"
+#include "uevent.h"
+
+static const char input_dir[] = "/dev/input";
 
 struct _StatedInput
 {
   GObject parent_instance;
 
   /* TODO: support multiple keys */
+  uint type;
   uint key;
 
+  /* Switches only: last known position */
+  gboolean switch_state;
+
   struct libevdev *watched_dev;
   int watched_fd;
   GIOChannel *watched_channel;
   GSource *watched_source;
+
+  GCancellable *scan_cancellable;
+  gboolean scanning;
+
+  /* A device was added while scanning, which might have missed it */
+  gboolean rescan_pending;
+
+  /* Set while waiting for the device to show up */
+  uint uevent_subscription_id;
+  gboolean waiting;
 };
 
+/* A device scan, run in a worker thread */
+typedef struct {
+  uint type;
+  uint key;
+  int fd;
+  struct libevdev *dev;
+} StatedInputScan;
+
 typedef enum {
-  STATED_INPUT_PROP_KEY = 1,
+  STATED_INPUT_PROP_TYPE = 1,
+  STATED_INPUT_PROP_KEY,
+  STATED_INPUT_PROP_SWITCH_STATE,
   STATED_INPUT_PROP_LAST
 } StatedInputProperty;
 
@@ -59,44 +89,118 @@ static uint signals[N_SIGNALS] = { 0 };
 
 G_DEFINE_TYPE (StatedInput, stated_input, G_TYPE_OBJECT)
 
+static void
+stated_input_set_switch_state (StatedInput *self,
+                               gboolean    switch_state)
+{
+  if (switch_state == self->switch_state)
+    return;
+
+  self->switch_state = switch_state;
+  g_object_notify_by_pspec (G_OBJECT (self), props[STATED_INPUT_PROP_SWITCH_STATE]);
+}
+
+static void stated_input_scan (StatedInput *self);
+
+/**
+ * Stops watching the device, if any.
+ */
+static void
+stated_input_close_device (StatedInput *self)
+{
+  if (self->watched_source != NULL) {
+    g_source_destroy (self->watched_source);
+    g_source_unref (self->watched_source);
+    self->watched_source = NULL;
+  }
+
+  if (self->watched_channel != NULL) {
+    g_io_channel_unref (self->watched_channel);
+    self->watched_channel = NULL;
+  }
+
+  if (self->watched_dev != NULL) {
+    libevdev_free (self->watched_dev);
+    self->watched_dev = NULL;
+  }
+
+  if (self->watched_fd >= 0) {
+    close (self->watched_fd);
+    self->watched_fd = -1;
+  }
+}
+
 static gboolean
 on_input_change (GIOChannel *source,
                  GIOCondition  cond,
                  StatedInput  *self)
 {
   struct input_event ev;
+  uint64_t prof_start = selfprof_begin ();
+  uint flags = LIBEVDEV_READ_FLAG_NORMAL;
+  gboolean gone = (cond & (G_IO_HUP | G_IO_ERR)) != 0;
   int rc;
-  do {
-    rc = libevdev_next_event (self->watched_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-    if (rc == LIBEVDEV_READ_STATUS_SUCCESS
-        && ev.type == EV_KEY && ev.code == self->key
-        && ev.value == 1) {
+
+  for (;;) {
+    rc = libevdev_next_event (self->watched_dev, flags, &ev);
+    if (rc == -ENODEV)
+      gone = TRUE;
+    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != LIBEVDEV_READ_STATUS_SYNC)
+      break;
+
+    /* Events were dropped: libevdev replays the state changes we missed */
+    if (rc == LIBEVDEV_READ_STATUS_SYNC)
+      flags = LIBEVDEV_READ_FLAG_SYNC;
+
+    if (ev.type == EV_KEY || ev.type == EV_SW)
+      flightrec_record (STATED_FLIGHTREC_INPUT, NULL, NULL, ev.code, ev.value, 0);
+
+    if (self->type == EV_KEY && ev.type == EV_KEY
+        && ev.code == self->key && ev.value == 1) {
       g_signal_emit (G_OBJECT (self), signals[SIGNAL_POWERKEY_PRESSED], 0);
     }
-  } while (rc != -EAGAIN);
+  }
+
+  /* Unplugged, or its driver was unbound: wait for it to come back */
+  if (gone) {
+    g_message ("Device for %d went away", self->key);
+    stated_input_close_device (self);
+    stated_input_scan (self);
+
+    selfprof_end ("evdev", NULL, prof_start);
+    return G_SOURCE_REMOVE;
+  }
+
+  if (self->type == EV_SW)
+    stated_input_set_switch_state (self, libevdev_get_event_value (self->watched_dev,
+                                                                   EV_SW, self->key) != 0);
+
+  selfprof_end ("evdev", NULL, prof_start);
 
   return G_SOURCE_CONTINUE;
 }
 
 
 /**
- * Searches for a suitable input device for the specified key.
+ * Searches for a suitable input device for the specified key
+ * (or switch, depending on type).
  * Returns an (opened) fd, or -1 if no suitable input
  * device has been found.
  */
 static int
-open_input_device_for_key (uint                     key,
+open_input_device_for_key (uint                     type,
+                           uint                     key,
                            struct libevdev **target_dev)
 {
   int fd, rc;
-  struct libevdev *dev;
+  struct libevdev *dev = NULL;
   g_autoptr(GFileEnumerator) enumerator = NULL;
   g_autoptr(GError) error = NULL;
   g_autoptr(GFile) source = NULL;
   GFileInfo *info;
   GFile *child;
 
-  source = g_file_new_for_path ("/dev/input");
+  source = g_file_new_for_path (stated_path (input_dir));
   enumerator = g_file_enumerate_children (source,
                                           G_FILE_ATTRIBUTE_STANDARD_NAME,
                                           G_FILE_QUERY_INFO_NONE,
@@ -118,7 +222,7 @@ open_input_device_for_key (uint                     key,
         continue;
 
       name = g_file_get_path (child);
-      if (name != NULL && g_str_has_prefix (name, "/dev/input/event")) {
+      if (name != NULL && g_str_has_prefix (g_file_info_get_name (info), "event")) {
         g_debug ("Opening %s", name);
         fd = open (name, O_RDONLY|O_NONBLOCK);
         if (fd == -1) {
@@ -136,7 +240,7 @@ open_input_device_for_key (uint                     key,
 
 
         lowered_devname = g_ascii_strdown (libevdev_get_name (dev), -1);
-        if (libevdev_has_event_code (dev, EV_KEY, key)
+        if (libevdev_has_event_code (dev, type, key)
             && !g_strrstr (lowered_devname, "keyboard")) { /* FIXME: Shouldn't exclude keyboards */
           /* Found! */
           g_debug ("Found key on device %s", name);
@@ -164,51 +268,173 @@ cleanup_and_continue:
 }
 
 static void
-stated_input_constructed (GObject *obj)
+input_scan_free (StatedInputScan *scan)
 {
-  StatedInput *self = STATED_INPUT (obj);
-  GIOChannel *channel;
-  GSource *source;
+  if (scan->dev != NULL)
+    libevdev_free (scan->dev);
 
-  /* Search for a suitable input device */
-  self->watched_fd = open_input_device_for_key (self->key, &self->watched_dev);
-  if (self->watched_fd < 0) {
-    g_warning ("Unable to find suitable device for key %d", self->key);
+  if (scan->fd >= 0)
+    close (scan->fd);
+
+  g_free (scan);
+}
+
+static void
+input_scan_thread (GTask        *task,
+                   void         *source_object,
+                   void         *task_data,
+                   GCancellable *cancellable)
+{
+  StatedInputScan *scan = task_data;
+
+  scan->fd = open_input_device_for_key (scan->type, scan->key, &scan->dev);
+
+  g_task_return_boolean (task, scan->fd >= 0);
+}
+
+static void
+on_input_added (const StatedUevent *event,
+                StatedInput        *self)
+{
+  /* Rescan on new event nodes, or if we might have missed one */
+  if (event != NULL &&
+      (event->devname == NULL || !g_str_has_prefix (event->devname, "input/event")))
     return;
+
+  if (self->scanning)
+    self->rescan_pending = TRUE;
+  else
+    stated_input_scan (self);
+}
+
+static void
+on_input_scan_done (GObject      *source_object,
+                    GAsyncResult *result,
+                    void         *data)
+{
+  StatedInput *self = STATED_INPUT (source_object);
+  StatedInputScan *scan = g_task_get_task_data (G_TASK (result));
+
+  if (self->scan_cancellable == NULL || g_cancellable_is_cancelled (self->scan_cancellable))
+    return;
+
+  self->scanning = FALSE;
+
+  if (!g_task_propagate_boolean (G_TASK (result), NULL)) {
+    if (self->rescan_pending) {
+      self->rescan_pending = FALSE;
+      stated_input_scan (self);
+      return;
+    }
+
+    if (self->waiting)
+      return;
+
+    /* Plenty of devices have no lid or cover, so that's not worth a warning */
+    if (self->type == EV_SW)
+      g_debug ("No device reports switch %d yet", self->key);
+    else
+      g_warning ("Unable to find suitable device for key %d, waiting for it", self->key);
+
+    self->waiting = TRUE;
+    return;
+  }
+
+  if (self->waiting)
+    g_debug ("Device for %d showed up", self->key);
+
+  self->waiting = FALSE;
+  self->rescan_pending = FALSE;
+
+  if (self->uevent_subscription_id > 0) {
+    uevent_unsubscribe (self->uevent_subscription_id);
+    self->uevent_subscription_id = 0;
   }
 
+  /* Take over the device */
+  self->watched_fd = scan->fd;
+  self->watched_dev = scan->dev;
+  scan->fd = -1;
+  scan->dev = NULL;
+
+  /* The switch might have been closed before we started, e.g. at boot */
+  if (self->type == EV_SW)
+    stated_input_set_switch_state (self, libevdev_get_event_value (self->watched_dev,
+                                                                   EV_SW, self->key) != 0);
+
   /* Attach the fd to glib's event loop */
   self->watched_channel = g_io_channel_unix_new (self->watched_fd);
   g_io_channel_set_encoding (self->watched_channel, NULL, NULL);
 
-  self->watched_source = g_io_create_watch (self->watched_channel, G_IO_IN);
+  /* Removed devices only report a hangup */
+  self->watched_source = g_io_create_watch (self->watched_channel, G_IO_IN | G_IO_HUP | G_IO_ERR);
   g_source_set_callback (self->watched_source,
                          G_SOURCE_FUNC (on_input_change),
                          self, NULL);
   g_source_attach (self->watched_source, g_main_context_default ());
+}
 
-  G_OBJECT_CLASS (stated_input_parent_class)->constructed (obj);
+/**
+ * Searches for a suitable input device off the main thread, as opening
+ * every evdev node can take a while at boot. Events are delivered
+ * as soon as it's found.
+ *
+ * Input uevents are followed until then, so that devices added during
+ * the scan aren't missed.
+ */
+static void
+stated_input_scan (StatedInput *self)
+{
+  g_autoptr(GTask) task = NULL;
+  StatedInputScan *scan;
+
+  if (self->uevent_subscription_id == 0)
+    self->uevent_subscription_id = uevent_subscribe ("input", "add",
+                                                     (StatedUeventFunc) on_input_added,
+                                                     self);
+
+  scan = g_new0 (StatedInputScan, 1);
+  scan->type = self->type;
+  scan->key = self->key;
+  scan->fd = -1;
+
+  self->scanning = TRUE;
+
+  task = g_task_new (self, self->scan_cancellable, on_input_scan_done, NULL);
+  g_task_set_task_data (task, scan, (GDestroyNotify) input_scan_free);
+  g_task_run_in_thread (task, input_scan_thread);
 }
 
 static void
-stated_input_dispose (GObject *obj)
+stated_input_constructed (GObject *obj)
 {
   StatedInput *self = STATED_INPUT (obj);
 
-  g_source_destroy (self->watched_source);
+  self->watched_fd = -1;
+  self->scan_cancellable = g_cancellable_new ();
 
-  g_io_channel_unref (self->watched_channel);
+  stated_input_scan (self);
 
-  if (self->watched_dev != NULL) {
-    libevdev_free (self->watched_dev);
-    self->watched_dev = NULL;
+  G_OBJECT_CLASS (stated_input_parent_class)->constructed (obj);
+}
+
+static void
+stated_input_dispose (GObject *obj)
+{
+  StatedInput *self = STATED_INPUT (obj);
+
+  if (self->scan_cancellable != NULL) {
+    g_cancellable_cancel (self->scan_cancellable);
+    g_clear_object (&self->scan_cancellable);
   }
 
-  if (self->watched_fd > 0) {
-    close (self->watched_fd);
-    self->watched_fd = -1;
+  if (self->uevent_subscription_id > 0) {
+    uevent_unsubscribe (self->uevent_subscription_id);
+    self->uevent_subscription_id = 0;
   }
 
+  stated_input_close_device (self);
+
   G_OBJECT_CLASS (stated_input_parent_class)->dispose (obj);
 }
 
@@ -222,6 +448,10 @@ stated_input_set_property (GObject      *obj,
 
   switch ((StatedInputProperty) property_id)
     {
+    case STATED_INPUT_PROP_TYPE:
+      self->type = g_value_get_uint (value);
+      break;
+
     case STATED_INPUT_PROP_KEY:
       self->key = g_value_get_uint (value);
       break;
@@ -243,10 +473,18 @@ stated_input_get_property (GObject    *obj,
 
   switch ((StatedInputProperty) property_id)
     {
+    case STATED_INPUT_PROP_TYPE:
+      g_value_set_uint (value, self->type);
+      break;
+
     case STATED_INPUT_PROP_KEY:
       g_value_set_uint (value, self->key);
       break;
 
+    case STATED_INPUT_PROP_SWITCH_STATE:
+      g_value_set_boolean (value, self->switch_state);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
       break;
@@ -276,15 +514,31 @@ stated_input_class_init (StatedInputClass *klass)
                 G_TYPE_NONE,
                 0);
 
+  props[STATED_INPUT_PROP_TYPE] =
+    g_param_spec_uint ("type",
+                       "type",
+                       "The event type to watch, EV_KEY or EV_SW",
+                       0,
+                       EV_MAX,
+                       EV_KEY,
+                       G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
   props[STATED_INPUT_PROP_KEY] =
     g_param_spec_uint ("key",
                        "key",
-                       "The key to watch events for",
+                       "The key (or switch) to watch events for",
                        0,
                        -1,
                        KEY_POWER,
                        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
 
+  props[STATED_INPUT_PROP_SWITCH_STATE] =
+    g_param_spec_boolean ("switch-state",
+                          "switch-state",
+                          "Whether the watched switch is on (e.g. the lid is closed)",
+                          FALSE,
+                          G_PARAM_READABLE);
+
   g_object_class_install_properties (object_class, STATED_INPUT_PROP_LAST, props);
 
 }
@@ -301,3 +555,17 @@ stated_input_new_for_key (uint key)
 {
   return g_object_new (STATED_TYPE_INPUT, "key", key, NULL);
 }
+
+StatedInput *
+stated_input_new_for_switch (uint sw)
+{
+  return g_object_new (STATED_TYPE_INPUT, "type", EV_SW, "key", sw, NULL);
+}
+
+gboolean
+stated_input_get_switch_state (StatedInput *self)
+{
+  g_return_val_if_fail (STATED_IS_INPUT (self), FALSE);
+
+  return self->switch_state;
+}
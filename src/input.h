@@ -43,6 +43,8 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (StatedInput, stated_input, STATED, INPUT, GObject)
 
 StatedInput *stated_input_new_for_key (uint key);
+StatedInput *stated_input_new_for_switch (uint sw);
+gboolean stated_input_get_switch_state (StatedInput *self);
 
 G_END_DECLS
 
@@ -0,0 +1,390 @@
+/* ledger.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-ledger"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ledger.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * The awake time ledger answers "why was the device awake?".
+ *
+ * Whenever at least one of stated's wakelocks is held, the elapsed
+ * boottime is attributed to the reasons holding it, split evenly
+ * between them when they overlap. A reason is a wakelock, optionally
+ * refined by a level (e.g. the resume damping level).
+ *
+ * Totals are rolled up per screen-off session and per (local) day in
+ * fixed rings, so that the ledger never allocates after a reason has
+ * first been seen.
+ */
+
+typedef struct {
+  const char *name;
+  uint level;
+  gboolean held;
+} StatedLedgerReason;
+
+static StatedLedgerReason reasons[STATED_LEDGER_MAX_REASONS];
+static uint n_reasons = 0;
+static uint n_held = 0;
+static uint64_t last_settle = 0;
+
+static StatedLedgerPeriod sessions[STATED_LEDGER_SESSIONS];
+static uint session_head = 0;
+static gboolean session_open = FALSE;
+static uint32_t last_session_id = 0;
+
+static StatedLedgerPeriod days[STATED_LEDGER_DAYS];
+static uint day_head = 0;
+
+static void append_stats (GString *out, void *data);
+
+static int
+lookup_reason (const char *name,
+               gboolean   create)
+{
+  uint i;
+
+  for (i = 0; i < n_reasons; i++) {
+    if (strcmp (reasons[i].name, name) == 0)
+      return i;
+  }
+
+  if (!create)
+    return -1;
+
+  if (n_reasons == 0)
+    stats_register ("ledger", append_stats, NULL);
+
+  if (n_reasons == STATED_LEDGER_MAX_REASONS) {
+    g_warning ("Too many reasons, not accounting %s", name);
+    return -1;
+  }
+
+  reasons[n_reasons].name = g_intern_string (name);
+  reasons[n_reasons].level = 0;
+  reasons[n_reasons].held = FALSE;
+
+  return n_reasons++;
+}
+
+static uint32_t
+get_today (void)
+{
+  time_t now = time (NULL);
+  struct tm tm;
+
+  localtime_r (&now, &tm);
+
+  return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+static void
+period_start (StatedLedgerPeriod *period,
+              uint32_t           id,
+              uint64_t           now)
+{
+  memset (period, 0, sizeof *period);
+  period->id = id;
+  period->start = now;
+}
+
+static void
+period_add (StatedLedgerPeriod *period,
+            uint64_t           awake_us,
+            uint64_t           share_us)
+{
+  uint i;
+
+  period->awake_us += awake_us;
+
+  for (i = 0; i < n_reasons; i++) {
+    if (reasons[i].held)
+      period->reason_us[i][reasons[i].level] += share_us;
+  }
+}
+
+/**
+ * Attributes the time elapsed since the last call to the reasons
+ * currently held. Must be called before any of them changes.
+ */
+static void
+ledger_settle (void)
+{
+  uint64_t now = time_get_boottime ();
+  uint64_t elapsed_us = (now - MIN (last_settle, now)) * 1000;
+  uint32_t today = get_today ();
+
+  if (days[day_head].id != today) {
+    if (days[day_head].id != 0) {
+      days[day_head].end = now;
+      day_head = (day_head + 1) % STATED_LEDGER_DAYS;
+    }
+    period_start (&days[day_head], today, now);
+  }
+
+  if (last_settle > 0 && n_held > 0) {
+    period_add (&days[day_head], elapsed_us, elapsed_us / n_held);
+    if (session_open)
+      period_add (&sessions[session_head], elapsed_us, elapsed_us / n_held);
+  }
+
+  last_settle = now;
+}
+
+/**
+ * Starts attributing awake time to the given reason.
+ */
+void
+ledger_acquire (const char *reason)
+{
+  int index = lookup_reason (reason, TRUE);
+
+  if (index < 0 || reasons[index].held)
+    return;
+
+  ledger_settle ();
+  reasons[index].held = TRUE;
+  n_held++;
+}
+
+/**
+ * Stops attributing awake time to the given reason.
+ */
+void
+ledger_release (const char *reason)
+{
+  int index = lookup_reason (reason, FALSE);
+
+  if (index < 0 || !reasons[index].held)
+    return;
+
+  ledger_settle ();
+  reasons[index].held = FALSE;
+  n_held--;
+}
+
+/**
+ * Refines the given reason with a level, from now on. Levels past
+ * STATED_LEDGER_MAX_LEVELS - 1 are accounted to the last one.
+ */
+void
+ledger_set_level (const char *reason,
+                  uint       level)
+{
+  int index = lookup_reason (reason, TRUE);
+
+  if (index < 0)
+    return;
+
+  ledger_settle ();
+  reasons[index].level = MIN (level, STATED_LEDGER_MAX_LEVELS - 1);
+}
+
+/**
+ * Starts a new screen-off session.
+ */
+void
+ledger_session_begin (void)
+{
+  if (session_open)
+    return;
+
+  ledger_settle ();
+
+  if (last_session_id > 0)
+    session_head = (session_head + 1) % STATED_LEDGER_SESSIONS;
+
+  period_start (&sessions[session_head], ++last_session_id, last_settle);
+  session_open = TRUE;
+}
+
+/**
+ * Ends the current screen-off session, logging where its awake time
+ * went.
+ */
+void
+ledger_session_end (void)
+{
+  g_autoptr(GString) summary = NULL;
+  StatedLedgerPeriod *session = &sessions[session_head];
+
+  if (!session_open)
+    return;
+
+  ledger_settle ();
+  session->end = last_settle;
+  session_open = FALSE;
+
+  summary = g_string_new (NULL);
+  ledger_format_period (session, summary);
+  g_message ("Screen-off session %u: %s", session->id, summary->str);
+}
+
+/**
+ * Returns the age-th latest screen-off session (0 being the current
+ * or last one), or NULL.
+ */
+const StatedLedgerPeriod *
+ledger_get_session (uint age)
+{
+  if (age >= STATED_LEDGER_SESSIONS || age >= last_session_id)
+    return NULL;
+
+  if (age == 0 && session_open)
+    ledger_settle ();
+
+  return &sessions[(session_head + STATED_LEDGER_SESSIONS - age) % STATED_LEDGER_SESSIONS];
+}
+
+/**
+ * Returns the age-th latest day (0 being today), or NULL.
+ */
+const StatedLedgerPeriod *
+ledger_get_day (uint age)
+{
+  const StatedLedgerPeriod *day;
+
+  if (age >= STATED_LEDGER_DAYS)
+    return NULL;
+
+  if (age == 0)
+    ledger_settle ();
+
+  day = &days[(day_head + STATED_LEDGER_DAYS - age) % STATED_LEDGER_DAYS];
+
+  return (day->id != 0) ? day : NULL;
+}
+
+static void
+append_period_stats (GString                  *out,
+                     const char               *metric,
+                     const char               *help,
+                     const StatedLedgerPeriod *period)
+{
+  char labels[128];
+  uint i, level;
+
+  stats_append_type (out, metric, "gauge", help);
+  if (period == NULL)
+    return;
+
+  for (i = 0; i < n_reasons; i++) {
+    for (level = 0; level < STATED_LEDGER_MAX_LEVELS; level++) {
+      if (period->reason_us[i][level] == 0)
+        continue;
+
+      g_snprintf (labels, sizeof labels, "reason=\"%s\",level=\"%u\"",
+                  reasons[i].name, level);
+      stats_append_value (out, metric, labels,
+                          period->reason_us[i][level] / 1000000.0);
+    }
+  }
+}
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  const StatedLedgerPeriod *day = ledger_get_day (0);
+  const StatedLedgerPeriod *session = ledger_get_session (0);
+
+  append_period_stats (out, "stated_ledger_day_seconds",
+                       "Awake time attributed to a reason today", day);
+  append_period_stats (out, "stated_ledger_session_seconds",
+                       "Awake time attributed to a reason in the current or last screen-off session",
+                       session);
+
+  stats_append_type (out, "stated_ledger_day_awake_seconds", "gauge",
+                     "Time spent holding a wakelock today");
+  stats_append_value (out, "stated_ledger_day_awake_seconds", NULL,
+                      (day != NULL) ? day->awake_us / 1000000.0 : 0);
+  stats_append_type (out, "stated_ledger_session_awake_seconds", "gauge",
+                     "Time spent holding a wakelock in the current or last screen-off session");
+  stats_append_value (out, "stated_ledger_session_awake_seconds", NULL,
+                      (session != NULL) ? session->awake_us / 1000000.0 : 0);
+}
+
+typedef struct {
+  uint reason;
+  uint level;
+  uint64_t us;
+} StatedLedgerEntry;
+
+static int
+compare_entries (const void *a,
+                 const void *b)
+{
+  const StatedLedgerEntry *entry_a = a, *entry_b = b;
+
+  return (entry_a->us < entry_b->us) - (entry_a->us > entry_b->us);
+}
+
+/**
+ * Appends a human readable summary of the period to out, costliest
+ * reasons first.
+ */
+void
+ledger_format_period (const StatedLedgerPeriod *period,
+                      GString                  *out)
+{
+  StatedLedgerEntry entries[STATED_LEDGER_MAX_REASONS * STATED_LEDGER_MAX_LEVELS];
+  uint64_t end = (period->end != 0) ? period->end : last_settle;
+  uint i, level, n_entries = 0;
+
+  for (i = 0; i < n_reasons; i++) {
+    for (level = 0; level < STATED_LEDGER_MAX_LEVELS; level++) {
+      if (period->reason_us[i][level] == 0)
+        continue;
+
+      entries[n_entries].reason = i;
+      entries[n_entries].level = level;
+      entries[n_entries++].us = period->reason_us[i][level];
+    }
+  }
+
+  qsort (entries, n_entries, sizeof *entries, compare_entries);
+
+  g_string_append_printf (out, "%.0f s, awake %.0f s",
+                          (end - MIN (period->start, end)) / 1000.0,
+                          period->awake_us / 1000000.0);
+
+  for (i = 0; i < n_entries; i++) {
+    g_string_append_printf (out, ", %s", reasons[entries[i].reason].name);
+    if (entries[i].level > 0)
+      g_string_append_printf (out, "@%u", entries[i].level);
+    g_string_append_printf (out, " %.0f s", entries[i].us / 1000000.0);
+  }
+}
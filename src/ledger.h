@@ -0,0 +1,64 @@
+/* ledger.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDLEDGER_H
+#define STATEDLEDGER_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+#define STATED_LEDGER_MAX_REASONS 16
+#define STATED_LEDGER_MAX_LEVELS 8
+#define STATED_LEDGER_SESSIONS 8
+#define STATED_LEDGER_DAYS 7
+
+/**
+ * Awake time attributed to every reason (and level) over a period:
+ * a screen-off session or a day.
+ */
+typedef struct {
+  uint32_t id;       /* session number, or day as YYYYMMDD */
+  uint64_t start;    /* boottime, milliseconds */
+  uint64_t end;      /* boottime, milliseconds, 0 while ongoing */
+  uint64_t awake_us;
+  uint64_t reason_us[STATED_LEDGER_MAX_REASONS][STATED_LEDGER_MAX_LEVELS];
+} StatedLedgerPeriod;
+
+void ledger_acquire (const char *reason);
+void ledger_release (const char *reason);
+void ledger_set_level (const char *reason,
+                       uint       level);
+void ledger_session_begin (void);
+void ledger_session_end (void);
+const StatedLedgerPeriod *ledger_get_session (uint age);
+const StatedLedgerPeriod *ledger_get_day (uint age);
+void ledger_format_period (const StatedLedgerPeriod *period,
+                           GString                  *out);
+
+#endif /* STATEDLEDGER_H */
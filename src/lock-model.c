@@ -0,0 +1,307 @@
+/* lock-model.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-lock-model"
+
+#include <string.h>
+
+#include "lock-model.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * A model of the kernel wakelocks a policy takes, mirroring the
+ * semantics of wakelock_lock(), wakelock_timed() and wakelock_cancel()
+ * without touching sysfs.
+ *
+ * It accounts the sysfs writes the policy makes, how long every lock
+ * is held and how long at least one of them is (i.e. the awake time
+ * the policy is responsible for). Timed locks expire lazily: nothing
+ * changes between two calls, so the model is only brought up to date
+ * when it's used and no timers are needed.
+ */
+
+typedef struct {
+  const char *name;
+  gboolean held;
+  gboolean expiring;
+  uint64_t deadline; /* monotonic, milliseconds */
+  uint64_t held_ms;
+} StatedLockModelLock;
+
+struct _StatedLockModel {
+  StatedLockModelLock locks[STATED_LOCK_MODEL_MAX_LOCKS];
+  uint n_locks;
+
+  uint64_t last_update;
+  uint64_t awake_ms;
+  uint64_t writes;
+};
+
+static StatedLockModelLock *
+lock_lookup (StatedLockModel *model,
+             const char      *lock_name)
+{
+  uint i;
+
+  for (i = 0; i < model->n_locks; i++) {
+    if (strcmp (model->locks[i].name, lock_name) == 0)
+      return &model->locks[i];
+  }
+
+  if (model->n_locks == STATED_LOCK_MODEL_MAX_LOCKS) {
+    g_warning ("Too many locks to model, ignoring %s", lock_name);
+    return NULL;
+  }
+
+  model->locks[model->n_locks].name = g_intern_string (lock_name);
+
+  return &model->locks[model->n_locks++];
+}
+
+/**
+ * Accounts the time elapsed since the last update, expiring the timed
+ * locks whose deadline has passed.
+ */
+static void
+lock_model_update (StatedLockModel *model)
+{
+  StatedLockModelLock *lock;
+  uint64_t now = time_get_monotonic ();
+  uint64_t awake_until = model->last_update;
+  uint64_t held_until;
+  uint i;
+
+  for (i = 0; i < model->n_locks; i++) {
+    lock = &model->locks[i];
+    if (!lock->held)
+      continue;
+
+    held_until = (lock->expiring) ? MIN (lock->deadline, now) : now;
+    if (held_until > model->last_update)
+      lock->held_ms += held_until - model->last_update;
+
+    awake_until = MAX (awake_until, held_until);
+
+    if (lock->expiring && lock->deadline <= now) {
+      /* The timeout would have released it */
+      lock->held = FALSE;
+      lock->expiring = FALSE;
+      model->writes++;
+    }
+  }
+
+  model->awake_ms += awake_until - model->last_update;
+  model->last_update = now;
+}
+
+StatedLockModel *
+lock_model_new (void)
+{
+  StatedLockModel *model = g_new0 (StatedLockModel, 1);
+
+  model->last_update = time_get_monotonic ();
+
+  return model;
+}
+
+void
+lock_model_free (StatedLockModel *model)
+{
+  g_free (model);
+}
+
+/**
+ * Models wakelock_lock().
+ */
+void
+lock_model_lock (StatedLockModel *model,
+                 const char      *lock_name)
+{
+  StatedLockModelLock *lock;
+
+  lock_model_update (model);
+
+  lock = lock_lookup (model, lock_name);
+  if (lock == NULL)
+    return;
+
+  lock->held = TRUE;
+  model->writes++;
+}
+
+/**
+ * Models wakelock_unlock().
+ */
+void
+lock_model_unlock (StatedLockModel *model,
+                   const char      *lock_name)
+{
+  StatedLockModelLock *lock;
+
+  lock_model_update (model);
+
+  lock = lock_lookup (model, lock_name);
+  if (lock == NULL || !lock->held)
+    return;
+
+  lock->held = FALSE;
+  lock->expiring = FALSE;
+  model->writes++;
+}
+
+/**
+ * Models wakelock_timed().
+ */
+void
+lock_model_timed (StatedLockModel *model,
+                  const char      *lock_name,
+                  uint            timeout)
+{
+  StatedLockModelLock *lock;
+
+  lock_model_update (model);
+
+  lock = lock_lookup (model, lock_name);
+  if (lock == NULL)
+    return;
+
+  if (!lock->expiring) {
+    lock->held = TRUE;
+    model->writes++;
+  }
+
+  lock->expiring = TRUE;
+  lock->deadline = model->last_update + (uint64_t)timeout * 1000;
+}
+
+/**
+ * Models wakelock_cancel().
+ */
+void
+lock_model_cancel (StatedLockModel *model,
+                   const char      *lock_name,
+                   gboolean        keep_lock)
+{
+  StatedLockModelLock *lock;
+
+  lock_model_update (model);
+
+  lock = lock_lookup (model, lock_name);
+  if (lock == NULL || !lock->expiring)
+    return;
+
+  lock->expiring = FALSE;
+
+  if (!keep_lock) {
+    lock->held = FALSE;
+    model->writes++;
+  }
+}
+
+/**
+ * Returns whether lock_name is currently held, timed or not.
+ */
+gboolean
+lock_model_is_held (StatedLockModel *model,
+                    const char      *lock_name)
+{
+  StatedLockModelLock *lock;
+
+  lock_model_update (model);
+
+  lock = lock_lookup (model, lock_name);
+
+  return lock != NULL && lock->held;
+}
+
+/**
+ * Returns for how long at least one lock has been held.
+ */
+uint64_t
+lock_model_get_awake_ms (StatedLockModel *model)
+{
+  lock_model_update (model);
+
+  return model->awake_ms;
+}
+
+/**
+ * Returns how many writes to /sys/power/wake_(un)lock would have
+ * been made.
+ */
+uint64_t
+lock_model_get_writes (StatedLockModel *model)
+{
+  lock_model_update (model);
+
+  return model->writes;
+}
+
+/**
+ * Appends the samples of n_models models, each labelled with its
+ * policy, one metric family at a time.
+ */
+void
+lock_model_append_stats (StatedLockModel   **models,
+                         const char *const *policies,
+                         uint              n_models,
+                         GString           *out)
+{
+  char labels[128];
+  uint i, k;
+
+  for (k = 0; k < n_models; k++)
+    lock_model_update (models[k]);
+
+  stats_append_type (out, "stated_policy_awake_seconds_total", "counter",
+                     "Awake time held by the active and the shadow policy");
+  for (k = 0; k < n_models; k++) {
+    g_snprintf (labels, sizeof labels, "policy=\"%s\"", policies[k]);
+    stats_append_value (out, "stated_policy_awake_seconds_total", labels,
+                        models[k]->awake_ms / 1000.0);
+  }
+
+  stats_append_type (out, "stated_policy_wakelock_writes_total", "counter", NULL);
+  for (k = 0; k < n_models; k++) {
+    g_snprintf (labels, sizeof labels, "policy=\"%s\"", policies[k]);
+    stats_append_value (out, "stated_policy_wakelock_writes_total", labels,
+                        models[k]->writes);
+  }
+
+  stats_append_type (out, "stated_policy_wakelock_held_seconds_total", "counter", NULL);
+  for (k = 0; k < n_models; k++) {
+    for (i = 0; i < models[k]->n_locks; i++) {
+      g_snprintf (labels, sizeof labels, "policy=\"%s\",lock=\"%s\"", policies[k],
+                  models[k]->locks[i].name);
+      stats_append_value (out, "stated_policy_wakelock_held_seconds_total", labels,
+                          models[k]->locks[i].held_ms / 1000.0);
+    }
+  }
+}
@@ -0,0 +1,61 @@
+/* lock-model.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDLOCKMODEL_H
+#define STATEDLOCKMODEL_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+#define STATED_LOCK_MODEL_MAX_LOCKS 8
+
+typedef struct _StatedLockModel StatedLockModel;
+
+StatedLockModel *lock_model_new (void);
+void lock_model_free (StatedLockModel *model);
+void lock_model_lock (StatedLockModel *model,
+                      const char      *lock_name);
+void lock_model_unlock (StatedLockModel *model,
+                        const char      *lock_name);
+void lock_model_timed (StatedLockModel *model,
+                       const char      *lock_name,
+                       uint            timeout);
+void lock_model_cancel (StatedLockModel *model,
+                        const char      *lock_name,
+                        gboolean        keep_lock);
+gboolean lock_model_is_held (StatedLockModel *model,
+                             const char      *lock_name);
+uint64_t lock_model_get_awake_ms (StatedLockModel *model);
+uint64_t lock_model_get_writes (StatedLockModel *model);
+void lock_model_append_stats (StatedLockModel   **models,
+                              const char *const *policies,
+                              uint              n_models,
+                              GString           *out);
+
+#endif /* STATEDLOCKMODEL_H */
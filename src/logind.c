@@ -0,0 +1,421 @@
+/* logind.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-logind"
+
+#define LOGIND_BUS_NAME "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+
+#include <string.h>
+
+#include "logind.h"
+
+/**
+ * StatedLogind watches systemd-logind's block-mode inhibitors: its
+ * "inhibited" property is TRUE while at least one "sleep" or "idle"
+ * inhibitor is active.
+ *
+ * logind aggregates them in the BlockInhibited property of its
+ * manager, so a single PropertiesChanged subscription is all that's
+ * needed: nothing is polled. The same goes for the "idle-hint"
+ * property, mirroring the manager's IdleHint: TRUE when every session
+ * has been reported idle, e.g. by the compositor.
+ *
+ * It works on the system bus by default (which can be redirected to a
+ * private one with a mock logind through DBUS_SYSTEM_BUS_ADDRESS), on
+ * the supplied connection, or on no bus at all when offline, in which
+ * case nothing is ever inhibited nor idle.
+ */
+
+struct _StatedLogind
+{
+  GObject parent_instance;
+
+  /* instance members */
+  GDBusConnection *connection;
+  gboolean offline;
+  GCancellable *cancellable;
+  uint properties_subscription_id;
+  gboolean inhibited;
+  gboolean idle_hint;
+};
+
+typedef enum {
+  STATED_LOGIND_PROP_CONNECTION = 1,
+  STATED_LOGIND_PROP_OFFLINE,
+  STATED_LOGIND_PROP_INHIBITED,
+  STATED_LOGIND_PROP_IDLE_HINT,
+  STATED_LOGIND_PROP_LAST
+} StatedLogindProperty;
+
+static GParamSpec *props[STATED_LOGIND_PROP_LAST] = { NULL, };
+
+G_DEFINE_TYPE (StatedLogind, stated_logind, G_TYPE_OBJECT)
+
+/**
+ * Returns whether a BlockInhibited value (e.g. "shutdown:sleep")
+ * blocks sleep or idle.
+ */
+static gboolean
+block_inhibits (const char *block_inhibited)
+{
+  g_auto(GStrv) what = g_strsplit (block_inhibited, ":", -1);
+  uint i;
+
+  for (i = 0; what[i] != NULL; i++) {
+    if (strcmp (what[i], "sleep") == 0 || strcmp (what[i], "idle") == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+stated_logind_set_block_inhibited (StatedLogind *self,
+                                   const char   *block_inhibited)
+{
+  gboolean inhibited = block_inhibits (block_inhibited);
+
+  g_debug ("BlockInhibited: '%s'", block_inhibited);
+
+  if (inhibited == self->inhibited)
+    return;
+
+  self->inhibited = inhibited;
+  g_object_notify_by_pspec (G_OBJECT (self), props[STATED_LOGIND_PROP_INHIBITED]);
+}
+
+static void
+stated_logind_set_idle_hint (StatedLogind *self,
+                             gboolean     idle_hint)
+{
+  g_debug ("IdleHint: %d", idle_hint);
+
+  if (idle_hint == self->idle_hint)
+    return;
+
+  self->idle_hint = idle_hint;
+  g_object_notify_by_pspec (G_OBJECT (self), props[STATED_LOGIND_PROP_IDLE_HINT]);
+}
+
+/**
+ * Picks the properties of interest from an a{sv} dictionary.
+ */
+static void
+stated_logind_set_properties (StatedLogind *self,
+                              GVariant     *properties)
+{
+  const char *block_inhibited;
+  gboolean idle_hint;
+
+  if (g_variant_lookup (properties, "BlockInhibited", "&s", &block_inhibited))
+    stated_logind_set_block_inhibited (self, block_inhibited);
+
+  if (g_variant_lookup (properties, "IdleHint", "b", &idle_hint))
+    stated_logind_set_idle_hint (self, idle_hint);
+}
+
+static void
+on_properties (GObject      *source_object,
+               GAsyncResult *result,
+               void         *data)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) properties = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+  if (reply == NULL) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Unable to get logind properties: %s", error->message);
+    return;
+  }
+
+  g_variant_get (reply, "(@a{sv})", &properties);
+  stated_logind_set_properties (STATED_LOGIND (data), properties);
+}
+
+static void
+stated_logind_query (StatedLogind *self)
+{
+  g_dbus_connection_call (self->connection, LOGIND_BUS_NAME, LOGIND_PATH,
+                          "org.freedesktop.DBus.Properties", "GetAll",
+                          g_variant_new ("(s)", LOGIND_MANAGER_INTERFACE),
+                          G_VARIANT_TYPE ("(a{sv})"), G_DBUS_CALL_FLAGS_NONE, -1,
+                          self->cancellable, on_properties, self);
+}
+
+static void
+on_properties_changed (GDBusConnection *connection,
+                       const char      *sender_name,
+                       const char      *object_path,
+                       const char      *interface_name,
+                       const char      *signal_name,
+                       GVariant        *parameters,
+                       StatedLogind    *self)
+{
+  g_autoptr(GVariant) changed = NULL;
+  g_autofree const char **invalidated = NULL;
+  uint i;
+
+  g_variant_get (parameters, "(&s@a{sv}^a&s)", NULL, &changed, &invalidated);
+
+  /* A signal can carry one property in each list */
+  stated_logind_set_properties (self, changed);
+
+  for (i = 0; invalidated[i] != NULL; i++) {
+    if (strcmp (invalidated[i], "BlockInhibited") == 0 ||
+        strcmp (invalidated[i], "IdleHint") == 0) {
+      stated_logind_query (self);
+      return;
+    }
+  }
+}
+
+static void
+stated_logind_watch (StatedLogind *self)
+{
+  self->properties_subscription_id =
+    g_dbus_connection_signal_subscribe (self->connection, LOGIND_BUS_NAME,
+                                        "org.freedesktop.DBus.Properties",
+                                        "PropertiesChanged", LOGIND_PATH,
+                                        LOGIND_MANAGER_INTERFACE,
+                                        G_DBUS_SIGNAL_FLAGS_NONE,
+                                        (GDBusSignalCallback) on_properties_changed,
+                                        self, NULL);
+
+  /* Initial state */
+  stated_logind_query (self);
+}
+
+static void
+on_bus_ready (GObject      *source_object,
+              GAsyncResult *result,
+              void         *data)
+{
+  g_autoptr(GError) error = NULL;
+  GDBusConnection *connection;
+  StatedLogind *self;
+
+  connection = g_bus_get_finish (result, &error);
+  if (connection == NULL) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Unable to connect to the system bus: %s", error->message);
+    return;
+  }
+
+  self = STATED_LOGIND (data);
+  self->connection = connection;
+  stated_logind_watch (self);
+}
+
+static void
+stated_logind_constructed (GObject *obj)
+{
+  StatedLogind *self = STATED_LOGIND (obj);
+
+  G_OBJECT_CLASS (stated_logind_parent_class)->constructed (obj);
+
+  if (self->offline)
+    return;
+
+  self->cancellable = g_cancellable_new ();
+
+  if (self->connection != NULL)
+    stated_logind_watch (self);
+  else
+    g_bus_get (G_BUS_TYPE_SYSTEM, self->cancellable, on_bus_ready, self);
+}
+
+static void
+stated_logind_dispose (GObject *obj)
+{
+  StatedLogind *self = STATED_LOGIND (obj);
+
+  if (self->cancellable != NULL) {
+    g_cancellable_cancel (self->cancellable);
+    g_clear_object (&self->cancellable);
+  }
+
+  if (self->properties_subscription_id > 0) {
+    g_dbus_connection_signal_unsubscribe (self->connection, self->properties_subscription_id);
+    self->properties_subscription_id = 0;
+  }
+
+  g_clear_object (&self->connection);
+
+  G_OBJECT_CLASS (stated_logind_parent_class)->dispose (obj);
+}
+
+static void
+stated_logind_set_property (GObject      *obj,
+                            uint         property_id,
+                            const GValue *value,
+                            GParamSpec   *pspec)
+{
+  StatedLogind *self = STATED_LOGIND (obj);
+
+  switch ((StatedLogindProperty) property_id)
+    {
+    case STATED_LOGIND_PROP_CONNECTION:
+      self->connection = g_value_dup_object (value);
+      break;
+
+    case STATED_LOGIND_PROP_OFFLINE:
+      self->offline = g_value_get_boolean (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
+static void
+stated_logind_get_property (GObject    *obj,
+                            uint       property_id,
+                            GValue     *value,
+                            GParamSpec *pspec)
+{
+  StatedLogind *self = STATED_LOGIND (obj);
+
+  switch ((StatedLogindProperty) property_id)
+    {
+    case STATED_LOGIND_PROP_CONNECTION:
+      g_value_set_object (value, self->connection);
+      break;
+
+    case STATED_LOGIND_PROP_OFFLINE:
+      g_value_set_boolean (value, self->offline);
+      break;
+
+    case STATED_LOGIND_PROP_INHIBITED:
+      g_value_set_boolean (value, self->inhibited);
+      break;
+
+    case STATED_LOGIND_PROP_IDLE_HINT:
+      g_value_set_boolean (value, self->idle_hint);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
+static void
+stated_logind_class_init (StatedLogindClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = stated_logind_constructed;
+  object_class->dispose      = stated_logind_dispose;
+  object_class->set_property = stated_logind_set_property;
+  object_class->get_property = stated_logind_get_property;
+
+  props[STATED_LOGIND_PROP_CONNECTION] =
+    g_param_spec_object ("connection",
+                         "connection",
+                         "The bus logind is on, the system bus if not supplied",
+                         G_TYPE_DBUS_CONNECTION,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  props[STATED_LOGIND_PROP_OFFLINE] =
+    g_param_spec_boolean ("offline",
+                          "offline",
+                          "Whether to stay off the bus, keeping the default state",
+                          FALSE,
+                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+
+  props[STATED_LOGIND_PROP_INHIBITED] =
+    g_param_spec_boolean ("inhibited",
+                          "inhibited",
+                          "Whether a sleep or idle block inhibitor is active",
+                          FALSE,
+                          G_PARAM_READABLE);
+
+  props[STATED_LOGIND_PROP_IDLE_HINT] =
+    g_param_spec_boolean ("idle-hint",
+                          "idle-hint",
+                          "Whether every session has been reported idle",
+                          FALSE,
+                          G_PARAM_READABLE);
+
+  g_object_class_install_properties (object_class, STATED_LOGIND_PROP_LAST, props);
+}
+
+static void
+stated_logind_init (StatedLogind *self)
+{
+}
+
+StatedLogind *
+stated_logind_new (void)
+{
+  return g_object_new (STATED_TYPE_LOGIND, NULL);
+}
+
+/**
+ * Creates a new StatedLogind talking to the logind on connection,
+ * e.g. a mock one on a private bus.
+ */
+StatedLogind *
+stated_logind_new_for_connection (GDBusConnection *connection)
+{
+  return g_object_new (STATED_TYPE_LOGIND, "connection", connection, NULL);
+}
+
+/**
+ * Creates a new StatedLogind that doesn't connect to any bus, for the
+ * tools running on virtual time: it's never inhibited nor idle.
+ */
+StatedLogind *
+stated_logind_new_offline (void)
+{
+  return g_object_new (STATED_TYPE_LOGIND, "offline", TRUE, NULL);
+}
+
+gboolean
+stated_logind_get_inhibited (StatedLogind *self)
+{
+  g_return_val_if_fail (STATED_IS_LOGIND (self), FALSE);
+
+  return self->inhibited;
+}
+
+gboolean
+stated_logind_get_idle_hint (StatedLogind *self)
+{
+  g_return_val_if_fail (STATED_IS_LOGIND (self), FALSE);
+
+  return self->idle_hint;
+}
@@ -29,12 +29,35 @@
 
 #include <glib-2.0/glib.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "wakelocks.h"
+#include "wakelock-watchdog.h"
+#include "sysfs-worker.h"
+#include "utils.h"
 #include "sleep.h"
+#include "sleephooks.h"
 #include "devicestate.h"
+#include "trace.h"
+#include "flightrec.h"
+#include "tracepoints.h"
+#include "stats.h"
+#include "policy.h"
+#include "metrics.h"
+#include "metrics-server.h"
+#include "wakelock-server.h"
+#include "selfprof.h"
+#include "sdnotify.h"
+#include "startup.h"
+#include "uevent.h"
 #include "stated-config.h"
 
+static void
+on_startup_finished (void *data)
+{
+  autosleep_enable ();
+}
+
 static gboolean
 handle_unix_signal (void* data)
 {
@@ -47,6 +70,23 @@ handle_unix_signal (void* data)
   return G_SOURCE_REMOVE;
 }
 
+static gboolean
+handle_dump_signal (void* data)
+{
+  flightrec_dump (stated_path ("/run/stated/flightrec.bin"));
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+handle_stats_signal (void* data)
+{
+  stats_dump (stated_path ("/run/stated/stats.prom"));
+  selfprof_dump (stated_path ("/run/stated/selfprof.txt"));
+
+  return G_SOURCE_CONTINUE;
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -54,8 +94,47 @@ main (int   argc,
   g_autoptr(GOptionContext) context = NULL;
   g_autoptr(GError) error = NULL;
   gboolean version = FALSE;
+  gboolean trace_marker = FALSE;
+  gboolean no_metrics_socket = FALSE;
+  gboolean no_wakelock_socket = FALSE;
+  g_autofree char *wakelock_socket_group = NULL;
+  g_autofree char *watchdog_policy = NULL;
+  g_auto(GStrv) watchdog_budgets = NULL;
+  g_autofree char *root = NULL;
+  g_autofree char *trace = NULL;
+  g_autofree char *shadow_policy = NULL;
+  g_autofree char *policy_file = NULL;
+  g_autofree char *sleep_hooks_dir = NULL;
+  StatedDevicestatePolicy shadow_overrides;
+  StatedDevicestate *shadow = NULL;
+  StatedWakelockWatchdogPolicy policy;
+  char *budget, *end;
+  guint64 seconds;
+  uint i;
   GOptionEntry main_entries[] = {
     { "version", 0, 0, G_OPTION_ARG_NONE, &version, "Show program version" },
+    { "root", 0, 0, G_OPTION_ARG_FILENAME, &root,
+      "Prefix for every kernel interface path (defaults to $STATED_ROOT)", "DIR" },
+    { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace,
+      "Record display, powerkey and resume events to FILE, for offline replay", "FILE" },
+    { "trace-marker", 0, 0, G_OPTION_ARG_NONE, &trace_marker,
+      "Write tracepoints to ftrace's trace_marker" },
+    { "no-metrics-socket", 0, 0, G_OPTION_ARG_NONE, &no_metrics_socket,
+      "Don't serve metrics on /run/stated/metrics.sock" },
+    { "no-wakelock-socket", 0, 0, G_OPTION_ARG_NONE, &no_wakelock_socket,
+      "Don't serve wakelocks on /run/stated/wakelock.sock" },
+    { "wakelock-socket-group", 0, 0, G_OPTION_ARG_STRING, &wakelock_socket_group,
+      "Group allowed to take wakelocks on /run/stated/wakelock.sock", "GROUP" },
+    { "policy", 0, 0, G_OPTION_ARG_FILENAME, &policy_file,
+      "Power policy file (defaults to " STATED_SYSCONFDIR "/stated/policy.conf)", "FILE" },
+    { "sleep-hooks", 0, 0, G_OPTION_ARG_FILENAME, &sleep_hooks_dir,
+      "Directory of the hooks run around sleep (defaults to " STATED_SYSCONFDIR "/stated/sleep.d)", "DIR" },
+    { "shadow-policy", 0, 0, G_OPTION_ARG_STRING, &shadow_policy,
+      "Evaluate a policy (e.g. display_wait_time=5) in shadow mode, see the stats", "OVERRIDES" },
+    { "wakelock-watchdog", 0, 0, G_OPTION_ARG_STRING, &watchdog_policy,
+      "What to do with wakelocks held over their budget (log, release, escalate)", "POLICY" },
+    { "wakelock-budget", 0, 0, G_OPTION_ARG_STRING_ARRAY, &watchdog_budgets,
+      "Hold budget of a wakelock in seconds, 0 for none (repeatable)", "NAME=SECS" },
     { NULL }
   };
 
@@ -72,19 +151,107 @@ main (int   argc,
     return EXIT_SUCCESS;
   }
 
+  startup_begin ();
+
+  if (root != NULL)
+    stated_set_root (root);
+
+  if (watchdog_policy != NULL) {
+    if (!wakelock_watchdog_parse_policy (watchdog_policy, &policy)) {
+      g_printerr ("Unknown wakelock watchdog policy: %s\n", watchdog_policy);
+      return EXIT_FAILURE;
+    }
+
+    wakelock_watchdog_set_policy (policy);
+  }
+
+  for (i = 0; watchdog_budgets != NULL && watchdog_budgets[i] != NULL; i++) {
+    budget = strchr (watchdog_budgets[i], '=');
+    if (budget == NULL) {
+      g_printerr ("Invalid wakelock budget: %s\n", watchdog_budgets[i]);
+      return EXIT_FAILURE;
+    }
+    *budget++ = '\0';
+
+    seconds = g_ascii_strtoull (budget, &end, 10);
+    if (end == budget || *end != '\0' || seconds > G_MAXUINT) {
+      g_printerr ("Invalid wakelock budget for %s: %s\n", watchdog_budgets[i], budget);
+      return EXIT_FAILURE;
+    }
+
+    wakelock_watchdog_set_budget (watchdog_budgets[i], (uint) seconds);
+  }
+
+  stated_devicestate_policy_init (&shadow_overrides);
+  if (shadow_policy != NULL &&
+      !policy_parse_overrides (&shadow_overrides, shadow_policy, &error)) {
+    g_printerr ("Invalid shadow policy: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  /* Bound before anything else is started, so that failing is a clean exit */
+  if (!no_wakelock_socket &&
+      !wakelock_server_start (stated_path ("/run/stated/wakelock.sock"),
+                              wakelock_socket_group))
+    return EXIT_FAILURE;
+
+  if (trace != NULL)
+    trace_open (trace);
+
+  if (trace_marker)
+    tracepoints_marker_open ();
+
+  selfprof_init ();
+  metrics_init ();
+  sleephooks_init ((sleep_hooks_dir != NULL) ? sleep_hooks_dir : STATED_SYSCONFDIR "/stated/sleep.d");
+
+  /* Move sysfs writes off the main loop */
+  sysfs_worker_start ();
+
+  /* Clean up after an eventual previous instance that didn't exit cleanly */
+  wakelock_reconcile ();
+
+  /* Hotplug, for whoever subscribes */
+  uevent_monitor_start ();
+
   StatedDevicestate *devicestate = stated_devicestate_new ();
 
-  /* TODO: Enable autosleep only after system startup */
-  autosleep_enable ();
+  policy_watch ((policy_file != NULL) ? policy_file : STATED_SYSCONFDIR "/stated/policy.conf",
+                devicestate);
+
+  if (shadow_policy != NULL) {
+    shadow = stated_devicestate_new_shadow (devicestate);
+    policy_watch_shadow (shadow, shadow_policy);
+  }
+
+  /* Let the system finish starting up before the first suspend */
+  startup_wait_finished (on_startup_finished, NULL);
+
+  if (!no_metrics_socket)
+    metrics_server_start (stated_path ("/run/stated/metrics.sock"));
 
   GMainLoop *loop = g_main_loop_new (NULL, FALSE);
   g_unix_signal_add (SIGTERM, G_SOURCE_FUNC (handle_unix_signal), loop);
+  g_unix_signal_add (SIGUSR1, G_SOURCE_FUNC (handle_stats_signal), NULL);
+  g_unix_signal_add (SIGUSR2, G_SOURCE_FUNC (handle_dump_signal), NULL);
+  startup_ready ();
   g_main_loop_run (loop);
 
   /* Cleanup */
+  sdnotify_send ("STOPPING=1");
+  sdnotify_watchdog_stop ();
   autosleep_disable ();
+  wakelock_server_stop ();
+  sleephooks_cleanup ();
   wakelock_cancel_all ();
+  g_clear_object (&shadow);
+  policy_unwatch ();
   g_clear_object (&devicestate);
+  sysfs_worker_stop ();
+  uevent_monitor_stop ();
+  metrics_server_stop ();
+  trace_close ();
+  tracepoints_marker_close ();
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,264 @@
+/* metrics-server.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-metrics-server"
+
+/* Initial size of the snapshot buffer, it only grows if needed */
+#define METRICS_SERVER_BUFFER_SIZE 16384
+
+/* Clients that don't read their snapshot within this are dropped, in seconds */
+#define METRICS_SERVER_CLIENT_TIMEOUT 5
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "metrics-server.h"
+#include "stats.h"
+#include "selfprof.h"
+#include "utils.h"
+
+/**
+ * Serves a snapshot of the stats registry, in the Prometheus text
+ * format, on a Unix socket: every connection gets the current snapshot
+ * and is then closed. Nothing is read from clients.
+ *
+ *   socat - UNIX-CONNECT:/run/stated/metrics.sock
+ *
+ * Everything is non-blocking and runs in the main loop. Clients are
+ * served one at a time from a single reused buffer: while a slow
+ * client is being written to, new connections wait in the listen
+ * backlog.
+ */
+
+static char *server_path = NULL;
+static int listen_fd = -1;
+static uint listen_source_id = 0;
+
+static int client_fd = -1;
+static uint client_source_id = 0;
+static uint client_timeout_id = 0;
+static gsize client_offset = 0;
+
+static GString *snapshot = NULL;
+
+static gboolean on_listen_ready (int          fd,
+                                 GIOCondition condition,
+                                 void         *data);
+
+static void
+client_close (void)
+{
+  if (client_source_id > 0) {
+    g_source_remove (client_source_id);
+    client_source_id = 0;
+  }
+
+  if (client_timeout_id > 0) {
+    time_source_remove (client_timeout_id);
+    client_timeout_id = 0;
+  }
+
+  if (client_fd >= 0) {
+    close (client_fd);
+    client_fd = -1;
+  }
+
+  /* Accept the next one */
+  if (listen_fd >= 0 && listen_source_id == 0)
+    listen_source_id = g_unix_fd_add (listen_fd, G_IO_IN, on_listen_ready, NULL);
+}
+
+/**
+ * Writes as much of the snapshot as the socket takes. Returns TRUE
+ * when the client is done with, either because it got everything or
+ * because it went away.
+ */
+static gboolean
+client_flush (void)
+{
+  ssize_t written;
+
+  while (client_offset < snapshot->len) {
+    written = send (client_fd, snapshot->str + client_offset,
+                    snapshot->len - client_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (written < 0 && errno == EINTR)
+      continue;
+    else if (written < 0 && errno == EAGAIN)
+      return FALSE;
+    else if (written < 0)
+      return TRUE;
+
+    client_offset += written;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+on_client_ready (int          fd,
+                 GIOCondition condition,
+                 void         *data)
+{
+  if (!client_flush ())
+    return G_SOURCE_CONTINUE;
+
+  client_source_id = 0;
+  client_close ();
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_client_timeout (void *data)
+{
+  g_debug ("Dropping a metrics client that stopped reading");
+
+  client_timeout_id = 0;
+  client_close ();
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_listen_ready (int          fd,
+                 GIOCondition condition,
+                 void         *data)
+{
+  uint64_t prof_start = selfprof_begin ();
+
+  /* Writes use MSG_DONTWAIT, so the client socket can stay blocking */
+  client_fd = accept (fd, NULL, NULL);
+  if (client_fd < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      g_warning ("Unable to accept metrics client: %s", g_strerror (errno));
+
+    selfprof_end ("metrics", NULL, prof_start);
+    return G_SOURCE_CONTINUE;
+  }
+
+  stats_collect_into (snapshot);
+  client_offset = 0;
+
+  if (client_flush ()) {
+    close (client_fd);
+    client_fd = -1;
+
+    selfprof_end ("metrics", NULL, prof_start);
+    return G_SOURCE_CONTINUE;
+  }
+
+  /* Slow reader: stop accepting until it's done */
+  client_source_id = g_unix_fd_add (client_fd, G_IO_OUT, on_client_ready, NULL);
+  client_timeout_id = time_timeout_add_seconds (METRICS_SERVER_CLIENT_TIMEOUT,
+                                                on_client_timeout, NULL);
+  listen_source_id = 0;
+
+  selfprof_end ("metrics", NULL, prof_start);
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * Starts serving metrics on socket_path, replacing a stale socket
+ * left there by a previous instance.
+ */
+gboolean
+metrics_server_start (const char *socket_path)
+{
+  g_autofree char *dir = NULL;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  if (listen_fd >= 0)
+    return TRUE;
+
+  if (strlen (socket_path) >= sizeof addr.sun_path) {
+    g_warning ("Metrics socket path too long: %s", socket_path);
+    return FALSE;
+  }
+
+  dir = g_path_get_dirname (socket_path);
+  if (g_mkdir_with_parents (dir, 0755) < 0) {
+    g_warning ("Unable to create %s: %s", dir, g_strerror (errno));
+    return FALSE;
+  }
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    g_warning ("Unable to create metrics socket: %s", g_strerror (errno));
+    return FALSE;
+  }
+
+  g_strlcpy (addr.sun_path, socket_path, sizeof addr.sun_path);
+  unlink (socket_path);
+
+  if (bind (listen_fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+      chmod (socket_path, 0660) < 0 ||
+      listen (listen_fd, 4) < 0) {
+    g_warning ("Unable to listen on %s: %s", socket_path, g_strerror (errno));
+    close (listen_fd);
+    listen_fd = -1;
+    return FALSE;
+  }
+
+  server_path = g_strdup (socket_path);
+
+  if (snapshot == NULL)
+    snapshot = g_string_sized_new (METRICS_SERVER_BUFFER_SIZE);
+
+  listen_source_id = g_unix_fd_add (listen_fd, G_IO_IN, on_listen_ready, NULL);
+
+  g_debug ("Serving metrics on %s", socket_path);
+
+  return TRUE;
+}
+
+void
+metrics_server_stop (void)
+{
+  if (listen_fd < 0)
+    return;
+
+  if (listen_source_id > 0) {
+    g_source_remove (listen_source_id);
+    listen_source_id = 0;
+  }
+
+  close (listen_fd);
+  listen_fd = -1;
+
+  client_close ();
+
+  unlink (server_path);
+  g_clear_pointer (&server_path, g_free);
+}
@@ -0,0 +1,215 @@
+/* metrics.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-metrics"
+
+#include <string.h>
+
+#include "metrics.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * Core counters: wakelocks, resumes, display transitions and sysfs
+ * writes, exported through the stats registry.
+ *
+ * Every counter lives in preallocated storage and is updated with a
+ * plain store, so that neither the hot paths nor a scrape allocate or
+ * lock. Sysfs writes are accounted with relaxed atomic adds instead:
+ * queued ones as their completion reaches the main loop, synchronous
+ * ones (before the sysfs worker starts, or in the tools) by whatever
+ * thread carries them out.
+ */
+
+typedef struct {
+  const char *name;
+  uint64_t acquires;
+  uint64_t held_ms;
+  uint64_t held_since; /* monotonic, milliseconds, 0 if not held */
+} StatedMetricsWakelock;
+
+/* Upper bounds of the sysfs write latency histogram, in microseconds */
+static const int64_t sysfs_latency_buckets[] = { 100, 1000, 10000, 100000 };
+
+static StatedMetricsWakelock wakelocks[STATED_METRICS_MAX_WAKELOCKS];
+static uint n_wakelocks = 0;
+
+static uint64_t resumes = 0;
+static uint subsequent_resumes_level = 0;
+static uint64_t display_on_transitions = 0;
+static uint64_t display_off_transitions = 0;
+
+static uint64_t sysfs_write_errors = 0;
+static uint64_t sysfs_write_latency_us = 0;
+static uint64_t sysfs_write_latency_counts[G_N_ELEMENTS (sysfs_latency_buckets) + 1];
+
+static StatedMetricsWakelock *
+wakelock_lookup (const char *lock_name)
+{
+  uint i;
+
+  for (i = 0; i < n_wakelocks; i++) {
+    if (strcmp (wakelocks[i].name, lock_name) == 0)
+      return &wakelocks[i];
+  }
+
+  if (n_wakelocks == STATED_METRICS_MAX_WAKELOCKS)
+    return NULL;
+
+  wakelocks[n_wakelocks].name = g_intern_string (lock_name);
+
+  return &wakelocks[n_wakelocks++];
+}
+
+void
+metrics_wakelock_acquired (const char *lock_name)
+{
+  StatedMetricsWakelock *wakelock = wakelock_lookup (lock_name);
+
+  if (wakelock == NULL || wakelock->held_since != 0)
+    return;
+
+  wakelock->acquires++;
+  wakelock->held_since = MAX (time_get_monotonic (), 1);
+}
+
+void
+metrics_wakelock_released (const char *lock_name)
+{
+  StatedMetricsWakelock *wakelock = wakelock_lookup (lock_name);
+
+  if (wakelock == NULL || wakelock->held_since == 0)
+    return;
+
+  wakelock->held_ms += time_get_monotonic () - wakelock->held_since;
+  wakelock->held_since = 0;
+}
+
+void
+metrics_resume (uint subsequent_resumes)
+{
+  resumes++;
+  subsequent_resumes_level = subsequent_resumes;
+}
+
+void
+metrics_display_changed (gboolean on)
+{
+  if (on)
+    display_on_transitions++;
+  else
+    display_off_transitions++;
+}
+
+/**
+ * Accounts a sysfs write. Safe to call from any thread.
+ */
+void
+metrics_sysfs_write (int     result,
+                     int64_t latency_us)
+{
+  uint i;
+
+  for (i = 0; i < G_N_ELEMENTS (sysfs_latency_buckets); i++) {
+    if (latency_us <= sysfs_latency_buckets[i])
+      break;
+  }
+
+  __atomic_fetch_add (&sysfs_write_latency_us, (uint64_t) MAX (latency_us, 0), __ATOMIC_RELAXED);
+  __atomic_fetch_add (&sysfs_write_latency_counts[i], 1, __ATOMIC_RELAXED);
+
+  if (result < 0)
+    __atomic_fetch_add (&sysfs_write_errors, 1, __ATOMIC_RELAXED);
+}
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  char labels[128];
+  uint64_t now = time_get_monotonic ();
+  uint64_t held_ms;
+  uint64_t cumulative = 0;
+  uint i;
+
+  stats_append_type (out, "stated_wakelock_acquires_total", "counter", "Wakelock acquisitions");
+  for (i = 0; i < n_wakelocks; i++) {
+    g_snprintf (labels, sizeof labels, "lock=\"%s\"", wakelocks[i].name);
+    stats_append_value (out, "stated_wakelock_acquires_total", labels, wakelocks[i].acquires);
+  }
+
+  stats_append_type (out, "stated_wakelock_held_seconds_total", "counter", "Wakelock hold time");
+  for (i = 0; i < n_wakelocks; i++) {
+    held_ms = wakelocks[i].held_ms;
+    if (wakelocks[i].held_since != 0)
+      held_ms += now - wakelocks[i].held_since;
+
+    g_snprintf (labels, sizeof labels, "lock=\"%s\"", wakelocks[i].name);
+    stats_append_value (out, "stated_wakelock_held_seconds_total", labels, held_ms / 1000.0);
+  }
+
+  stats_append_type (out, "stated_resumes_total", "counter", NULL);
+  stats_append_value (out, "stated_resumes_total", NULL, resumes);
+  stats_append_type (out, "stated_subsequent_resumes", "gauge", "Resume loop damping level");
+  stats_append_value (out, "stated_subsequent_resumes", NULL, subsequent_resumes_level);
+
+  stats_append_type (out, "stated_display_transitions_total", "counter", NULL);
+  stats_append_value (out, "stated_display_transitions_total", "state=\"on\"",
+                      display_on_transitions);
+  stats_append_value (out, "stated_display_transitions_total", "state=\"off\"",
+                      display_off_transitions);
+
+  stats_append_type (out, "stated_sysfs_write_errors_total", "counter", NULL);
+  stats_append_value (out, "stated_sysfs_write_errors_total", NULL,
+                      __atomic_load_n (&sysfs_write_errors, __ATOMIC_RELAXED));
+
+  stats_append_type (out, "stated_sysfs_write_latency_seconds", "histogram", NULL);
+  for (i = 0; i < G_N_ELEMENTS (sysfs_write_latency_counts); i++) {
+    cumulative += __atomic_load_n (&sysfs_write_latency_counts[i], __ATOMIC_RELAXED);
+
+    if (i < G_N_ELEMENTS (sysfs_latency_buckets))
+      g_snprintf (labels, sizeof labels, "le=\"%g\"", sysfs_latency_buckets[i] / 1000000.0);
+    else
+      g_strlcpy (labels, "le=\"+Inf\"", sizeof labels);
+
+    stats_append_value (out, "stated_sysfs_write_latency_seconds_bucket", labels, cumulative);
+  }
+  stats_append_value (out, "stated_sysfs_write_latency_seconds_sum", NULL,
+                      __atomic_load_n (&sysfs_write_latency_us, __ATOMIC_RELAXED) / 1000000.0);
+  stats_append_value (out, "stated_sysfs_write_latency_seconds_count", NULL, cumulative);
+}
+
+/**
+ * Registers the core counters with the stats registry.
+ */
+void
+metrics_init (void)
+{
+  stats_register ("metrics", append_stats, NULL);
+}
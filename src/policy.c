@@ -0,0 +1,511 @@
+/* policy.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-policy"
+
+#define POLICY_GROUP "Policy"
+#define POLICY_PROFILE_PREFIX "Profile "
+#define POLICY_POWER_PREFIX "Power "
+
+#include <string.h>
+#include <glib-2.0/gio/gio.h>
+
+#include "cpuprofile.h"
+#include "policy.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * Declarative power policy. The policy file is a keyfile: the [Policy]
+ * group overrides the built-in defaults, and the first [Profile NAME]
+ * group matching the device overrides them further.
+ *
+ *   [Policy]
+ *   display_wait_time=10
+ *
+ *   [Profile pinephone]
+ *   Compatible=pine64,pinephone*
+ *   resume_max_ceiling=4
+ *
+ * Profiles match on the device tree compatible strings (Compatible=)
+ * or on the DMI product and board names (DMIProductName=, DMIBoardName=),
+ * all of them lists of glob patterns.
+ *
+ * Every power source has its own policy set, starting from its own
+ * built-in defaults: [Policy] and the profile apply to all of them,
+ * and [Power battery], [Power ac] and [Power low-battery] on top, to
+ * the one of that source only.
+ *
+ *   [Power ac]
+ *   display_wait_time=30
+ *   cpu_profile=performance
+ *
+ * The file is watched: when it changes, the policy is reloaded and
+ * swapped in one go. Held wakelocks are left alone, so timed ones keep
+ * their deadline; the new values apply from the next event on. A file
+ * that doesn't load keeps the previous policy in place.
+ */
+
+static const struct {
+  const char *key;
+  size_t offset;
+} policy_keys[] = {
+  { "display_wait_time", G_STRUCT_OFFSET (StatedDevicestatePolicy, display_wait_time) },
+  { "lid_display_wait_time", G_STRUCT_OFFSET (StatedDevicestatePolicy, lid_display_wait_time) },
+  { "powerkey_wait_time", G_STRUCT_OFFSET (StatedDevicestatePolicy, powerkey_wait_time) },
+  { "resume_lock_wait_time", G_STRUCT_OFFSET (StatedDevicestatePolicy, resume_lock_wait_time) },
+  { "resume_max_ceiling", G_STRUCT_OFFSET (StatedDevicestatePolicy, resume_max_ceiling) },
+  { "resume_loop_threshold", G_STRUCT_OFFSET (StatedDevicestatePolicy, resume_loop_threshold) },
+  { "autosleep", G_STRUCT_OFFSET (StatedDevicestatePolicy, autosleep) },
+  { "cpu_profile", G_STRUCT_OFFSET (StatedDevicestatePolicy, cpu_profile) },
+  { "low_battery_threshold", G_STRUCT_OFFSET (StatedDevicestatePolicy, low_battery_threshold) },
+  { "idle_timeout", G_STRUCT_OFFSET (StatedDevicestatePolicy, idle_timeout) },
+};
+
+/* Group suffixes of the power sources, see StatedPowersourceState */
+static const char *policy_power_groups[STATED_POWERSOURCE_N] = {
+  [STATED_POWERSOURCE_BATTERY] = "battery",
+  [STATED_POWERSOURCE_AC] = "ac",
+  [STATED_POWERSOURCE_LOW_BATTERY] = "low-battery",
+};
+
+static const struct {
+  const char *key;
+  const char *path;
+} policy_match_keys[] = {
+  { "Compatible", "/proc/device-tree/compatible" },
+  { "DMIProductName", "/sys/class/dmi/id/product_name" },
+  { "DMIBoardName", "/sys/class/dmi/id/board_name" },
+};
+
+static char *policy_path = NULL;
+static GFileMonitor *policy_monitor = NULL;
+static StatedDevicestate *policy_devicestate = NULL;
+static StatedDevicestate *policy_shadow = NULL;
+static char *policy_shadow_overrides = NULL;
+static char *policy_profile = NULL;
+static uint policy_reloads = 0;
+static uint policy_reload_errors = 0;
+
+/**
+ * Sets a policy value from its string representation.
+ */
+gboolean
+policy_set_value (StatedDevicestatePolicy *policy,
+                  const char              *key,
+                  const char              *value,
+                  GError                  **error)
+{
+  StatedCpuProfile cpu_profile;
+  guint64 parsed;
+  char *end;
+  uint i;
+
+  for (i = 0; i < G_N_ELEMENTS (policy_keys); i++) {
+    if (strcmp (policy_keys[i].key, key) == 0)
+      break;
+  }
+
+  if (i == G_N_ELEMENTS (policy_keys)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Unknown policy key %s", key);
+    return FALSE;
+  }
+
+  /* CPU profiles go by name as well */
+  if (strcmp (key, "cpu_profile") == 0 && cpuprofile_from_string (value, &cpu_profile)) {
+    G_STRUCT_MEMBER (uint, policy, policy_keys[i].offset) = cpu_profile;
+    return TRUE;
+  }
+
+  parsed = g_ascii_strtoull (value, &end, 10);
+  if (end == value || *end != '\0' || parsed > G_MAXUINT) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Invalid value for %s: %s", key, value);
+    return FALSE;
+  }
+
+  if (strcmp (key, "resume_max_ceiling") == 0 && (parsed == 0 || parsed > G_MAXUINT8)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "resume_max_ceiling must be between 1 and %u", G_MAXUINT8);
+    return FALSE;
+  }
+
+  if (strcmp (key, "cpu_profile") == 0 && parsed >= STATED_CPU_PROFILE_N) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Unknown CPU profile %s", value);
+    return FALSE;
+  }
+
+  if ((strcmp (key, "autosleep") == 0 && parsed > 1) ||
+      (strcmp (key, "low_battery_threshold") == 0 && parsed > 100)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Invalid value for %s: %s", key, value);
+    return FALSE;
+  }
+
+  G_STRUCT_MEMBER (uint, policy, policy_keys[i].offset) = (uint) parsed;
+
+  return TRUE;
+}
+
+/**
+ * Parses a comma separated list of key=value overrides (e.g.
+ * "display_wait_time=5,resume_max_ceiling=4") into policy.
+ */
+gboolean
+policy_parse_overrides (StatedDevicestatePolicy *policy,
+                        const char              *str,
+                        GError                  **error)
+{
+  g_auto(GStrv) pairs = g_strsplit (str, ",", -1);
+  char *key, *value;
+  uint i;
+
+  for (i = 0; pairs[i] != NULL; i++) {
+    key = g_strstrip (pairs[i]);
+    if (*key == '\0')
+      continue;
+
+    value = strchr (key, '=');
+    if (value == NULL) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Missing value for %s", key);
+      return FALSE;
+    }
+    *value++ = '\0';
+
+    if (!policy_set_value (policy, g_strstrip (key), g_strstrip (value), error))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Gives shadow the policies of active with overrides (see
+ * policy_parse_overrides()) applied to the one of each power source.
+ */
+gboolean
+policy_apply_shadow (StatedDevicestate *shadow,
+                     StatedDevicestate *active,
+                     const char        *overrides,
+                     GError            **error)
+{
+  StatedDevicestatePolicy policies[STATED_POWERSOURCE_N];
+  uint i;
+
+  for (i = 0; i < STATED_POWERSOURCE_N; i++) {
+    policies[i] = *stated_devicestate_get_source_policy (active, i);
+    if (!policy_parse_overrides (&policies[i], overrides, error))
+      return FALSE;
+  }
+
+  stated_devicestate_set_policies (shadow, policies);
+
+  return TRUE;
+}
+
+static gboolean
+apply_group (GKeyFile                *keyfile,
+             const char              *group,
+             StatedDevicestatePolicy *policy,
+             GError                  **error)
+{
+  g_auto(GStrv) keys = g_key_file_get_keys (keyfile, group, NULL, NULL);
+  g_autofree char *value = NULL;
+  uint i, k;
+
+  for (i = 0; keys != NULL && keys[i] != NULL; i++) {
+    for (k = 0; k < G_N_ELEMENTS (policy_match_keys); k++) {
+      if (strcmp (policy_match_keys[k].key, keys[i]) == 0)
+        break;
+    }
+
+    /* Matches aren't values */
+    if (k < G_N_ELEMENTS (policy_match_keys))
+      continue;
+
+    g_clear_pointer (&value, g_free);
+    value = g_key_file_get_string (keyfile, group, keys[i], error);
+    if (value == NULL ||
+        !policy_set_value (policy, keys[i], g_strstrip (value), error)) {
+      g_prefix_error (error, "[%s] ", group);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * Returns whether any of the patterns matches any of the NUL
+ * separated strings in the file at path.
+ */
+static gboolean
+device_matches (const char *path,
+                char       **patterns)
+{
+  g_autofree char *contents = NULL;
+  const char *str;
+  gsize length;
+  uint i;
+
+  if (!g_file_get_contents (stated_path (path), &contents, &length, NULL))
+    return FALSE;
+
+  /* DMI attributes end with a newline, device tree ones with a NUL */
+  for (str = contents; str < contents + length; str += strlen (str) + 1) {
+    g_strchomp ((char *) str);
+
+    for (i = 0; patterns[i] != NULL; i++) {
+      if (g_pattern_match_simple (g_strstrip (patterns[i]), str))
+        return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static gboolean
+profile_matches (GKeyFile   *keyfile,
+                 const char *group)
+{
+  g_auto(GStrv) patterns = NULL;
+  uint i;
+
+  for (i = 0; i < G_N_ELEMENTS (policy_match_keys); i++) {
+    g_clear_pointer (&patterns, g_strfreev);
+    patterns = g_key_file_get_string_list (keyfile, group, policy_match_keys[i].key,
+                                           NULL, NULL);
+
+    if (patterns != NULL && device_matches (policy_match_keys[i].path, patterns))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+ * Loads the policy at path on top of the built-in defaults, filling
+ * policies with the set of every power source. If profile is not NULL,
+ * it's set to the name of the matching profile, or NULL.
+ */
+gboolean
+policy_load (const char              *path,
+             StatedDevicestatePolicy policies[STATED_POWERSOURCE_N],
+             char                    **profile,
+             GError                  **error)
+{
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_auto(GStrv) groups = NULL;
+  StatedDevicestatePolicy loaded[STATED_POWERSOURCE_N];
+  g_autofree char *power_group = NULL;
+  const char *matched = NULL;
+  uint i, source;
+
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, error))
+    return FALSE;
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+  for (i = 0; groups[i] != NULL; i++) {
+    if (g_str_has_prefix (groups[i], POLICY_PROFILE_PREFIX) &&
+        profile_matches (keyfile, groups[i])) {
+      matched = groups[i];
+      break;
+    }
+  }
+
+  for (source = 0; source < STATED_POWERSOURCE_N; source++) {
+    stated_devicestate_policy_init_for_source (&loaded[source], source);
+
+    if (g_key_file_has_group (keyfile, POLICY_GROUP) &&
+        !apply_group (keyfile, POLICY_GROUP, &loaded[source], error))
+      return FALSE;
+
+    if (matched != NULL && !apply_group (keyfile, matched, &loaded[source], error))
+      return FALSE;
+
+    g_clear_pointer (&power_group, g_free);
+    power_group = g_strconcat (POLICY_POWER_PREFIX, policy_power_groups[source], NULL);
+    if (g_key_file_has_group (keyfile, power_group) &&
+        !apply_group (keyfile, power_group, &loaded[source], error))
+      return FALSE;
+  }
+
+  memcpy (policies, loaded, sizeof loaded);
+  if (profile != NULL)
+    *profile = (matched != NULL) ? g_strdup (matched + strlen (POLICY_PROFILE_PREFIX)) : NULL;
+
+  return TRUE;
+}
+
+static void
+policy_reload (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *profile = NULL;
+  StatedDevicestatePolicy policies[STATED_POWERSOURCE_N];
+
+  if (!policy_load (policy_path, policies, &profile, &error)) {
+    /* A missing file at startup just means the defaults */
+    if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) || policy_reloads > 0) {
+      g_warning ("Unable to load %s, keeping the current policy: %s",
+                 policy_path, error->message);
+      policy_reload_errors++;
+    }
+    return;
+  }
+
+  stated_devicestate_set_policies (policy_devicestate, policies);
+  policy_reloads++;
+
+  if (policy_shadow != NULL &&
+      !policy_apply_shadow (policy_shadow, policy_devicestate, policy_shadow_overrides, &error))
+    g_warning ("Unable to update the shadow policy: %s", error->message);
+
+  g_free (policy_profile);
+  policy_profile = g_steal_pointer (&profile);
+
+  g_message ("Policy loaded from %s (profile: %s)", policy_path,
+             (policy_profile != NULL) ? policy_profile : "none");
+}
+
+static void
+on_policy_file_changed (GFileMonitor      *monitor,
+                        GFile             *file,
+                        GFile             *other_file,
+                        GFileMonitorEvent event_type,
+                        void              *data)
+{
+  if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+      event_type == G_FILE_MONITOR_EVENT_CREATED)
+    policy_reload ();
+}
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  const StatedDevicestatePolicy *policy = stated_devicestate_get_policy (policy_devicestate);
+  char labels[128];
+  uint i;
+
+  stats_append_type (out, "stated_policy_setting", "gauge", "Current power policy values");
+  for (i = 0; i < G_N_ELEMENTS (policy_keys); i++) {
+    g_snprintf (labels, sizeof labels, "key=\"%s\"", policy_keys[i].key);
+    stats_append_value (out, "stated_policy_setting", labels,
+                        G_STRUCT_MEMBER (uint, policy, policy_keys[i].offset));
+  }
+
+  g_snprintf (labels, sizeof labels, "source=\"%s\"",
+              policy_power_groups[stated_devicestate_get_power_source (policy_devicestate)]);
+  stats_append_type (out, "stated_policy_power_source", "gauge", "Power source whose policy is in use");
+  stats_append_value (out, "stated_policy_power_source", labels, 1);
+
+  g_snprintf (labels, sizeof labels, "profile=\"%s\"",
+              (policy_profile != NULL) ? policy_profile : "");
+  stats_append_type (out, "stated_policy_profile", "gauge", NULL);
+  stats_append_value (out, "stated_policy_profile", labels, 1);
+
+  stats_append_type (out, "stated_policy_reloads_total", "counter", NULL);
+  stats_append_value (out, "stated_policy_reloads_total", NULL, policy_reloads);
+  stats_append_type (out, "stated_policy_reload_errors_total", "counter", NULL);
+  stats_append_value (out, "stated_policy_reload_errors_total", NULL, policy_reload_errors);
+}
+
+/**
+ * Applies the policy at path to devicestate, and keeps doing so every
+ * time the file changes.
+ */
+void
+policy_watch (const char        *path,
+              StatedDevicestate *devicestate)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  policy_unwatch ();
+
+  policy_path = g_strdup (path);
+  policy_devicestate = g_object_ref (devicestate);
+
+  policy_reload ();
+
+  file = g_file_new_for_path (path);
+  policy_monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+  if (policy_monitor == NULL)
+    g_warning ("Unable to watch %s: %s", path, error->message);
+  else
+    g_signal_connect (policy_monitor, "changed",
+                      G_CALLBACK (on_policy_file_changed), NULL);
+
+  stats_register ("policy", append_stats, NULL);
+}
+
+/**
+ * Applies the watched policy with overrides to shadow (see
+ * policy_apply_shadow()), and keeps doing so every time it is
+ * reloaded.
+ */
+void
+policy_watch_shadow (StatedDevicestate *shadow,
+                     const char        *overrides)
+{
+  g_autoptr(GError) error = NULL;
+
+  g_return_if_fail (policy_devicestate != NULL);
+
+  g_set_object (&policy_shadow, shadow);
+  g_free (policy_shadow_overrides);
+  policy_shadow_overrides = g_strdup (overrides);
+
+  if (!policy_apply_shadow (policy_shadow, policy_devicestate, policy_shadow_overrides, &error))
+    g_warning ("Unable to update the shadow policy: %s", error->message);
+}
+
+void
+policy_unwatch (void)
+{
+  if (policy_devicestate == NULL)
+    return;
+
+  stats_unregister ("policy");
+
+  if (policy_monitor != NULL) {
+    g_file_monitor_cancel (policy_monitor);
+    g_clear_object (&policy_monitor);
+  }
+
+  g_clear_object (&policy_shadow);
+  g_clear_pointer (&policy_shadow_overrides, g_free);
+  g_clear_object (&policy_devicestate);
+  g_clear_pointer (&policy_path, g_free);
+  g_clear_pointer (&policy_profile, g_free);
+}
@@ -0,0 +1,442 @@
+/* powersource.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-powersource"
+
+#define POWERSOURCE_MAX_SUPPLIES 8
+
+/* Percentage points the battery has to recover to leave the low state */
+#define POWERSOURCE_LOW_HYSTERESIS 3
+
+#define POWERSOURCE_DEFAULT_LOW_THRESHOLD 15
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "powersource.h"
+#include "stats.h"
+#include "tracepoints.h"
+#include "uevent.h"
+#include "utils.h"
+
+/**
+ * StatedPowersource tells whether the device runs on a charger, on
+ * battery, or on a low battery, so that a different policy can be
+ * applied to each.
+ *
+ * The power supplies are read from sysfs once, and then followed
+ * through their uevents, whose POWER_SUPPLY_* fields carry everything
+ * needed: nothing is polled. Every transition is logged with its
+ * boottime, and the time spent on every source is exported, so that
+ * changes in drain can be matched with policy switches.
+ */
+
+static const char power_supply_dir[] = "/sys/class/power_supply";
+
+static const char *state_names[STATED_POWERSOURCE_N] = {
+  [STATED_POWERSOURCE_BATTERY] = "battery",
+  [STATED_POWERSOURCE_AC] = "ac",
+  [STATED_POWERSOURCE_LOW_BATTERY] = "low_battery",
+};
+
+typedef struct {
+  const char *name; /* interned, NULL for unused slots */
+  gboolean battery;
+  gboolean online;
+  int capacity;     /* -1 if unknown */
+} StatedPowersourceSupply;
+
+struct _StatedPowersource
+{
+  GObject parent_instance;
+
+  StatedPowersourceSupply supplies[POWERSOURCE_MAX_SUPPLIES];
+  uint low_threshold;
+  uint uevent_subscription_id;
+
+  StatedPowersourceState state;
+  uint64_t state_since; /* boottime, milliseconds */
+  uint64_t residency_ms[STATED_POWERSOURCE_N];
+  uint64_t transitions;
+};
+
+typedef enum {
+  STATED_POWERSOURCE_PROP_STATE = 1,
+  STATED_POWERSOURCE_PROP_LAST
+} StatedPowersourceProperty;
+
+static GParamSpec *props[STATED_POWERSOURCE_PROP_LAST] = { NULL, };
+
+G_DEFINE_TYPE (StatedPowersource, stated_powersource, G_TYPE_OBJECT)
+
+static StatedPowersourceSupply *
+supply_lookup (StatedPowersource *self,
+               const char        *name,
+               gboolean          create)
+{
+  const char *interned = g_intern_string (name);
+  StatedPowersourceSupply *free_slot = NULL;
+  uint i;
+
+  for (i = 0; i < POWERSOURCE_MAX_SUPPLIES; i++) {
+    if (self->supplies[i].name == interned)
+      return &self->supplies[i];
+    else if (self->supplies[i].name == NULL && free_slot == NULL)
+      free_slot = &self->supplies[i];
+  }
+
+  if (!create || free_slot == NULL)
+    return NULL;
+
+  free_slot->name = interned;
+  free_slot->battery = FALSE;
+  free_slot->online = FALSE;
+  free_slot->capacity = -1;
+
+  return free_slot;
+}
+
+/**
+ * Sets the supply's type from its POWER_SUPPLY_TYPE value. Only
+ * system batteries count, not the ones of e.g. a bluetooth mouse.
+ */
+static void
+supply_set_type (StatedPowersourceSupply *supply,
+                 const char              *type,
+                 const char              *scope)
+{
+  supply->battery = g_str_has_prefix (type, "Battery") &&
+                    (scope == NULL || !g_str_has_prefix (scope, "Device"));
+}
+
+static char *
+supply_read (const char *name,
+             const char *attribute)
+{
+  g_autofree char *path = NULL;
+  char *contents = NULL;
+
+  path = g_build_filename (stated_path (power_supply_dir), name, attribute, NULL);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return NULL;
+
+  return g_strchomp (contents);
+}
+
+static void
+supply_load (StatedPowersource *self,
+             const char        *name)
+{
+  g_autofree char *type = NULL, *scope = NULL, *online = NULL, *capacity = NULL;
+  StatedPowersourceSupply *supply;
+
+  type = supply_read (name, "type");
+  if (type == NULL)
+    return;
+
+  supply = supply_lookup (self, name, TRUE);
+  if (supply == NULL)
+    return;
+
+  scope = supply_read (name, "scope");
+  supply_set_type (supply, type, scope);
+
+  online = supply_read (name, "online");
+  supply->online = (online != NULL && atoi (online) > 0);
+
+  capacity = supply_read (name, "capacity");
+  supply->capacity = (capacity != NULL) ? atoi (capacity) : -1;
+}
+
+static void
+stated_powersource_load (StatedPowersource *self)
+{
+  const char *name;
+  GDir *dir;
+
+  memset (self->supplies, 0, sizeof self->supplies);
+
+  dir = g_dir_open (stated_path (power_supply_dir), 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    supply_load (self, name);
+
+  g_dir_close (dir);
+}
+
+static StatedPowersourceState
+stated_powersource_compute (StatedPowersource *self)
+{
+  StatedPowersourceSupply *battery = NULL;
+  uint i, threshold;
+
+  for (i = 0; i < POWERSOURCE_MAX_SUPPLIES; i++) {
+    if (self->supplies[i].name == NULL)
+      continue;
+
+    if (self->supplies[i].battery && battery == NULL)
+      battery = &self->supplies[i];
+    else if (!self->supplies[i].battery && self->supplies[i].online)
+      return STATED_POWERSOURCE_AC;
+  }
+
+  /* Nothing to run on but the mains */
+  if (battery == NULL)
+    return STATED_POWERSOURCE_AC;
+
+  threshold = self->low_threshold;
+  if (self->state == STATED_POWERSOURCE_LOW_BATTERY)
+    threshold += POWERSOURCE_LOW_HYSTERESIS;
+
+  if (battery->capacity >= 0 && (uint) battery->capacity <= threshold)
+    return STATED_POWERSOURCE_LOW_BATTERY;
+
+  return STATED_POWERSOURCE_BATTERY;
+}
+
+static void
+stated_powersource_update (StatedPowersource *self)
+{
+  StatedPowersourceState state = stated_powersource_compute (self);
+  uint64_t now;
+
+  if (state == self->state)
+    return;
+
+  now = time_get_boottime ();
+
+  g_message ("Power source: %s -> %s at %lu ms since boot (after %lu ms)",
+             state_names[self->state], state_names[state], now, now - self->state_since);
+  TRACE_POWER_SOURCE (state_names[self->state], state_names[state]);
+
+  self->residency_ms[self->state] += now - self->state_since;
+  self->state_since = now;
+  self->state = state;
+  self->transitions++;
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[STATED_POWERSOURCE_PROP_STATE]);
+}
+
+static void
+on_power_supply_uevent (const StatedUevent *event,
+                        StatedPowersource  *self)
+{
+  StatedPowersourceSupply *supply;
+  const char *name, *value;
+
+  /* Events were lost, start over */
+  if (event == NULL) {
+    stated_powersource_load (self);
+    stated_powersource_update (self);
+    return;
+  }
+
+  name = uevent_get (event, "POWER_SUPPLY_NAME");
+  if (name == NULL) {
+    name = strrchr (event->devpath, '/');
+    name = (name != NULL) ? name + 1 : event->devpath;
+  }
+
+  if (strcmp (event->action, "remove") == 0) {
+    supply = supply_lookup (self, name, FALSE);
+    if (supply != NULL)
+      supply->name = NULL;
+  } else if (supply_lookup (self, name, FALSE) == NULL) {
+    /* New supply: its uevent might lack the type, sysfs has it all */
+    supply_load (self, name);
+  } else {
+    supply = supply_lookup (self, name, FALSE);
+
+    value = uevent_get (event, "POWER_SUPPLY_TYPE");
+    if (value != NULL)
+      supply_set_type (supply, value, uevent_get (event, "POWER_SUPPLY_SCOPE"));
+
+    value = uevent_get (event, "POWER_SUPPLY_ONLINE");
+    if (value != NULL)
+      supply->online = atoi (value) > 0;
+
+    value = uevent_get (event, "POWER_SUPPLY_CAPACITY");
+    if (value != NULL)
+      supply->capacity = atoi (value);
+  }
+
+  stated_powersource_update (self);
+}
+
+static void
+append_stats (GString           *out,
+              StatedPowersource *self)
+{
+  uint64_t now = time_get_boottime ();
+  char labels[64];
+  uint i;
+
+  stats_append_type (out, "stated_power_source", "gauge", "Current power source");
+  for (i = 0; i < STATED_POWERSOURCE_N; i++) {
+    g_snprintf (labels, sizeof labels, "source=\"%s\"", state_names[i]);
+    stats_append_value (out, "stated_power_source", labels, self->state == i);
+  }
+
+  stats_append_type (out, "stated_power_source_seconds_total", "counter",
+                     "Time spent on every power source");
+  for (i = 0; i < STATED_POWERSOURCE_N; i++) {
+    g_snprintf (labels, sizeof labels, "source=\"%s\"", state_names[i]);
+    stats_append_value (out, "stated_power_source_seconds_total", labels,
+                        (self->residency_ms[i] +
+                         ((self->state == i) ? now - self->state_since : 0)) / 1000.0);
+  }
+
+  stats_append_type (out, "stated_power_source_transitions_total", "counter", NULL);
+  stats_append_value (out, "stated_power_source_transitions_total", NULL, self->transitions);
+
+  stats_append_type (out, "stated_power_source_since_seconds", "gauge",
+                     "Boottime of the last power source change");
+  stats_append_value (out, "stated_power_source_since_seconds", NULL, self->state_since / 1000.0);
+}
+
+static void
+stated_powersource_constructed (GObject *obj)
+{
+  StatedPowersource *self = STATED_POWERSOURCE (obj);
+
+  G_OBJECT_CLASS (stated_powersource_parent_class)->constructed (obj);
+
+  self->low_threshold = POWERSOURCE_DEFAULT_LOW_THRESHOLD;
+  self->state_since = time_get_boottime ();
+
+  stated_powersource_load (self);
+  self->state = stated_powersource_compute (self);
+
+  g_message ("Power source: %s", state_names[self->state]);
+
+  self->uevent_subscription_id = uevent_subscribe ("power_supply", NULL,
+                                                   (StatedUeventFunc) on_power_supply_uevent,
+                                                   self);
+
+  stats_register ("powersource", (StatedStatsProviderFunc) append_stats, self);
+}
+
+static void
+stated_powersource_dispose (GObject *obj)
+{
+  StatedPowersource *self = STATED_POWERSOURCE (obj);
+
+  if (self->uevent_subscription_id > 0) {
+    uevent_unsubscribe (self->uevent_subscription_id);
+    self->uevent_subscription_id = 0;
+    stats_unregister ("powersource");
+  }
+
+  G_OBJECT_CLASS (stated_powersource_parent_class)->dispose (obj);
+}
+
+static void
+stated_powersource_get_property (GObject    *obj,
+                                 uint       property_id,
+                                 GValue     *value,
+                                 GParamSpec *pspec)
+{
+  StatedPowersource *self = STATED_POWERSOURCE (obj);
+
+  switch ((StatedPowersourceProperty) property_id)
+    {
+    case STATED_POWERSOURCE_PROP_STATE:
+      g_value_set_uint (value, self->state);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, property_id, pspec);
+      break;
+    }
+
+}
+
+static void
+stated_powersource_class_init (StatedPowersourceClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = stated_powersource_constructed;
+  object_class->dispose      = stated_powersource_dispose;
+  object_class->get_property = stated_powersource_get_property;
+
+  props[STATED_POWERSOURCE_PROP_STATE] =
+    g_param_spec_uint ("state",
+                       "state",
+                       "The current power source",
+                       0,
+                       STATED_POWERSOURCE_N - 1,
+                       STATED_POWERSOURCE_BATTERY,
+                       G_PARAM_READABLE);
+
+  g_object_class_install_properties (object_class, STATED_POWERSOURCE_PROP_LAST, props);
+}
+
+static void
+stated_powersource_init (StatedPowersource *self)
+{
+}
+
+StatedPowersource *
+stated_powersource_new (void)
+{
+  return g_object_new (STATED_TYPE_POWERSOURCE, NULL);
+}
+
+StatedPowersourceState
+stated_powersource_get_state (StatedPowersource *self)
+{
+  g_return_val_if_fail (STATED_IS_POWERSOURCE (self), STATED_POWERSOURCE_BATTERY);
+
+  return self->state;
+}
+
+/**
+ * Sets the battery capacity, in percent, at or below which the battery
+ * is considered low.
+ */
+void
+stated_powersource_set_low_threshold (StatedPowersource *self,
+                                      uint              capacity)
+{
+  g_return_if_fail (STATED_IS_POWERSOURCE (self));
+
+  self->low_threshold = capacity;
+  stated_powersource_update (self);
+}
+
+const char *
+stated_powersource_state_to_string (StatedPowersourceState state)
+{
+  g_return_val_if_fail (state < STATED_POWERSOURCE_N, NULL);
+
+  return state_names[state];
+}
@@ -0,0 +1,56 @@
+/* powersource.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDPOWERSOURCE_H
+#define STATEDPOWERSOURCE_H
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  STATED_POWERSOURCE_BATTERY = 0,
+  STATED_POWERSOURCE_AC,          /* A charger is plugged in, or there's no battery */
+  STATED_POWERSOURCE_LOW_BATTERY,
+  STATED_POWERSOURCE_N
+} StatedPowersourceState;
+
+#define STATED_TYPE_POWERSOURCE stated_powersource_get_type ()
+G_DECLARE_FINAL_TYPE (StatedPowersource, stated_powersource, STATED, POWERSOURCE, GObject)
+
+StatedPowersource *stated_powersource_new (void);
+StatedPowersourceState stated_powersource_get_state (StatedPowersource *self);
+void stated_powersource_set_low_threshold (StatedPowersource *self,
+                                           uint              capacity);
+const char *stated_powersource_state_to_string (StatedPowersourceState state);
+
+G_END_DECLS
+
+#endif /* STATEDPOWERSOURCE_H */
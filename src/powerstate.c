@@ -0,0 +1,266 @@
+/* powerstate.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-powerstate"
+
+#include "powerstate.h"
+#include "stats.h"
+#include "tracepoints.h"
+#include "utils.h"
+
+/**
+ * The device power state machine.
+ *
+ * devicestate feeds it the events it reacts to (display changes,
+ * powerkey presses, resumes, the wakelocks being all released) and
+ * every transition is looked up in a table: events without an entry
+ * for the current state are ignored. Transitions are
+ * timestamped on the boot clock, which gives the residency of every
+ * state and the latency from screen-off to the first suspend.
+ *
+ * Suspend entries aren't observed directly: on resume, the time spent
+ * suspended is the boottime elapsed since the last transition minus
+ * the monotonic time elapsed in the same period, and the transition to
+ * Suspended is backdated accordingly.
+ */
+
+static const struct {
+  StatedPowerState from;
+  StatedPowerEvent event;
+  StatedPowerState to;
+} transition_table[] = {
+  { STATED_POWER_STATE_ACTIVE,             STATED_POWER_EVENT_DISPLAY_OFF,    STATED_POWER_STATE_SCREEN_OFF_GRACE },
+
+  { STATED_POWER_STATE_SCREEN_OFF_GRACE,   STATED_POWER_EVENT_DISPLAY_ON,     STATED_POWER_STATE_ACTIVE },
+  { STATED_POWER_STATE_SCREEN_OFF_GRACE,   STATED_POWER_EVENT_WAKELOCKS_IDLE, STATED_POWER_STATE_IDLE },
+  { STATED_POWER_STATE_SCREEN_OFF_GRACE,   STATED_POWER_EVENT_RESUME,         STATED_POWER_STATE_RESUMING },
+
+  { STATED_POWER_STATE_IDLE,               STATED_POWER_EVENT_DISPLAY_ON,     STATED_POWER_STATE_ACTIVE },
+  { STATED_POWER_STATE_IDLE,               STATED_POWER_EVENT_POWERKEY,       STATED_POWER_STATE_SCREEN_OFF_GRACE },
+  { STATED_POWER_STATE_IDLE,               STATED_POWER_EVENT_RESUME,         STATED_POWER_STATE_RESUMING },
+
+  { STATED_POWER_STATE_SUSPENDED,          STATED_POWER_EVENT_DISPLAY_ON,     STATED_POWER_STATE_ACTIVE },
+  { STATED_POWER_STATE_SUSPENDED,          STATED_POWER_EVENT_RESUME,         STATED_POWER_STATE_RESUMING },
+
+  { STATED_POWER_STATE_RESUMING,           STATED_POWER_EVENT_DISPLAY_ON,     STATED_POWER_STATE_ACTIVE },
+  { STATED_POWER_STATE_RESUMING,           STATED_POWER_EVENT_WAKELOCKS_IDLE, STATED_POWER_STATE_IDLE },
+  { STATED_POWER_STATE_RESUMING,           STATED_POWER_EVENT_RESUME,         STATED_POWER_STATE_RESUMING },
+  { STATED_POWER_STATE_RESUMING,           STATED_POWER_EVENT_RESUME_LOOP,    STATED_POWER_STATE_RESUME_LOOP_DAMPED },
+
+  { STATED_POWER_STATE_RESUME_LOOP_DAMPED, STATED_POWER_EVENT_DISPLAY_ON,     STATED_POWER_STATE_ACTIVE },
+  { STATED_POWER_STATE_RESUME_LOOP_DAMPED, STATED_POWER_EVENT_WAKELOCKS_IDLE, STATED_POWER_STATE_IDLE },
+  { STATED_POWER_STATE_RESUME_LOOP_DAMPED, STATED_POWER_EVENT_RESUME,         STATED_POWER_STATE_RESUMING },
+};
+
+static const char *state_names[] = {
+  [STATED_POWER_STATE_ACTIVE]             = "active",
+  [STATED_POWER_STATE_SCREEN_OFF_GRACE]   = "screen-off-grace",
+  [STATED_POWER_STATE_IDLE]               = "idle",
+  [STATED_POWER_STATE_SUSPENDED]          = "suspended",
+  [STATED_POWER_STATE_RESUMING]           = "resuming",
+  [STATED_POWER_STATE_RESUME_LOOP_DAMPED] = "resume-loop-damped",
+};
+
+static const char *event_names[] = {
+  [STATED_POWER_EVENT_DISPLAY_ON]     = "display-on",
+  [STATED_POWER_EVENT_DISPLAY_OFF]    = "display-off",
+  [STATED_POWER_EVENT_POWERKEY]       = "powerkey",
+  [STATED_POWER_EVENT_WAKELOCKS_IDLE] = "wakelocks-idle",
+  [STATED_POWER_EVENT_RESUME]         = "resume",
+  [STATED_POWER_EVENT_RESUME_LOOP]    = "resume-loop",
+};
+
+static StatedPowerState current_state = STATED_POWER_STATE_ACTIVE;
+static uint64_t state_since_boottime = 0;
+static uint64_t state_since_monotonic = 0;
+
+static uint64_t residency_ms[STATED_POWER_STATE_N];
+static uint64_t entries[STATED_POWER_STATE_N];
+static uint64_t transition_counts[STATED_POWER_STATE_N][STATED_POWER_STATE_N];
+
+/* Screen-off to first suspend */
+static gboolean screen_off_pending = FALSE;
+static uint64_t screen_off_boottime = 0;
+static uint64_t screen_off_to_suspend_last_ms = 0;
+static uint64_t screen_off_to_suspend_sum_ms = 0;
+static uint64_t screen_off_to_suspend_count = 0;
+
+const char *
+powerstate_state_to_string (StatedPowerState state)
+{
+  g_return_val_if_fail (state < STATED_POWER_STATE_N, NULL);
+
+  return state_names[state];
+}
+
+const char *
+powerstate_event_to_string (StatedPowerEvent event)
+{
+  g_return_val_if_fail (event < STATED_POWER_EVENT_N, NULL);
+
+  return event_names[event];
+}
+
+static void
+transition (StatedPowerState state,
+            uint64_t         boottime,
+            uint64_t         monotonic)
+{
+  g_debug ("%s -> %s (after %lu ms)", state_names[current_state], state_names[state],
+           boottime - state_since_boottime);
+  TRACE_POWER_STATE (state_names[current_state], state_names[state]);
+
+  residency_ms[current_state] += boottime - state_since_boottime;
+  transition_counts[current_state][state]++;
+  entries[state]++;
+
+  if (state == STATED_POWER_STATE_SUSPENDED && screen_off_pending) {
+    screen_off_to_suspend_last_ms = boottime - screen_off_boottime;
+    screen_off_to_suspend_sum_ms += screen_off_to_suspend_last_ms;
+    screen_off_to_suspend_count++;
+    screen_off_pending = FALSE;
+  }
+
+  current_state = state;
+  state_since_boottime = boottime;
+  state_since_monotonic = monotonic;
+}
+
+/**
+ * Feeds an event to the state machine.
+ */
+void
+powerstate_handle (StatedPowerEvent event)
+{
+  uint64_t boottime = time_get_boottime ();
+  uint64_t monotonic = time_get_monotonic ();
+  uint64_t awake_ms, suspended_ms;
+  uint i;
+
+  g_return_if_fail (event < STATED_POWER_EVENT_N);
+
+  if (state_since_boottime == 0)
+    powerstate_init ();
+
+  if (event == STATED_POWER_EVENT_RESUME) {
+    awake_ms = monotonic - state_since_monotonic;
+    suspended_ms = boottime - state_since_boottime;
+    suspended_ms = (suspended_ms > awake_ms) ? suspended_ms - awake_ms : 0;
+
+    if (suspended_ms > 0 && current_state != STATED_POWER_STATE_SUSPENDED)
+      transition (STATED_POWER_STATE_SUSPENDED, boottime - suspended_ms, monotonic);
+  }
+
+  if (event == STATED_POWER_EVENT_DISPLAY_OFF) {
+    screen_off_pending = TRUE;
+    screen_off_boottime = boottime;
+  } else if (event == STATED_POWER_EVENT_DISPLAY_ON) {
+    screen_off_pending = FALSE;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (transition_table); i++) {
+    if (transition_table[i].from == current_state && transition_table[i].event == event) {
+      transition (transition_table[i].to, boottime, monotonic);
+      return;
+    }
+  }
+
+  g_debug ("%s: ignored in %s", event_names[event], state_names[current_state]);
+}
+
+StatedPowerState
+powerstate_get_state (void)
+{
+  return current_state;
+}
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  char labels[128];
+  uint64_t residency;
+  uint i, k;
+
+  stats_append_type (out, "stated_power_state", "gauge", "Current device power state");
+  for (i = 0; i < STATED_POWER_STATE_N; i++) {
+    g_snprintf (labels, sizeof labels, "state=\"%s\"", state_names[i]);
+    stats_append_value (out, "stated_power_state", labels, i == current_state);
+  }
+
+  stats_append_type (out, "stated_power_state_residency_seconds_total", "counter", NULL);
+  for (i = 0; i < STATED_POWER_STATE_N; i++) {
+    residency = residency_ms[i];
+    if (i == current_state)
+      residency += time_get_boottime () - state_since_boottime;
+
+    g_snprintf (labels, sizeof labels, "state=\"%s\"", state_names[i]);
+    stats_append_value (out, "stated_power_state_residency_seconds_total", labels,
+                        residency / 1000.0);
+  }
+
+  stats_append_type (out, "stated_power_state_entries_total", "counter", NULL);
+  for (i = 0; i < STATED_POWER_STATE_N; i++) {
+    g_snprintf (labels, sizeof labels, "state=\"%s\"", state_names[i]);
+    stats_append_value (out, "stated_power_state_entries_total", labels, entries[i]);
+  }
+
+  stats_append_type (out, "stated_power_transitions_total", "counter", NULL);
+  for (i = 0; i < STATED_POWER_STATE_N; i++) {
+    for (k = 0; k < STATED_POWER_STATE_N; k++) {
+      if (transition_counts[i][k] == 0)
+        continue;
+
+      g_snprintf (labels, sizeof labels, "from=\"%s\",to=\"%s\"", state_names[i], state_names[k]);
+      stats_append_value (out, "stated_power_transitions_total", labels, transition_counts[i][k]);
+    }
+  }
+
+  stats_append_type (out, "stated_screen_off_to_suspend_seconds", "summary",
+                     "Time from screen-off to the first suspend");
+  stats_append_value (out, "stated_screen_off_to_suspend_seconds_sum", NULL,
+                      screen_off_to_suspend_sum_ms / 1000.0);
+  stats_append_value (out, "stated_screen_off_to_suspend_seconds_count", NULL,
+                      screen_off_to_suspend_count);
+  stats_append_type (out, "stated_screen_off_to_suspend_last_seconds", "gauge", NULL);
+  stats_append_value (out, "stated_screen_off_to_suspend_last_seconds", NULL,
+                      screen_off_to_suspend_last_ms / 1000.0);
+}
+
+/**
+ * Starts the state machine in the Active state.
+ */
+void
+powerstate_init (void)
+{
+  state_since_boottime = MAX (time_get_boottime (), 1);
+  state_since_monotonic = time_get_monotonic ();
+
+  stats_register ("powerstate", append_stats, NULL);
+}
@@ -0,0 +1,62 @@
+/* powerstate.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDPOWERSTATE_H
+#define STATEDPOWERSTATE_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+typedef enum {
+  STATED_POWER_STATE_ACTIVE = 0,         /* Display on */
+  STATED_POWER_STATE_SCREEN_OFF_GRACE,   /* Display off, wakelocks still held */
+  STATED_POWER_STATE_IDLE,               /* Nothing held, autosleep can kick in */
+  STATED_POWER_STATE_SUSPENDED,
+  STATED_POWER_STATE_RESUMING,           /* Holding the resume wakelock */
+  STATED_POWER_STATE_RESUME_LOOP_DAMPED, /* Same, for longer: a resume loop was detected */
+  STATED_POWER_STATE_N
+} StatedPowerState;
+
+typedef enum {
+  STATED_POWER_EVENT_DISPLAY_ON = 0,
+  STATED_POWER_EVENT_DISPLAY_OFF,
+  STATED_POWER_EVENT_POWERKEY,
+  STATED_POWER_EVENT_WAKELOCKS_IDLE,
+  STATED_POWER_EVENT_RESUME,
+  STATED_POWER_EVENT_RESUME_LOOP,
+  STATED_POWER_EVENT_N
+} StatedPowerEvent;
+
+void powerstate_init (void);
+void powerstate_handle (StatedPowerEvent event);
+StatedPowerState powerstate_get_state (void);
+const char *powerstate_state_to_string (StatedPowerState state);
+const char *powerstate_event_to_string (StatedPowerEvent event);
+
+#endif /* STATEDPOWERSTATE_H */
@@ -0,0 +1,164 @@
+/* sdnotify.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-sdnotify"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sdnotify.h"
+#include "utils.h"
+
+/**
+ * The systemd notification protocol (see sd_notify(3)), implemented
+ * in-tree to avoid depending on libsystemd for a datagram.
+ *
+ * Everything is a no-op when not started by systemd (NOTIFY_SOCKET
+ * unset).
+ */
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_addr_len = 0;
+static gboolean notify_checked = FALSE;
+
+static uint watchdog_source_id = 0;
+
+static gboolean
+notify_open (void)
+{
+  const char *socket_path;
+  size_t length;
+
+  if (notify_checked)
+    return notify_fd >= 0;
+
+  notify_checked = TRUE;
+
+  socket_path = g_getenv ("NOTIFY_SOCKET");
+  if (socket_path == NULL)
+    return FALSE;
+
+  length = strlen (socket_path);
+  if ((socket_path[0] != '/' && socket_path[0] != '@') ||
+      length < 2 || length >= sizeof notify_addr.sun_path) {
+    g_warning ("Unsupported NOTIFY_SOCKET: %s", socket_path);
+    return FALSE;
+  }
+
+  memset (&notify_addr, 0, sizeof notify_addr);
+  notify_addr.sun_family = AF_UNIX;
+  memcpy (notify_addr.sun_path, socket_path, length);
+
+  /* Abstract socket */
+  if (notify_addr.sun_path[0] == '@')
+    notify_addr.sun_path[0] = '\0';
+
+  notify_addr_len = G_STRUCT_OFFSET (struct sockaddr_un, sun_path) + length;
+
+  notify_fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (notify_fd < 0) {
+    g_warning ("Unable to create notify socket: %s", g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Sends state (e.g. "READY=1") to the service manager. Returns FALSE
+ * if there's none or if it couldn't be reached.
+ */
+gboolean
+sdnotify_send (const char *state)
+{
+  if (!notify_open ())
+    return FALSE;
+
+  if (sendto (notify_fd, state, strlen (state), MSG_NOSIGNAL,
+              (struct sockaddr *) &notify_addr, notify_addr_len) < 0) {
+    g_debug ("Unable to notify %s: %s", state, g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void
+sdnotify_ready (void)
+{
+  sdnotify_send ("READY=1");
+}
+
+static gboolean
+on_watchdog_keepalive (void *data)
+{
+  sdnotify_send ("WATCHDOG=1");
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Pings the service manager's watchdog at half its timeout, if it
+ * has been enabled for us (WatchdogSec=).
+ */
+void
+sdnotify_watchdog_start (void)
+{
+  const char *usec_str = g_getenv ("WATCHDOG_USEC");
+  const char *pid_str = g_getenv ("WATCHDOG_PID");
+  guint64 usec;
+
+  if (watchdog_source_id > 0 || usec_str == NULL)
+    return;
+
+  if (pid_str != NULL && g_ascii_strtoull (pid_str, NULL, 10) != (guint64) getpid ())
+    return;
+
+  usec = g_ascii_strtoull (usec_str, NULL, 10);
+  if (usec == 0)
+    return;
+
+  g_debug ("Enabling the watchdog keepalive every %lu ms", usec / 2000);
+
+  watchdog_source_id = time_timeout_add (MAX (usec / 2000, 1), on_watchdog_keepalive, NULL);
+}
+
+void
+sdnotify_watchdog_stop (void)
+{
+  if (watchdog_source_id > 0) {
+    time_source_remove (watchdog_source_id);
+    watchdog_source_id = 0;
+  }
+}
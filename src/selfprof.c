@@ -0,0 +1,313 @@
+/* selfprof.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-selfprof"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "selfprof.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * Self-profiling: what stated itself costs, in wakeups and CPU time.
+ *
+ * Every main loop callback is bracketed by selfprof_begin() and
+ * selfprof_end(), which account a dispatch and the thread CPU time it
+ * took to its source. Main loop iterations are counted by wrapping the
+ * poll function, and context switches are sampled with getrusage()
+ * across screen-off periods, where every wakeup matters the most.
+ *
+ * Only the main thread is profiled.
+ */
+
+typedef struct {
+  const char *source;
+  const char *detail;
+  uint64_t dispatches;
+  uint64_t screen_off_dispatches;
+  uint64_t cpu_ns;
+  uint64_t max_ns;
+} StatedSelfprofSource;
+
+static StatedSelfprofSource sources[STATED_SELFPROF_MAX_SOURCES];
+static uint n_sources = 0;
+
+static GPollFunc default_poll = NULL;
+static uint64_t start_boottime = 0;
+static uint64_t iterations = 0;
+static uint64_t wakeups = 0;
+
+/* Screen-off periods */
+static gboolean screen_off = FALSE;
+static uint64_t screen_off_start = 0;
+static uint64_t screen_off_start_wakeups = 0;
+static long screen_off_start_csw = 0;
+static uint screen_off_periods = 0;
+static uint64_t screen_off_ms = 0;
+static uint64_t screen_off_wakeups = 0;
+static uint64_t screen_off_csw = 0;
+
+static uint64_t
+get_thread_cpu_ns (void)
+{
+  struct timespec tspec;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &tspec);
+
+  return (uint64_t)tspec.tv_sec * 1000000000 + tspec.tv_nsec;
+}
+
+static long
+get_context_switches (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) < 0)
+    return 0;
+
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static int
+profiled_poll (GPollFD *ufds,
+               uint    nfds,
+               int     timeout)
+{
+  iterations++;
+
+  /* Non-blocking polls don't wake anything up */
+  if (timeout != 0)
+    wakeups++;
+
+  return default_poll (ufds, nfds, timeout);
+}
+
+static StatedSelfprofSource *
+lookup_source (const char *source,
+               const char *detail)
+{
+  uint i;
+
+  for (i = 0; i < n_sources; i++) {
+    if (strcmp (sources[i].source, source) == 0 &&
+        g_strcmp0 (sources[i].detail, detail) == 0)
+      return &sources[i];
+  }
+
+  if (n_sources == STATED_SELFPROF_MAX_SOURCES)
+    return NULL;
+
+  sources[n_sources].source = g_intern_string (source);
+  sources[n_sources].detail = g_intern_string (detail);
+
+  return &sources[n_sources++];
+}
+
+/**
+ * To be called at the start of a main loop callback, the returned
+ * value must be passed to selfprof_end().
+ */
+uint64_t
+selfprof_begin (void)
+{
+  return get_thread_cpu_ns ();
+}
+
+/**
+ * To be called at the end of a main loop callback. detail, if not
+ * NULL, further distinguishes the source (e.g. the wakelock a timeout
+ * belongs to).
+ */
+void
+selfprof_end (const char *source,
+              const char *detail,
+              uint64_t   start)
+{
+  StatedSelfprofSource *entry = lookup_source (source, detail);
+  uint64_t elapsed = get_thread_cpu_ns () - start;
+
+  if (entry == NULL)
+    return;
+
+  entry->dispatches++;
+  entry->cpu_ns += elapsed;
+  entry->max_ns = MAX (entry->max_ns, elapsed);
+
+  if (screen_off)
+    entry->screen_off_dispatches++;
+}
+
+void
+selfprof_screen_off_begin (void)
+{
+  if (screen_off)
+    return;
+
+  screen_off = TRUE;
+  screen_off_start = time_get_boottime ();
+  screen_off_start_wakeups = wakeups;
+  screen_off_start_csw = get_context_switches ();
+}
+
+void
+selfprof_screen_off_end (void)
+{
+  uint64_t period_wakeups;
+  long period_csw;
+
+  if (!screen_off)
+    return;
+
+  screen_off = FALSE;
+  period_wakeups = wakeups - screen_off_start_wakeups;
+  period_csw = get_context_switches () - screen_off_start_csw;
+
+  screen_off_periods++;
+  screen_off_ms += time_get_boottime () - screen_off_start;
+  screen_off_wakeups += period_wakeups;
+  screen_off_csw += MAX (period_csw, 0);
+
+  g_debug ("Screen off for %lu ms: %lu wakeups, %ld context switches",
+           time_get_boottime () - screen_off_start, period_wakeups, period_csw);
+}
+
+static int
+compare_sources (const void *a,
+                 const void *b)
+{
+  const StatedSelfprofSource *source_a = *(StatedSelfprofSource **) a;
+  const StatedSelfprofSource *source_b = *(StatedSelfprofSource **) b;
+
+  return (source_a->dispatches < source_b->dispatches) -
+         (source_a->dispatches > source_b->dispatches);
+}
+
+/**
+ * Appends a powertop-style breakdown of what stated costs, busiest
+ * sources first.
+ */
+void
+selfprof_format (GString *out)
+{
+  StatedSelfprofSource *sorted[STATED_SELFPROF_MAX_SOURCES];
+  double minutes = MAX (time_get_boottime () - start_boottime, 1) / 60000.0;
+  uint i;
+
+  g_string_append_printf (out, "Main loop: %lu iterations, %lu wakeups (%.2f/min)\n",
+                          iterations, wakeups, wakeups / minutes);
+  g_string_append_printf (out, "Screen off: %u periods, %.0f s, %lu wakeups (%.2f/min), "
+                          "%lu context switches\n\n",
+                          screen_off_periods, screen_off_ms / 1000.0, screen_off_wakeups,
+                          screen_off_ms ? screen_off_wakeups / (screen_off_ms / 60000.0) : 0,
+                          screen_off_csw);
+
+  for (i = 0; i < n_sources; i++)
+    sorted[i] = &sources[i];
+  qsort (sorted, n_sources, sizeof *sorted, compare_sources);
+
+  g_string_append (out, "Dispatches  Events/min  Screen off   CPU ms  Max us  Source\n");
+  for (i = 0; i < n_sources; i++) {
+    g_string_append_printf (out, "%10lu  %10.2f  %10lu  %7.2f  %6lu  %s%s%s\n",
+                            sorted[i]->dispatches, sorted[i]->dispatches / minutes,
+                            sorted[i]->screen_off_dispatches,
+                            sorted[i]->cpu_ns / 1000000.0, sorted[i]->max_ns / 1000,
+                            sorted[i]->source,
+                            (sorted[i]->detail != NULL) ? " " : "",
+                            (sorted[i]->detail != NULL) ? sorted[i]->detail : "");
+  }
+}
+
+gboolean
+selfprof_dump (const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GString) out = g_string_new (NULL);
+
+  selfprof_format (out);
+
+  if (!g_file_set_contents (path, out->str, out->len, &error)) {
+    g_warning ("Unable to dump self-profile: %s", error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  char labels[128];
+  uint i;
+
+  stats_append_type (out, "stated_main_loop_iterations_total", "counter", NULL);
+  stats_append_value (out, "stated_main_loop_iterations_total", NULL, iterations);
+  stats_append_type (out, "stated_main_loop_wakeups_total", "counter", NULL);
+  stats_append_value (out, "stated_main_loop_wakeups_total", NULL, wakeups);
+  stats_append_type (out, "stated_screen_off_wakeups_total", "counter", NULL);
+  stats_append_value (out, "stated_screen_off_wakeups_total", NULL, screen_off_wakeups);
+  stats_append_type (out, "stated_screen_off_context_switches_total", "counter", NULL);
+  stats_append_value (out, "stated_screen_off_context_switches_total", NULL, screen_off_csw);
+
+  stats_append_type (out, "stated_dispatches_total", "counter", "Main loop dispatches per source");
+  for (i = 0; i < n_sources; i++) {
+    g_snprintf (labels, sizeof labels, "source=\"%s\",detail=\"%s\"", sources[i].source,
+                (sources[i].detail != NULL) ? sources[i].detail : "");
+    stats_append_value (out, "stated_dispatches_total", labels, sources[i].dispatches);
+  }
+
+  stats_append_type (out, "stated_dispatch_cpu_seconds_total", "counter", "CPU time per source");
+  for (i = 0; i < n_sources; i++) {
+    g_snprintf (labels, sizeof labels, "source=\"%s\",detail=\"%s\"", sources[i].source,
+                (sources[i].detail != NULL) ? sources[i].detail : "");
+    stats_append_value (out, "stated_dispatch_cpu_seconds_total", labels,
+                        sources[i].cpu_ns / 1000000000.0);
+  }
+}
+
+/**
+ * Starts profiling the default main context.
+ */
+void
+selfprof_init (void)
+{
+  if (default_poll != NULL)
+    return;
+
+  start_boottime = time_get_boottime ();
+
+  default_poll = g_main_context_get_poll_func (NULL);
+  g_main_context_set_poll_func (NULL, profiled_poll);
+
+  stats_register ("selfprof", append_stats, NULL);
+}
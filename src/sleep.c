@@ -30,17 +30,26 @@
 #define G_LOG_DOMAIN "stated-sleep"
 
 #include "sleep.h"
+#include "sysfs-worker.h"
 #include "utils.h"
+#include "selfprof.h"
 
 static const char autosleep_file[]   = "/sys/power/autosleep";
 
 /* -1: not checked, 0: not supported, 1: supported */
 static int autosleep_supported = -1;
 
+/* Source that re-enables autosleep after autosleep_pause() */
+static uint autosleep_pause_source_id = 0;
+
+/* Whether autosleep has been asked for, and whether the policy allows it */
+static gboolean autosleep_wanted = FALSE;
+static gboolean autosleep_allowed = TRUE;
+
 static void
 check_if_supported ()
 {
-  if (access (autosleep_file, F_OK) == 0) {
+  if (access (stated_path (autosleep_file), F_OK) == 0) {
     autosleep_supported = 1;
     g_debug ("Autosleep supported");
   } else {
@@ -49,13 +58,39 @@ check_if_supported ()
   }
 }
 
+static gboolean
+on_autosleep_pause_elapsed (void *data)
+{
+  uint64_t prof_start = selfprof_begin ();
+
+  g_debug ("Autosleep pause elapsed, re-enabling");
+  autosleep_pause_source_id = 0;
+  autosleep_enable ();
+
+  selfprof_end ("autosleep-pause", NULL, prof_start);
+
+  return G_SOURCE_REMOVE;
+}
+
 int
 autosleep_enable (void)
 {
   if (autosleep_supported < 0)
     check_if_supported ();
 
-  if (autosleep_supported && sysfs_write ("mem", autosleep_file) == 0) {
+  /* An explicit enable supersedes an eventual pending pause */
+  if (autosleep_pause_source_id > 0) {
+    time_source_remove (autosleep_pause_source_id);
+    autosleep_pause_source_id = 0;
+  }
+
+  autosleep_wanted = TRUE;
+  if (!autosleep_allowed) {
+    g_debug ("Autosleep not allowed by the current policy, not enabling");
+    return 0;
+  }
+
+  if (autosleep_supported && sysfs_write_queued ("mem", stated_path (autosleep_file), NULL) == 0) {
     g_debug ("Autosleep enabled!");
     return 0;
   } else {
@@ -70,7 +105,9 @@ autosleep_disable (void)
   if (autosleep_supported < 0)
     check_if_supported ();
 
-  if (autosleep_supported && sysfs_write ("off", autosleep_file) == 0) {
+  autosleep_wanted = FALSE;
+
+  if (autosleep_supported && sysfs_write_queued ("off", stated_path (autosleep_file), NULL) == 0) {
     g_debug ("Autosleep disabled!");
     return 0;
   } else {
@@ -78,3 +115,61 @@ autosleep_disable (void)
     return -1;
   }
 }
+
+/**
+ * Temporarily disables autosleep, re-enabling it after the given
+ * amount of seconds. Calling this while a pause is pending extends it.
+ */
+int
+autosleep_pause (uint seconds)
+{
+  if (autosleep_pause_source_id > 0) {
+    time_source_remove (autosleep_pause_source_id);
+  } else if (autosleep_disable () < 0) {
+    return -1;
+  }
+
+  g_warning ("Autosleep paused for %u secs", seconds);
+  autosleep_pause_source_id = time_timeout_add_seconds (seconds,
+                                                        G_SOURCE_FUNC (on_autosleep_pause_elapsed),
+                                                        NULL);
+
+  return 0;
+}
+
+/**
+ * Allows or forbids autosleep altogether. While forbidden, enabling
+ * autosleep is remembered but not acted upon until it's allowed again.
+ */
+void
+autosleep_set_allowed (gboolean allowed)
+{
+  gboolean wanted = autosleep_wanted;
+
+  if (allowed == autosleep_allowed)
+    return;
+
+  g_message ("Autosleep %s by the current policy", allowed ? "allowed" : "forbidden");
+
+  if (allowed) {
+    autosleep_allowed = TRUE;
+    if (wanted && autosleep_pause_source_id == 0)
+      autosleep_enable ();
+  } else {
+    if (wanted && autosleep_pause_source_id == 0)
+      autosleep_disable ();
+    autosleep_wanted = wanted;
+    autosleep_allowed = FALSE;
+  }
+}
+
+/**
+ * Returns whether autosleep is in effect: asked for, allowed by the
+ * policy, and not paused.
+ */
+gboolean
+autosleep_is_enabled (void)
+{
+  return autosleep_supported > 0 && autosleep_wanted && autosleep_allowed &&
+         autosleep_pause_source_id == 0;
+}
@@ -36,5 +36,8 @@
 
 int autosleep_enable (void);
 int autosleep_disable (void);
+int autosleep_pause (uint seconds);
+void autosleep_set_allowed (gboolean allowed);
+gboolean autosleep_is_enabled (void);
 
 #endif /* STATEDSLEEP_H */
@@ -0,0 +1,445 @@
+/* sleephooks.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-sleephooks"
+
+/* Held while a batch of hooks runs */
+#define SLEEP_HOOKS_WAKELOCK "stated_sleep_hooks"
+
+/* Hooks still running after this are killed, in seconds */
+#define SLEEP_HOOK_DEADLINE 10
+
+/* Hooks slower than this are logged, in milliseconds */
+#define SLEEP_HOOK_SLOW_THRESHOLD 1000
+
+#define SLEEP_HOOKS_MAX_STATS 32
+
+#include <string.h>
+#include <glib-2.0/gio/gio.h>
+
+#include "sleephooks.h"
+#include "wakelocks.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * Runs the executables in the hooks directory around sleep, the
+ * same way systemd-sleep does with system-sleep/: every hook is
+ * called with "pre" or "post" and "suspend" as arguments.
+ *
+ * The hooks of a batch run in parallel, under a single wakelock
+ * released when the last of them exits. Each one has a deadline and
+ * is killed when it overruns it, which bounds the time the batch can
+ * keep the device awake. The wall time of every hook is exported, so
+ * that slow hooks can be told apart in the awake time accounting
+ * (where they all show up as stated_sleep_hooks).
+ */
+
+typedef struct {
+  const char *name;
+  GSubprocess *process;
+  int64_t start; /* monotonic, microseconds */
+  uint deadline_source_id;
+  gboolean killed;
+} StatedSleepHook;
+
+typedef struct {
+  const char *name;
+  StatedSleepHooksPhase phase;
+  uint64_t runs;
+  uint64_t failures;
+  uint64_t kills;
+  uint64_t last_us;
+  uint64_t total_us;
+} StatedSleepHookStats;
+
+static const char *phase_names[STATED_SLEEP_HOOKS_N] = {
+  [STATED_SLEEP_HOOKS_PRE] = "pre",
+  [STATED_SLEEP_HOOKS_POST] = "post",
+};
+
+static char *hooks_dir = NULL;
+static GCancellable *cancellable = NULL;
+
+/* Current batch */
+static GPtrArray *running = NULL;
+static uint pending = 0;
+static StatedSleepHooksPhase batch_phase;
+static int64_t batch_start = 0;
+
+/* Batch asked for while another one was running */
+static gboolean queued = FALSE;
+static StatedSleepHooksPhase queued_phase;
+
+static StatedSleepHookStats hook_stats[SLEEP_HOOKS_MAX_STATS];
+static uint n_hook_stats = 0;
+static uint64_t batches[STATED_SLEEP_HOOKS_N];
+static uint64_t batch_total_us[STATED_SLEEP_HOOKS_N];
+
+static StatedSleepHookStats *
+hook_stats_lookup (const char            *name,
+                   StatedSleepHooksPhase phase)
+{
+  uint i;
+
+  for (i = 0; i < n_hook_stats; i++) {
+    if (hook_stats[i].name == name && hook_stats[i].phase == phase)
+      return &hook_stats[i];
+  }
+
+  if (n_hook_stats == SLEEP_HOOKS_MAX_STATS)
+    return NULL;
+
+  hook_stats[n_hook_stats].name = name;
+  hook_stats[n_hook_stats].phase = phase;
+
+  return &hook_stats[n_hook_stats++];
+}
+
+static void
+hook_stats_labels (const StatedSleepHookStats *stats,
+                   char                       *labels,
+                   size_t                     labels_size)
+{
+  g_snprintf (labels, labels_size, "hook=\"%s\",phase=\"%s\"",
+              stats->name, phase_names[stats->phase]);
+}
+
+static void
+sleephooks_append_stats (GString *out,
+                         void    *data)
+{
+  char labels[128];
+  uint i;
+
+  stats_append_type (out, "stated_sleep_hook_batches_total", "counter",
+                     "Sleep hook batches run");
+  for (i = 0; i < STATED_SLEEP_HOOKS_N; i++) {
+    g_snprintf (labels, sizeof labels, "phase=\"%s\"", phase_names[i]);
+    stats_append_value (out, "stated_sleep_hook_batches_total", labels, batches[i]);
+  }
+
+  stats_append_type (out, "stated_sleep_hook_batch_seconds_total", "counter",
+                     "Wall time of the sleep hook batches");
+  for (i = 0; i < STATED_SLEEP_HOOKS_N; i++) {
+    g_snprintf (labels, sizeof labels, "phase=\"%s\"", phase_names[i]);
+    stats_append_value (out, "stated_sleep_hook_batch_seconds_total", labels,
+                        batch_total_us[i] / 1000000.0);
+  }
+
+  stats_append_type (out, "stated_sleep_hook_runs_total", "counter", NULL);
+  for (i = 0; i < n_hook_stats; i++) {
+    hook_stats_labels (&hook_stats[i], labels, sizeof labels);
+    stats_append_value (out, "stated_sleep_hook_runs_total", labels, hook_stats[i].runs);
+  }
+
+  stats_append_type (out, "stated_sleep_hook_failures_total", "counter",
+                     "Sleep hook runs that didn't exit successfully");
+  for (i = 0; i < n_hook_stats; i++) {
+    hook_stats_labels (&hook_stats[i], labels, sizeof labels);
+    stats_append_value (out, "stated_sleep_hook_failures_total", labels, hook_stats[i].failures);
+  }
+
+  stats_append_type (out, "stated_sleep_hook_kills_total", "counter",
+                     "Sleep hook runs killed for overrunning their deadline");
+  for (i = 0; i < n_hook_stats; i++) {
+    hook_stats_labels (&hook_stats[i], labels, sizeof labels);
+    stats_append_value (out, "stated_sleep_hook_kills_total", labels, hook_stats[i].kills);
+  }
+
+  stats_append_type (out, "stated_sleep_hook_last_seconds", "gauge",
+                     "Wall time of the last run of every sleep hook");
+  for (i = 0; i < n_hook_stats; i++) {
+    hook_stats_labels (&hook_stats[i], labels, sizeof labels);
+    stats_append_value (out, "stated_sleep_hook_last_seconds", labels,
+                        hook_stats[i].last_us / 1000000.0);
+  }
+
+  stats_append_type (out, "stated_sleep_hook_seconds_total", "counter", NULL);
+  for (i = 0; i < n_hook_stats; i++) {
+    hook_stats_labels (&hook_stats[i], labels, sizeof labels);
+    stats_append_value (out, "stated_sleep_hook_seconds_total", labels,
+                        hook_stats[i].total_us / 1000000.0);
+  }
+}
+
+static void
+sleep_hook_free (StatedSleepHook *hook)
+{
+  if (hook->deadline_source_id > 0) {
+    time_source_remove (hook->deadline_source_id);
+    hook->deadline_source_id = 0;
+  }
+
+  g_clear_object (&hook->process);
+  g_free (hook);
+}
+
+static void
+batch_finish (void)
+{
+  uint64_t elapsed = g_get_monotonic_time () - batch_start;
+
+  g_debug ("%s sleep hooks done in %lu ms",
+           phase_names[batch_phase], elapsed / 1000);
+
+  batch_total_us[batch_phase] += elapsed;
+  g_ptr_array_set_size (running, 0);
+
+  /* The queued batch takes the wakelock over, so that there's no gap */
+  if (queued) {
+    queued = FALSE;
+    if (sleephooks_run (queued_phase))
+      return;
+  }
+
+  wakelock_unlock (SLEEP_HOOKS_WAKELOCK);
+}
+
+static gboolean
+on_hook_deadline (StatedSleepHook *hook)
+{
+  g_warning ("Sleep hook %s overran its %u secs deadline, killing it",
+             hook->name, SLEEP_HOOK_DEADLINE);
+
+  hook->deadline_source_id = 0;
+  hook->killed = TRUE;
+  g_subprocess_force_exit (hook->process);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_hook_exited (GObject      *source_object,
+                GAsyncResult *result,
+                void         *data)
+{
+  g_autoptr(GError) error = NULL;
+  StatedSleepHook *hook = data;
+  StatedSleepHookStats *stats;
+  uint64_t elapsed;
+  gboolean failed;
+
+  if (!g_subprocess_wait_finish (G_SUBPROCESS (source_object), result, &error) &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  elapsed = g_get_monotonic_time () - hook->start;
+  failed = !g_subprocess_get_if_exited (hook->process) ||
+           g_subprocess_get_exit_status (hook->process) != 0;
+
+  if (hook->deadline_source_id > 0) {
+    time_source_remove (hook->deadline_source_id);
+    hook->deadline_source_id = 0;
+  }
+
+  if (failed && !hook->killed)
+    g_warning ("Sleep hook %s failed", hook->name);
+  else if (elapsed / 1000 >= SLEEP_HOOK_SLOW_THRESHOLD)
+    g_message ("Sleep hook %s took %lu ms", hook->name, elapsed / 1000);
+
+  stats = hook_stats_lookup (hook->name, batch_phase);
+  if (stats != NULL) {
+    stats->runs++;
+    stats->failures += failed;
+    stats->kills += hook->killed;
+    stats->last_us = elapsed;
+    stats->total_us += elapsed;
+  }
+
+  if (--pending == 0)
+    batch_finish ();
+}
+
+static int
+compare_names (const void *a,
+               const void *b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+/**
+ * Returns the executables in the hooks directory, sorted by name.
+ */
+static GPtrArray *
+list_hooks (void)
+{
+  g_autoptr(GDir) dir = NULL;
+  GPtrArray *hooks;
+  const char *name;
+
+  hooks = g_ptr_array_new_with_free_func (g_free);
+
+  dir = g_dir_open (hooks_dir, 0, NULL);
+  if (dir == NULL)
+    return hooks;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *path = NULL;
+
+    if (name[0] == '.')
+      continue;
+
+    path = g_build_filename (hooks_dir, name, NULL);
+    if (!g_file_test (path, G_FILE_TEST_IS_EXECUTABLE) ||
+        g_file_test (path, G_FILE_TEST_IS_DIR))
+      continue;
+
+    g_ptr_array_add (hooks, g_steal_pointer (&path));
+  }
+
+  g_ptr_array_sort (hooks, compare_names);
+
+  return hooks;
+}
+
+/**
+ * Starts the hooks of the given phase, returns FALSE if there was
+ * nothing to run. If a batch is still running, the new one is queued
+ * after it; a pre and a post batch both waiting cancel each other.
+ */
+gboolean
+sleephooks_run (StatedSleepHooksPhase phase)
+{
+  g_autoptr(GPtrArray) paths = NULL;
+  uint i;
+
+  g_return_val_if_fail (phase < STATED_SLEEP_HOOKS_N, FALSE);
+
+  if (hooks_dir == NULL)
+    return FALSE;
+
+  if (pending > 0) {
+    if (queued && queued_phase != phase) {
+      g_debug ("Queued %s sleep hooks cancelled by the %s ones",
+               phase_names[queued_phase], phase_names[phase]);
+      queued = FALSE;
+    } else {
+      g_debug ("Sleep hooks already running, queueing the %s ones", phase_names[phase]);
+      queued = TRUE;
+      queued_phase = phase;
+    }
+
+    return TRUE;
+  }
+
+  paths = list_hooks ();
+  if (paths->len == 0)
+    return FALSE;
+
+  /* Taken before spawning anything, so that we can't suspend midway */
+  wakelock_lock (SLEEP_HOOKS_WAKELOCK);
+
+  batch_phase = phase;
+  batch_start = g_get_monotonic_time ();
+  batches[phase]++;
+
+  for (i = 0; i < paths->len; i++) {
+    const char *argv[] = { g_ptr_array_index (paths, i), phase_names[phase], "suspend", NULL };
+    g_autoptr(GError) error = NULL;
+    StatedSleepHook *hook;
+
+    hook = g_new0 (StatedSleepHook, 1);
+    hook->name = g_intern_string (strrchr (argv[0], '/') + 1);
+    hook->start = g_get_monotonic_time ();
+    hook->process = g_subprocess_newv (argv, G_SUBPROCESS_FLAGS_NONE, &error);
+
+    if (hook->process == NULL) {
+      g_warning ("Unable to run sleep hook %s: %s", hook->name, error->message);
+      sleep_hook_free (hook);
+      continue;
+    }
+
+    hook->deadline_source_id = time_timeout_add_seconds (SLEEP_HOOK_DEADLINE,
+                                                         G_SOURCE_FUNC (on_hook_deadline),
+                                                         hook);
+    g_subprocess_wait_async (hook->process, cancellable, on_hook_exited, hook);
+
+    g_ptr_array_add (running, hook);
+    pending++;
+  }
+
+  g_debug ("Started %u %s sleep hooks", pending, phase_names[phase]);
+
+  if (pending == 0)
+    batch_finish ();
+
+  return TRUE;
+}
+
+gboolean
+sleephooks_is_running (void)
+{
+  return pending > 0;
+}
+
+/**
+ * Sets the directory hooks are looked up in. It's listed every time
+ * hooks are run, so hooks can be added and removed at any time.
+ */
+void
+sleephooks_init (const char *dir)
+{
+  g_return_if_fail (hooks_dir == NULL);
+
+  hooks_dir = g_strdup (dir);
+  cancellable = g_cancellable_new ();
+  running = g_ptr_array_new_with_free_func ((GDestroyNotify) sleep_hook_free);
+
+  stats_register ("sleephooks", sleephooks_append_stats, NULL);
+}
+
+/**
+ * Kills the hooks still running.
+ */
+void
+sleephooks_cleanup (void)
+{
+  uint i;
+
+  if (hooks_dir == NULL)
+    return;
+
+  stats_unregister ("sleephooks");
+
+  g_cancellable_cancel (cancellable);
+  g_clear_object (&cancellable);
+
+  for (i = 0; i < running->len; i++)
+    g_subprocess_force_exit (((StatedSleepHook *) g_ptr_array_index (running, i))->process);
+
+  queued = FALSE;
+  if (pending > 0) {
+    pending = 0;
+    wakelock_unlock (SLEEP_HOOKS_WAKELOCK);
+  }
+
+  g_clear_pointer (&running, g_ptr_array_unref);
+  g_clear_pointer (&hooks_dir, g_free);
+}
@@ -32,6 +32,7 @@
 #define SLEEPTRACKER_WAKELOCK "stated_sleeptracker"
 
 #include "sleeptracker.h"
+#include "selfprof.h"
 
 /**
  * StatedSleeptracker allows to keep track of the sleep status and to
@@ -64,6 +65,29 @@ G_DEFINE_TYPE (StatedSleeptracker, stated_sleeptracker, G_TYPE_OBJECT)
 
 static void stated_sleeptracker_rearm_timer (StatedSleeptracker *self);
 
+/**
+ * Notifies a resume, emitting the "resume" signal with the boottime
+ * of the previous resume and the current one.
+ *
+ * This is called when the timerfd gets cancelled, but can be also
+ * used to inject resumes (e.g. in simulations).
+ */
+void
+stated_sleeptracker_notify_resume (StatedSleeptracker *self)
+{
+  uint64_t now;
+
+  g_return_if_fail (STATED_IS_SLEEPTRACKER (self));
+
+  now = time_get_boottime ();
+  g_debug ("Resume detected");
+  g_signal_emit (G_OBJECT (self), signals[SIGNAL_RESUME], 0,
+                 self->previous_boottime, now);
+
+  /* Update previous_boottime */
+  self->previous_boottime = now;
+}
+
 static gboolean
 on_timer_changed (GIOChannel *source,
                   GIOCondition  cond,
@@ -71,19 +95,13 @@ on_timer_changed (GIOChannel *source,
 {
   ssize_t cnt = 0;
   int8_t ret;
-  uint64_t now;
+  uint64_t prof_start = selfprof_begin ();
 
   ret = read (self->watched_fd, &cnt, sizeof cnt);
 
   if (ret == -1 && errno == ECANCELED) {
     /* FIXME: handle real time changes! */
-    now = time_get_boottime ();
-    g_debug ("Resume detected");
-    g_signal_emit (G_OBJECT (self), signals[SIGNAL_RESUME], 0,
-                   self->previous_boottime, now);
-
-    /* Update previous_boottime */
-    self->previous_boottime = now;
+    stated_sleeptracker_notify_resume (self);
   }
 
   stated_sleeptracker_rearm_timer (self);
@@ -91,6 +109,8 @@ on_timer_changed (GIOChannel *source,
 cleanup:
   wakelock_unlock (SLEEPTRACKER_WAKELOCK);
 
+  selfprof_end ("sleeptracker", NULL, prof_start);
+
   return G_SOURCE_CONTINUE;
 }
 
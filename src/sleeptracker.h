@@ -44,6 +44,7 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (StatedSleeptracker, stated_sleeptracker, STATED, SLEEPTRACKER, GObject)
 
 StatedSleeptracker *stated_sleeptracker_new (void);
+void stated_sleeptracker_notify_resume (StatedSleeptracker *self);
 
 G_END_DECLS
 
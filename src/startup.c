@@ -0,0 +1,241 @@
+/* startup.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-startup"
+
+/* Give up waiting for the system startup after this, in seconds */
+#define STARTUP_FINISHED_TIMEOUT 180
+
+#define SYSTEMD_BUS_NAME "org.freedesktop.systemd1"
+#define SYSTEMD_PATH "/org/freedesktop/systemd1"
+#define SYSTEMD_MANAGER_INTERFACE "org.freedesktop.systemd1.Manager"
+
+#include <glib-2.0/gio/gio.h>
+
+#include "startup.h"
+#include "sdnotify.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * Daemon startup: readiness notification and the system startup
+ * gate.
+ *
+ * Things that don't need to happen before the first suspend (e.g.
+ * autosleep) wait for the system to finish starting up, as reported by
+ * systemd's StartupFinished signal (or its FinishTimestampMonotonic
+ * property, when we're late). Without systemd on the system bus they
+ * happen right away.
+ */
+
+static uint64_t begin_monotonic = 0;
+static uint64_t ready_ms = 0;
+static uint64_t finished_boottime = 0;
+
+static StatedStartupFunc finished_func = NULL;
+static void *finished_data = NULL;
+static GDBusConnection *bus = NULL;
+static uint finished_subscription_id = 0;
+static uint finished_timeout_id = 0;
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  stats_append_type (out, "stated_startup_ready_seconds", "gauge",
+                     "Time from stated's start to readiness");
+  stats_append_value (out, "stated_startup_ready_seconds", NULL, ready_ms / 1000.0);
+  stats_append_type (out, "stated_startup_finished_boottime_seconds", "gauge",
+                     "Boot time when the system startup finished and autosleep was allowed");
+  stats_append_value (out, "stated_startup_finished_boottime_seconds", NULL,
+                      finished_boottime / 1000.0);
+}
+
+/**
+ * Marks the start of stated's initialization.
+ */
+void
+startup_begin (void)
+{
+  begin_monotonic = time_get_monotonic ();
+
+  stats_register ("startup", append_stats, NULL);
+}
+
+/**
+ * Marks the core as up: tells the service manager and starts pinging
+ * its watchdog.
+ */
+void
+startup_ready (void)
+{
+  ready_ms = time_get_monotonic () - begin_monotonic;
+  g_message ("Ready in %lu ms", ready_ms);
+
+  sdnotify_ready ();
+  sdnotify_watchdog_start ();
+}
+
+static void
+startup_finished (const char *reason)
+{
+  StatedStartupFunc func = finished_func;
+
+  if (func == NULL)
+    return;
+
+  finished_func = NULL;
+  finished_boottime = time_get_boottime ();
+
+  g_message ("System startup finished (%s) at %lu ms since boot", reason, finished_boottime);
+
+  if (finished_subscription_id > 0) {
+    g_dbus_connection_signal_unsubscribe (bus, finished_subscription_id);
+    finished_subscription_id = 0;
+
+    /* The system bus connection is shared: don't leave systemd sending
+     * its manager signals to it for the rest of our life */
+    g_dbus_connection_call (bus, SYSTEMD_BUS_NAME, SYSTEMD_PATH, SYSTEMD_MANAGER_INTERFACE,
+                            "Unsubscribe", NULL, NULL, G_DBUS_CALL_FLAGS_NONE, -1,
+                            NULL, NULL, NULL);
+  }
+
+  if (finished_timeout_id > 0) {
+    time_source_remove (finished_timeout_id);
+    finished_timeout_id = 0;
+  }
+
+  g_clear_object (&bus);
+
+  func (finished_data);
+}
+
+static void
+on_startup_finished (GDBusConnection *connection,
+                     const char      *sender_name,
+                     const char      *object_path,
+                     const char      *interface_name,
+                     const char      *signal_name,
+                     GVariant        *parameters,
+                     void            *data)
+{
+  startup_finished ("StartupFinished");
+}
+
+static gboolean
+on_startup_finished_timeout (void *data)
+{
+  finished_timeout_id = 0;
+  g_warning ("System startup not finished after %d seconds, going on", STARTUP_FINISHED_TIMEOUT);
+  startup_finished ("timeout");
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_finish_timestamp (GObject      *source_object,
+                     GAsyncResult *result,
+                     void         *data)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GVariant) value = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+  if (reply == NULL) {
+    g_debug ("Unable to query systemd: %s", error->message);
+    startup_finished ("no systemd");
+    return;
+  }
+
+  g_variant_get (reply, "(v)", &value);
+
+  /* Already done by the time we asked */
+  if (g_variant_get_uint64 (value) != 0)
+    startup_finished ("already finished");
+}
+
+static void
+on_bus_ready (GObject      *source_object,
+              GAsyncResult *result,
+              void         *data)
+{
+  g_autoptr(GError) error = NULL;
+
+  bus = g_bus_get_finish (result, &error);
+
+  /* Timed out in the meantime */
+  if (finished_func == NULL) {
+    g_clear_object (&bus);
+    return;
+  }
+
+  if (bus == NULL) {
+    g_debug ("Unable to connect to the system bus: %s", error->message);
+    startup_finished ("no system bus");
+    return;
+  }
+
+  /* Subscribe before asking, so that the signal can't be missed */
+  finished_subscription_id =
+    g_dbus_connection_signal_subscribe (bus, SYSTEMD_BUS_NAME, SYSTEMD_MANAGER_INTERFACE,
+                                        "StartupFinished", SYSTEMD_PATH, NULL,
+                                        G_DBUS_SIGNAL_FLAGS_NONE,
+                                        on_startup_finished, NULL, NULL);
+
+  /* Manager signals are only sent to subscribed clients */
+  g_dbus_connection_call (bus, SYSTEMD_BUS_NAME, SYSTEMD_PATH, SYSTEMD_MANAGER_INTERFACE,
+                          "Subscribe", NULL, NULL, G_DBUS_CALL_FLAGS_NONE, -1,
+                          NULL, NULL, NULL);
+
+  g_dbus_connection_call (bus, SYSTEMD_BUS_NAME, SYSTEMD_PATH,
+                          "org.freedesktop.DBus.Properties", "Get",
+                          g_variant_new ("(ss)", SYSTEMD_MANAGER_INTERFACE,
+                                         "FinishTimestampMonotonic"),
+                          G_VARIANT_TYPE ("(v)"), G_DBUS_CALL_FLAGS_NONE, -1,
+                          NULL, on_finish_timestamp, NULL);
+}
+
+/**
+ * Calls func once the system has finished starting up.
+ */
+void
+startup_wait_finished (StatedStartupFunc func,
+                       void              *data)
+{
+  g_return_if_fail (finished_func == NULL);
+
+  finished_func = func;
+  finished_data = data;
+
+  finished_timeout_id = time_timeout_add_seconds (STARTUP_FINISHED_TIMEOUT,
+                                                  on_startup_finished_timeout, NULL);
+
+  g_bus_get (G_BUS_TYPE_SYSTEM, NULL, on_bus_ready, NULL);
+}
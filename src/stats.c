@@ -0,0 +1,203 @@
+/* stats.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-stats"
+
+/* Initial size of the collection buffer, it only grows if needed */
+#define STATS_BUFFER_SIZE 4096
+
+/* Longest line formatted by the helpers, longer ones are truncated */
+#define STATS_LINE_MAX 512
+
+#include <string.h>
+
+#include "stats.h"
+
+/**
+ * A registry of statistics providers (suspend counters, battery
+ * drain...), collected together in the Prometheus text format and
+ * dumped on demand (SIGUSR1).
+ *
+ * The collection buffer is reused, and metrics are formatted on the
+ * stack, so collecting doesn't allocate once the buffer has grown to
+ * fit.
+ */
+
+typedef struct {
+  const char *name;
+  StatedStatsProviderFunc func;
+  void *data;
+} StatedStatsProvider;
+
+static StatedStatsProvider providers[STATED_STATS_MAX_PROVIDERS];
+static uint n_providers = 0;
+static GString *buffer = NULL;
+
+/**
+ * Registers a provider. Registering a name twice replaces the
+ * previous provider.
+ */
+void
+stats_register (const char              *name,
+                StatedStatsProviderFunc func,
+                void                    *data)
+{
+  uint i;
+
+  for (i = 0; i < n_providers; i++) {
+    if (strcmp (providers[i].name, name) == 0)
+      break;
+  }
+
+  if (i == STATED_STATS_MAX_PROVIDERS) {
+    g_warning ("Too many stats providers, ignoring %s", name);
+    return;
+  }
+
+  providers[i].name = g_intern_string (name);
+  providers[i].func = func;
+  providers[i].data = data;
+
+  if (i == n_providers)
+    n_providers++;
+}
+
+void
+stats_unregister (const char *name)
+{
+  uint i;
+
+  for (i = 0; i < n_providers; i++) {
+    if (strcmp (providers[i].name, name) == 0) {
+      providers[i] = providers[--n_providers];
+      return;
+    }
+  }
+}
+
+/**
+ * Collects every provider into out, replacing its contents.
+ */
+void
+stats_collect_into (GString *out)
+{
+  uint i;
+
+  g_string_truncate (out, 0);
+
+  for (i = 0; i < n_providers; i++)
+    providers[i].func (out, providers[i].data);
+}
+
+/**
+ * Collects every provider. The returned buffer is only valid until
+ * the next call.
+ */
+const GString *
+stats_collect (void)
+{
+  if (buffer == NULL)
+    buffer = g_string_sized_new (STATS_BUFFER_SIZE);
+
+  stats_collect_into (buffer);
+
+  return buffer;
+}
+
+gboolean
+stats_dump (const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  const GString *stats = stats_collect ();
+
+  if (!g_file_set_contents (path, stats->str, stats->len, &error)) {
+    g_warning ("Unable to dump stats: %s", error->message);
+    return FALSE;
+  }
+
+  g_message ("Stats dumped to %s", path);
+
+  return TRUE;
+}
+
+static void
+append_line (GString *out,
+             char    *line,
+             int     len)
+{
+  /* Keep truncated lines terminated */
+  if (len >= STATS_LINE_MAX) {
+    len = STATS_LINE_MAX - 1;
+    line[len - 1] = '\n';
+  }
+
+  g_string_append_len (out, line, len);
+}
+
+/**
+ * Appends the TYPE (and HELP, if not NULL) lines of a metric.
+ */
+void
+stats_append_type (GString    *out,
+                   const char *metric,
+                   const char *type,
+                   const char *help)
+{
+  char line[STATS_LINE_MAX];
+  int len;
+
+  if (help != NULL) {
+    len = g_snprintf (line, sizeof line, "# HELP %s %s\n", metric, help);
+    append_line (out, line, len);
+  }
+
+  len = g_snprintf (line, sizeof line, "# TYPE %s %s\n", metric, type);
+  append_line (out, line, len);
+}
+
+/**
+ * Appends a sample of a metric. labels, if not NULL, is the label
+ * set without braces (e.g. mode="suspended").
+ */
+void
+stats_append_value (GString    *out,
+                    const char *metric,
+                    const char *labels,
+                    double     value)
+{
+  char line[STATS_LINE_MAX];
+  int len;
+
+  if (labels != NULL)
+    len = g_snprintf (line, sizeof line, "%s{%s} %.15g\n", metric, labels, value);
+  else
+    len = g_snprintf (line, sizeof line, "%s %.15g\n", metric, value);
+
+  append_line (out, line, len);
+}
@@ -0,0 +1,60 @@
+/* stats.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDSTATS_H
+#define STATEDSTATS_H
+
+#include <glib-2.0/glib.h>
+
+#define STATED_STATS_MAX_PROVIDERS 32
+
+/**
+ * A stats provider appends its metrics, in the Prometheus text
+ * exposition format, to out.
+ */
+typedef void (*StatedStatsProviderFunc) (GString *out,
+                                         void    *data);
+
+void stats_register (const char              *name,
+                     StatedStatsProviderFunc func,
+                     void                    *data);
+void stats_unregister (const char *name);
+void stats_collect_into (GString *out);
+const GString *stats_collect (void);
+gboolean stats_dump (const char *path);
+void stats_append_type (GString    *out,
+                        const char *metric,
+                        const char *type,
+                        const char *help);
+void stats_append_value (GString    *out,
+                         const char *metric,
+                         const char *labels,
+                         double     value);
+
+#endif /* STATEDSTATS_H */
@@ -0,0 +1,380 @@
+/* suspendstats.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-suspendstats"
+
+/* Sampling interval while the display is off, in seconds */
+#define SUSPENDSTATS_POLL_INTERVAL 30
+
+/* Abort storm detection */
+#define SUSPENDSTATS_STORM_WINDOW (uint64_t)300000 /* 5 mins */
+#define SUSPENDSTATS_STORM_MIN_FAILS 10
+#define SUSPENDSTATS_HISTORY 16
+
+#include "suspendstats.h"
+#include "stats.h"
+#include "selfprof.h"
+
+/**
+ * StatedSuspendstats keeps an eye on the kernel suspend statistics
+ * exposed in /sys/power/suspend_stats, and notifies when an "abort storm"
+ * is happening, i.e. when a driver keeps aborting suspend and autosleep
+ * spins through failed attempts.
+ *
+ * Every attribute is kept open for the whole lifetime of the object
+ * and re-read with pread(), so that sampling doesn't allocate.
+ */
+
+static const char suspend_stats_dir[] = "/sys/power/suspend_stats";
+
+typedef enum {
+  SUSPENDSTATS_SUCCESS = 0,
+  SUSPENDSTATS_FAIL,
+  SUSPENDSTATS_FAILED_FREEZE,
+  SUSPENDSTATS_LAST_FAILED_DEV,
+  SUSPENDSTATS_LAST_FAILED_ERRNO,
+  SUSPENDSTATS_N_ATTRIBUTES
+} StatedSuspendstatsAttribute;
+
+static const char *suspend_stats_attributes[SUSPENDSTATS_N_ATTRIBUTES] = {
+  "success",
+  "fail",
+  "failed_freeze",
+  "last_failed_dev",
+  "last_failed_errno",
+};
+
+typedef struct {
+  uint64_t boottime;
+  uint64_t success;
+  uint64_t fail;
+} StatedSuspendstatsSample;
+
+struct _StatedSuspendstats
+{
+  GObject parent_instance;
+
+  int fds[SUSPENDSTATS_N_ATTRIBUTES];
+  uint poll_source_id;
+
+  uint64_t success;
+  uint64_t fail;
+  uint64_t failed_freeze;
+  int last_failed_errno;
+  char last_failed_dev[64];
+
+  /* Ring buffer of the latest samples, used for storm detection */
+  StatedSuspendstatsSample history[SUSPENDSTATS_HISTORY];
+  uint history_head;
+  uint history_len;
+};
+
+enum {
+  SIGNAL_ABORT_STORM,
+  N_SIGNALS
+};
+static uint signals[N_SIGNALS] = { 0 };
+
+G_DEFINE_TYPE (StatedSuspendstats, stated_suspendstats, G_TYPE_OBJECT)
+
+/**
+ * Reads the given attribute into buf, stripping the trailing newline.
+ *
+ * Returns the length of the read string, or -1 on failure.
+ */
+static ssize_t
+read_attribute (StatedSuspendstats          *self,
+                StatedSuspendstatsAttribute attribute,
+                char                        *buf,
+                size_t                      buf_size)
+{
+  ssize_t len;
+
+  if (self->fds[attribute] < 0)
+    return -1;
+
+  len = pread (self->fds[attribute], buf, buf_size - 1, 0);
+  if (len < 0) {
+    g_debug ("Unable to read %s: %s", suspend_stats_attributes[attribute],
+             g_strerror (errno));
+    return -1;
+  }
+
+  while (len > 0 && buf[len - 1] == '\n')
+    len--;
+  buf[len] = '\0';
+
+  return len;
+}
+
+static gboolean
+read_uint64 (StatedSuspendstats          *self,
+             StatedSuspendstatsAttribute attribute,
+             uint64_t                    *value)
+{
+  char buf[32];
+
+  if (read_attribute (self, attribute, buf, sizeof buf) <= 0)
+    return FALSE;
+
+  *value = g_ascii_strtoull (buf, NULL, 10);
+
+  return TRUE;
+}
+
+static gboolean
+on_poll_timeout (StatedSuspendstats *self)
+{
+  uint64_t prof_start = selfprof_begin ();
+
+  stated_suspendstats_sample (self);
+
+  selfprof_end ("suspendstats", NULL, prof_start);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Samples the suspend statistics and checks whether an abort storm
+ * is in progress. "abort-storm" is emitted for every sample that
+ * found new failures while the storm is ongoing.
+ */
+void
+stated_suspendstats_sample (StatedSuspendstats *self)
+{
+  StatedSuspendstatsSample *sample, *baseline = NULL;
+  uint64_t now, previous_fail, fails, successes;
+  char buf[32];
+  uint i;
+
+  g_return_if_fail (STATED_IS_SUSPENDSTATS (self));
+
+  now = time_get_boottime ();
+  previous_fail = self->fail;
+
+  if (!read_uint64 (self, SUSPENDSTATS_SUCCESS, &self->success) ||
+      !read_uint64 (self, SUSPENDSTATS_FAIL, &self->fail))
+    return;
+
+  read_uint64 (self, SUSPENDSTATS_FAILED_FREEZE, &self->failed_freeze);
+
+  if (read_attribute (self, SUSPENDSTATS_LAST_FAILED_ERRNO, buf, sizeof buf) > 0)
+    self->last_failed_errno = (int)g_ascii_strtoll (buf, NULL, 10);
+
+  if (read_attribute (self, SUSPENDSTATS_LAST_FAILED_DEV, self->last_failed_dev,
+                      sizeof self->last_failed_dev) < 0)
+    self->last_failed_dev[0] = '\0';
+
+  /* Find the oldest sample still inside the detection window */
+  for (i = 0; i < self->history_len; i++) {
+    sample = &self->history[(self->history_head + SUSPENDSTATS_HISTORY
+                             - self->history_len + i) % SUSPENDSTATS_HISTORY];
+
+    if (now - sample->boottime <= SUSPENDSTATS_STORM_WINDOW) {
+      baseline = sample;
+      break;
+    }
+  }
+
+  if (baseline != NULL) {
+    fails = self->fail - baseline->fail;
+    successes = self->success - baseline->success;
+
+    g_debug ("%lu failed and %lu successful suspends in the last %lu ms",
+             fails, successes, now - baseline->boottime);
+
+    if (fails >= SUSPENDSTATS_STORM_MIN_FAILS && fails > successes
+        && self->fail > previous_fail) {
+      g_warning ("Suspend abort storm detected: %lu failures, last failing "
+                 "device '%s' (errno %d)",
+                 fails, self->last_failed_dev, self->last_failed_errno);
+      g_signal_emit (G_OBJECT (self), signals[SIGNAL_ABORT_STORM], 0,
+                     (uint)fails, self->last_failed_dev, self->last_failed_errno);
+    }
+  }
+
+  /* Store the sample */
+  sample = &self->history[self->history_head];
+  sample->boottime = now;
+  sample->success = self->success;
+  sample->fail = self->fail;
+
+  self->history_head = (self->history_head + 1) % SUSPENDSTATS_HISTORY;
+  self->history_len = MIN (self->history_len + 1, SUSPENDSTATS_HISTORY);
+}
+
+/**
+ * Enables or disables the low-rate periodic sampling. This is meant
+ * to be enabled only while the display is off.
+ */
+void
+stated_suspendstats_set_polling (StatedSuspendstats *self,
+                                 gboolean           polling)
+{
+  g_return_if_fail (STATED_IS_SUSPENDSTATS (self));
+
+  if (polling && self->poll_source_id == 0) {
+    g_debug ("Starting periodic sampling");
+    self->poll_source_id = time_timeout_add_seconds (SUSPENDSTATS_POLL_INTERVAL,
+                                                     G_SOURCE_FUNC (on_poll_timeout),
+                                                     self);
+  } else if (!polling && self->poll_source_id > 0) {
+    g_debug ("Stopping periodic sampling");
+    time_source_remove (self->poll_source_id);
+    self->poll_source_id = 0;
+  }
+}
+
+void
+stated_suspendstats_get_counters (StatedSuspendstats *self,
+                                  uint64_t           *success,
+                                  uint64_t           *fail,
+                                  uint64_t           *failed_freeze)
+{
+  g_return_if_fail (STATED_IS_SUSPENDSTATS (self));
+
+  if (success)
+    *success = self->success;
+  if (fail)
+    *fail = self->fail;
+  if (failed_freeze)
+    *failed_freeze = self->failed_freeze;
+}
+
+const char *
+stated_suspendstats_get_last_failed_dev (StatedSuspendstats *self)
+{
+  g_return_val_if_fail (STATED_IS_SUSPENDSTATS (self), NULL);
+
+  return self->last_failed_dev;
+}
+
+static void
+append_stats (GString            *out,
+              StatedSuspendstats *self)
+{
+  stats_append_type (out, "stated_suspend_success_total", "counter", "Successful suspends");
+  stats_append_value (out, "stated_suspend_success_total", NULL, self->success);
+  stats_append_type (out, "stated_suspend_fail_total", "counter", "Failed suspends");
+  stats_append_value (out, "stated_suspend_fail_total", NULL, self->fail);
+  stats_append_type (out, "stated_suspend_failed_freeze_total", "counter",
+                     "Suspends failed while freezing tasks");
+  stats_append_value (out, "stated_suspend_failed_freeze_total", NULL, self->failed_freeze);
+}
+
+static void
+stated_suspendstats_constructed (GObject *obj)
+{
+  StatedSuspendstats *self = STATED_SUSPENDSTATS (obj);
+  char path[PATH_MAX];
+  int i;
+
+  G_OBJECT_CLASS (stated_suspendstats_parent_class)->constructed (obj);
+
+  for (i = 0; i < SUSPENDSTATS_N_ATTRIBUTES; i++) {
+    g_snprintf (path, sizeof path, "%s/%s", stated_path (suspend_stats_dir),
+                suspend_stats_attributes[i]);
+
+    self->fds[i] = open (path, O_RDONLY | O_CLOEXEC);
+    if (self->fds[i] < 0)
+      g_warning ("Unable to open %s: %s", path, g_strerror (errno));
+  }
+
+  stats_register ("suspendstats", (StatedStatsProviderFunc) append_stats, self);
+
+  /* Take the initial sample */
+  stated_suspendstats_sample (self);
+}
+
+static void
+stated_suspendstats_dispose (GObject *obj)
+{
+  StatedSuspendstats *self = STATED_SUSPENDSTATS (obj);
+  int i;
+
+  stated_suspendstats_set_polling (self, FALSE);
+  stats_unregister ("suspendstats");
+
+  for (i = 0; i < SUSPENDSTATS_N_ATTRIBUTES; i++) {
+    if (self->fds[i] >= 0) {
+      close (self->fds[i]);
+      self->fds[i] = -1;
+    }
+  }
+
+  G_OBJECT_CLASS (stated_suspendstats_parent_class)->dispose (obj);
+}
+
+static void
+stated_suspendstats_class_init (StatedSuspendstatsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed  = stated_suspendstats_constructed;
+  object_class->dispose      = stated_suspendstats_dispose;
+
+  signals[SIGNAL_ABORT_STORM] =
+  g_signal_new ("abort-storm",
+                G_TYPE_FROM_CLASS (klass),
+                G_SIGNAL_RUN_LAST,
+                0,
+                NULL,
+                NULL,
+                NULL,
+                G_TYPE_NONE,
+                3,
+                G_TYPE_UINT,
+                G_TYPE_STRING | G_SIGNAL_TYPE_STATIC_SCOPE,
+                G_TYPE_INT);
+}
+
+static void
+stated_suspendstats_init (StatedSuspendstats *self)
+{
+  int i;
+
+  for (i = 0; i < SUSPENDSTATS_N_ATTRIBUTES; i++)
+    self->fds[i] = -1;
+}
+
+StatedSuspendstats *
+stated_suspendstats_new (void)
+{
+  return g_object_new (STATED_TYPE_SUSPENDSTATS, NULL);
+}
+
+gboolean
+stated_suspendstats_check (void)
+{
+  if (access (stated_path (suspend_stats_dir), F_OK) == 0) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,58 @@
+/* suspendstats.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDSUSPENDSTATS_H
+#define STATEDSUSPENDSTATS_H
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-object.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "utils.h"
+
+G_BEGIN_DECLS
+
+#define STATED_TYPE_SUSPENDSTATS stated_suspendstats_get_type ()
+G_DECLARE_FINAL_TYPE (StatedSuspendstats, stated_suspendstats, STATED, SUSPENDSTATS, GObject)
+
+StatedSuspendstats *stated_suspendstats_new (void);
+gboolean stated_suspendstats_check (void);
+void stated_suspendstats_sample (StatedSuspendstats *self);
+void stated_suspendstats_set_polling (StatedSuspendstats *self,
+                                      gboolean            polling);
+void stated_suspendstats_get_counters (StatedSuspendstats *self,
+                                       uint64_t           *success,
+                                       uint64_t           *fail,
+                                       uint64_t           *failed_freeze);
+const char *stated_suspendstats_get_last_failed_dev (StatedSuspendstats *self);
+
+G_END_DECLS
+
+#endif /* STATEDSUSPENDSTATS_H */
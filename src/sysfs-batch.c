@@ -0,0 +1,335 @@
+/* sysfs-batch.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-sysfs-batch"
+
+#define SYSFS_BATCH_MAX_FILES 32
+#define SYSFS_BATCH_RING_SIZE 64
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stated-config.h"
+#include "sysfs-batch.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/**
+ * Batched sysfs writes.
+ *
+ * Every attribute is opened once and kept open. When io_uring is
+ * available, a whole batch of writes is submitted with a single
+ * syscall against registered fds, otherwise every entry is written
+ * with pwrite().
+ *
+ * Entries in a batch are carried out in order, one after the other,
+ * as wakelock writes depend on each other (e.g. taking a lock before
+ * dropping another one must not leave a window with none held). With
+ * io_uring, the writes of a batch are hard-linked: each one starts
+ * when the previous one completes, failed or not, just like with
+ * pwrite().
+ *
+ * This is not thread-safe: it's meant to be used by a single thread
+ * (the sysfs worker).
+ */
+
+typedef struct {
+  const char *sysfs_file;
+  int fd;
+  gboolean registered;
+} StatedSysfsBatchFile;
+
+static StatedSysfsBatchFile batch_files[SYSFS_BATCH_MAX_FILES];
+static uint n_batch_files = 0;
+
+static StatedSysfsBatchBackend batch_backend = SYSFS_BATCH_BACKEND_WRITE;
+static uint64_t batch_syscalls = 0;
+
+#ifdef HAVE_LIBURING
+static struct io_uring batch_ring;
+static gboolean batch_files_registered = FALSE;
+#endif
+
+/**
+ * Returns the index of the given file in batch_files, opening it
+ * if needed, or -errno on failure.
+ */
+static int
+lookup_file (const char *sysfs_file)
+{
+  StatedSysfsBatchFile *file;
+  uint i;
+  int fd;
+
+  for (i = 0; i < n_batch_files; i++) {
+    if (batch_files[i].sysfs_file == sysfs_file ||
+        strcmp (batch_files[i].sysfs_file, sysfs_file) == 0)
+      return i;
+  }
+
+  if (n_batch_files == SYSFS_BATCH_MAX_FILES)
+    return -ENFILE;
+
+  batch_syscalls++;
+  fd = open (sysfs_file, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  file = &batch_files[n_batch_files];
+  file->sysfs_file = sysfs_file;
+  file->fd = fd;
+  file->registered = FALSE;
+
+#ifdef HAVE_LIBURING
+  if (batch_files_registered) {
+    batch_syscalls++;
+    if (io_uring_register_files_update (&batch_ring, n_batch_files, &fd, 1) == 1)
+      file->registered = TRUE;
+    else
+      g_debug ("Unable to register %s, using a plain fd", sysfs_file);
+  }
+#endif
+
+  return n_batch_files++;
+}
+
+static int
+submit_write (StatedSysfsBatchEntry *entries,
+              uint                  n_entries)
+{
+  uint i;
+  int idx, failed = 0;
+
+  for (i = 0; i < n_entries; i++) {
+    idx = lookup_file (entries[i].sysfs_file);
+
+    if (idx < 0) {
+      entries[i].result = idx;
+    } else {
+      batch_syscalls++;
+      if (pwrite (batch_files[idx].fd, entries[i].content,
+                  strlen (entries[i].content), 0) < 0)
+        entries[i].result = -errno;
+      else
+        entries[i].result = 0;
+    }
+
+    if (entries[i].result < 0)
+      failed++;
+  }
+
+  return failed;
+}
+
+#ifdef HAVE_LIBURING
+static int
+submit_io_uring_chunk (StatedSysfsBatchEntry *entries,
+                       uint                  n_entries)
+{
+  StatedSysfsBatchEntry *entry;
+  struct io_uring_sqe *sqe, *previous = NULL;
+  struct io_uring_cqe *cqe;
+  uint i, submitted = 0;
+  int idx, ret, failed = 0;
+
+  for (i = 0; i < n_entries; i++) {
+    entry = &entries[i];
+
+    idx = lookup_file (entry->sysfs_file);
+    if (idx < 0) {
+      entry->result = idx;
+      failed++;
+      continue;
+    }
+
+    sqe = io_uring_get_sqe (&batch_ring);
+    if (batch_files[idx].registered) {
+      io_uring_prep_write (sqe, idx, entry->content, strlen (entry->content), 0);
+      sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+      io_uring_prep_write (sqe, batch_files[idx].fd, entry->content,
+                           strlen (entry->content), 0);
+    }
+    io_uring_sqe_set_data (sqe, entry);
+    submitted++;
+
+    /* Keep the order, without a failure cancelling the rest */
+    if (previous != NULL)
+      previous->flags |= IOSQE_IO_HARDLINK;
+    previous = sqe;
+  }
+
+  if (submitted == 0)
+    return failed;
+
+  batch_syscalls++;
+  ret = io_uring_submit_and_wait (&batch_ring, submitted);
+  if (ret < 0) {
+    g_warning ("Unable to submit batch: %s", g_strerror (-ret));
+    return -1;
+  }
+
+  for (i = 0; i < submitted; i++) {
+    if (io_uring_wait_cqe (&batch_ring, &cqe) < 0)
+      break;
+
+    entry = io_uring_cqe_get_data (cqe);
+    entry->result = (cqe->res < 0) ? cqe->res : 0;
+    if (entry->result < 0)
+      failed++;
+
+    io_uring_cqe_seen (&batch_ring, cqe);
+  }
+
+  return failed;
+}
+
+static int
+submit_io_uring (StatedSysfsBatchEntry *entries,
+                 uint                  n_entries)
+{
+  uint offset, chunk;
+  int ret, failed = 0;
+
+  for (offset = 0; offset < n_entries; offset += chunk) {
+    chunk = MIN (n_entries - offset, SYSFS_BATCH_RING_SIZE);
+
+    ret = submit_io_uring_chunk (entries + offset, chunk);
+    if (ret < 0) {
+      /* The ring is not usable, fall back to plain writes for good */
+      g_warning ("Falling back to plain writes");
+      batch_backend = SYSFS_BATCH_BACKEND_WRITE;
+      return failed + submit_write (entries + offset, n_entries - offset);
+    }
+
+    failed += ret;
+  }
+
+  return failed;
+}
+#endif
+
+/**
+ * Sets up batched writes, using io_uring if requested and available.
+ *
+ * Returns TRUE if io_uring is going to be used.
+ */
+gboolean
+sysfs_batch_init (gboolean use_io_uring)
+{
+#ifdef HAVE_LIBURING
+  int fds[SYSFS_BATCH_MAX_FILES];
+  int ret, i;
+
+  if (!use_io_uring || batch_backend == SYSFS_BATCH_BACKEND_IO_URING)
+    return batch_backend == SYSFS_BATCH_BACKEND_IO_URING;
+
+  ret = io_uring_queue_init (SYSFS_BATCH_RING_SIZE, &batch_ring, 0);
+  if (ret < 0) {
+    g_message ("io_uring not available (%s), using plain writes",
+               g_strerror (-ret));
+    return FALSE;
+  }
+
+  /* Register a sparse table, filled as the files get opened */
+  for (i = 0; i < SYSFS_BATCH_MAX_FILES; i++)
+    fds[i] = -1;
+
+  if (io_uring_register_files (&batch_ring, fds, SYSFS_BATCH_MAX_FILES) == 0)
+    batch_files_registered = TRUE;
+  else
+    g_debug ("Unable to register a file table, using plain fds");
+
+  batch_backend = SYSFS_BATCH_BACKEND_IO_URING;
+  g_debug ("Using io_uring for sysfs writes");
+
+  return TRUE;
+#else
+  if (use_io_uring)
+    g_debug ("Built without io_uring support, using plain writes");
+
+  return FALSE;
+#endif
+}
+
+void
+sysfs_batch_cleanup (void)
+{
+  uint i;
+
+  for (i = 0; i < n_batch_files; i++)
+    close (batch_files[i].fd);
+  n_batch_files = 0;
+
+#ifdef HAVE_LIBURING
+  if (batch_backend == SYSFS_BATCH_BACKEND_IO_URING) {
+    io_uring_queue_exit (&batch_ring);
+    batch_files_registered = FALSE;
+  }
+#endif
+
+  batch_backend = SYSFS_BATCH_BACKEND_WRITE;
+}
+
+StatedSysfsBatchBackend
+sysfs_batch_get_backend (void)
+{
+  return batch_backend;
+}
+
+/**
+ * Carries out the given writes, storing the result of each one in
+ * the entry itself.
+ *
+ * Returns the number of failed entries.
+ */
+int
+sysfs_batch_submit (StatedSysfsBatchEntry *entries,
+                    uint                  n_entries)
+{
+#ifdef HAVE_LIBURING
+  if (batch_backend == SYSFS_BATCH_BACKEND_IO_URING)
+    return submit_io_uring (entries, n_entries);
+#endif
+
+  return submit_write (entries, n_entries);
+}
+
+/**
+ * Returns the number of syscalls issued so far, useful to compare
+ * backends.
+ */
+uint64_t
+sysfs_batch_get_syscalls (void)
+{
+  return batch_syscalls;
+}
@@ -0,0 +1,511 @@
+/* sysfs-worker.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-sysfs-worker"
+
+/* Must be a power of two */
+#define SYSFS_WORKER_QUEUE_SIZE 64
+#define SYSFS_WORKER_CONTENT_MAX 64
+
+#include <string.h>
+#include <sys/eventfd.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "sysfs-worker.h"
+#include "sysfs-batch.h"
+#include "flightrec.h"
+#include "metrics.h"
+#include "selfprof.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * Writing to sysfs attributes such as /sys/power/wake_lock might block
+ * for a while when the kernel is busy (e.g. in the middle of a suspend
+ * attempt). The sysfs worker moves those writes off the main loop into
+ * a dedicated thread.
+ *
+ * Commands are passed through a lock-free single-producer/single-consumer
+ * ring: the main thread is the only producer, the worker the only
+ * consumer. The worker drains everything that is queued in one go,
+ * keeping the order, but skipping the commands that are superseded by
+ * a later one on the same key within the same batch (e.g. a lock followed
+ * by an unlock of the same wakelock).
+ *
+ * Every batch is carried out through sysfs-batch, so that it's submitted
+ * with a single io_uring_enter() where io_uring is available.
+ *
+ * Results travel back through a second ring and are processed in the
+ * main loop, which also owns the metrics.
+ */
+
+typedef struct {
+  const char *sysfs_file; /* must be static */
+  const char *group;      /* must be static, or NULL */
+  char content[SYSFS_WORKER_CONTENT_MAX];
+} StatedSysfsCommand;
+
+typedef struct {
+  const char *sysfs_file;
+  char content[SYSFS_WORKER_CONTENT_MAX];
+  int result;
+  gboolean coalesced;
+  uint64_t write_us;
+} StatedSysfsCompletion;
+
+typedef struct {
+  StatedSysfsCommand commands[SYSFS_WORKER_QUEUE_SIZE];
+  uint head; /* written by the main thread */
+  uint tail; /* written by the worker */
+} StatedSysfsCommandQueue;
+
+typedef struct {
+  StatedSysfsCompletion completions[SYSFS_WORKER_QUEUE_SIZE];
+  uint head; /* written by the worker */
+  uint tail; /* written by the main thread */
+} StatedSysfsCompletionQueue;
+
+static StatedSysfsCommandQueue command_queue;
+static StatedSysfsCompletionQueue completion_queue;
+static uint completions_dropped = 0;
+
+static GThread *worker_thread = NULL;
+static int worker_quit = 0;
+static int command_fd = -1;
+static int completion_fd = -1;
+static uint completion_source_id = 0;
+
+/* Used only to wait for the queue to drain */
+static GMutex drain_mutex;
+static GCond drain_cond;
+
+static StatedSysfsWorkerMetrics metrics;
+
+/**
+ * Bucket n counts the values below 2^(n + 1) us, the last one the rest.
+ */
+static void
+histogram_add (uint64_t *histogram,
+               uint64_t *max,
+               uint64_t *total,
+               uint64_t value_us)
+{
+  uint bucket = 0;
+
+  while ((value_us >> bucket) > 1 && bucket < SYSFS_WORKER_LATENCY_BUCKETS - 1)
+    bucket++;
+
+  histogram[bucket]++;
+  *max = MAX (*max, value_us);
+  *total += value_us;
+}
+
+static void
+append_histogram (GString        *out,
+                  const char     *metric,
+                  const char     *help,
+                  const uint64_t *histogram,
+                  uint64_t       total_us)
+{
+  uint64_t cumulative = 0;
+  char series[64];
+  char labels[32];
+  uint i;
+
+  stats_append_type (out, metric, "histogram", help);
+  g_snprintf (series, sizeof series, "%s_bucket", metric);
+  for (i = 0; i < SYSFS_WORKER_LATENCY_BUCKETS; i++) {
+    cumulative += histogram[i];
+
+    if (i < SYSFS_WORKER_LATENCY_BUCKETS - 1)
+      g_snprintf (labels, sizeof labels, "le=\"%g\"", (double) (2 << i) / 1000000.0);
+    else
+      g_strlcpy (labels, "le=\"+Inf\"", sizeof labels);
+
+    stats_append_value (out, series, labels, cumulative);
+  }
+
+  g_snprintf (series, sizeof series, "%s_sum", metric);
+  stats_append_value (out, series, NULL, total_us / 1000000.0);
+  g_snprintf (series, sizeof series, "%s_count", metric);
+  stats_append_value (out, series, NULL, cumulative);
+}
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  stats_append_type (out, "stated_sysfs_worker_queued_total", "counter", NULL);
+  stats_append_value (out, "stated_sysfs_worker_queued_total", NULL, metrics.queued);
+  stats_append_type (out, "stated_sysfs_worker_coalesced_total", "counter",
+                     "Queued writes skipped as superseded by a later one");
+  stats_append_value (out, "stated_sysfs_worker_coalesced_total", NULL, metrics.coalesced);
+  stats_append_type (out, "stated_sysfs_worker_written_total", "counter", NULL);
+  stats_append_value (out, "stated_sysfs_worker_written_total", NULL, metrics.written);
+  stats_append_type (out, "stated_sysfs_worker_errors_total", "counter", NULL);
+  stats_append_value (out, "stated_sysfs_worker_errors_total", NULL, metrics.errors);
+  stats_append_type (out, "stated_sysfs_worker_completions_dropped_total", "counter", NULL);
+  stats_append_value (out, "stated_sysfs_worker_completions_dropped_total", NULL,
+                      metrics.completions_dropped);
+
+  stats_append_type (out, "stated_sysfs_worker_enqueue_max_seconds", "gauge", NULL);
+  stats_append_value (out, "stated_sysfs_worker_enqueue_max_seconds", NULL,
+                      metrics.enqueue_max_us / 1000000.0);
+  stats_append_type (out, "stated_sysfs_worker_write_max_seconds", "gauge", NULL);
+  stats_append_value (out, "stated_sysfs_worker_write_max_seconds", NULL,
+                      metrics.write_max_us / 1000000.0);
+
+  append_histogram (out, "stated_sysfs_worker_enqueue_seconds",
+                    "Time spent by the main thread queueing a write",
+                    metrics.enqueue_histogram, metrics.enqueue_total_us);
+  append_histogram (out, "stated_sysfs_worker_write_seconds",
+                    "Time spent by the worker on the batch a write was part of",
+                    metrics.write_histogram, metrics.write_total_us);
+}
+
+static void
+eventfd_signal (int fd)
+{
+  uint64_t value = 1;
+
+  if (write (fd, &value, sizeof value) < 0 && errno != EAGAIN)
+    g_warning ("Unable to signal eventfd: %s", g_strerror (errno));
+}
+
+static gboolean
+command_is_superseded (uint index,
+                       uint head)
+{
+  StatedSysfsCommand *command, *other;
+  uint i;
+
+  command = &command_queue.commands[index % SYSFS_WORKER_QUEUE_SIZE];
+
+  for (i = index + 1; i != head; i++) {
+    other = &command_queue.commands[i % SYSFS_WORKER_QUEUE_SIZE];
+
+    if (command->group != NULL) {
+      /* Grouped attributes (e.g. wake_lock/wake_unlock) are keyed by content */
+      if (other->group == command->group &&
+          strcmp (other->content, command->content) == 0)
+        return TRUE;
+    } else if (other->group == NULL &&
+               strcmp (other->sysfs_file, command->sysfs_file) == 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static void
+push_completion (StatedSysfsCommand *command,
+                 int                result,
+                 gboolean           coalesced,
+                 uint64_t           write_us)
+{
+  StatedSysfsCompletion *completion;
+  uint head = completion_queue.head;
+
+  if (head - g_atomic_int_get (&completion_queue.tail) == SYSFS_WORKER_QUEUE_SIZE) {
+    g_atomic_int_inc (&completions_dropped);
+    return;
+  }
+
+  completion = &completion_queue.completions[head % SYSFS_WORKER_QUEUE_SIZE];
+  completion->sysfs_file = command->sysfs_file;
+  memcpy (completion->content, command->content, SYSFS_WORKER_CONTENT_MAX);
+  completion->result = result;
+  completion->coalesced = coalesced;
+  completion->write_us = write_us;
+
+  g_atomic_int_set (&completion_queue.head, head + 1);
+}
+
+static void *
+worker_thread_func (void *data)
+{
+  StatedSysfsBatchEntry batch[SYSFS_WORKER_QUEUE_SIZE];
+  StatedSysfsCommand *batch_commands[SYSFS_WORKER_QUEUE_SIZE];
+  StatedSysfsCommand *command;
+  uint64_t value, start, elapsed;
+  uint tail, head, n_batch, i;
+
+  while (!g_atomic_int_get (&worker_quit)) {
+    if (read (command_fd, &value, sizeof value) < 0 && errno != EINTR) {
+      g_warning ("Unable to read from eventfd: %s", g_strerror (errno));
+      break;
+    }
+
+    tail = command_queue.tail;
+    head = g_atomic_int_get (&command_queue.head);
+
+    for (n_batch = 0; tail != head; tail++) {
+      command = &command_queue.commands[tail % SYSFS_WORKER_QUEUE_SIZE];
+
+      if (command_is_superseded (tail, head)) {
+        push_completion (command, 0, TRUE, 0);
+        continue;
+      }
+
+      batch[n_batch].sysfs_file = command->sysfs_file;
+      batch[n_batch].content = command->content;
+      batch[n_batch].result = 0;
+      batch_commands[n_batch++] = command;
+    }
+
+    if (n_batch > 0) {
+      start = g_get_monotonic_time ();
+      sysfs_batch_submit (batch, n_batch);
+      elapsed = g_get_monotonic_time () - start;
+
+      for (i = 0; i < n_batch; i++) {
+        flightrec_record (STATED_FLIGHTREC_SYSFS_WRITE, batch[i].sysfs_file,
+                          batch[i].content, 0, batch[i].result, elapsed);
+        push_completion (batch_commands[i], batch[i].result, FALSE, elapsed);
+      }
+    }
+
+    g_atomic_int_set (&command_queue.tail, tail);
+    eventfd_signal (completion_fd);
+
+    g_mutex_lock (&drain_mutex);
+    g_cond_broadcast (&drain_cond);
+    g_mutex_unlock (&drain_mutex);
+  }
+
+  return NULL;
+}
+
+static gboolean
+on_completions_available (int          fd,
+                          GIOCondition condition,
+                          void         *data)
+{
+  StatedSysfsCompletion *completion;
+  uint64_t value;
+  uint64_t prof_start = selfprof_begin ();
+  uint tail, head;
+
+  if (read (fd, &value, sizeof value) < 0 && errno != EAGAIN)
+    g_warning ("Unable to read from eventfd: %s", g_strerror (errno));
+
+  tail = completion_queue.tail;
+  head = g_atomic_int_get (&completion_queue.head);
+
+  for (; tail != head; tail++) {
+    completion = &completion_queue.completions[tail % SYSFS_WORKER_QUEUE_SIZE];
+
+    if (completion->coalesced) {
+      metrics.coalesced++;
+      g_debug ("%s: write of '%s' superseded, skipped",
+               completion->sysfs_file, completion->content);
+      continue;
+    }
+
+    metrics.written++;
+    histogram_add (metrics.write_histogram, &metrics.write_max_us,
+                   &metrics.write_total_us, completion->write_us);
+
+    /* The latency of a write is the one of the batch it was part of */
+    metrics_sysfs_write (completion->result, completion->write_us);
+
+    if (completion->result < 0) {
+      metrics.errors++;
+      g_warning ("Unable to write '%s' to %s: %s", completion->content,
+                 completion->sysfs_file, g_strerror (-completion->result));
+    }
+  }
+
+  g_atomic_int_set (&completion_queue.tail, tail);
+  metrics.completions_dropped = g_atomic_int_get (&completions_dropped);
+
+  selfprof_end ("sysfs-worker", NULL, prof_start);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Starts the worker thread. Until then (or if it fails to start),
+ * sysfs_write_queued() writes synchronously.
+ */
+gboolean
+sysfs_worker_start (void)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (worker_thread != NULL)
+    return TRUE;
+
+  command_fd = eventfd (0, EFD_CLOEXEC);
+  completion_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (command_fd < 0 || completion_fd < 0) {
+    g_warning ("Unable to create eventfds: %s", g_strerror (errno));
+    goto error;
+  }
+
+  completion_source_id = g_unix_fd_add (completion_fd, G_IO_IN,
+                                        on_completions_available, NULL);
+
+  sysfs_batch_init (TRUE);
+
+  g_atomic_int_set (&worker_quit, 0);
+  worker_thread = g_thread_try_new ("sysfs-worker", worker_thread_func,
+                                    NULL, &error);
+  if (worker_thread == NULL) {
+    g_warning ("Unable to start sysfs worker: %s", error->message);
+    goto error;
+  }
+
+  stats_register ("sysfs_worker", append_stats, NULL);
+
+  return TRUE;
+
+error:
+  sysfs_worker_stop ();
+  return FALSE;
+}
+
+/**
+ * Flushes the pending writes and stops the worker thread.
+ */
+void
+sysfs_worker_stop (void)
+{
+  if (worker_thread != NULL) {
+    stats_unregister ("sysfs_worker");
+    sysfs_worker_flush ();
+
+    g_atomic_int_set (&worker_quit, 1);
+    eventfd_signal (command_fd);
+    g_thread_join (worker_thread);
+    worker_thread = NULL;
+
+    /* Process the last completions */
+    on_completions_available (completion_fd, G_IO_IN, NULL);
+
+    g_message ("sysfs writes: %lu queued, %lu coalesced, %lu errors, "
+               "max enqueue %lu us, max write %lu us",
+               metrics.queued, metrics.coalesced, metrics.errors,
+               metrics.enqueue_max_us, metrics.write_max_us);
+  }
+
+  sysfs_batch_cleanup ();
+
+  if (completion_source_id > 0) {
+    g_source_remove (completion_source_id);
+    completion_source_id = 0;
+  }
+
+  if (command_fd >= 0) {
+    close (command_fd);
+    command_fd = -1;
+  }
+
+  if (completion_fd >= 0) {
+    close (completion_fd);
+    completion_fd = -1;
+  }
+}
+
+/**
+ * Blocks until every queued write has been carried out.
+ * Not meant to be used in hot paths.
+ */
+void
+sysfs_worker_flush (void)
+{
+  if (worker_thread == NULL)
+    return;
+
+  g_mutex_lock (&drain_mutex);
+  while (g_atomic_int_get (&command_queue.tail) != command_queue.head)
+    g_cond_wait (&drain_cond, &drain_mutex);
+  g_mutex_unlock (&drain_mutex);
+}
+
+/**
+ * Queues a write of content to sysfs_file. Both sysfs_file and group
+ * must be static strings.
+ *
+ * Writes to the same file supersede each other, unless a group is
+ * specified: in that case writes belonging to the same group supersede
+ * each other when they carry the same content (e.g. wake_lock and
+ * wake_unlock of the same lock).
+ *
+ * Returns 0 if the write has been queued (or carried out, if the worker
+ * is not running), -1 on failure.
+ */
+int
+sysfs_write_queued (const char *content,
+                    const char *sysfs_file,
+                    const char *group)
+{
+  StatedSysfsCommand *command;
+  uint64_t start;
+  uint head;
+
+  if (worker_thread == NULL)
+    return sysfs_write ((char *)content, (char *)sysfs_file);
+
+  if (strlen (content) >= SYSFS_WORKER_CONTENT_MAX) {
+    g_warning ("Content too long for %s, writing synchronously", sysfs_file);
+    sysfs_worker_flush ();
+    return sysfs_write ((char *)content, (char *)sysfs_file);
+  }
+
+  start = g_get_monotonic_time ();
+  head = command_queue.head;
+
+  /* Queue full: this should really never happen, wait for the worker */
+  if (head - g_atomic_int_get (&command_queue.tail) == SYSFS_WORKER_QUEUE_SIZE) {
+    g_warning ("sysfs worker queue full, waiting");
+    sysfs_worker_flush ();
+  }
+
+  command = &command_queue.commands[head % SYSFS_WORKER_QUEUE_SIZE];
+  command->sysfs_file = sysfs_file;
+  command->group = group;
+  g_strlcpy (command->content, content, SYSFS_WORKER_CONTENT_MAX);
+
+  g_atomic_int_set (&command_queue.head, head + 1);
+  eventfd_signal (command_fd);
+
+  metrics.queued++;
+  histogram_add (metrics.enqueue_histogram, &metrics.enqueue_max_us,
+                 &metrics.enqueue_total_us, g_get_monotonic_time () - start);
+
+  return 0;
+}
+
+const StatedSysfsWorkerMetrics *
+sysfs_worker_get_metrics (void)
+{
+  return &metrics;
+}
@@ -0,0 +1,65 @@
+/* sysfs-worker.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDSYSFSWORKER_H
+#define STATEDSYSFSWORKER_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+/* Latency histograms use power-of-two microsecond buckets */
+#define SYSFS_WORKER_LATENCY_BUCKETS 20
+
+typedef struct {
+  uint64_t queued;
+  uint64_t coalesced;
+  uint64_t written;
+  uint64_t errors;
+  uint64_t completions_dropped;
+
+  /* Time spent by the main thread queueing a write */
+  uint64_t enqueue_max_us;
+  uint64_t enqueue_total_us;
+  uint64_t enqueue_histogram[SYSFS_WORKER_LATENCY_BUCKETS];
+
+  /* Time spent by the worker carrying out the batch the write was part of */
+  uint64_t write_max_us;
+  uint64_t write_total_us;
+  uint64_t write_histogram[SYSFS_WORKER_LATENCY_BUCKETS];
+} StatedSysfsWorkerMetrics;
+
+gboolean sysfs_worker_start (void);
+void sysfs_worker_stop (void);
+void sysfs_worker_flush (void);
+int sysfs_write_queued (const char *content,
+                        const char *sysfs_file,
+                        const char *group);
+const StatedSysfsWorkerMetrics *sysfs_worker_get_metrics (void);
+
+#endif /* STATEDSYSFSWORKER_H */
@@ -0,0 +1,148 @@
+/* trace.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-trace"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib-2.0/gio/gio.h>
+
+#include "trace.h"
+
+/**
+ * An optional, append-only binary trace of the events stated reacts
+ * to (display changes, powerkey presses, resumes), so that they can be
+ * replayed offline against a different policy.
+ *
+ * Records have a fixed size and are written with a single write(), so
+ * a trace cut short by a crash loses at most its last record.
+ */
+
+static int trace_fd = -1;
+
+/**
+ * Starts recording to the given file, appending to it if it already
+ * is a trace.
+ */
+gboolean
+trace_open (const char *path)
+{
+  StatedTraceHeader header = {
+    .magic = STATED_TRACE_MAGIC,
+    .version = STATED_TRACE_VERSION,
+  };
+  struct stat st;
+
+  trace_close ();
+
+  trace_fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    g_warning ("Unable to open trace %s: %s", path, g_strerror (errno));
+    return FALSE;
+  }
+
+  if (fstat (trace_fd, &st) == 0 && st.st_size == 0 &&
+      write (trace_fd, &header, sizeof header) != sizeof header) {
+    g_warning ("Unable to write trace header: %s", g_strerror (errno));
+    trace_close ();
+    return FALSE;
+  }
+
+  g_debug ("Recording trace to %s", path);
+
+  return TRUE;
+}
+
+void
+trace_close (void)
+{
+  if (trace_fd < 0)
+    return;
+
+  close (trace_fd);
+  trace_fd = -1;
+}
+
+/**
+ * Records an event, if a trace is open.
+ */
+void
+trace_record (StatedTraceEventType type,
+              uint64_t             boottime)
+{
+  StatedTraceRecord record = {
+    .boottime = boottime,
+    .type = type,
+  };
+
+  if (trace_fd < 0)
+    return;
+
+  if (write (trace_fd, &record, sizeof record) != sizeof record) {
+    g_warning ("Unable to record trace event, stopping: %s", g_strerror (errno));
+    trace_close ();
+  }
+}
+
+/**
+ * Loads a trace, returning its records as StatedTraceRecord.
+ * A trailing partial record is ignored.
+ */
+GArray *
+trace_load (const char *path,
+            GError     **error)
+{
+  g_autofree char *contents = NULL;
+  const StatedTraceHeader *header;
+  GArray *records;
+  gsize length;
+  uint count;
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return NULL;
+
+  header = (const StatedTraceHeader *) contents;
+  if (length < sizeof *header || header->magic != STATED_TRACE_MAGIC) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "%s is not a stated trace", path);
+    return NULL;
+  } else if (header->version != STATED_TRACE_VERSION) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "%s: unsupported trace version %u", path, header->version);
+    return NULL;
+  }
+
+  count = (length - sizeof *header) / sizeof (StatedTraceRecord);
+  records = g_array_sized_new (FALSE, FALSE, sizeof (StatedTraceRecord), count);
+  g_array_append_vals (records, contents + sizeof *header, count);
+
+  return records;
+}
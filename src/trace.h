@@ -0,0 +1,68 @@
+/* trace.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDTRACE_H
+#define STATEDTRACE_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+/**
+ * A trace is a StatedTraceHeader followed by fixed-size
+ * StatedTraceRecords, in host byte order.
+ */
+#define STATED_TRACE_MAGIC 0x52545453 /* "STTR" */
+#define STATED_TRACE_VERSION 1
+
+typedef enum {
+  STATED_TRACE_DISPLAY_ON = 1,
+  STATED_TRACE_DISPLAY_OFF = 2,
+  STATED_TRACE_POWERKEY = 3,
+  STATED_TRACE_RESUME = 4,
+} StatedTraceEventType;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} StatedTraceHeader;
+
+typedef struct {
+  uint64_t boottime; /* milliseconds */
+  uint32_t type;
+  uint32_t reserved;
+} StatedTraceRecord;
+
+gboolean trace_open (const char *path);
+void trace_close (void);
+void trace_record (StatedTraceEventType type,
+                   uint64_t             boottime);
+GArray *trace_load (const char *path,
+                    GError     **error);
+
+#endif /* STATEDTRACE_H */
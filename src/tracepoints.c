@@ -0,0 +1,105 @@
+/* tracepoints.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-tracepoints"
+
+/* ftrace truncates markers anyway, keep them on the stack */
+#define TRACEPOINTS_MARKER_MAX 256
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tracepoints.h"
+#include "utils.h"
+
+static const char *marker_files[] = {
+  "/sys/kernel/tracing/trace_marker",
+  "/sys/kernel/debug/tracing/trace_marker",
+};
+
+int tracepoints_marker_fd = -1;
+
+/**
+ * Opens ftrace's trace_marker, which is then kept open. Until this
+ * is called, tracepoints only fire USDT probes.
+ */
+gboolean
+tracepoints_marker_open (void)
+{
+  uint i;
+
+  if (tracepoints_marker_fd >= 0)
+    return TRUE;
+
+  for (i = 0; i < G_N_ELEMENTS (marker_files); i++) {
+    tracepoints_marker_fd = open (stated_path (marker_files[i]),
+                                  O_WRONLY | O_CLOEXEC);
+    if (tracepoints_marker_fd >= 0) {
+      g_debug ("Writing tracepoints to %s", marker_files[i]);
+      return TRUE;
+    }
+  }
+
+  g_warning ("Unable to open trace_marker: %s", g_strerror (errno));
+
+  return FALSE;
+}
+
+void
+tracepoints_marker_close (void)
+{
+  if (tracepoints_marker_fd < 0)
+    return;
+
+  close (tracepoints_marker_fd);
+  tracepoints_marker_fd = -1;
+}
+
+void
+tracepoints_marker_write (const char *format,
+                          ...)
+{
+  char buffer[TRACEPOINTS_MARKER_MAX];
+  va_list args;
+  int length;
+
+  va_start (args, format);
+  length = vsnprintf (buffer, sizeof buffer, format, args);
+  va_end (args);
+
+  if (length < 0)
+    return;
+
+  /* Failures are not worth a warning on every tracepoint */
+  if (write (tracepoints_marker_fd, buffer, MIN ((size_t)length, sizeof buffer - 1)) < 0)
+    g_debug ("Unable to write to trace_marker: %s", g_strerror (errno));
+}
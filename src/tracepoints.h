@@ -0,0 +1,122 @@
+/* tracepoints.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDTRACEPOINTS_H
+#define STATEDTRACEPOINTS_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+#include "stated-config.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#else
+#define STAP_PROBE(provider, name)
+#define STAP_PROBE1(provider, name, arg1)
+#define STAP_PROBE2(provider, name, arg1, arg2)
+#define STAP_PROBE3(provider, name, arg1, arg2, arg3)
+#endif
+
+/**
+ * Tracepoints at stated's power decisions, so that they can be put on
+ * the same timeline as the kernel's suspend_resume and wakeup_source
+ * events.
+ *
+ * Every tracepoint is both a USDT probe (a nop unless a tracer is
+ * attached) and, if tracepoints_marker_open() succeeded, a fixed-format
+ * record written to ftrace's trace_marker:
+ *
+ *   stated: <event> key=value...
+ *
+ * See tools/stated-trace-merge.py.
+ */
+
+extern int tracepoints_marker_fd;
+
+gboolean tracepoints_marker_open (void);
+void tracepoints_marker_close (void);
+void tracepoints_marker_write (const char *format, ...) G_GNUC_PRINTF (1, 2);
+
+#define TRACEPOINT_MARKER(format, ...) \
+  G_STMT_START { \
+    if (G_UNLIKELY (tracepoints_marker_fd >= 0)) \
+      tracepoints_marker_write ("stated: " format "\n", __VA_ARGS__); \
+  } G_STMT_END
+
+#define TRACE_WAKELOCK_LOCK(lock_name) \
+  G_STMT_START { \
+    STAP_PROBE1 (stated, wakelock_lock, lock_name); \
+    TRACEPOINT_MARKER ("wakelock_lock name=%s", lock_name); \
+  } G_STMT_END
+
+#define TRACE_WAKELOCK_UNLOCK(lock_name) \
+  G_STMT_START { \
+    STAP_PROBE1 (stated, wakelock_unlock, lock_name); \
+    TRACEPOINT_MARKER ("wakelock_unlock name=%s", lock_name); \
+  } G_STMT_END
+
+#define TRACE_WAKELOCK_TIMED(lock_name, timeout) \
+  G_STMT_START { \
+    STAP_PROBE2 (stated, wakelock_timed, lock_name, timeout); \
+    TRACEPOINT_MARKER ("wakelock_timed name=%s timeout=%u", lock_name, timeout); \
+  } G_STMT_END
+
+#define TRACE_DISPLAY_CHANGED(on) \
+  G_STMT_START { \
+    STAP_PROBE1 (stated, display_changed, on); \
+    TRACEPOINT_MARKER ("display_changed on=%d", on); \
+  } G_STMT_END
+
+#define TRACE_POWERKEY_PRESSED() \
+  G_STMT_START { \
+    STAP_PROBE (stated, powerkey_pressed); \
+    TRACEPOINT_MARKER ("powerkey_pressed%s", ""); \
+  } G_STMT_END
+
+#define TRACE_RESUME(previous_boottime, boottime, subsequent_resumes) \
+  G_STMT_START { \
+    STAP_PROBE3 (stated, resume, previous_boottime, boottime, subsequent_resumes); \
+    TRACEPOINT_MARKER ("resume previous_boottime=%lu boottime=%lu subsequent_resumes=%u", \
+                       previous_boottime, boottime, subsequent_resumes); \
+  } G_STMT_END
+
+#define TRACE_POWER_STATE(from, to) \
+  G_STMT_START { \
+    STAP_PROBE2 (stated, power_state, from, to); \
+    TRACEPOINT_MARKER ("power_state from=%s to=%s", from, to); \
+  } G_STMT_END
+
+#define TRACE_POWER_SOURCE(from, to) \
+  G_STMT_START { \
+    STAP_PROBE2 (stated, power_source, from, to); \
+    TRACEPOINT_MARKER ("power_source from=%s to=%s", from, to); \
+  } G_STMT_END
+
+#endif /* STATEDTRACEPOINTS_H */
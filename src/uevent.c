@@ -0,0 +1,509 @@
+/* uevent.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-uevent"
+
+/* Socket receive buffer, big enough for the bursts at boot or on
+ * hotplug of a dock full of devices */
+#define UEVENT_RCVBUF_SIZE (4 * 1024 * 1024)
+
+/* The kernel doesn't send uevents larger than UEVENT_BUFFER_SIZE (2048) */
+#define UEVENT_MSG_MAX 8192
+
+/* Messages handled per wakeup, so that bursts don't starve the main loop */
+#define UEVENT_BATCH 64
+
+/* Bytes the socket filter scans for the end of the ACTION@DEVPATH
+ * header. Messages with longer headers aren't filtered in the kernel */
+#define UEVENT_BPF_HEADER_SCAN 256
+
+/* Longer subsystem names aren't filtered in the kernel either */
+#define UEVENT_BPF_SUBSYSTEM_MAX 64
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "uevent.h"
+#include "stats.h"
+#include "selfprof.h"
+
+/**
+ * A single NETLINK_KOBJECT_UEVENT socket shared by everything that
+ * needs to follow hotplug: subscribers register a subsystem and
+ * optionally an action, and are called for every matching uevent.
+ *
+ * Messages are parsed in place in a static buffer. A socket filter,
+ * rebuilt whenever subscriptions change, drops the uevents of the
+ * other subsystems in the kernel, so that they don't even wake us up.
+ *
+ * The monitor can run on any socket that preserves message
+ * boundaries instead (e.g. one end of a SOCK_SEQPACKET socketpair),
+ * and uevent_inject() writes uevents to the other end in the
+ * kernel's format, filter included.
+ */
+
+typedef struct {
+  const char *subsystem; /* interned, NULL for every subsystem */
+  const char *action;    /* interned, NULL for every action */
+  StatedUeventFunc func;
+  void *data;
+} StatedUeventSubscription;
+
+static StatedUeventSubscription subscriptions[STATED_UEVENT_MAX_SUBSCRIPTIONS];
+
+static int monitor_fd = -1;
+static gboolean monitor_netlink = FALSE;
+static uint monitor_source_id = 0;
+
+static char buffer[UEVENT_MSG_MAX + 1];
+
+static uint64_t received = 0;
+static uint64_t dispatched = 0;
+static uint64_t overruns = 0;
+static uint64_t rejected = 0;
+
+static void
+uevent_append_stats (GString *out,
+                     void    *data)
+{
+  stats_append_type (out, "stated_uevents_received_total", "counter",
+                     "Uevents that made it through the socket filter");
+  stats_append_value (out, "stated_uevents_received_total", NULL, received);
+
+  stats_append_type (out, "stated_uevents_dispatched_total", "counter",
+                     "Uevent deliveries to subscribers");
+  stats_append_value (out, "stated_uevents_dispatched_total", NULL, dispatched);
+
+  stats_append_type (out, "stated_uevent_overruns_total", "counter",
+                     "Times uevents were lost because the socket buffer was full");
+  stats_append_value (out, "stated_uevent_overruns_total", NULL, overruns);
+
+  stats_append_type (out, "stated_uevents_rejected_total", "counter",
+                     "Malformed, truncated or spoofed uevents");
+  stats_append_value (out, "stated_uevents_rejected_total", NULL, rejected);
+}
+
+/**
+ * Returns the first 1 to 4 bytes of str as a BPF load sees them.
+ */
+static uint32_t
+bpf_bytes (const char *str,
+           uint       size)
+{
+  uint32_t value = 0;
+  uint i;
+
+  for (i = 0; i < size; i++)
+    value = (value << 8) | (uint8_t) str[i];
+
+  return value;
+}
+
+/**
+ * Builds the socket filter: it finds the end of the ACTION@DEVPATH
+ * header, from which the offset of SUBSYSTEM= follows (the kernel
+ * always sends ACTION=, DEVPATH= and SUBSYSTEM= first), and accepts
+ * the message only if the subsystem is one we're subscribed to.
+ *
+ * Classic BPF can't loop, so the header scan is unrolled. Whatever
+ * the filter can't make sense of is accepted, and left to the
+ * userspace matching.
+ *
+ * Returns the number of instructions, 0 if no filter is needed.
+ */
+static uint
+uevent_filter_build (struct sock_filter *prog)
+{
+  const char *subsystems[STATED_UEVENT_MAX_SUBSCRIPTIONS];
+  uint n_subsystems = 0;
+  uint n = 0, match, i, j;
+
+  for (i = 0; i < STATED_UEVENT_MAX_SUBSCRIPTIONS; i++) {
+    if (subscriptions[i].func == NULL)
+      continue;
+
+    if (subscriptions[i].subsystem == NULL ||
+        strlen (subscriptions[i].subsystem) >= UEVENT_BPF_SUBSYSTEM_MAX)
+      return 0;
+
+    for (j = 0; j < n_subsystems; j++) {
+      if (subsystems[j] == subscriptions[i].subsystem)
+        break;
+    }
+
+    if (j == n_subsystems)
+      subsystems[n_subsystems++] = subscriptions[i].subsystem;
+  }
+
+  /* Header scan: X = offset of SUBSYSTEM=, i.e. twice the header
+   * length (NUL included) plus the ACTION= and DEVPATH= overhead */
+  match = UEVENT_BPF_HEADER_SCAN * 4 + 1;
+  for (i = 0; i < UEVENT_BPF_HEADER_SCAN; i++) {
+    prog[n++] = (struct sock_filter) BPF_STMT (BPF_LD | BPF_B | BPF_ABS, i);
+    prog[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2);
+    prog[n++] = (struct sock_filter) BPF_STMT (BPF_LDX | BPF_W | BPF_IMM, 2 * (i + 1) + 15);
+    prog[n] = (struct sock_filter) BPF_STMT (BPF_JMP | BPF_JA, match - n - 1);
+    n++;
+  }
+  prog[n++] = (struct sock_filter) BPF_STMT (BPF_RET | BPF_K, 0xffffffff);
+
+  /* Check that it's SUBSYSTEM= indeed */
+  prog[n++] = (struct sock_filter) BPF_STMT (BPF_LD | BPF_W | BPF_IND, 0);
+  prog[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, bpf_bytes ("SUBS", 4), 0, 2);
+  prog[n++] = (struct sock_filter) BPF_STMT (BPF_LD | BPF_W | BPF_IND, 6);
+  prog[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, bpf_bytes ("TEM=", 4), 1, 0);
+  prog[n++] = (struct sock_filter) BPF_STMT (BPF_RET | BPF_K, 0xffffffff);
+
+  /* Compare the value, NUL included, to every subscribed subsystem */
+  for (i = 0; i < n_subsystems; i++) {
+    const char *subsystem = subsystems[i];
+    uint size = strlen (subsystem) + 1;
+    uint block_start = n, offset = 0, chunk;
+    uint sizes[] = { 0, BPF_B, BPF_H, 0, BPF_W };
+
+    while (offset < size) {
+      chunk = (size - offset >= 4) ? 4 : (size - offset >= 2) ? 2 : 1;
+
+      prog[n++] = (struct sock_filter) BPF_STMT (BPF_LD | sizes[chunk] | BPF_IND, 10 + offset);
+      prog[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K,
+                                                 bpf_bytes (subsystem + offset, chunk), 0, 0);
+      offset += chunk;
+    }
+    prog[n++] = (struct sock_filter) BPF_STMT (BPF_RET | BPF_K, 0xffffffff);
+
+    /* On mismatch, skip to the next subsystem */
+    for (j = block_start + 1; j < n; j += 2)
+      prog[j].jf = n - j - 1;
+  }
+
+  prog[n++] = (struct sock_filter) BPF_STMT (BPF_RET | BPF_K, 0);
+
+  return n;
+}
+
+static void
+uevent_filter_update (void)
+{
+  /* Scan, checks, and up to 33 compares per subsystem */
+  static struct sock_filter prog[UEVENT_BPF_HEADER_SCAN * 4 + 6 +
+                                 STATED_UEVENT_MAX_SUBSCRIPTIONS *
+                                 (UEVENT_BPF_SUBSYSTEM_MAX / 2 + 2) + 1];
+  struct sock_fprog fprog = { .filter = prog };
+
+  if (monitor_fd < 0)
+    return;
+
+  fprog.len = uevent_filter_build (prog);
+
+  if (fprog.len == 0) {
+    if (setsockopt (monitor_fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0) < 0 && errno != ENOENT)
+      g_warning ("Unable to detach the uevent filter: %s", g_strerror (errno));
+  } else if (setsockopt (monitor_fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof fprog) < 0) {
+    g_warning ("Unable to attach the uevent filter: %s", g_strerror (errno));
+  }
+}
+
+/**
+ * Returns the value of key in event, or NULL if not set.
+ */
+const char *
+uevent_get (const StatedUevent *event,
+            const char         *key)
+{
+  const char *field = event->env, *end = event->env + event->env_len;
+  size_t key_len = strlen (key);
+
+  for (; field < end; field += strlen (field) + 1) {
+    if (strncmp (field, key, key_len) == 0 && field[key_len] == '=')
+      return field + key_len + 1;
+  }
+
+  return NULL;
+}
+
+static void
+uevent_dispatch (const StatedUevent *event)
+{
+  uint i;
+
+  for (i = 0; i < STATED_UEVENT_MAX_SUBSCRIPTIONS; i++) {
+    if (subscriptions[i].func == NULL)
+      continue;
+
+    if (event != NULL &&
+        ((subscriptions[i].subsystem != NULL && strcmp (subscriptions[i].subsystem, event->subsystem) != 0) ||
+         (subscriptions[i].action != NULL && strcmp (subscriptions[i].action, event->action) != 0)))
+      continue;
+
+    dispatched++;
+    subscriptions[i].func (event, subscriptions[i].data);
+  }
+}
+
+/**
+ * Parses the len bytes in buffer, NUL terminated, and dispatches them.
+ */
+static void
+uevent_parse (size_t len)
+{
+  StatedUevent event = { NULL, };
+  const char *field, *end = buffer + len;
+  size_t header_len;
+
+  /* ACTION@DEVPATH: anything else (e.g. libudev messages) is ignored */
+  header_len = strlen (buffer) + 1;
+  if (strchr (buffer, '@') == NULL || header_len >= len) {
+    rejected++;
+    return;
+  }
+
+  event.env = buffer + header_len;
+  event.env_len = len - header_len;
+
+  for (field = event.env; field < end; field += strlen (field) + 1) {
+    if (g_str_has_prefix (field, "ACTION="))
+      event.action = field + strlen ("ACTION=");
+    else if (g_str_has_prefix (field, "DEVPATH="))
+      event.devpath = field + strlen ("DEVPATH=");
+    else if (g_str_has_prefix (field, "SUBSYSTEM="))
+      event.subsystem = field + strlen ("SUBSYSTEM=");
+    else if (g_str_has_prefix (field, "DEVTYPE="))
+      event.devtype = field + strlen ("DEVTYPE=");
+    else if (g_str_has_prefix (field, "DEVNAME="))
+      event.devname = field + strlen ("DEVNAME=");
+  }
+
+  if (event.action == NULL || event.devpath == NULL || event.subsystem == NULL) {
+    rejected++;
+    return;
+  }
+
+  received++;
+  uevent_dispatch (&event);
+}
+
+static gboolean
+on_uevent_ready (int          fd,
+                 GIOCondition condition,
+                 void         *data)
+{
+  uint64_t prof_start = selfprof_begin ();
+  struct sockaddr_nl addr;
+  struct iovec iov = { .iov_base = buffer, .iov_len = UEVENT_MSG_MAX };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  ssize_t len;
+  uint i;
+
+  for (i = 0; i < UEVENT_BATCH; i++) {
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof addr;
+
+    len = recvmsg (fd, &msg, MSG_DONTWAIT);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    } else if (len < 0 && errno == ENOBUFS) {
+      g_warning ("uevents lost, the receive buffer is full");
+      overruns++;
+      uevent_dispatch (NULL);
+      continue;
+    } else if (len <= 0) {
+      break;
+    }
+
+    /* Only the kernel is trusted on netlink */
+    if ((msg.msg_flags & MSG_TRUNC) ||
+        (monitor_netlink && (msg.msg_namelen != sizeof addr || addr.nl_pid != 0))) {
+      rejected++;
+      continue;
+    }
+
+    buffer[len] = '\0';
+    uevent_parse (len);
+  }
+
+  selfprof_end ("uevent", NULL, prof_start);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Calls func for every uevent of subsystem (NULL for all of them)
+ * with the given action (NULL for all of them). Returns the id to
+ * unsubscribe with, 0 if there's no room left.
+ */
+uint
+uevent_subscribe (const char       *subsystem,
+                  const char       *action,
+                  StatedUeventFunc func,
+                  void             *data)
+{
+  uint i;
+
+  g_return_val_if_fail (func != NULL, 0);
+
+  for (i = 0; i < STATED_UEVENT_MAX_SUBSCRIPTIONS; i++) {
+    if (subscriptions[i].func != NULL)
+      continue;
+
+    subscriptions[i].subsystem = g_intern_string (subsystem);
+    subscriptions[i].action = g_intern_string (action);
+    subscriptions[i].func = func;
+    subscriptions[i].data = data;
+
+    uevent_filter_update ();
+
+    return i + 1;
+  }
+
+  g_warning ("Too many uevent subscriptions");
+
+  return 0;
+}
+
+void
+uevent_unsubscribe (uint id)
+{
+  g_return_if_fail (id > 0 && id <= STATED_UEVENT_MAX_SUBSCRIPTIONS);
+
+  subscriptions[id - 1].func = NULL;
+  subscriptions[id - 1].data = NULL;
+
+  uevent_filter_update ();
+}
+
+/**
+ * Starts dispatching the uevents read from fd, which is then owned
+ * by the monitor.
+ */
+gboolean
+uevent_monitor_start_for_fd (int fd)
+{
+  g_return_val_if_fail (monitor_fd < 0, FALSE);
+
+  monitor_fd = fd;
+  uevent_filter_update ();
+
+  monitor_source_id = g_unix_fd_add (monitor_fd, G_IO_IN, on_uevent_ready, NULL);
+
+  stats_register ("uevent", uevent_append_stats, NULL);
+
+  return TRUE;
+}
+
+/**
+ * Starts dispatching the kernel's uevents.
+ */
+gboolean
+uevent_monitor_start (void)
+{
+  struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+  int size = UEVENT_RCVBUF_SIZE;
+  int fd;
+
+  fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0) {
+    g_warning ("Unable to create the uevent socket: %s", g_strerror (errno));
+    return FALSE;
+  }
+
+  /* Going over rmem_max needs CAP_NET_ADMIN */
+  if (setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size) < 0)
+    setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+    g_warning ("Unable to bind the uevent socket: %s", g_strerror (errno));
+    close (fd);
+    return FALSE;
+  }
+
+  monitor_netlink = TRUE;
+
+  return uevent_monitor_start_for_fd (fd);
+}
+
+void
+uevent_monitor_stop (void)
+{
+  if (monitor_fd < 0)
+    return;
+
+  stats_unregister ("uevent");
+
+  if (monitor_source_id > 0) {
+    g_source_remove (monitor_source_id);
+    monitor_source_id = 0;
+  }
+
+  close (monitor_fd);
+  monitor_fd = -1;
+  monitor_netlink = FALSE;
+}
+
+/**
+ * Sends a uevent to fd in the kernel's format, for the monitor
+ * running on the other end. env is a NULL terminated array of extra
+ * KEY=VALUE fields, or NULL.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+uevent_inject (int               fd,
+               const char        *action,
+               const char        *devpath,
+               const char        *subsystem,
+               const char *const *env)
+{
+  g_autoptr(GString) msg = NULL;
+  uint i;
+
+  msg = g_string_new (NULL);
+  g_string_append_printf (msg, "%s@%s", action, devpath);
+  g_string_append_c (msg, '\0');
+  g_string_append_printf (msg, "ACTION=%s", action);
+  g_string_append_c (msg, '\0');
+  g_string_append_printf (msg, "DEVPATH=%s", devpath);
+  g_string_append_c (msg, '\0');
+  g_string_append_printf (msg, "SUBSYSTEM=%s", subsystem);
+  g_string_append_c (msg, '\0');
+
+  for (i = 0; env != NULL && env[i] != NULL; i++) {
+    g_string_append (msg, env[i]);
+    g_string_append_c (msg, '\0');
+  }
+
+  if (send (fd, msg->str, msg->len, MSG_NOSIGNAL) != (ssize_t) msg->len)
+    return -1;
+
+  return 0;
+}
@@ -0,0 +1,73 @@
+/* uevent.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDUEVENT_H
+#define STATEDUEVENT_H
+
+#include <glib-2.0/glib.h>
+
+/**
+ * A kernel uevent. Every string points into the receive buffer, so
+ * it's only valid for the duration of the callback.
+ */
+typedef struct {
+  const char *action;
+  const char *devpath;
+  const char *subsystem;
+  const char *devtype;  /* NULL if not set */
+  const char *devname;  /* NULL if not set */
+
+  /* KEY=VALUE fields, NUL separated */
+  const char *env;
+  size_t env_len;
+} StatedUevent;
+
+/* event is NULL when events were lost: subscribers should rescan */
+typedef void (*StatedUeventFunc) (const StatedUevent *event,
+                                  void               *data);
+
+#define STATED_UEVENT_MAX_SUBSCRIPTIONS 16
+
+uint uevent_subscribe (const char       *subsystem,
+                       const char       *action,
+                       StatedUeventFunc func,
+                       void             *data);
+void uevent_unsubscribe (uint id);
+const char *uevent_get (const StatedUevent *event,
+                        const char         *key);
+gboolean uevent_monitor_start (void);
+gboolean uevent_monitor_start_for_fd (int fd);
+void uevent_monitor_stop (void);
+int uevent_inject (int               fd,
+                   const char        *action,
+                   const char        *devpath,
+                   const char        *subsystem,
+                   const char *const *env);
+
+#endif /* STATEDUEVENT_H */
@@ -29,7 +29,65 @@
 
 #define G_LOG_DOMAIN "stated-utils"
 
+#include <errno.h>
+
 #include "utils.h"
+#include "flightrec.h"
+#include "metrics.h"
+
+/* Clock override, NULL for the real clocks */
+static const StatedClock *override_clock = NULL;
+
+/* Optional hook called on every sysfs write */
+static StatedSysfsWriteHook write_hook = NULL;
+static void *write_hook_data = NULL;
+
+/* Root prefix for every kernel interface, NULL for the real one */
+static const char *root_prefix = NULL;
+static gboolean root_prefix_checked = FALSE;
+
+/**
+ * Sets the root prefix prepended to every kernel interface path
+ * (/sys, /dev, ...). This allows to run stated against a fake tree.
+ *
+ * If never set, the STATED_ROOT environment variable is used.
+ * Must be called before any path is resolved.
+ */
+void
+stated_set_root (const char *root)
+{
+  root_prefix = (root != NULL && root[0] != '\0') ? g_intern_string (root) : NULL;
+  root_prefix_checked = TRUE;
+}
+
+const char *
+stated_get_root (void)
+{
+  if (!root_prefix_checked)
+    stated_set_root (g_getenv ("STATED_ROOT"));
+
+  return root_prefix;
+}
+
+/**
+ * Resolves the given absolute path against the root prefix.
+ *
+ * The returned string is never freed, so it can be safely stored
+ * (e.g. by the sysfs worker). Without a root prefix, the path itself
+ * is returned.
+ */
+const char *
+stated_path (const char *path)
+{
+  g_autofree char *prefixed = NULL;
+
+  if (stated_get_root () == NULL)
+    return path;
+
+  prefixed = g_strconcat (root_prefix, path, NULL);
+
+  return g_intern_string (prefixed);
+}
 
 /**
  * Helper function that allows to write the given content to a file
@@ -41,24 +99,57 @@ sysfs_write (char *content, char *sysfs_file)
 {
   /* TODO: Check if we're actually going to write in /sys? */
 
+  int64_t start = g_get_monotonic_time ();
+  int64_t latency;
+  int error;
   FILE* file = fopen (sysfs_file, "w");
   if (file == NULL) {
+    latency = g_get_monotonic_time () - start;
+    flightrec_record (STATED_FLIGHTREC_SYSFS_WRITE, sysfs_file, content, 0, -errno, latency);
+    metrics_sysfs_write (-1, latency);
     g_warning ("Unable to open file (%s) for writing",
                sysfs_file);
+    if (write_hook != NULL)
+      write_hook (content, sysfs_file, -1, write_hook_data);
     return -1;
   }
 
   fputs (content, file);
-  fclose (file);
+
+  /* The kernel rejects a write when it's flushed. That's only accounted:
+   * callers don't expect sysfs_write() to fail past opening the file */
+  error = (fclose (file) != 0) ? -errno : 0;
+  latency = g_get_monotonic_time () - start;
+
+  flightrec_record (STATED_FLIGHTREC_SYSFS_WRITE, sysfs_file, content, 0, error, latency);
+  metrics_sysfs_write (error, latency);
+
+  if (write_hook != NULL)
+    write_hook (content, sysfs_file, 0, write_hook_data);
 
   return 0;
 }
 
+/**
+ * Sets a hook that gets called on every sysfs_write(). Pass NULL
+ * to unset it.
+ */
+void
+sysfs_set_write_hook (StatedSysfsWriteHook hook,
+                      void                 *user_data)
+{
+  write_hook = hook;
+  write_hook_data = user_data;
+}
+
 static uint64_t
 time_get_current (uint8_t clk)
 {
   struct timespec tspec;
 
+  if (override_clock != NULL)
+    return override_clock->get_time (clk, override_clock->user_data);
+
   clock_gettime (clk, &tspec);
 
   return (uint64_t)tspec.tv_sec * 1000 + tspec.tv_nsec / 1000000;
@@ -81,3 +172,70 @@ time_get_boottime (void)
 {
   return time_get_current (CLOCK_BOOTTIME);
 }
+
+/**
+ * Replaces the real clocks (and GLib timeouts) with the given one.
+ * Passing NULL restores the real clocks.
+ *
+ * This should be done before any timeout is added.
+ */
+void
+time_set_clock (const StatedClock *clock)
+{
+  override_clock = clock;
+}
+
+/**
+ * Helper function that adds a timeout on the current clock,
+ * interval is in milliseconds.
+ */
+uint
+time_timeout_add (uint        interval,
+                  GSourceFunc function,
+                  void        *data)
+{
+  if (override_clock != NULL)
+    return override_clock->timeout_add (G_PRIORITY_DEFAULT, interval, function,
+                                        data, override_clock->user_data);
+
+  return g_timeout_add (interval, function, data);
+}
+
+/**
+ * Helper function that adds a timeout on the current clock,
+ * interval is in seconds.
+ */
+uint
+time_timeout_add_seconds (uint        interval,
+                          GSourceFunc function,
+                          void        *data)
+{
+  return time_timeout_add_seconds_full (G_PRIORITY_DEFAULT, interval,
+                                        function, data);
+}
+
+uint
+time_timeout_add_seconds_full (int         priority,
+                               uint        interval,
+                               GSourceFunc function,
+                               void        *data)
+{
+  if (override_clock != NULL)
+    return override_clock->timeout_add (priority, interval * 1000, function,
+                                        data, override_clock->user_data);
+
+  return g_timeout_add_seconds_full (priority, interval, function, data, NULL);
+}
+
+/**
+ * Helper function that removes a timeout added with one of the
+ * time_timeout_add* functions.
+ */
+gboolean
+time_source_remove (uint source_id)
+{
+  if (override_clock != NULL)
+    return override_clock->source_remove (source_id, override_clock->user_data);
+
+  return g_source_remove (source_id);
+}
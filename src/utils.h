@@ -36,8 +36,46 @@
 #include <time.h>
 #include <glib-2.0/glib.h>
 
+/**
+ * A clock, allowing to replace the real clocks and GLib timeouts
+ * with virtual ones (e.g. in simulations). Times are in milliseconds.
+ */
+typedef struct {
+  uint64_t (*get_time) (clockid_t clock_id,
+                        void      *user_data);
+  uint (*timeout_add) (int         priority,
+                       uint        interval,
+                       GSourceFunc function,
+                       void        *data,
+                       void        *user_data);
+  gboolean (*source_remove) (uint source_id,
+                             void *user_data);
+  void *user_data;
+} StatedClock;
+
+/**
+ * A hook called on every sysfs_write(), after the content has been
+ * written (successfully or not).
+ */
+typedef void (*StatedSysfsWriteHook) (const char *content,
+                                      const char *sysfs_file,
+                                      int         result,
+                                      void        *user_data);
+
+void stated_set_root (const char *root);
+const char *stated_get_root (void);
+const char *stated_path (const char *path);
 int sysfs_write (char *content, char *sysfs_file);
+void sysfs_set_write_hook (StatedSysfsWriteHook hook, void *user_data);
 uint64_t time_get_monotonic (void);
 uint64_t time_get_boottime (void);
+void time_set_clock (const StatedClock *clock);
+uint time_timeout_add (uint interval, GSourceFunc function, void *data);
+uint time_timeout_add_seconds (uint interval, GSourceFunc function, void *data);
+uint time_timeout_add_seconds_full (int         priority,
+                                    uint        interval,
+                                    GSourceFunc function,
+                                    void        *data);
+gboolean time_source_remove (uint source_id);
 
 #endif /* STATEDUTILS_H */
@@ -0,0 +1,421 @@
+/* wakelock-server.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-wakelock-server"
+
+/* The kernel wakelock every client lock is multiplexed onto */
+#define CLIENT_WAKELOCK "stated_client"
+
+/* Bounds, so that clients can't exhaust our fds */
+#define WAKELOCK_SERVER_MAX_CLIENTS 32
+#define WAKELOCK_SERVER_MAX_LOCKS 512
+
+/* ...and so that a single client can't take all of them */
+#define WAKELOCK_SERVER_MAX_CLIENT_LOCKS 32
+
+#include <errno.h>
+#include <grp.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "wakelock-server.h"
+#include "wakelocks.h"
+#include "stats.h"
+#include "selfprof.h"
+#include "utils.h"
+
+/**
+ * Lets native services take wakelocks without a D-Bus round trip and
+ * without a release request: every granted lock is one end of a
+ * socketpair, passed to the client, and it's released as soon as we
+ * see the hangup on our end, i.e. when the client closes it or dies.
+ *
+ * Client locks are reference counted onto a single kernel wakelock,
+ * so sysfs is only written on the first acquisition and the last
+ * release, however many locks the clients take in between.
+ */
+
+/**
+ * A connection. It's referenced by its own source and by the source of
+ * every lock it was granted, which may outlive it.
+ */
+typedef struct {
+  uint ref;
+  uint n_locks;
+} StatedWakelockClient;
+
+static char *server_path = NULL;
+static int listen_fd = -1;
+static uint listen_source_id = 0;
+
+/* fd -> source id, for connections and lock fds */
+static GHashTable *clients = NULL;
+static GHashTable *locks = NULL;
+
+static uint64_t acquisitions = 0;
+static uint64_t denials = 0;
+static uint64_t kernel_acquisitions = 0;
+
+static void
+wakelock_server_append_stats (GString *out,
+                              void    *data)
+{
+  stats_append_type (out, "stated_client_locks_held", "gauge",
+                     "Wakelocks currently held by socket clients");
+  stats_append_value (out, "stated_client_locks_held", NULL, g_hash_table_size (locks));
+
+  stats_append_type (out, "stated_client_lock_acquisitions_total", "counter",
+                     "Wakelocks granted to socket clients");
+  stats_append_value (out, "stated_client_lock_acquisitions_total", NULL, acquisitions);
+
+  stats_append_type (out, "stated_client_lock_denials_total", "counter",
+                     "Wakelock requests refused for lack of resources");
+  stats_append_value (out, "stated_client_lock_denials_total", NULL, denials);
+
+  stats_append_type (out, "stated_client_kernel_acquisitions_total", "counter",
+                     "Times the client locks took the kernel wakelock");
+  stats_append_value (out, "stated_client_kernel_acquisitions_total", NULL, kernel_acquisitions);
+
+  stats_append_type (out, "stated_client_connections", "gauge",
+                     "Clients connected to the wakelock socket");
+  stats_append_value (out, "stated_client_connections", NULL, g_hash_table_size (clients));
+}
+
+static StatedWakelockClient *
+client_ref (StatedWakelockClient *client)
+{
+  client->ref++;
+
+  return client;
+}
+
+static void
+client_unref (StatedWakelockClient *client)
+{
+  if (--client->ref == 0)
+    g_free (client);
+}
+
+static void
+on_lock_destroyed (StatedWakelockClient *client)
+{
+  client->n_locks--;
+  client_unref (client);
+}
+
+static gboolean
+on_lock_released (int          fd,
+                  GIOCondition condition,
+                  void         *data)
+{
+  g_hash_table_remove (locks, GINT_TO_POINTER (fd));
+  close (fd);
+
+  if (g_hash_table_size (locks) == 0)
+    wakelock_unlock (CLIENT_WAKELOCK);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * Creates a new lock for client, returns the fd to pass to it or -1.
+ */
+static int
+lock_new (StatedWakelockClient *client)
+{
+  int fds[2];
+
+  if (g_hash_table_size (locks) >= WAKELOCK_SERVER_MAX_LOCKS) {
+    g_warning ("Too many client wakelocks, denying");
+    return -1;
+  }
+
+  if (client->n_locks >= WAKELOCK_SERVER_MAX_CLIENT_LOCKS) {
+    g_warning ("Too many wakelocks for a single client, denying");
+    return -1;
+  }
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+    g_warning ("Unable to create client wakelock: %s", g_strerror (errno));
+    return -1;
+  }
+
+  if (g_hash_table_size (locks) == 0) {
+    wakelock_lock (CLIENT_WAKELOCK);
+    kernel_acquisitions++;
+  }
+
+  client->n_locks++;
+  g_hash_table_insert (locks, GINT_TO_POINTER (fds[0]),
+                       GUINT_TO_POINTER (g_unix_fd_add_full (G_PRIORITY_DEFAULT, fds[0],
+                                                             G_IO_HUP | G_IO_ERR,
+                                                             on_lock_released,
+                                                             client_ref (client),
+                                                             (GDestroyNotify) on_lock_destroyed)));
+
+  return fds[1];
+}
+
+static gboolean
+client_reply (int  fd,
+              char status,
+              int  lock_fd)
+{
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = &status, .iov_len = 1 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  struct cmsghdr *cmsg;
+  ssize_t sent;
+
+  if (lock_fd >= 0) {
+    memset (&control, 0, sizeof control);
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cmsg), &lock_fd, sizeof (int));
+  }
+
+  do
+    sent = sendmsg (fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  while (sent < 0 && errno == EINTR);
+
+  return sent == 1;
+}
+
+static void
+client_close (int fd)
+{
+  g_hash_table_remove (clients, GINT_TO_POINTER (fd));
+  close (fd);
+}
+
+static gboolean
+on_client_request (int                  fd,
+                   GIOCondition         condition,
+                   StatedWakelockClient *client)
+{
+  uint64_t prof_start = selfprof_begin ();
+  gboolean keep = TRUE;
+  char request;
+  ssize_t received;
+  int lock_fd;
+
+  received = recv (fd, &request, 1, MSG_DONTWAIT);
+  if (received < 0 && (errno == EAGAIN || errno == EINTR)) {
+    selfprof_end ("wakelock-server", NULL, prof_start);
+    return G_SOURCE_CONTINUE;
+  }
+
+  if (received != 1) {
+    /* Hangup or error */
+    keep = FALSE;
+  } else if (request != STATED_WAKELOCK_SERVER_ACQUIRE) {
+    g_warning ("Unknown wakelock request from client, disconnecting it");
+    keep = FALSE;
+  } else {
+    lock_fd = lock_new (client);
+
+    if (lock_fd >= 0) {
+      acquisitions++;
+      /* If the reply can't be sent, our end gets the hangup right away */
+      keep = client_reply (fd, STATED_WAKELOCK_SERVER_GRANTED, lock_fd);
+      close (lock_fd);
+    } else {
+      denials++;
+      keep = client_reply (fd, STATED_WAKELOCK_SERVER_DENIED, -1);
+    }
+  }
+
+  if (!keep)
+    client_close (fd);
+
+  selfprof_end ("wakelock-server", NULL, prof_start);
+  return keep ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_listen_ready (int          fd,
+                 GIOCondition condition,
+                 void         *data)
+{
+  StatedWakelockClient *client;
+  int client_fd;
+
+  client_fd = accept (fd, NULL, NULL);
+  if (client_fd < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      g_warning ("Unable to accept wakelock client: %s", g_strerror (errno));
+
+    return G_SOURCE_CONTINUE;
+  }
+
+  if (g_hash_table_size (clients) >= WAKELOCK_SERVER_MAX_CLIENTS) {
+    g_warning ("Too many wakelock clients, refusing a new one");
+    close (client_fd);
+    return G_SOURCE_CONTINUE;
+  }
+
+  client = g_new0 (StatedWakelockClient, 1);
+  client->ref = 1;
+
+  g_hash_table_insert (clients, GINT_TO_POINTER (client_fd),
+                       GUINT_TO_POINTER (g_unix_fd_add_full (G_PRIORITY_DEFAULT, client_fd,
+                                                             G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                                             (GUnixFDSourceFunc) on_client_request,
+                                                             client,
+                                                             (GDestroyNotify) client_unref)));
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+close_all (GHashTable *table)
+{
+  GHashTableIter iter;
+  void *fd, *source_id;
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, &fd, &source_id)) {
+    g_source_remove (GPOINTER_TO_UINT (source_id));
+    close (GPOINTER_TO_INT (fd));
+  }
+
+  g_hash_table_remove_all (table);
+}
+
+/**
+ * Starts serving wakelocks on socket_path, replacing a stale socket
+ * left there by a previous instance. The socket is only accessible to
+ * our user and to the members of group (our own group if NULL).
+ */
+gboolean
+wakelock_server_start (const char *socket_path,
+                       const char *group)
+{
+  g_autofree char *dir = NULL;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct group *group_entry;
+  gid_t gid = -1;
+
+  if (listen_fd >= 0)
+    return TRUE;
+
+  if (group != NULL) {
+    group_entry = getgrnam (group);
+    if (group_entry == NULL) {
+      g_warning ("Unknown wakelock socket group: %s", group);
+      return FALSE;
+    }
+    gid = group_entry->gr_gid;
+  }
+
+  if (strlen (socket_path) >= sizeof addr.sun_path) {
+    g_warning ("Wakelock socket path too long: %s", socket_path);
+    return FALSE;
+  }
+
+  dir = g_path_get_dirname (socket_path);
+  if (g_mkdir_with_parents (dir, 0755) < 0) {
+    g_warning ("Unable to create %s: %s", dir, g_strerror (errno));
+    return FALSE;
+  }
+
+  listen_fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    g_warning ("Unable to create wakelock socket: %s", g_strerror (errno));
+    return FALSE;
+  }
+
+  g_strlcpy (addr.sun_path, socket_path, sizeof addr.sun_path);
+  unlink (socket_path);
+
+  if (bind (listen_fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+      chown (socket_path, -1, gid) < 0 ||
+      chmod (socket_path, 0660) < 0 ||
+      listen (listen_fd, 16) < 0) {
+    g_warning ("Unable to listen on %s: %s", socket_path, g_strerror (errno));
+    close (listen_fd);
+    listen_fd = -1;
+    return FALSE;
+  }
+
+  server_path = g_strdup (socket_path);
+  clients = g_hash_table_new (NULL, NULL);
+  locks = g_hash_table_new (NULL, NULL);
+
+  listen_source_id = g_unix_fd_add (listen_fd, G_IO_IN, on_listen_ready, NULL);
+
+  stats_register ("wakelock_server", wakelock_server_append_stats, NULL);
+
+  g_debug ("Serving wakelocks on %s", socket_path);
+
+  return TRUE;
+}
+
+/**
+ * Stops serving wakelocks, releasing the ones clients still hold.
+ */
+void
+wakelock_server_stop (void)
+{
+  if (listen_fd < 0)
+    return;
+
+  stats_unregister ("wakelock_server");
+
+  if (listen_source_id > 0) {
+    g_source_remove (listen_source_id);
+    listen_source_id = 0;
+  }
+
+  close (listen_fd);
+  listen_fd = -1;
+
+  close_all (clients);
+  g_clear_pointer (&clients, g_hash_table_unref);
+
+  if (g_hash_table_size (locks) > 0)
+    wakelock_unlock (CLIENT_WAKELOCK);
+  close_all (locks);
+  g_clear_pointer (&locks, g_hash_table_unref);
+
+  unlink (server_path);
+  g_clear_pointer (&server_path, g_free);
+}
@@ -0,0 +1,55 @@
+/* wakelock-server.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDWAKELOCKSERVER_H
+#define STATEDWAKELOCKSERVER_H
+
+#include <glib-2.0/glib.h>
+
+/**
+ * Protocol, over a SOCK_SEQPACKET connection to the server socket:
+ *
+ * - the client sends a single STATED_WAKELOCK_SERVER_ACQUIRE byte
+ * - the server replies with a single STATED_WAKELOCK_SERVER_GRANTED
+ *   byte carrying the lock fd (SCM_RIGHTS), or with
+ *   STATED_WAKELOCK_SERVER_DENIED and no fd
+ *
+ * The lock is held until every copy of the fd is closed. A connection
+ * can be kept open and used for many requests, but it's only granted
+ * a bounded number of locks at a time.
+ */
+#define STATED_WAKELOCK_SERVER_ACQUIRE 'A'
+#define STATED_WAKELOCK_SERVER_GRANTED '+'
+#define STATED_WAKELOCK_SERVER_DENIED '-'
+
+gboolean wakelock_server_start (const char *socket_path,
+                                const char *group);
+void wakelock_server_stop (void);
+
+#endif /* STATEDWAKELOCKSERVER_H */
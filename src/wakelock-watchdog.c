@@ -0,0 +1,349 @@
+/* wakelock-watchdog.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-wakelock-watchdog"
+
+/* Hold budget of locks without an explicit one, in seconds */
+#define WAKELOCK_WATCHDOG_DEFAULT_BUDGET (10 * 60)
+
+#include "wakelock-watchdog.h"
+#include "wakelocks.h"
+#include "utils.h"
+#include "selfprof.h"
+#include "stats.h"
+
+/**
+ * The wakelock watchdog bounds how long a wakelock can be held. Every
+ * lock name gets a hold budget: when a lock exceeds it, a structured
+ * event is logged, the violation is counted and, depending on the
+ * policy, the lock is force-released.
+ *
+ * A single timeout is used for all the locks: it's always armed on the
+ * earliest deadline among the held ones.
+ */
+
+typedef enum {
+  WATCH_STAGE_WITHIN_BUDGET = 0,
+  WATCH_STAGE_REPORTED,
+} StatedWakelockWatchStage;
+
+typedef struct {
+  uint budget;     /* seconds, 0 means unbounded */
+  uint violations;
+
+  gboolean held;
+  uint64_t acquired;
+  uint64_t deadline;
+  StatedWakelockWatchStage stage;
+} StatedWakelockWatch;
+
+static const struct {
+  const char *lock_name;
+  uint budget;
+} default_budgets[] = {
+  /* The display might legitimately stay on for long */
+  { "stated_display", 6 * 60 * 60 },
+
+  /*
+   * Aggregates of locks held on behalf of others (socket clients,
+   * logind inhibitors): they're bounded by their holders, who might
+   * have good reasons to keep the device up for hours.
+   */
+  { "stated_client", 0 },
+  { "stated_logind_inhibit", 0 },
+
+  /* Hooks are killed after 10 seconds, this is only a safety net */
+  { "stated_sleep_hooks", 60 },
+};
+
+static StatedWakelockWatchdogPolicy watchdog_policy = WAKELOCK_WATCHDOG_POLICY_ESCALATE;
+
+/* Hashtable of the known locks, lock_name -> StatedWakelockWatch */
+static GHashTable *watched_wakelocks = NULL;
+static uint watchdog_source_id = 0;
+static uint64_t watchdog_deadline = 0;
+
+static void watchdog_rearm (void);
+static void append_stats (GString *out, void *data);
+
+static StatedWakelockWatch *
+watch_lookup (const char *lock_name,
+              gboolean   create)
+{
+  StatedWakelockWatch *watch;
+  uint i;
+
+  if (watched_wakelocks == NULL) {
+    watched_wakelocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    stats_register ("wakelock_watchdog", append_stats, NULL);
+  }
+
+  watch = g_hash_table_lookup (watched_wakelocks, lock_name);
+  if (watch == NULL && create) {
+    watch = g_new0 (StatedWakelockWatch, 1);
+    watch->budget = WAKELOCK_WATCHDOG_DEFAULT_BUDGET;
+
+    for (i = 0; i < G_N_ELEMENTS (default_budgets); i++) {
+      if (g_strcmp0 (default_budgets[i].lock_name, lock_name) == 0)
+        watch->budget = default_budgets[i].budget;
+    }
+
+    g_hash_table_insert (watched_wakelocks, g_strdup (lock_name), watch);
+  }
+
+  return watch;
+}
+
+static void
+watch_report (const char          *lock_name,
+              StatedWakelockWatch *watch,
+              uint64_t            now,
+              const char          *action)
+{
+  g_log_structured (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+                    "MESSAGE", "%s: held for %lu ms, over its %u secs budget (%s)",
+                    lock_name, now - watch->acquired, watch->budget, action,
+                    "STATED_EVENT", "wakelock-budget-exceeded",
+                    "STATED_WAKELOCK", "%s", lock_name,
+                    "STATED_HELD_MS", "%lu", now - watch->acquired,
+                    "STATED_BUDGET", "%u", watch->budget,
+                    "STATED_ACTION", "%s", action,
+                    "STATED_VIOLATIONS", "%u", watch->violations);
+}
+
+static gboolean
+on_watchdog_timeout (void *data)
+{
+  g_autoptr(GPtrArray) to_release = g_ptr_array_new_with_free_func (g_free);
+  GHashTableIter iter;
+  StatedWakelockWatch *watch;
+  char *lock_name;
+  uint64_t now;
+  uint64_t prof_start = selfprof_begin ();
+  uint i;
+
+  watchdog_source_id = 0;
+  watchdog_deadline = 0;
+  now = time_get_monotonic ();
+
+  g_hash_table_iter_init (&iter, watched_wakelocks);
+  while (g_hash_table_iter_next (&iter, (void **)&lock_name, (void **)&watch)) {
+    if (!watch->held || watch->deadline == 0 || watch->deadline > now)
+      continue;
+
+    if (watch->stage == WATCH_STAGE_WITHIN_BUDGET)
+      watch->violations++;
+
+    if (watchdog_policy == WAKELOCK_WATCHDOG_POLICY_RELEASE ||
+        (watchdog_policy == WAKELOCK_WATCHDOG_POLICY_ESCALATE &&
+         watch->stage == WATCH_STAGE_REPORTED)) {
+      watch_report (lock_name, watch, now, "release");
+      watch->deadline = 0;
+      g_ptr_array_add (to_release, g_strdup (lock_name));
+    } else if (watchdog_policy == WAKELOCK_WATCHDOG_POLICY_ESCALATE) {
+      watch_report (lock_name, watch, now, "warn");
+      watch->stage = WATCH_STAGE_REPORTED;
+      watch->deadline = now + (uint64_t)watch->budget * 1000;
+    } else {
+      watch_report (lock_name, watch, now, "warn");
+      watch->stage = WATCH_STAGE_REPORTED;
+      watch->deadline = 0;
+    }
+  }
+
+  /* Release outside of the iteration, as unlocking untracks the lock */
+  for (i = 0; i < to_release->len; i++) {
+    lock_name = g_ptr_array_index (to_release, i);
+
+    wakelock_cancel (lock_name, TRUE);
+    wakelock_unlock (lock_name);
+  }
+
+  watchdog_rearm ();
+
+  selfprof_end ("wakelock-watchdog", NULL, prof_start);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * Arms the watchdog timeout on the earliest pending deadline, if
+ * it's not armed on it already.
+ */
+static void
+watchdog_rearm (void)
+{
+  GHashTableIter iter;
+  StatedWakelockWatch *watch;
+  uint64_t earliest = 0, now;
+
+  g_hash_table_iter_init (&iter, watched_wakelocks);
+  while (g_hash_table_iter_next (&iter, NULL, (void **)&watch)) {
+    if (watch->held && watch->deadline > 0 &&
+        (earliest == 0 || watch->deadline < earliest))
+      earliest = watch->deadline;
+  }
+
+  if (earliest == watchdog_deadline)
+    return;
+
+  if (watchdog_source_id > 0) {
+    time_source_remove (watchdog_source_id);
+    watchdog_source_id = 0;
+  }
+
+  watchdog_deadline = earliest;
+  if (earliest == 0)
+    return;
+
+  now = time_get_monotonic ();
+  watchdog_source_id = time_timeout_add ((earliest > now) ? (uint)(earliest - now) : 0,
+                                         G_SOURCE_FUNC (on_watchdog_timeout),
+                                         NULL);
+}
+
+/**
+ * Starts tracking a freshly acquired wakelock.
+ * Tracking an already held lock is a no-op.
+ */
+void
+wakelock_watchdog_track (const char *lock_name)
+{
+  StatedWakelockWatch *watch = watch_lookup (lock_name, TRUE);
+
+  if (watch->held)
+    return;
+
+  watch->held = TRUE;
+  watch->stage = WATCH_STAGE_WITHIN_BUDGET;
+  watch->acquired = time_get_monotonic ();
+  watch->deadline = (watch->budget > 0)
+                    ? watch->acquired + (uint64_t)watch->budget * 1000
+                    : 0;
+
+  watchdog_rearm ();
+}
+
+/**
+ * Stops tracking a released wakelock.
+ */
+void
+wakelock_watchdog_untrack (const char *lock_name)
+{
+  StatedWakelockWatch *watch = watch_lookup (lock_name, FALSE);
+
+  if (watch == NULL || !watch->held)
+    return;
+
+  watch->held = FALSE;
+  watch->deadline = 0;
+
+  watchdog_rearm ();
+}
+
+/**
+ * Sets the hold budget of the given lock, in seconds.
+ * A budget of 0 means that the lock can be held indefinitely.
+ */
+void
+wakelock_watchdog_set_budget (const char *lock_name,
+                              uint       budget)
+{
+  StatedWakelockWatch *watch = watch_lookup (lock_name, TRUE);
+
+  watch->budget = budget;
+
+  if (watch->held && watch->stage == WATCH_STAGE_WITHIN_BUDGET) {
+    watch->deadline = (budget > 0)
+                      ? watch->acquired + (uint64_t)budget * 1000
+                      : 0;
+    watchdog_rearm ();
+  }
+}
+
+void
+wakelock_watchdog_set_policy (StatedWakelockWatchdogPolicy policy)
+{
+  watchdog_policy = policy;
+}
+
+gboolean
+wakelock_watchdog_parse_policy (const char                   *str,
+                                StatedWakelockWatchdogPolicy *policy)
+{
+  if (g_strcmp0 (str, "log") == 0)
+    *policy = WAKELOCK_WATCHDOG_POLICY_LOG;
+  else if (g_strcmp0 (str, "release") == 0)
+    *policy = WAKELOCK_WATCHDOG_POLICY_RELEASE;
+  else if (g_strcmp0 (str, "escalate") == 0)
+    *policy = WAKELOCK_WATCHDOG_POLICY_ESCALATE;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * Returns how many times the given lock exceeded its budget.
+ */
+uint
+wakelock_watchdog_get_violations (const char *lock_name)
+{
+  StatedWakelockWatch *watch = watch_lookup (lock_name, FALSE);
+
+  return (watch != NULL) ? watch->violations : 0;
+}
+
+static void
+append_stats (GString *out,
+              void    *data)
+{
+  GHashTableIter iter;
+  const char *lock_name;
+  StatedWakelockWatch *watch;
+  char labels[128];
+
+  stats_append_type (out, "stated_wakelock_budget_violations_total", "counter",
+                     "Times a wakelock was held over its budget");
+  g_hash_table_iter_init (&iter, watched_wakelocks);
+  while (g_hash_table_iter_next (&iter, (void **)&lock_name, (void **)&watch)) {
+    g_snprintf (labels, sizeof labels, "lock=\"%s\"", lock_name);
+    stats_append_value (out, "stated_wakelock_budget_violations_total", labels,
+                        watch->violations);
+  }
+
+  stats_append_type (out, "stated_wakelock_budget_seconds", "gauge",
+                     "Wakelock hold budget, 0 if unbounded");
+  g_hash_table_iter_init (&iter, watched_wakelocks);
+  while (g_hash_table_iter_next (&iter, (void **)&lock_name, (void **)&watch)) {
+    g_snprintf (labels, sizeof labels, "lock=\"%s\"", lock_name);
+    stats_append_value (out, "stated_wakelock_budget_seconds", labels, watch->budget);
+  }
+}
@@ -29,10 +29,58 @@
 
 #define G_LOG_DOMAIN "stated-wakelocks"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wakelocks.h"
+#include "wakelock-watchdog.h"
+#include "sysfs-worker.h"
+#include "flightrec.h"
+#include "tracepoints.h"
+#include "ledger.h"
+#include "metrics.h"
+#include "selfprof.h"
 #include "utils.h"
 
+/* Prefix shared by every wakelock owned by stated */
+#define WAKELOCK_PREFIX "stated_"
+
+/* wake_lock and wake_unlock writes of the same lock supersede each other */
+#define WAKELOCK_SYSFS_GROUP "wakelock"
+
+/* Persisted state of the timed wakelocks */
+#define WAKELOCK_STATE_MAGIC 0x5354574bU /* STWK */
+#define WAKELOCK_STATE_VERSION 1
+#define WAKELOCK_STATE_SLOTS 16
+#define WAKELOCK_STATE_NAME_MAX 48
+
 static const char wakelock_lock_file[]   = "/sys/power/wake_lock";
 static const char wakelock_unlock_file[] = "/sys/power/wake_unlock";
+static const char wakelock_state_dir[]   = "/run/stated";
+static const char wakelock_state_file[]  = "/run/stated/wakelocks.state";
+
+/**
+ * Pending timed wakelocks are mirrored in a small state file on tmpfs,
+ * mapped in memory so that every update is a plain store. If stated
+ * crashes, the next instance uses it to pick up the pending deadlines
+ * (see wakelock_reconcile()).
+ *
+ * Deadlines are expressed in CLOCK_MONOTONIC milliseconds, which is
+ * fine since the file doesn't survive a reboot.
+ */
+typedef struct {
+  char name[WAKELOCK_STATE_NAME_MAX];
+  uint64_t deadline;
+} StatedWakelockStateSlot;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  StatedWakelockStateSlot slots[WAKELOCK_STATE_SLOTS];
+} StatedWakelockState;
+
+static StatedWakelockState *wakelock_state = NULL;
 
 /* -1: not checked, 0: not supported, 1: supported */
 static int wakelocks_supported = -1;
@@ -41,6 +89,115 @@ static int wakelocks_supported = -1;
 static GHashTable *expiring_wakelocks = NULL;
 static GMutex expiring_wakelocks_mutex;
 
+/* Set of the wakelocks currently held, and who to tell when it empties */
+static GHashTable *held_wakelocks = NULL;
+static StatedWakelockIdleHook idle_hook = NULL;
+static void *idle_hook_data = NULL;
+
+static StatedWakelockStateSlot *
+wakelock_state_lookup (const char *lock_name,
+                       gboolean   create)
+{
+  StatedWakelockStateSlot *free_slot = NULL;
+  int i;
+
+  if (wakelock_state == NULL)
+    return NULL;
+
+  for (i = 0; i < WAKELOCK_STATE_SLOTS; i++) {
+    if (wakelock_state->slots[i].name[0] == '\0') {
+      if (free_slot == NULL)
+        free_slot = &wakelock_state->slots[i];
+    } else if (strncmp (wakelock_state->slots[i].name, lock_name,
+                        WAKELOCK_STATE_NAME_MAX) == 0) {
+      return &wakelock_state->slots[i];
+    }
+  }
+
+  if (create && free_slot != NULL)
+    g_strlcpy (free_slot->name, lock_name, WAKELOCK_STATE_NAME_MAX);
+  else
+    free_slot = NULL;
+
+  return free_slot;
+}
+
+static void
+wakelock_state_store (const char *lock_name,
+                      uint64_t   deadline)
+{
+  StatedWakelockStateSlot *slot;
+
+  if (wakelock_state == NULL)
+    return;
+
+  if (strlen (lock_name) >= WAKELOCK_STATE_NAME_MAX ||
+      (slot = wakelock_state_lookup (lock_name, TRUE)) == NULL) {
+    g_warning ("%s: unable to persist wakelock deadline", lock_name);
+    return;
+  }
+
+  slot->deadline = deadline;
+}
+
+static void
+wakelock_state_clear (const char *lock_name)
+{
+  StatedWakelockStateSlot *slot = wakelock_state_lookup (lock_name, FALSE);
+
+  if (slot != NULL) {
+    slot->deadline = 0;
+    slot->name[0] = '\0';
+  }
+}
+
+static gboolean
+wakelock_state_open (void)
+{
+  const char *state_dir = stated_path (wakelock_state_dir);
+  const char *state_file = stated_path (wakelock_state_file);
+  int fd;
+  void *map;
+
+  if (g_mkdir_with_parents (state_dir, 0755) < 0) {
+    g_warning ("Unable to create %s: %s", state_dir, g_strerror (errno));
+    return FALSE;
+  }
+
+  fd = open (state_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    g_warning ("Unable to open %s: %s", state_file, g_strerror (errno));
+    return FALSE;
+  }
+
+  if (ftruncate (fd, sizeof (StatedWakelockState)) < 0) {
+    g_warning ("Unable to resize %s: %s", state_file, g_strerror (errno));
+    close (fd);
+    return FALSE;
+  }
+
+  map = mmap (NULL, sizeof (StatedWakelockState), PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (map == MAP_FAILED) {
+    g_warning ("Unable to map %s: %s", state_file, g_strerror (errno));
+    return FALSE;
+  }
+
+  wakelock_state = map;
+
+  /* Start from scratch if the file is new or from an incompatible version */
+  if (wakelock_state->magic != WAKELOCK_STATE_MAGIC ||
+      wakelock_state->version != WAKELOCK_STATE_VERSION) {
+    memset (wakelock_state, 0, sizeof (StatedWakelockState));
+    wakelock_state->magic = WAKELOCK_STATE_MAGIC;
+    wakelock_state->version = WAKELOCK_STATE_VERSION;
+  }
+
+  return TRUE;
+}
+
 static gboolean
 on_expiring_wakelocks_removal (void *key_ptr, void * value_ptr, void* data)
 {
@@ -48,8 +205,9 @@ on_expiring_wakelocks_removal (void *key_ptr, void * value_ptr, void* data)
   uint source_id = GPOINTER_TO_UINT (value_ptr);
 
   g_debug ("%s: removing pending wakelock, including source", lock_name);
-  g_source_remove (source_id);
+  time_source_remove (source_id);
   wakelock_unlock (lock_name);
+  wakelock_state_clear (lock_name);
 
   return TRUE;
 }
@@ -66,25 +224,32 @@ on_key_should_be_destroyed (void *data)
 static gboolean
 on_wakelock_timeout_elapsed (char *lock_name)
 {
+  uint64_t prof_start = selfprof_begin ();
+  const char *prof_detail = g_intern_string (lock_name);
+
   /* Remove the wakelock */
   g_debug ("Timeout elapsed for wakelock %s, unlocking", lock_name);
   wakelock_unlock (lock_name);
+  wakelock_state_clear (lock_name);
 
   g_hash_table_remove (expiring_wakelocks, lock_name);
 
+  selfprof_end ("wakelock-timeout", prof_detail, prof_start);
+
   return G_SOURCE_REMOVE;
 }
 
 static void
 check_if_supported ()
 {
-  if (access (wakelock_lock_file, F_OK) == 0) {
+  if (access (stated_path (wakelock_lock_file), F_OK) == 0) {
     wakelocks_supported = 1;
     g_debug ("Wakelocks supported");
 
     expiring_wakelocks = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 (GDestroyNotify) on_key_should_be_destroyed,
                                                 NULL);
+    held_wakelocks = g_hash_table_new (g_str_hash, g_str_equal);
   } else {
     wakelocks_supported = 0;
     g_warning ("Wakelocks not supported");
@@ -101,8 +266,16 @@ wakelock_lock (char* lock_name)
   if (wakelocks_supported < 0)
     check_if_supported ();
 
-  if (wakelocks_supported && sysfs_write (lock_name, wakelock_lock_file) == 0) {
+  flightrec_record (STATED_FLIGHTREC_WAKELOCK_LOCK, lock_name, NULL, 0, 0, 0);
+  TRACE_WAKELOCK_LOCK (lock_name);
+
+  if (wakelocks_supported && sysfs_write_queued (lock_name, stated_path (wakelock_lock_file),
+                                                  WAKELOCK_SYSFS_GROUP) == 0) {
     g_debug ("Added wakelock %s", lock_name);
+    wakelock_watchdog_track (lock_name);
+    ledger_acquire (lock_name);
+    metrics_wakelock_acquired (lock_name);
+    g_hash_table_add (held_wakelocks, (char *) g_intern_string (lock_name));
   }
 }
 
@@ -115,8 +288,19 @@ wakelock_unlock (char* lock_name)
   if (wakelocks_supported < 0)
     check_if_supported ();
 
-  if (wakelocks_supported && sysfs_write (lock_name, wakelock_unlock_file) == 0) {
+  flightrec_record (STATED_FLIGHTREC_WAKELOCK_UNLOCK, lock_name, NULL, 0, 0, 0);
+  TRACE_WAKELOCK_UNLOCK (lock_name);
+
+  if (wakelocks_supported && sysfs_write_queued (lock_name, stated_path (wakelock_unlock_file),
+                                                  WAKELOCK_SYSFS_GROUP) == 0) {
     g_debug ("Removed wakelock %s", lock_name);
+    wakelock_watchdog_untrack (lock_name);
+    ledger_release (lock_name);
+    metrics_wakelock_released (lock_name);
+
+    if (g_hash_table_remove (held_wakelocks, lock_name) &&
+        g_hash_table_size (held_wakelocks) == 0 && idle_hook != NULL)
+      idle_hook (idle_hook_data);
   }
 }
 
@@ -137,6 +321,9 @@ wakelock_timed (char* lock_name, uint timeout)
     return;
   }
 
+  flightrec_record (STATED_FLIGHTREC_WAKELOCK_TIMED, lock_name, NULL, timeout, 0, 0);
+  TRACE_WAKELOCK_TIMED (lock_name, timeout);
+
   g_mutex_lock (&expiring_wakelocks_mutex);
 
   if (!g_hash_table_contains (expiring_wakelocks, lock_name)) {
@@ -148,20 +335,22 @@ wakelock_timed (char* lock_name, uint timeout)
     /* Rearm by removing the old source */
     if (source_id != NULL) {
       g_debug ("%s: wakelock already tracked; assuming a rearm", lock_name);
-      g_source_remove (source_id);
+      time_source_remove (source_id);
     }
   }
 
   dup_lock_name = g_strdup (lock_name);
 
   g_debug ("%s: adding timeout (%d secs)", dup_lock_name, timeout);
-  source_id = g_timeout_add_seconds_full (G_PRIORITY_HIGH, timeout,
-                                          G_SOURCE_FUNC (on_wakelock_timeout_elapsed),
-                                          dup_lock_name, NULL);
+  source_id = time_timeout_add_seconds_full (G_PRIORITY_HIGH, timeout,
+                                             G_SOURCE_FUNC (on_wakelock_timeout_elapsed),
+                                             dup_lock_name);
 
   g_debug ("%s: inserting into hash table", dup_lock_name);
   g_hash_table_replace (expiring_wakelocks, dup_lock_name, GUINT_TO_POINTER (source_id));
 
+  wakelock_state_store (lock_name, time_get_monotonic () + (uint64_t)timeout * 1000);
+
   g_mutex_unlock (&expiring_wakelocks_mutex);
 }
 
@@ -190,8 +379,9 @@ wakelock_cancel (char* lock_name, gboolean keep_lock)
 
     if (source_id != NULL) {
       g_debug ("%s: asked to cancel timeout", lock_name);
-      g_source_remove (source_id);
+      time_source_remove (source_id);
       g_hash_table_remove (expiring_wakelocks, lock_name);
+      wakelock_state_clear (lock_name);
     }
 
     /* Remove wakelock, if keep_lock is FALSE */
@@ -225,3 +415,84 @@ wakelock_cancel_all (void)
 
   g_mutex_unlock (&expiring_wakelocks_mutex);
 }
+
+/**
+ * Reconciles the kernel wakelocks with our own state, to be called on
+ * startup before anything else takes a wakelock.
+ *
+ * A previous instance might have died while holding some of our locks:
+ * timed ones that were still pending get re-adopted with their remaining
+ * time, every other stale stated_* lock is released.
+ */
+void
+wakelock_reconcile (void)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) held_locks = NULL;
+  StatedWakelockStateSlot *slot;
+  uint64_t now, remaining;
+  int i;
+
+  if (wakelocks_supported < 0)
+    check_if_supported ();
+
+  if (!wakelocks_supported)
+    return;
+
+  if (!wakelock_state_open ())
+    g_warning ("Timed wakelocks won't survive a restart");
+
+  if (!g_file_get_contents (stated_path (wakelock_lock_file), &contents, NULL, NULL)) {
+    g_warning ("Unable to read the active wakelocks");
+    return;
+  }
+
+  now = time_get_monotonic ();
+  held_locks = g_strsplit_set (g_strstrip (contents), " \n", -1);
+
+  for (i = 0; held_locks[i] != NULL; i++) {
+    if (!g_str_has_prefix (held_locks[i], WAKELOCK_PREFIX))
+      continue;
+
+    slot = wakelock_state_lookup (held_locks[i], FALSE);
+    if (slot != NULL && slot->deadline > now) {
+      /* Round up to the next second */
+      remaining = (slot->deadline - now + 999) / 1000;
+      g_warning ("%s: re-adopting stale timed wakelock (%lu secs left)",
+                 held_locks[i], remaining);
+      wakelock_timed (held_locks[i], (uint)remaining);
+    } else {
+      /* Not through wakelock_unlock(): this process never took it,
+       * so there's nothing to account */
+      g_warning ("%s: releasing stale wakelock", held_locks[i]);
+      sysfs_write_queued (held_locks[i], stated_path (wakelock_unlock_file),
+                          WAKELOCK_SYSFS_GROUP);
+      wakelock_state_clear (held_locks[i]);
+    }
+  }
+
+  /* Drop the deadlines of locks that have been released in the meantime */
+  if (wakelock_state != NULL) {
+    for (i = 0; i < WAKELOCK_STATE_SLOTS; i++) {
+      slot = &wakelock_state->slots[i];
+
+      if (slot->name[0] != '\0' &&
+          !g_hash_table_contains (expiring_wakelocks, slot->name)) {
+        slot->deadline = 0;
+        slot->name[0] = '\0';
+      }
+    }
+  }
+}
+
+/**
+ * Sets a hook called whenever the last of stated's wakelocks is
+ * released, i.e. when stated no longer prevents autosleep.
+ */
+void
+wakelock_set_idle_hook (StatedWakelockIdleHook hook,
+                        void                   *data)
+{
+  idle_hook = hook;
+  idle_hook_data = data;
+}
@@ -34,10 +34,15 @@
 #include <stdio.h>
 #include <glib-2.0/glib.h>
 
+typedef void (*StatedWakelockIdleHook) (void *data);
+
 void wakelock_lock (char* lock_name);
 void wakelock_unlock (char* lock_name);
 void wakelock_timed (char* lock_name, uint timeout);
 void wakelock_cancel (char* lock_name, gboolean keep_lock);
 void wakelock_cancel_all (void);
+void wakelock_reconcile (void);
+void wakelock_set_idle_hook (StatedWakelockIdleHook hook,
+                             void                   *data);
 
 #endif /* STATEDWAKELOCKS_H */
@@ -0,0 +1,241 @@
+/* test-battery.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * Exercises the battery drain sampler against a fake power supply:
+ * energy drops get attributed to the mode that just ended, charging
+ * periods and unreadable gauges get skipped.
+ */
+
+#define G_LOG_DOMAIN "test-battery"
+
+#include <stdio.h>
+#include <glib-2.0/glib.h>
+#include <glib-2.0/gstdio.h>
+
+#include "battery.h"
+#include "fake-root.h"
+#include "utils.h"
+
+#define BATTERY_DIR "/sys/class/power_supply/battery"
+
+typedef struct {
+  char *root;
+} BatteryFixture;
+
+static uint64_t now;
+
+static uint64_t
+test_get_time (clockid_t clock_id,
+               void      *user_data)
+{
+  return now;
+}
+
+/* The sampler never adds timeouts, only the time is needed */
+static StatedClock test_clock = {
+  .get_time = test_get_time,
+};
+
+/**
+ * Rewrites an attribute in place: the battery keeps them open.
+ */
+static void
+write_attribute (const char *name,
+                 const char *contents)
+{
+  g_autofree char *path = g_build_filename (stated_path (BATTERY_DIR), name, NULL);
+  FILE *file = fopen (path, "w");
+
+  g_assert_nonnull (file);
+  fputs (contents, file);
+  fclose (file);
+}
+
+/**
+ * Advances the time and drops the energy, then switches mode.
+ */
+static void
+drain (StatedBattery     *battery,
+       uint64_t          elapsed_ms,
+       const char        *energy_now,
+       StatedBatteryMode mode)
+{
+  now += elapsed_ms;
+  write_attribute ("energy_now", energy_now);
+  stated_battery_set_mode (battery, mode);
+}
+
+static void
+fixture_setup (BatteryFixture *fixture,
+               const void     *data)
+{
+  now = 1000;
+  time_set_clock (&test_clock);
+  fixture->root = stated_fake_root_new ();
+}
+
+static void
+fixture_teardown (BatteryFixture *fixture,
+                  const void     *data)
+{
+  time_set_clock (NULL);
+  stated_fake_root_free (fixture->root);
+}
+
+static void
+test_battery_mode_drain (BatteryFixture *fixture,
+                         const void     *data)
+{
+  g_autoptr(StatedBattery) battery = stated_battery_new ();
+  const StatedBatteryModeStats *stats;
+
+  /* The initial sample is taken in STATED_BATTERY_MODE_SCREEN_OFF_AWAKE */
+  drain (battery, 120000, "14900000\n", STATED_BATTERY_MODE_SCREEN_ON);
+  drain (battery, 240000, "14500000\n", STATED_BATTERY_MODE_SUSPENDED);
+  drain (battery, 600000, "14440000\n", STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+  g_assert_cmpuint (stats->time_ms, ==, 120000);
+  g_assert_cmpuint (stats->energy_uwh, ==, 100000);
+  g_assert_cmpuint (stats->periods, ==, 1);
+  g_assert_cmpfloat_with_epsilon (stats->drain_ewma_mw, 3000, 0.001);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_ON);
+  g_assert_cmpuint (stats->time_ms, ==, 240000);
+  g_assert_cmpuint (stats->energy_uwh, ==, 400000);
+  g_assert_cmpfloat_with_epsilon (stats->drain_ewma_mw, 6000, 0.001);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SUSPENDED);
+  g_assert_cmpuint (stats->time_ms, ==, 600000);
+  g_assert_cmpuint (stats->energy_uwh, ==, 60000);
+  g_assert_cmpfloat_with_epsilon (stats->drain_ewma_mw, 360, 0.001);
+
+  /* Later periods are folded into the rolling average */
+  drain (battery, 60000, "14380000\n", STATED_BATTERY_MODE_SCREEN_ON);
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+  g_assert_cmpuint (stats->periods, ==, 2);
+  g_assert_cmpfloat_with_epsilon (stats->drain_ewma_mw, 3000 * 0.8 + 3600 * 0.2, 0.001);
+
+  /* Short periods only count towards the totals */
+  drain (battery, 10000, "14370000\n", STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_ON);
+  g_assert_cmpuint (stats->time_ms, ==, 250000);
+  g_assert_cmpuint (stats->energy_uwh, ==, 410000);
+  g_assert_cmpuint (stats->periods, ==, 2);
+  g_assert_cmpfloat_with_epsilon (stats->drain_ewma_mw, 6000, 0.001);
+}
+
+static void
+test_battery_charging (BatteryFixture *fixture,
+                       const void     *data)
+{
+  g_autoptr(StatedBattery) battery = stated_battery_new ();
+  const StatedBatteryModeStats *stats;
+
+  write_attribute ("status", "Charging\n");
+  drain (battery, 120000, "15100000\n", STATED_BATTERY_MODE_SCREEN_ON);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+  g_assert_cmpuint (stats->periods, ==, 0);
+
+  /* The charging sample is the baseline of the next period */
+  write_attribute ("status", "Discharging\n");
+  drain (battery, 120000, "15000000\n", STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_ON);
+  g_assert_cmpuint (stats->periods, ==, 1);
+  g_assert_cmpuint (stats->energy_uwh, ==, 100000);
+}
+
+static void
+test_battery_unreadable (BatteryFixture *fixture,
+                         const void     *data)
+{
+  g_autoptr(StatedBattery) battery = stated_battery_new ();
+  const StatedBatteryModeStats *stats;
+
+  /* A gauge that can't be read breaks the period... */
+  drain (battery, 120000, "", STATED_BATTERY_MODE_SCREEN_ON);
+  drain (battery, 120000, "14900000\n", STATED_BATTERY_MODE_SUSPENDED);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+  g_assert_cmpuint (stats->periods, ==, 0);
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_ON);
+  g_assert_cmpuint (stats->periods, ==, 0);
+
+  /* ...and sampling resumes with it */
+  drain (battery, 600000, "14840000\n", STATED_BATTERY_MODE_SCREEN_ON);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SUSPENDED);
+  g_assert_cmpuint (stats->periods, ==, 1);
+  g_assert_cmpuint (stats->energy_uwh, ==, 60000);
+}
+
+static void
+test_battery_charge_gauge (BatteryFixture *fixture,
+                           const void     *data)
+{
+  g_autoptr(StatedBattery) battery = NULL;
+  g_autofree char *energy_now = NULL;
+  const StatedBatteryModeStats *stats;
+
+  /* Gauges exposing charge only are converted with the voltage */
+  energy_now = g_build_filename (stated_path (BATTERY_DIR), "energy_now", NULL);
+  g_assert_cmpint (g_unlink (energy_now), ==, 0);
+  write_attribute ("charge_now", "4000000\n");
+
+  battery = stated_battery_new ();
+
+  now += 120000;
+  write_attribute ("charge_now", "3900000\n");
+  stated_battery_set_mode (battery, STATED_BATTERY_MODE_SCREEN_ON);
+
+  stats = stated_battery_get_mode_stats (battery, STATED_BATTERY_MODE_SCREEN_OFF_AWAKE);
+  g_assert_cmpuint (stats->periods, ==, 1);
+  g_assert_cmpuint (stats->energy_uwh, ==, 380000);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/battery/mode-drain", BatteryFixture, NULL,
+              fixture_setup, test_battery_mode_drain, fixture_teardown);
+  g_test_add ("/battery/charging", BatteryFixture, NULL,
+              fixture_setup, test_battery_charging, fixture_teardown);
+  g_test_add ("/battery/unreadable", BatteryFixture, NULL,
+              fixture_setup, test_battery_unreadable, fixture_teardown);
+  g_test_add ("/battery/charge-gauge", BatteryFixture, NULL,
+              fixture_setup, test_battery_charge_gauge, fixture_teardown);
+
+  return g_test_run ();
+}
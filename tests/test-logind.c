@@ -0,0 +1,375 @@
+/* test-logind.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * Exercises StatedLogind against a mock logind on a private bus,
+ * toggling BlockInhibited and IdleHint through PropertiesChanged.
+ */
+
+#define G_LOG_DOMAIN "test-logind"
+
+#define LOGIND_BUS_NAME "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+
+#define TEST_TIMEOUT 5 /* secs */
+
+#include <string.h>
+#include <glib-2.0/glib.h>
+#include <glib-2.0/gio/gio.h>
+
+#include "logind.h"
+
+static const char manager_xml[] =
+  "<node>"
+  "  <interface name='" LOGIND_MANAGER_INTERFACE "'>"
+  "    <property name='BlockInhibited' type='s' access='read'/>"
+  "    <property name='IdleHint' type='b' access='read'/>"
+  "  </interface>"
+  "</node>";
+
+typedef gboolean (*TestGetter) (void *object);
+
+typedef struct {
+  GTestDBus *bus;
+  GDBusConnection *mock_connection;
+  GDBusConnection *connection;
+  GDBusNodeInfo *node_info;
+  uint name_id;
+  gboolean name_acquired;
+
+  /* Mock logind state */
+  char *block_inhibited;
+  gboolean idle_hint;
+} LogindFixture;
+
+static GVariant *
+mock_get_property (GDBusConnection *connection,
+                   const char      *sender,
+                   const char      *object_path,
+                   const char      *interface_name,
+                   const char      *property_name,
+                   GError          **error,
+                   LogindFixture   *fixture)
+{
+  if (strcmp (property_name, "BlockInhibited") == 0)
+    return g_variant_new_string (fixture->block_inhibited);
+
+  return g_variant_new_boolean (fixture->idle_hint);
+}
+
+/* The manager has no methods, GDBus answers the Properties calls */
+static const GDBusInterfaceVTable mock_vtable = {
+  NULL,
+  (GDBusInterfaceGetPropertyFunc) mock_get_property,
+  NULL,
+};
+
+/**
+ * Updates the mock state (keeping what's NULL or negative), then
+ * emits PropertiesChanged with the changed property (value included)
+ * and the invalidated one (name only), either of which may be NULL.
+ */
+static void
+mock_set (LogindFixture *fixture,
+          const char    *block_inhibited,
+          int           idle_hint,
+          const char    *changed,
+          const char    *invalidated)
+{
+  const char *invalidated_names[] = { invalidated, NULL };
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+
+  if (block_inhibited != NULL) {
+    g_free (fixture->block_inhibited);
+    fixture->block_inhibited = g_strdup (block_inhibited);
+  }
+
+  if (idle_hint >= 0)
+    fixture->idle_hint = idle_hint;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  if (changed != NULL)
+    g_variant_builder_add (&builder, "{sv}", changed,
+                           mock_get_property (NULL, NULL, NULL, NULL, changed,
+                                              NULL, fixture));
+
+  g_dbus_connection_emit_signal (fixture->mock_connection, NULL, LOGIND_PATH,
+                                 "org.freedesktop.DBus.Properties",
+                                 "PropertiesChanged",
+                                 g_variant_new ("(sa{sv}^as)", LOGIND_MANAGER_INTERFACE,
+                                                &builder, invalidated_names),
+                                 &error);
+  g_assert_no_error (error);
+}
+
+static gboolean
+on_timeout (void *data)
+{
+  *(gboolean *) data = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * Iterates the main context until the getter returns expected.
+ * Returns FALSE on timeout.
+ */
+static gboolean
+wait_for_value (TestGetter getter,
+                void       *object,
+                gboolean   expected)
+{
+  gboolean timed_out = FALSE;
+  uint timeout_id;
+
+  timeout_id = g_timeout_add_seconds (TEST_TIMEOUT, on_timeout, &timed_out);
+
+  while (getter (object) != expected && !timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (!timed_out)
+    g_source_remove (timeout_id);
+
+  return !timed_out;
+}
+
+static gboolean
+get_name_acquired (LogindFixture *fixture)
+{
+  return fixture->name_acquired;
+}
+
+static void
+on_name_acquired (GDBusConnection *connection,
+                  const char      *name,
+                  LogindFixture   *fixture)
+{
+  fixture->name_acquired = TRUE;
+}
+
+static GDBusConnection *
+open_connection (GTestDBus *bus)
+{
+  g_autoptr(GError) error = NULL;
+  GDBusConnection *connection;
+
+  connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  return connection;
+}
+
+static void
+fixture_setup (LogindFixture *fixture,
+               const void    *data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dbus_daemon = g_find_program_in_path ("dbus-daemon");
+
+  if (dbus_daemon == NULL) {
+    g_test_skip ("dbus-daemon is not available");
+    return;
+  }
+
+  fixture->block_inhibited = g_strdup ("shutdown");
+
+  fixture->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (fixture->bus);
+
+  fixture->mock_connection = open_connection (fixture->bus);
+  fixture->node_info = g_dbus_node_info_new_for_xml (manager_xml, &error);
+  g_assert_no_error (error);
+
+  g_dbus_connection_register_object (fixture->mock_connection, LOGIND_PATH,
+                                     g_dbus_node_info_lookup_interface (fixture->node_info,
+                                                                        LOGIND_MANAGER_INTERFACE),
+                                     &mock_vtable, fixture, NULL, &error);
+  g_assert_no_error (error);
+
+  fixture->name_id = g_bus_own_name_on_connection (fixture->mock_connection, LOGIND_BUS_NAME,
+                                                   G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                   (GBusNameAcquiredCallback) on_name_acquired,
+                                                   NULL, fixture, NULL);
+  g_assert_true (wait_for_value ((TestGetter) get_name_acquired, fixture, TRUE));
+
+  fixture->connection = open_connection (fixture->bus);
+}
+
+static void
+fixture_teardown (LogindFixture *fixture,
+                  const void    *data)
+{
+  if (fixture->bus == NULL)
+    return;
+
+  g_bus_unown_name (fixture->name_id);
+  g_dbus_connection_close_sync (fixture->connection, NULL, NULL);
+  g_dbus_connection_close_sync (fixture->mock_connection, NULL, NULL);
+  g_clear_object (&fixture->connection);
+  g_clear_object (&fixture->mock_connection);
+  g_dbus_node_info_unref (fixture->node_info);
+  g_free (fixture->block_inhibited);
+
+  g_test_dbus_down (fixture->bus);
+  g_clear_object (&fixture->bus);
+}
+
+/**
+ * Creates a StatedLogind with a sleep inhibitor active, and waits for
+ * it to pick it up: later changes can then only come from signals.
+ */
+static StatedLogind *
+logind_new_synced (LogindFixture *fixture)
+{
+  StatedLogind *logind;
+
+  g_free (fixture->block_inhibited);
+  fixture->block_inhibited = g_strdup ("sleep");
+
+  logind = stated_logind_new_for_connection (fixture->connection);
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_inhibited, logind, TRUE));
+
+  return logind;
+}
+
+static void
+test_logind_initial_state (LogindFixture *fixture,
+                           const void    *data)
+{
+  g_autoptr(StatedLogind) logind = NULL;
+
+  if (fixture->bus == NULL)
+    return;
+
+  g_free (fixture->block_inhibited);
+  fixture->block_inhibited = g_strdup ("shutdown:sleep");
+  fixture->idle_hint = TRUE;
+
+  logind = stated_logind_new_for_connection (fixture->connection);
+
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_inhibited, logind, TRUE));
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_idle_hint, logind, TRUE));
+}
+
+static void
+test_logind_changed (LogindFixture *fixture,
+                     const void    *data)
+{
+  g_autoptr(StatedLogind) logind = NULL;
+
+  if (fixture->bus == NULL)
+    return;
+
+  logind = logind_new_synced (fixture);
+
+  /* Other block inhibitors don't count */
+  mock_set (fixture, "shutdown:handle-lid-switch", -1, "BlockInhibited", NULL);
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_inhibited, logind, FALSE));
+
+  mock_set (fixture, "shutdown:idle", -1, "BlockInhibited", NULL);
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_inhibited, logind, TRUE));
+
+  mock_set (fixture, NULL, TRUE, "IdleHint", NULL);
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_idle_hint, logind, TRUE));
+
+  mock_set (fixture, NULL, FALSE, "IdleHint", NULL);
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_idle_hint, logind, FALSE));
+}
+
+static void
+test_logind_invalidated (LogindFixture *fixture,
+                         const void    *data)
+{
+  g_autoptr(StatedLogind) logind = NULL;
+
+  if (fixture->bus == NULL)
+    return;
+
+  logind = logind_new_synced (fixture);
+
+  /* Invalidated properties are queried again */
+  mock_set (fixture, "shutdown", -1, NULL, "BlockInhibited");
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_inhibited, logind, FALSE));
+
+  mock_set (fixture, NULL, TRUE, NULL, "IdleHint");
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_idle_hint, logind, TRUE));
+}
+
+static void
+test_logind_changed_and_invalidated (LogindFixture *fixture,
+                                     const void    *data)
+{
+  g_autoptr(StatedLogind) logind = NULL;
+
+  if (fixture->bus == NULL)
+    return;
+
+  logind = logind_new_synced (fixture);
+
+  /* Both lists of a single signal must be followed */
+  mock_set (fixture, "shutdown", TRUE, "BlockInhibited", "IdleHint");
+  g_assert_true (wait_for_value ((TestGetter) stated_logind_get_idle_hint, logind, TRUE));
+  g_assert_false (stated_logind_get_inhibited (logind));
+}
+
+static void
+test_logind_offline (void)
+{
+  g_autoptr(StatedLogind) logind = stated_logind_new_offline ();
+  g_autoptr(GDBusConnection) connection = NULL;
+
+  g_object_get (logind, "connection", &connection, NULL);
+  g_assert_null (connection);
+  g_assert_false (stated_logind_get_inhibited (logind));
+  g_assert_false (stated_logind_get_idle_hint (logind));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/logind/initial-state", LogindFixture, NULL,
+              fixture_setup, test_logind_initial_state, fixture_teardown);
+  g_test_add ("/logind/changed", LogindFixture, NULL,
+              fixture_setup, test_logind_changed, fixture_teardown);
+  g_test_add ("/logind/invalidated", LogindFixture, NULL,
+              fixture_setup, test_logind_invalidated, fixture_teardown);
+  g_test_add ("/logind/changed-and-invalidated", LogindFixture, NULL,
+              fixture_setup, test_logind_changed_and_invalidated, fixture_teardown);
+  g_test_add_func ("/logind/offline", test_logind_offline);
+
+  return g_test_run ();
+}
@@ -0,0 +1,239 @@
+/* test-uevent.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * Exercises the uevent monitor through a socketpair: uevents are
+ * injected in the kernel's format, and must only reach the matching
+ * subscribers. A receive buffer overrun must reach all of them, as a
+ * NULL event.
+ *
+ * Overruns can't happen on a socketpair: the test is linked with
+ * --wrap=recvmsg, so that the next receive can be made to fail with
+ * ENOBUFS instead.
+ */
+
+#define G_LOG_DOMAIN "test-uevent"
+
+#define TEST_TIMEOUT 5 /* secs */
+
+#define BATTERY_DEVPATH "/devices/platform/battery/power_supply/battery"
+#define INPUT_DEVPATH "/devices/platform/gpio-keys/input/input3/event3"
+#define USB_DEVPATH "/devices/platform/ehci/usb1/1-1/1-1:1.0"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib-2.0/glib.h>
+
+#include "uevent.h"
+
+typedef struct {
+  uint events;
+  uint lost;
+  char *last_devpath;
+} UeventRecorder;
+
+typedef struct {
+  int fds[2];
+  UeventRecorder power_supply;
+  UeventRecorder input_add;
+  UeventRecorder all;
+  uint subscription_ids[3];
+} UeventFixture;
+
+static gboolean fail_next_recvmsg = FALSE;
+
+ssize_t __real_recvmsg (int           fd,
+                        struct msghdr *msg,
+                        int           flags);
+
+ssize_t
+__wrap_recvmsg (int           fd,
+                struct msghdr *msg,
+                int           flags)
+{
+  if (fail_next_recvmsg) {
+    fail_next_recvmsg = FALSE;
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  return __real_recvmsg (fd, msg, flags);
+}
+
+static void
+on_uevent (const StatedUevent *event,
+           UeventRecorder     *recorder)
+{
+  if (event == NULL) {
+    recorder->lost++;
+    return;
+  }
+
+  recorder->events++;
+  g_free (recorder->last_devpath);
+  recorder->last_devpath = g_strdup (event->devpath);
+}
+
+static gboolean
+on_timeout (void *data)
+{
+  *(gboolean *) data = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * Iterates the main context until the recorder got events uevents.
+ * Returns FALSE on timeout.
+ */
+static gboolean
+wait_for_events (UeventRecorder *recorder,
+                 uint           events)
+{
+  gboolean timed_out = FALSE;
+  uint timeout_id;
+
+  timeout_id = g_timeout_add_seconds (TEST_TIMEOUT, on_timeout, &timed_out);
+
+  while (recorder->events < events && !timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (!timed_out)
+    g_source_remove (timeout_id);
+
+  return !timed_out;
+}
+
+static void
+fixture_setup (UeventFixture *fixture,
+               const void    *data)
+{
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fixture->fds), ==, 0);
+
+  fixture->subscription_ids[0] = uevent_subscribe ("power_supply", NULL,
+                                                   (StatedUeventFunc) on_uevent,
+                                                   &fixture->power_supply);
+  fixture->subscription_ids[1] = uevent_subscribe ("input", "add",
+                                                   (StatedUeventFunc) on_uevent,
+                                                   &fixture->input_add);
+  fixture->subscription_ids[2] = uevent_subscribe (NULL, NULL,
+                                                   (StatedUeventFunc) on_uevent,
+                                                   &fixture->all);
+
+  g_assert_true (uevent_monitor_start_for_fd (fixture->fds[1]));
+}
+
+static void
+fixture_teardown (UeventFixture *fixture,
+                  const void    *data)
+{
+  uint i;
+
+  uevent_monitor_stop ();
+  close (fixture->fds[0]);
+
+  for (i = 0; i < G_N_ELEMENTS (fixture->subscription_ids); i++) {
+    if (fixture->subscription_ids[i] > 0)
+      uevent_unsubscribe (fixture->subscription_ids[i]);
+  }
+
+  g_free (fixture->power_supply.last_devpath);
+  g_free (fixture->input_add.last_devpath);
+  g_free (fixture->all.last_devpath);
+}
+
+static void
+test_uevent_filtering (UeventFixture *fixture,
+                       const void    *data)
+{
+  static const char *battery_env[] = { "POWER_SUPPLY_NAME=battery", "POWER_SUPPLY_CAPACITY=42", NULL };
+
+  g_assert_cmpint (uevent_inject (fixture->fds[0], "change", BATTERY_DEVPATH,
+                                  "power_supply", battery_env), ==, 0);
+  g_assert_cmpint (uevent_inject (fixture->fds[0], "add", INPUT_DEVPATH, "input", NULL), ==, 0);
+  g_assert_cmpint (uevent_inject (fixture->fds[0], "remove", INPUT_DEVPATH, "input", NULL), ==, 0);
+  g_assert_cmpint (uevent_inject (fixture->fds[0], "add", USB_DEVPATH, "usb", NULL), ==, 0);
+
+  /* Uevents are read in order: the last one is there once everything is */
+  g_assert_true (wait_for_events (&fixture->all, 4));
+  g_assert_cmpstr (fixture->all.last_devpath, ==, USB_DEVPATH);
+
+  g_assert_cmpuint (fixture->power_supply.events, ==, 1);
+  g_assert_cmpstr (fixture->power_supply.last_devpath, ==, BATTERY_DEVPATH);
+  g_assert_cmpuint (fixture->input_add.events, ==, 1);
+  g_assert_cmpstr (fixture->input_add.last_devpath, ==, INPUT_DEVPATH);
+
+  /* Without the catch-all subscription, the socket filter drops the
+   * other subsystems: the battery uevent must still come through */
+  uevent_unsubscribe (fixture->subscription_ids[2]);
+  fixture->subscription_ids[2] = 0;
+
+  g_assert_cmpint (uevent_inject (fixture->fds[0], "add", USB_DEVPATH, "usb", NULL), ==, 0);
+  g_assert_cmpint (uevent_inject (fixture->fds[0], "change", BATTERY_DEVPATH,
+                                  "power_supply", battery_env), ==, 0);
+
+  g_assert_true (wait_for_events (&fixture->power_supply, 2));
+  g_assert_cmpuint (fixture->all.events, ==, 4);
+  g_assert_cmpuint (fixture->input_add.events, ==, 1);
+}
+
+static void
+test_uevent_overrun (UeventFixture *fixture,
+                     const void    *data)
+{
+  /* The overrun is reported before the uevent queued behind it */
+  fail_next_recvmsg = TRUE;
+  g_assert_cmpint (uevent_inject (fixture->fds[0], "add", USB_DEVPATH, "usb", NULL), ==, 0);
+
+  g_assert_true (wait_for_events (&fixture->all, 1));
+  g_assert_false (fail_next_recvmsg);
+
+  /* Every subscriber must rescan, whatever it's subscribed to */
+  g_assert_cmpuint (fixture->power_supply.lost, ==, 1);
+  g_assert_cmpuint (fixture->input_add.lost, ==, 1);
+  g_assert_cmpuint (fixture->all.lost, ==, 1);
+
+  g_assert_cmpuint (fixture->power_supply.events, ==, 0);
+  g_assert_cmpuint (fixture->input_add.events, ==, 0);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/uevent/filtering", UeventFixture, NULL,
+              fixture_setup, test_uevent_filtering, fixture_teardown);
+  g_test_add ("/uevent/overrun", UeventFixture, NULL,
+              fixture_setup, test_uevent_overrun, fixture_teardown);
+
+  return g_test_run ();
+}
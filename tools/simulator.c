@@ -0,0 +1,675 @@
+/* simulator.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#define G_LOG_DOMAIN "stated-sim"
+
+/* Virtual uptime at the start of a simulation */
+#define SIM_START_TIME 10000
+
+/* Battery model: initial energy (µWh) and draw per mode (mW) */
+#define SIM_BATTERY_ENERGY 15000000
+#define SIM_POWER_SCREEN_ON 1200
+#define SIM_POWER_AWAKE 300
+#define SIM_POWER_SUSPENDED 15
+
+#include <string.h>
+#include <glib-2.0/glib.h>
+#include <glib-2.0/gio/gio.h>
+
+#include "simulator.h"
+#include "devicestate.h"
+#include "display-manual.h"
+#include "fake-root.h"
+#include "input.h"
+#include "ledger.h"
+#include "policy.h"
+#include "sleep.h"
+#include "sleeptracker.h"
+#include "utils.h"
+#include "wakelocks.h"
+
+/**
+ * StatedSim drives StatedDevicestate against a fake tree of kernel
+ * interfaces, on virtual time.
+ *
+ * Every timeout is queued on a virtual clock rather than on GLib's,
+ * and time jumps straight to the next timeout or scripted event, so
+ * that hours of device behaviour run in milliseconds.
+ *
+ * Suspend is modelled after the kernel's autosleep: as soon as
+ * autosleep is enabled and no wakelock is held the device suspends.
+ * While suspended the monotonic clock (thus every timeout) stops, and
+ * only a scripted event wakes the device up. A scripted resume while
+ * the device is awake is ignored, as there's nothing to wake up from.
+ *
+ * The fake battery is drained at a constant power per mode, so that
+ * the battery sampler can be checked against a known draw.
+ */
+
+typedef struct {
+  uint id;
+  int priority;
+  uint64_t deadline;
+  uint interval;
+  GSourceFunc function;
+  void *data;
+} StatedSimTimer;
+
+struct _StatedSim
+{
+  StatedClock clock;
+  char *root;
+
+  uint64_t boottime;
+  uint64_t monotonic;
+
+  GPtrArray *timers;
+  uint last_timer_id;
+  uint dispatching_id;
+  gboolean dispatching_removed;
+
+  GArray *events;
+
+  /* Kernel state, as seen through the sysfs writes */
+  GHashTable *held_locks;
+  gboolean autosleep;
+  gboolean suspended;
+  uint64_t suspend_start;
+  const char *lock_file;
+  const char *unlock_file;
+  const char *autosleep_file;
+  const char *suspend_success_file;
+  const char *energy_file;
+  gboolean display_on;
+  double energy_uwh;
+
+  gboolean record_writes;
+  GArray *writes;
+
+  StatedDisplayManual *display;
+  StatedInput *powerkey_input;
+  StatedSleeptracker *sleep_tracker;
+  StatedLogind *logind;
+  StatedDevicestate *devicestate;
+  StatedDevicestate *shadow;
+
+  StatedSimReport report;
+};
+
+static const char *event_names[] = {
+  [STATED_SIM_EVENT_DISPLAY_ON]  = "display-on",
+  [STATED_SIM_EVENT_DISPLAY_OFF] = "display-off",
+  [STATED_SIM_EVENT_POWERKEY]    = "powerkey",
+  [STATED_SIM_EVENT_RESUME]      = "resume",
+  [STATED_SIM_EVENT_END]         = "end",
+};
+
+const char *
+stated_sim_event_type_to_string (StatedSimEventType type)
+{
+  g_return_val_if_fail (type <= STATED_SIM_EVENT_END, NULL);
+
+  return event_names[type];
+}
+
+static uint64_t
+sim_get_time (clockid_t clock_id,
+              StatedSim *sim)
+{
+  if (clock_id == CLOCK_MONOTONIC)
+    return sim->monotonic;
+
+  return sim->boottime;
+}
+
+static uint
+sim_timeout_add (int         priority,
+                 uint        interval,
+                 GSourceFunc function,
+                 void        *data,
+                 StatedSim   *sim)
+{
+  StatedSimTimer *timer = g_new0 (StatedSimTimer, 1);
+
+  timer->id = ++sim->last_timer_id;
+  timer->priority = priority;
+  timer->deadline = sim->monotonic + interval;
+  timer->interval = interval;
+  timer->function = function;
+  timer->data = data;
+
+  g_ptr_array_add (sim->timers, timer);
+
+  return timer->id;
+}
+
+static gboolean
+sim_source_remove (uint      source_id,
+                   StatedSim *sim)
+{
+  StatedSimTimer *timer;
+  uint i;
+
+  /* Removing the timeout being dispatched */
+  if (source_id == sim->dispatching_id) {
+    sim->dispatching_removed = TRUE;
+    return TRUE;
+  }
+
+  for (i = 0; i < sim->timers->len; i++) {
+    timer = g_ptr_array_index (sim->timers, i);
+    if (timer->id == source_id) {
+      g_ptr_array_remove_index_fast (sim->timers, i);
+      return TRUE;
+    }
+  }
+
+  g_warning ("Timeout %u not found", source_id);
+
+  return FALSE;
+}
+
+static void
+on_sysfs_write (const char *content,
+                const char *sysfs_file,
+                int        result,
+                StatedSim  *sim)
+{
+  g_auto(GStrv) tokens = NULL;
+  StatedSimWrite write;
+
+  sim->report.sysfs_writes++;
+
+  if (sim->record_writes) {
+    write.time = sim->boottime - SIM_START_TIME;
+    write.sysfs_file = g_intern_string (sysfs_file + strlen (sim->root));
+    write.content = g_strdup (content);
+    write.result = result;
+    g_array_append_val (sim->writes, write);
+  }
+
+  if (result < 0)
+    return;
+
+  if (g_strcmp0 (sysfs_file, sim->lock_file) == 0 ||
+      g_strcmp0 (sysfs_file, sim->unlock_file) == 0) {
+    tokens = g_strsplit (content, " ", 2);
+    if (tokens[0] == NULL)
+      return;
+
+    if (g_strcmp0 (sysfs_file, sim->lock_file) == 0)
+      g_hash_table_add (sim->held_locks, g_strdup (tokens[0]));
+    else
+      g_hash_table_remove (sim->held_locks, tokens[0]);
+  } else if (g_strcmp0 (sysfs_file, sim->autosleep_file) == 0) {
+    sim->autosleep = (g_strcmp0 (content, "off") != 0);
+  }
+}
+
+static void
+sim_write_counter (const char *path,
+                   uint       value)
+{
+  FILE *file;
+
+  /* Rewrite in place, as suspend statistics are read on persistent fds */
+  file = fopen (path, "w");
+  if (file == NULL)
+    return;
+
+  fprintf (file, "%u\n", value);
+  fclose (file);
+}
+
+static void
+sim_advance (StatedSim *sim,
+             uint64_t  boottime)
+{
+  uint power_mw;
+  FILE *file;
+
+  if (boottime <= sim->boottime)
+    return;
+
+  if (sim->suspended)
+    power_mw = SIM_POWER_SUSPENDED;
+  else if (sim->display_on)
+    power_mw = SIM_POWER_SCREEN_ON;
+  else
+    power_mw = SIM_POWER_AWAKE;
+
+  /* mW * ms = µJ, and µJ / 3600 = µWh */
+  sim->energy_uwh = MAX (sim->energy_uwh - (double)power_mw * (boottime - sim->boottime) / 3600, 0);
+  sim->report.energy_drawn_uwh = SIM_BATTERY_ENERGY - sim->energy_uwh;
+
+  file = fopen (sim->energy_file, "w");
+  if (file != NULL) {
+    fprintf (file, "%.0f\n", sim->energy_uwh);
+    fclose (file);
+  }
+
+  if (!sim->suspended)
+    sim->monotonic += boottime - sim->boottime;
+
+  if (g_hash_table_size (sim->held_locks) > 0)
+    sim->report.wakelock_held_ms += boottime - sim->boottime;
+
+  sim->boottime = boottime;
+}
+
+static void
+sim_maybe_suspend (StatedSim *sim)
+{
+  if (sim->suspended || !sim->autosleep ||
+      g_hash_table_size (sim->held_locks) > 0)
+    return;
+
+  g_debug ("%lu: suspending", sim->boottime - SIM_START_TIME);
+  sim->suspended = TRUE;
+  sim->suspend_start = sim->boottime;
+  sim->report.suspends++;
+  sim_write_counter (sim->suspend_success_file, sim->report.suspends);
+}
+
+static void
+sim_resume (StatedSim *sim)
+{
+  if (sim->suspended) {
+    g_debug ("%lu: resuming", sim->boottime - SIM_START_TIME);
+    sim->suspended = FALSE;
+    sim->report.suspended_ms += sim->boottime - sim->suspend_start;
+  }
+
+  sim->report.resumes++;
+  stated_sleeptracker_notify_resume (sim->sleep_tracker);
+}
+
+static StatedSimTimer *
+sim_get_next_timer (StatedSim *sim,
+                    uint      *index)
+{
+  StatedSimTimer *timer, *next = NULL;
+  uint i;
+
+  for (i = 0; i < sim->timers->len; i++) {
+    timer = g_ptr_array_index (sim->timers, i);
+    if (next == NULL || timer->deadline < next->deadline ||
+        (timer->deadline == next->deadline &&
+         (timer->priority < next->priority ||
+          (timer->priority == next->priority && timer->id < next->id)))) {
+      next = timer;
+      *index = i;
+    }
+  }
+
+  return next;
+}
+
+static void
+sim_fire_timer (StatedSim *sim,
+                uint      index)
+{
+  StatedSimTimer *timer;
+
+  timer = g_ptr_array_steal_index_fast (sim->timers, index);
+
+  sim->dispatching_id = timer->id;
+  sim->dispatching_removed = FALSE;
+  sim->report.timers_fired++;
+
+  if (timer->function (timer->data) == G_SOURCE_CONTINUE && !sim->dispatching_removed) {
+    timer->deadline = sim->monotonic + MAX (timer->interval, 1);
+    g_ptr_array_add (sim->timers, timer);
+  } else {
+    g_free (timer);
+  }
+
+  sim->dispatching_id = 0;
+}
+
+static void
+sim_dispatch_event (StatedSim            *sim,
+                    const StatedSimEvent *event)
+{
+  g_debug ("%lu: %s", event->time, stated_sim_event_type_to_string (event->type));
+
+  switch (event->type)
+    {
+    case STATED_SIM_EVENT_DISPLAY_ON:
+      if (sim->suspended)
+        sim_resume (sim);
+      sim->display_on = TRUE;
+      stated_display_manual_set_on (sim->display, TRUE);
+      break;
+
+    case STATED_SIM_EVENT_DISPLAY_OFF:
+      sim->display_on = FALSE;
+      stated_display_manual_set_on (sim->display, FALSE);
+      break;
+
+    case STATED_SIM_EVENT_POWERKEY:
+      if (sim->suspended)
+        sim_resume (sim);
+      g_signal_emit_by_name (sim->powerkey_input, "powerkey-pressed");
+      break;
+
+    case STATED_SIM_EVENT_RESUME:
+      if (sim->suspended)
+        sim_resume (sim);
+      break;
+
+    case STATED_SIM_EVENT_END:
+      break;
+    }
+}
+
+/**
+ * Creates a new simulation. Only a simulation at a time can exist,
+ * as it replaces the clock and the root of the kernel interfaces.
+ *
+ * If record_writes is TRUE, every sysfs write is recorded and can be
+ * retrieved with stated_sim_get_writes().
+ */
+StatedSim *
+stated_sim_new (gboolean record_writes)
+{
+  StatedSim *sim = g_new0 (StatedSim, 1);
+
+  sim->boottime = SIM_START_TIME;
+  sim->monotonic = SIM_START_TIME;
+  sim->timers = g_ptr_array_new_with_free_func (g_free);
+  sim->events = g_array_new (FALSE, FALSE, sizeof (StatedSimEvent));
+  sim->held_locks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  sim->record_writes = record_writes;
+  sim->writes = g_array_new (FALSE, FALSE, sizeof (StatedSimWrite));
+
+  sim->clock.get_time = (void *) sim_get_time;
+  sim->clock.timeout_add = (void *) sim_timeout_add;
+  sim->clock.source_remove = (void *) sim_source_remove;
+  sim->clock.user_data = sim;
+  time_set_clock (&sim->clock);
+
+  sim->root = stated_fake_root_new ();
+  sim->lock_file = stated_path ("/sys/power/wake_lock");
+  sim->unlock_file = stated_path ("/sys/power/wake_unlock");
+  sim->autosleep_file = stated_path ("/sys/power/autosleep");
+  sim->suspend_success_file = stated_path ("/sys/power/suspend_stats/success");
+  sim->energy_file = stated_path ("/sys/class/power_supply/battery/energy_now");
+  sim->energy_uwh = SIM_BATTERY_ENERGY;
+  sysfs_set_write_hook ((StatedSysfsWriteHook) on_sysfs_write, sim);
+
+  sim->display = stated_display_manual_new (FALSE);
+  sim->powerkey_input = stated_input_new_for_key (KEY_POWER);
+  sim->sleep_tracker = stated_sleeptracker_new ();
+  /* Never the host's logind, whose inhibitors would leak into the run */
+  sim->logind = stated_logind_new_offline ();
+  sim->devicestate = stated_devicestate_new_full (STATED_DISPLAY (sim->display),
+                                                  sim->powerkey_input,
+                                                  sim->sleep_tracker,
+                                                  sim->logind);
+
+  autosleep_enable ();
+
+  return sim;
+}
+
+/**
+ * Runs a shadow devicestate alongside the active one, with overrides
+ * (see policy_parse_overrides()) applied to the policy of each power
+ * source. Its outcome is reported in the "shadow" stats.
+ */
+gboolean
+stated_sim_set_shadow_policy (StatedSim  *sim,
+                              const char *overrides,
+                              GError     **error)
+{
+  g_autoptr(StatedDevicestate) shadow = stated_devicestate_new_shadow (sim->devicestate);
+
+  if (!policy_apply_shadow (shadow, sim->devicestate, overrides, error))
+    return FALSE;
+
+  g_clear_object (&sim->shadow);
+  sim->shadow = g_steal_pointer (&shadow);
+
+  return TRUE;
+}
+
+void
+stated_sim_free (StatedSim *sim)
+{
+  uint i;
+
+  g_clear_object (&sim->shadow);
+  g_clear_object (&sim->devicestate);
+  g_clear_object (&sim->logind);
+  g_clear_object (&sim->sleep_tracker);
+  g_clear_object (&sim->powerkey_input);
+  g_clear_object (&sim->display);
+  wakelock_cancel_all ();
+
+  sysfs_set_write_hook (NULL, NULL);
+  time_set_clock (NULL);
+  stated_fake_root_free (sim->root);
+
+  for (i = 0; i < sim->writes->len; i++)
+    g_free (g_array_index (sim->writes, StatedSimWrite, i).content);
+
+  g_array_unref (sim->writes);
+  g_hash_table_unref (sim->held_locks);
+  g_array_unref (sim->events);
+  g_ptr_array_unref (sim->timers);
+  g_free (sim);
+}
+
+/**
+ * Queues an event. Events with the same time are dispatched in the
+ * order they've been pushed.
+ */
+void
+stated_sim_push_event (StatedSim            *sim,
+                       const StatedSimEvent *event)
+{
+  uint i = sim->events->len;
+
+  while (i > 0 && g_array_index (sim->events, StatedSimEvent, i - 1).time > event->time)
+    i--;
+
+  g_array_insert_val (sim->events, i, *event);
+}
+
+/**
+ * Returns the time of the last event queued, 0 if none.
+ */
+uint64_t
+stated_sim_get_last_event_time (StatedSim *sim)
+{
+  if (sim->events->len == 0)
+    return 0;
+
+  return g_array_index (sim->events, StatedSimEvent, sim->events->len - 1).time;
+}
+
+/**
+ * Loads events from a script. Every line is in the form
+ *
+ *   <seconds> <event>
+ *
+ * where event is one of "display on", "display off", "powerkey",
+ * "resume" and "end". Empty lines and lines starting with # are
+ * skipped.
+ */
+gboolean
+stated_sim_load_script (StatedSim  *sim,
+                        const char *path,
+                        GError     **error)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  StatedSimEvent event;
+  char *line, *end;
+  double seconds;
+  uint i;
+
+  if (!g_file_get_contents (path, &contents, NULL, error))
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++) {
+    line = g_strstrip (lines[i]);
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+
+    seconds = g_ascii_strtod (line, &end);
+    if (end == line || seconds < 0)
+      goto invalid;
+
+    line = g_strchug (end);
+    if (g_strcmp0 (line, "display on") == 0)
+      event.type = STATED_SIM_EVENT_DISPLAY_ON;
+    else if (g_strcmp0 (line, "display off") == 0)
+      event.type = STATED_SIM_EVENT_DISPLAY_OFF;
+    else if (g_strcmp0 (line, "powerkey") == 0)
+      event.type = STATED_SIM_EVENT_POWERKEY;
+    else if (g_strcmp0 (line, "resume") == 0)
+      event.type = STATED_SIM_EVENT_RESUME;
+    else if (g_strcmp0 (line, "end") == 0)
+      event.type = STATED_SIM_EVENT_END;
+    else
+      goto invalid;
+
+    event.time = (uint64_t)(seconds * 1000);
+    stated_sim_push_event (sim, &event);
+  }
+
+  return TRUE;
+
+invalid:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "%s:%u: invalid event", path, i + 1);
+  return FALSE;
+}
+
+/**
+ * Runs the simulation, up to the first "end" event or to the last
+ * event queued.
+ */
+void
+stated_sim_run (StatedSim *sim)
+{
+  const StatedSimEvent *event;
+  StatedSimTimer *timer;
+  uint64_t timer_boottime;
+  uint i = 0, index = 0;
+
+  while (TRUE) {
+    /* Let eventual non-timeout sources run */
+    while (g_main_context_iteration (NULL, FALSE));
+
+    sim_maybe_suspend (sim);
+
+    if (i >= sim->events->len)
+      break;
+
+    event = &g_array_index (sim->events, StatedSimEvent, i);
+
+    /* Timeouts are on the monotonic clock, thus never fire while suspended */
+    timer = sim->suspended ? NULL : sim_get_next_timer (sim, &index);
+    if (timer != NULL) {
+      timer_boottime = sim->boottime + MAX (timer->deadline, sim->monotonic) - sim->monotonic;
+      if (timer_boottime <= event->time + SIM_START_TIME) {
+        sim_advance (sim, timer_boottime);
+        sim_fire_timer (sim, index);
+        continue;
+      }
+    }
+
+    sim_advance (sim, event->time + SIM_START_TIME);
+    sim_dispatch_event (sim, event);
+    i++;
+
+    if (event->type == STATED_SIM_EVENT_END)
+      break;
+  }
+
+  if (sim->suspended) {
+    sim->report.suspended_ms += sim->boottime - sim->suspend_start;
+    sim->suspend_start = sim->boottime;
+  }
+
+  sim->report.elapsed_ms = sim->boottime - SIM_START_TIME;
+  sim->report.awake_ms = sim->report.elapsed_ms - sim->report.suspended_ms;
+  sim->report.resume_loops = stated_devicestate_get_resume_loops (sim->devicestate);
+}
+
+const StatedSimReport *
+stated_sim_get_report (StatedSim *sim)
+{
+  return &sim->report;
+}
+
+/**
+ * Returns the recorded sysfs writes, as StatedSimWrite. The array
+ * is owned by the simulation.
+ */
+GArray *
+stated_sim_get_writes (StatedSim *sim)
+{
+  return sim->writes;
+}
+
+/**
+ * Prints the report of a simulation that has been run, including the
+ * awake time projected over a day.
+ */
+void
+stated_sim_print_report (StatedSim *sim)
+{
+  const StatedSimReport *report = &sim->report;
+  const StatedLedgerPeriod *ledger = ledger_get_day (0);
+  g_autoptr(GString) attribution = g_string_new (NULL);
+  double days = MAX (report->elapsed_ms, 1) / 86400000.0;
+
+  g_print ("elapsed:      %10.3f s\n", report->elapsed_ms / 1000.0);
+  g_print ("awake:        %10.3f s (%.1f%%, %.0f s/day)\n", report->awake_ms / 1000.0,
+           100.0 * report->awake_ms / MAX (report->elapsed_ms, 1),
+           report->awake_ms / 1000.0 / days);
+  g_print ("suspended:    %10.3f s\n", report->suspended_ms / 1000.0);
+  g_print ("wakelocks:    %10.3f s\n", report->wakelock_held_ms / 1000.0);
+  g_print ("suspends:     %10u\n", report->suspends);
+  g_print ("resumes:      %10u\n", report->resumes);
+  g_print ("resume loops: %10u\n", report->resume_loops);
+  g_print ("sysfs writes: %10u\n", report->sysfs_writes);
+  g_print ("timeouts:     %10u\n", report->timers_fired);
+  g_print ("energy:       %10.1f mWh\n", report->energy_drawn_uwh / 1000.0);
+
+  if (ledger != NULL) {
+    ledger_format_period (ledger, attribution);
+    g_print ("attribution:  %s\n", attribution->str);
+  }
+}
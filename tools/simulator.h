@@ -0,0 +1,90 @@
+/* simulator.h
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+#ifndef STATEDSIMULATOR_H
+#define STATEDSIMULATOR_H
+
+#include <stdint.h>
+#include <glib-2.0/glib.h>
+
+#include "devicestate.h"
+
+typedef enum {
+  STATED_SIM_EVENT_DISPLAY_ON,
+  STATED_SIM_EVENT_DISPLAY_OFF,
+  STATED_SIM_EVENT_POWERKEY,
+  STATED_SIM_EVENT_RESUME,
+  STATED_SIM_EVENT_END,
+} StatedSimEventType;
+
+typedef struct {
+  uint64_t time; /* milliseconds since the start of the simulation */
+  StatedSimEventType type;
+} StatedSimEvent;
+
+typedef struct {
+  uint64_t time;
+  const char *sysfs_file; /* relative to the fake root */
+  char *content;
+  int result;
+} StatedSimWrite;
+
+typedef struct {
+  uint64_t elapsed_ms;
+  uint64_t awake_ms;
+  uint64_t suspended_ms;
+  uint64_t wakelock_held_ms;
+  double energy_drawn_uwh;
+  uint suspends;
+  uint resumes;
+  uint sysfs_writes;
+  uint timers_fired;
+  uint resume_loops;
+} StatedSimReport;
+
+typedef struct _StatedSim StatedSim;
+
+StatedSim *stated_sim_new (gboolean record_writes);
+void stated_sim_free (StatedSim *sim);
+gboolean stated_sim_set_shadow_policy (StatedSim  *sim,
+                                       const char *overrides,
+                                       GError     **error);
+void stated_sim_push_event (StatedSim            *sim,
+                            const StatedSimEvent *event);
+gboolean stated_sim_load_script (StatedSim  *sim,
+                                 const char *path,
+                                 GError     **error);
+uint64_t stated_sim_get_last_event_time (StatedSim *sim);
+void stated_sim_run (StatedSim *sim);
+const StatedSimReport *stated_sim_get_report (StatedSim *sim);
+void stated_sim_print_report (StatedSim *sim);
+GArray *stated_sim_get_writes (StatedSim *sim);
+const char *stated_sim_event_type_to_string (StatedSimEventType type);
+
+#endif /* STATEDSIMULATOR_H */
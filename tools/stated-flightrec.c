@@ -0,0 +1,139 @@
+/* stated-flightrec.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * stated-flightrec decodes a flight recorder dump (written by stated
+ * on SIGUSR2 to /run/stated/flightrec.bin), printing its records
+ * oldest first, timed relatively to the dump.
+ *
+ *   stated-flightrec [DUMP]
+ */
+
+#define G_LOG_DOMAIN "stated-flightrec"
+
+#define DEFAULT_DUMP "/run/stated/flightrec.bin"
+
+#include <stdlib.h>
+#include <glib-2.0/glib.h>
+
+#include "flightrec.h"
+
+static int
+compare_records (const void *a,
+                 const void *b)
+{
+  const StatedFlightrecRecord *record_a = a, *record_b = b;
+
+  return (record_a->seq > record_b->seq) - (record_a->seq < record_b->seq);
+}
+
+static void
+print_record (const StatedFlightrecRecord *record,
+              int64_t                     dump_time_us)
+{
+  g_autofree char *description = NULL;
+
+  switch ((StatedFlightrecEventType) record->type)
+    {
+    case STATED_FLIGHTREC_WAKELOCK_LOCK:
+    case STATED_FLIGHTREC_WAKELOCK_UNLOCK:
+      description = g_strdup (record->subject);
+      break;
+
+    case STATED_FLIGHTREC_WAKELOCK_TIMED:
+      description = g_strdup_printf ("%s %d s", record->subject, record->value);
+      break;
+
+    case STATED_FLIGHTREC_SYSFS_WRITE:
+      description = g_strdup_printf ("%s <- '%s' %s (%u us)", record->subject,
+                                     record->detail,
+                                     (record->result < 0) ? g_strerror (-record->result) : "ok",
+                                     record->duration_us);
+      break;
+
+    case STATED_FLIGHTREC_DISPLAY:
+      description = g_strdup (record->value ? "on" : "off");
+      break;
+
+    case STATED_FLIGHTREC_RESUME:
+      description = g_strdup_printf ("%d ms since previous, subsequent resumes %d (%u us)",
+                                     record->value, record->result,
+                                     record->duration_us);
+      break;
+
+    case STATED_FLIGHTREC_INPUT:
+      description = g_strdup_printf ("key %d value %d", record->value, record->result);
+      break;
+    }
+
+  g_print ("%8u %14.6f %-16s %s\n", record->seq,
+           (record->time_us - dump_time_us) / 1000000.0,
+           flightrec_event_type_to_string (record->type),
+           (description != NULL) ? description : "");
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *contents = NULL;
+  const StatedFlightrecHeader *header;
+  StatedFlightrecRecord *records;
+  const char *path = (argc > 1) ? argv[1] : DEFAULT_DUMP;
+  gsize length;
+  uint i;
+
+  if (!g_file_get_contents (path, &contents, &length, &error)) {
+    g_printerr ("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  header = (const StatedFlightrecHeader *) contents;
+  if (length < sizeof *header || header->magic != STATED_FLIGHTREC_MAGIC ||
+      header->version != STATED_FLIGHTREC_VERSION ||
+      header->record_size != sizeof (StatedFlightrecRecord) ||
+      length < sizeof *header + (gsize)header->n_records * header->record_size) {
+    g_printerr ("%s is not a supported flight recorder dump\n", path);
+    return EXIT_FAILURE;
+  }
+
+  records = (StatedFlightrecRecord *) (contents + sizeof *header);
+  qsort (records, header->n_records, sizeof *records, compare_records);
+
+  for (i = 0; i < header->n_records; i++) {
+    /* Unused slots, or slots being written at dump time */
+    if (records[i].seq == 0)
+      continue;
+
+    print_record (&records[i], header->dump_time_us);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+/* stated-replay.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * stated-replay feeds a trace recorded with `stated --trace` through
+ * StatedDevicestate on virtual time, and reports how long the device
+ * would have been kept awake by the current policy.
+ *
+ *   stated-replay [--json] TRACE
+ *
+ * Comparing the reports of two builds quantifies the awake time a
+ * policy change saves on real usage.
+ */
+
+#define G_LOG_DOMAIN "stated-replay"
+
+#include <stdlib.h>
+#include <glib-2.0/glib.h>
+
+#include "simulator.h"
+#include "trace.h"
+#include "stated-config.h"
+
+static gboolean
+trace_to_event (const StatedTraceRecord *record,
+                uint64_t                start,
+                StatedSimEvent          *event)
+{
+  event->time = record->boottime - start;
+
+  switch ((StatedTraceEventType) record->type)
+    {
+    case STATED_TRACE_DISPLAY_ON:
+      event->type = STATED_SIM_EVENT_DISPLAY_ON;
+      return TRUE;
+
+    case STATED_TRACE_DISPLAY_OFF:
+      event->type = STATED_SIM_EVENT_DISPLAY_OFF;
+      return TRUE;
+
+    case STATED_TRACE_POWERKEY:
+      event->type = STATED_SIM_EVENT_POWERKEY;
+      return TRUE;
+
+    case STATED_TRACE_RESUME:
+      event->type = STATED_SIM_EVENT_RESUME;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GArray) records = NULL;
+  const StatedTraceRecord *record;
+  const StatedSimReport *report;
+  StatedSimEvent event;
+  gboolean json = FALSE;
+  uint64_t start = 0, previous = 0;
+  uint i, skipped = 0;
+  StatedSim *sim;
+  GOptionEntry entries[] = {
+    { "json", 'j', 0, G_OPTION_ARG_NONE, &json, "Print the report as a JSON line" },
+    { NULL }
+  };
+
+  context = g_option_context_new ("TRACE - replay a stated trace on virtual time");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (argc != 2) {
+    g_printerr ("A trace is required\n");
+    return EXIT_FAILURE;
+  }
+
+  records = trace_load (argv[1], &error);
+  if (records == NULL) {
+    g_printerr ("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  sim = stated_sim_new (FALSE);
+
+  for (i = 0; i < records->len; i++) {
+    record = &g_array_index (records, StatedTraceRecord, i);
+
+    /* Traces can span several boots, only replay the first one: boottime
+     * going backwards means a reboot happened */
+    if (i == 0)
+      start = record->boottime;
+    else if (record->boottime < previous)
+      break;
+    previous = record->boottime;
+
+    if (trace_to_event (record, start, &event))
+      stated_sim_push_event (sim, &event);
+    else
+      skipped++;
+  }
+
+  if (i < records->len)
+    g_warning ("Trace spans more than a boot, replaying %u records out of %u",
+               i, records->len);
+  if (skipped > 0)
+    g_warning ("Skipped %u unknown records", skipped);
+
+  event.type = STATED_SIM_EVENT_END;
+  event.time = stated_sim_get_last_event_time (sim);
+  stated_sim_push_event (sim, &event);
+
+  stated_sim_run (sim);
+
+  report = stated_sim_get_report (sim);
+  if (json)
+    g_print ("{\"version\": \"%s\", \"elapsed_ms\": %lu, \"awake_ms\": %lu, "
+             "\"wakelock_held_ms\": %lu, \"sysfs_writes\": %u, "
+             "\"resume_loops\": %u}\n",
+             PACKAGE_VERSION, report->elapsed_ms, report->awake_ms,
+             report->wakelock_held_ms, report->sysfs_writes,
+             report->resume_loops);
+  else
+    stated_sim_print_report (sim);
+
+  stated_sim_free (sim);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+/* stated-sim.c
+ *
+ * Copyright 2021 Eugenio Paolantonio (g7)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE X CONSORTIUM BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name(s) of the above copyright
+ * holders shall not be used in advertising or otherwise to promote the sale,
+ * use or other dealings in this Software without prior written
+ * authorization.
+ */
+
+/**
+ * stated-sim runs StatedDevicestate against a script of display,
+ * powerkey and resume events on virtual time, and reports how long
+ * the device would have been awake.
+ *
+ *   stated-sim [--writes] [--tail SECS] SCRIPT
+ */
+
+#define G_LOG_DOMAIN "stated-sim"
+
+/* How long to keep simulating after the last event, without "end" */
+#define DEFAULT_TAIL 600
+
+#include <stdlib.h>
+#include <glib-2.0/glib.h>
+
+#include "simulator.h"
+#include "stats.h"
+
+static void
+print_writes (GArray *writes)
+{
+  StatedSimWrite *write;
+  uint i;
+
+  for (i = 0; i < writes->len; i++) {
+    write = &g_array_index (writes, StatedSimWrite, i);
+    g_print ("%10.3f %s %s%s\n", write->time / 1000.0, write->sysfs_file,
+             write->content, (write->result < 0) ? " (failed)" : "");
+  }
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean writes = FALSE;
+  gboolean stats = FALSE;
+  g_autofree char *shadow_policy = NULL;
+  int tail = DEFAULT_TAIL;
+  StatedSimEvent end = { .type = STATED_SIM_EVENT_END };
+  StatedSim *sim;
+  GOptionEntry entries[] = {
+    { "writes", 'w', 0, G_OPTION_ARG_NONE, &writes, "Print the sysfs write sequence" },
+    { "stats", 's', 0, G_OPTION_ARG_NONE, &stats, "Print the collected stats" },
+    { "shadow-policy", 0, 0, G_OPTION_ARG_STRING, &shadow_policy,
+      "Compare with a shadow policy (e.g. display_wait_time=5), see --stats", "OVERRIDES" },
+    { "tail", 't', 0, G_OPTION_ARG_INT, &tail,
+      "Seconds to simulate after the last event, if the script has no end", "SECS" },
+    { NULL }
+  };
+
+  context = g_option_context_new ("SCRIPT - simulate stated on virtual time");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (argc != 2) {
+    g_printerr ("A script is required\n");
+    return EXIT_FAILURE;
+  }
+
+  sim = stated_sim_new (writes);
+
+  if (shadow_policy != NULL &&
+      !stated_sim_set_shadow_policy (sim, shadow_policy, &error)) {
+    g_printerr ("%s\n", error->message);
+    stated_sim_free (sim);
+    return EXIT_FAILURE;
+  }
+
+  if (!stated_sim_load_script (sim, argv[1], &error)) {
+    g_printerr ("%s\n", error->message);
+    stated_sim_free (sim);
+    return EXIT_FAILURE;
+  }
+
+  /* Events after the first end are ignored, so this is harmless */
+  end.time = stated_sim_get_last_event_time (sim) + (uint64_t)MAX (tail, 0) * 1000;
+  stated_sim_push_event (sim, &end);
+
+  stated_sim_run (sim);
+
+  if (writes)
+    print_writes (stated_sim_get_writes (sim));
+
+  stated_sim_print_report (sim);
+
+  if (stats)
+    g_print ("%s", stats_collect ()->str);
+
+  stated_sim_free (sim);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+#
+# stated-trace-merge.py
+#
+# Copyright 2021 Eugenio Paolantonio (g7)
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+# the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE X11 CONSORTIUM BE LIABLE FOR ANY CLAIM, DAMAGES OR
+# OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+# ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+# OTHER DEALINGS IN THE SOFTWARE.
+#
+# Except as contained in this notice, the name(s) of the above copyright
+# holders shall not be used in advertising or otherwise to promote the sale,
+# use or other dealings in this Software without prior written
+# authorization.
+#
+# Merges stated's trace_marker tracepoints with the kernel's
+# suspend_resume and wakeup_source events into a per-suspend-cycle
+# latency breakdown.
+#
+# Record with the boot clock, so that time spent suspended is accounted:
+#
+#   cd /sys/kernel/tracing
+#   echo boot > trace_clock
+#   echo 1 > events/power/suspend_resume/enable
+#   echo 1 > events/power/wakeup_source_activate/enable
+#   stated --trace-marker &
+#   ...
+#   cat trace > stated.trace
+#   stated-trace-merge.py stated.trace
+#
+
+import argparse
+import re
+import sys
+
+LINE_RE = re.compile(
+    r"^\s*(?P<task>.+?)-(?P<pid>\d+)\s+(?:\(\s*\S+\)\s+)?\[(?P<cpu>\d+)\]\s+"
+    r"(?:\S+\s+)?(?P<ts>\d+\.\d+):\s+(?P<event>\w+):\s+(?P<message>.*)$"
+)
+SUSPEND_RESUME_RE = re.compile(r"^(?P<action>\w+)\[(?P<value>-?\d+)\]\s+(?P<state>begin|end)$")
+
+COLUMNS = [
+    ("cycle", "%5d"),
+    ("start", "%12.6f"),
+    ("idle_to_suspend", "%15s"),
+    ("suspend_entry", "%13s"),
+    ("asleep", "%12s"),
+    ("kernel_resume", "%13s"),
+    ("stated_resume", "%13s"),
+    ("awake", "%12s"),
+    ("wakeup", "%s"),
+]
+
+
+def parse(lines):
+    """Yields (timestamp, kind, data) tuples for the events of interest."""
+    for line in lines:
+        match = LINE_RE.match(line)
+        if match is None:
+            continue
+
+        ts = float(match.group("ts"))
+        event = match.group("event")
+        message = match.group("message").strip()
+
+        if event == "suspend_resume":
+            sr = SUSPEND_RESUME_RE.match(message)
+            if sr is not None:
+                yield ts, "%s_%s" % (sr.group("action"), sr.group("state")), None
+        elif event == "wakeup_source_activate":
+            yield ts, "wakeup", message.split()[0]
+        elif event == "tracing_mark_write" and message.startswith("stated: "):
+            fields = message[len("stated: "):].split()
+            data = dict(field.split("=", 1) for field in fields[1:] if "=" in field)
+            yield ts, "stated_" + fields[0], data
+
+
+def ms(begin, end):
+    if begin is None or end is None:
+        return "-"
+
+    return "%.1f ms" % ((end - begin) * 1000)
+
+
+def breakdown(events):
+    cycles = []
+    cycle = None
+    last_unlock = None
+    previous_resume_end = None
+
+    for ts, kind, data in events:
+        if kind == "stated_wakelock_unlock":
+            last_unlock = ts
+        elif kind == "suspend_enter_begin":
+            cycle = {
+                "start": ts,
+                "last_unlock": last_unlock,
+                "previous_resume_end": previous_resume_end,
+                "machine_begin": None,
+                "machine_end": None,
+                "resume_end": None,
+                "stated_resume": None,
+                "wakeup": None,
+            }
+            cycles.append(cycle)
+        elif cycle is None:
+            continue
+        elif kind == "machine_suspend_begin":
+            cycle["machine_begin"] = ts
+        elif kind == "machine_suspend_end":
+            cycle["machine_end"] = ts
+        elif kind == "suspend_enter_end":
+            cycle["resume_end"] = ts
+            previous_resume_end = ts
+        elif kind == "wakeup" and cycle["machine_end"] is not None and cycle["wakeup"] is None:
+            cycle["wakeup"] = data
+        elif kind == "stated_resume" and cycle["resume_end"] is not None and cycle["stated_resume"] is None:
+            cycle["stated_resume"] = ts
+
+    rows = []
+    for index, cycle in enumerate(cycles):
+        aborted = cycle["machine_begin"] is None
+        rows.append({
+            "cycle": index,
+            "start": cycle["start"],
+            "idle_to_suspend": ms(cycle["last_unlock"], cycle["start"]),
+            "suspend_entry": "aborted" if aborted else ms(cycle["start"], cycle["machine_begin"]),
+            "asleep": ms(cycle["machine_begin"], cycle["machine_end"]),
+            "kernel_resume": ms(cycle["machine_end"], cycle["resume_end"]),
+            "stated_resume": ms(cycle["resume_end"], cycle["stated_resume"]),
+            "awake": ms(cycle["previous_resume_end"], cycle["start"]),
+            "wakeup": cycle["wakeup"] or "-",
+        })
+
+    return rows
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Per-suspend-cycle latency breakdown of a stated ftrace trace")
+    parser.add_argument("trace", nargs="?", default="-", help="ftrace text output (default: stdin)")
+    parser.add_argument("--csv", action="store_true", help="print comma separated values")
+    args = parser.parse_args()
+
+    stream = sys.stdin if args.trace == "-" else open(args.trace, errors="replace")
+    with stream:
+        rows = breakdown(parse(stream))
+
+    if args.csv:
+        print(",".join(name for name, _ in COLUMNS))
+        for row in rows:
+            print(",".join(str(row[name]) for name, _ in COLUMNS))
+        return
+
+    print(" ".join(name for name, _ in COLUMNS))
+    for row in rows:
+        print(" ".join(fmt % row[name] for name, fmt in COLUMNS))
+
+
+if __name__ == "__main__":
+    main()